@@ -0,0 +1,196 @@
+// Copyright 2019-2020 CERN and copyright holders of ALICE O2.
+// See https://alice-o2.web.cern.ch/copyright for details of the copyright holders.
+// All rights not expressly granted are reserved.
+//
+// This software is distributed under the terms of the GNU General Public
+// License v3 (GPL Version 3), copied verbatim in the file "COPYING".
+//
+// In applying this license CERN does not waive the privileges and immunities
+// granted to it by virtue of its status as an Intergovernmental Organization
+// or submit itself to any jurisdiction.
+
+#ifndef _ADAPTIVEIDLE_H
+#define _ADAPTIVEIDLE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+
+#include "TscClock.h"
+
+// helper class for a polling thread to wait when there is nothing to do
+// usage:
+//   - call setActive() after each iteration where something was done, with the number of items processed
+//   - call wait() after each iteration where nothing was done
+//   - call notify() from any thread to wake up the polling thread, e.g. when new data is ready
+// On consecutive idle iterations, wait() spins a little, then yields, then sleeps with exponential backoff.
+// The sleep time is bounded by a maximum, which is reduced when items come at high rate (to half of the average interval between items),
+// so that latency stays low without busy polling. It can also be bounded for next wait only, e.g. when the time of next data is known.
+// All methods but notify() should be called from the polling thread.
+
+class AdaptiveIdle
+{
+ public:
+  // constructor
+  // parameters:
+  // - maximum sleep time, in microseconds
+  // - number of idle iterations spinning, then yielding, before sleeping
+  // - minimum sleep time, in microseconds (first sleep after spin/yield phases)
+  AdaptiveIdle(int maxSleepMicroseconds, int spinCount = 64, int yieldCount = 8, int minSleepMicroseconds = 5)
+  {
+    maxSleep = (maxSleepMicroseconds > 0) ? maxSleepMicroseconds : 1;
+    minSleep = (minSleepMicroseconds < maxSleep) ? minSleepMicroseconds : maxSleep;
+    this->spinCount = spinCount;
+    this->yieldCount = yieldCount;
+    currentMaxSleep = maxSleep;
+    TscClock::calibrate();
+  }
+
+  ~AdaptiveIdle() {}
+
+  // to be called when some work was done. Resets backoff.
+  void setActive(uint64_t nItems = 1)
+  {
+    nIdle = 0;
+    nItemsInWindow += nItems;
+    updateRate();
+  }
+
+  // to be called when nothing was done. Returns after some time, or when notify() is called.
+  void wait()
+  {
+    updateRate();
+    nIdle++;
+    if (nIdle <= spinCount) {
+      stats.nSpin++;
+      for (int i = 0; i < spinLoops; i++) {
+        if (pending.load(std::memory_order_relaxed)) {
+          break;
+        }
+        cpuRelax();
+      }
+      pending = false;
+      return;
+    }
+    if (nIdle <= spinCount + yieldCount) {
+      stats.nYield++;
+      std::this_thread::yield();
+      pending = false;
+      return;
+    }
+    int n = nIdle - spinCount - yieldCount - 1;
+    int64_t sleepTime = ((int64_t)minSleep) << ((n < 20) ? n : 20);
+    if (sleepTime > currentMaxSleep) {
+      sleepTime = currentMaxSleep;
+    }
+    if ((nextWaitLimit >= 0) && (sleepTime > nextWaitLimit)) {
+      sleepTime = nextWaitLimit;
+    }
+    nextWaitLimit = -1;
+    stats.nSleep++;
+    std::unique_lock<std::mutex> lock(mutex);
+    sleeping = true;
+    if (cv.wait_for(lock, std::chrono::microseconds(sleepTime), [&] { return pending.load(); })) {
+      stats.nWakeup++;
+    }
+    sleeping = false;
+    pending = false;
+  }
+
+  // wake up the polling thread, if waiting. Can be called from any thread.
+  void notify()
+  {
+    if (pending.load()) {
+      // already notified, the polling thread has not yet woken up
+      return;
+    }
+    // pending and sleeping are checked under lock, so that a wakeup is not lost while the polling thread goes to sleep
+    std::unique_lock<std::mutex> lock(mutex);
+    pending = true;
+    if (sleeping) {
+      cv.notify_one();
+    }
+  }
+
+  // limit duration of next wait (e.g. when time of next data is known)
+  void setWaitLimit(double seconds)
+  {
+    nextWaitLimit = (seconds > 0) ? (int64_t)(seconds * 1000000) : 0;
+  }
+
+  // statistics on waits
+  struct Stats {
+    uint64_t nSpin = 0;   // number of waits by spinning
+    uint64_t nYield = 0;  // number of waits by yielding
+    uint64_t nSleep = 0;  // number of waits by sleeping
+    uint64_t nWakeup = 0; // number of sleeps interrupted by notify()
+  };
+  Stats getStats() { return stats; }
+  void resetStats() { stats = Stats(); }
+
+  int getCurrentMaxSleep() { return currentMaxSleep; } // current maximum sleep time, in microseconds, adapted from items rate
+
+ private:
+  static constexpr int spinLoops = 100;        // number of pause instructions in a spin wait
+  static constexpr double rateWindow = 0.01;   // interval (seconds) between updates of items rate estimation
+
+  int maxSleep;        // maximum sleep time (microseconds)
+  int minSleep;        // minimum sleep time (microseconds)
+  int spinCount;       // number of idle iterations spinning
+  int yieldCount;      // number of idle iterations yielding
+  int currentMaxSleep; // maximum sleep time (microseconds), adapted from items rate
+  int64_t nextWaitLimit = -1; // if set, maximum duration of next wait (microseconds)
+  int nIdle = 0;       // number of consecutive idle iterations
+
+  uint64_t windowStart = 0;    // start of current rate window (TscClock ticks)
+  uint64_t nItemsInWindow = 0; // number of items in current rate window
+  double itemsRate = 0;        // average items rate (Hz)
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::atomic<bool> pending = false;  // set by notify()
+  std::atomic<bool> sleeping = false; // set while waiting on condition variable, protected by mutex
+
+  Stats stats;
+
+  static inline void cpuRelax()
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+
+  // update items rate estimation and corresponding maximum sleep time
+  void updateRate()
+  {
+    uint64_t now = TscClock::now();
+    if (windowStart == 0) {
+      windowStart = now;
+      return;
+    }
+    double dt = TscClock::toSeconds(now - windowStart);
+    if (dt < rateWindow) {
+      return;
+    }
+    double r = nItemsInWindow / dt;
+    itemsRate = 0.7 * itemsRate + 0.3 * r;
+    windowStart = now;
+    nItemsInWindow = 0;
+    double limit = maxSleep;
+    if (itemsRate > 0) {
+      limit = 0.5 * 1000000.0 / itemsRate;
+    }
+    if (limit > maxSleep) {
+      limit = maxSleep;
+    }
+    if (limit < minSleep) {
+      limit = minSleep;
+    }
+    currentMaxSleep = (int)limit;
+  }
+};
+
+#endif // #ifndef _ADAPTIVEIDLE_H
@@ -30,7 +30,10 @@
 #include <fairmq/TransportFactory.h>
 #include <fairmq/tools/Unique.h>
 
+#include "MemoryPagesBuddyAllocator.h"
 #include "RAWDataHeader.h"
+#include "RdhUtils.h"
+#include "RecyclingPool.h"
 #include "SubTimeframe.h"
 #include <Common/Fifo.h>
 
@@ -106,7 +109,10 @@ void incDataBlockStats(DataBlockContainerReference* blockRef, uint64_t dataSizeA
     //printf("adding %d / %d\n", (int)dataSizeAccounted, (int)s->memorySizeAccounted);
     //ddsizemem+=s->memorySizeAccounted;
     //printf("page %p pool %p\n",b->data,(*blockRef)->memoryPagesPoolPtr);
-    updatePageStateFromDataBlockContainerReference(*blockRef, MemoryPage::PageState::InFMQ);
+    if ((*blockRef)->memoryPagesPoolPtr != nullptr) {
+      // blocks from sub-allocator chunks are not pool pages, no state to update
+      updatePageStateFromDataBlockContainerReference(*blockRef, MemoryPage::PageState::InFMQ);
+    }
   }
   s->dataSizeAccounted += dataSizeAccounted;
   gReadoutStats.counters.ddPayloadPendingBytes += dataSizeAccounted;
@@ -156,7 +162,7 @@ class ConsumerFMQchannel : public Consumer
   bool enableRawFormat = false;
   bool enableStfSuperpage = false; // optimized stf transport: minimize STF packets
   bool enableRawFormatDatablock = false;
-  int enablePackedCopy = 1; // default mode for repacking of page overlapping HBF. 0 = one page per copy, 1 = change page on TF only
+  int enablePackedCopy = 1; // default mode for repacking of page overlapping HBF. 0 = one page per copy, 1 = change page on TF only, 2 = chunks from buddy sub-allocator
   int checkIncomplete = 0; // TF are checked to detect missing packets
   int dropIncomplete = 0; // TF with missing packets are discarded
 
@@ -168,6 +174,7 @@ class ConsumerFMQchannel : public Consumer
 
   CounterStats repackSizeStats; // keep track of page size used when repacking
   uint64_t nPagesUsedForRepack = 0; // count pages used for repack
+  std::unique_ptr<MemoryPagesBuddyAllocator> repackAllocator; // sub-allocator for repack chunks, when enablePackedCopy = 2
   uint64_t nPagesUsedInput = 0; // count pages received
   uint64_t nIncompleteHBF = 0; // count incomplete HBF
   uint64_t TFdropped = 0; // number of TF dropped
@@ -196,6 +203,11 @@ class ConsumerFMQchannel : public Consumer
 
   uint64_t currentTimeframeId = undefinedTimeframeId; // current timeframe being processed
   wThreadInput currentTimeframeBuffer; // all data sets for current TF
+
+  // preallocated containers for the TF buffers exchanged with the threads, to avoid heap allocation for each TF
+  std::unique_ptr<RecyclingPool<std::vector<DataSetReference>>> tfBufferPool;
+  std::unique_ptr<RecyclingPool<std::vector<DDMessage>>> msgListPool;
+  const int tfBufferReservedSize = 32; // number of items reserved in each TF buffer
   
   struct wThread {
     std::unique_ptr<AliceO2::Common::Fifo<wThreadInput>> input;
@@ -415,13 +427,27 @@ class ConsumerFMQchannel : public Consumer
       if ((mp->getId() >= 0) && (mp->getId() < ReadoutStatsMaxItems)) {
 	mp -> setBufferStateVariable(&gReadoutStats.counters.bufferUsage[mp->getId()]);
         gReadoutStats.counters.bufferSize[mp->getId()] = (uint64_t)memoryPoolPageSize * (uint64_t)memoryPoolNumberOfPages;
+        gReadoutStats.counters.bufferMemoryPageSize[mp->getId()] = mp->getMemoryPageSize();
+        mp -> setPageStateLatencyHistogram(&gReadoutStats.pageLatency.bufferPageStateLatency[mp->getId()][0][0]);
       }
     }
     theLog.log(LogInfoDevel_(3008), "Using memory pool [%d]: %d pages x %d bytes", mp->getId(), memoryPoolNumberOfPages, memoryPoolPageSize);
 
-    // configuration parameter: | consumer-FairMQChannel-* | enablePackedCopy | int | 1 | If set, the same superpage may be reused (space allowing) for the copy of multiple HBF (instead of a separate one for each copy). This allows a reduced memoryPoolNumberOfPages. |
+    // configuration parameter: | consumer-FairMQChannel-* | enablePackedCopy | int | 1 | If set, the same superpage may be reused (space allowing) for the copy of multiple HBF (instead of a separate one for each copy). This allows a reduced memoryPoolNumberOfPages. If 2, copies are done in chunks from a buddy sub-allocator, each chunk being released individually when the corresponding FMQ message is released (see packedCopyMinChunkSize). |
     cfg.getOptionalValue<int>(cfgEntryPoint + ".enablePackedCopy", enablePackedCopy);
     theLog.log(LogInfoDevel_(3008), "Packed copy enabled = %d", enablePackedCopy);
+    if (enablePackedCopy == 2) {
+      // configuration parameter: | consumer-FairMQChannel-* | packedCopyMinChunkSize | bytes | 4k | When enablePackedCopy = 2, minimum size of the chunks allocated for HBF copies. Chunk sizes are a power of 2 multiple of this value. |
+      std::string cfgPackedCopyMinChunkSize = "4k";
+      cfg.getOptionalValue<std::string>(cfgEntryPoint + ".packedCopyMinChunkSize", cfgPackedCopyMinChunkSize);
+      size_t packedCopyMinChunkSize = (size_t)ReadoutUtils::getNumberOfBytesFromString(cfgPackedCopyMinChunkSize.c_str());
+      try {
+        repackAllocator = std::make_unique<MemoryPagesBuddyAllocator>(mp, packedCopyMinChunkSize);
+      } catch (...) {
+        throw "ConsumerFMQ: failed to create sub-allocator for packed copy, chunk size " + cfgPackedCopyMinChunkSize;
+      }
+      theLog.log(LogInfoDevel_(3008), "Packed copy with sub-allocator: chunk size %d - %d bytes", (int)packedCopyMinChunkSize, (int)(repackAllocator->getChunkMaxSize() + sizeof(DataBlock)));
+    }
 
     // configuration parameter: | consumer-FairMQChannel-* | threads | int | 0 | If set, a pool of threads is created for the data processing. |
     cfg.getOptionalValue<int>(cfgEntryPoint + ".threads", nwThreads);
@@ -433,6 +459,11 @@ class ConsumerFMQchannel : public Consumer
       wThreads.resize(nwThreads);
       wThreadShutdown = 0;
       int isError = 0;
+      // enough buffers for all FIFO slots, plus the ones being processed
+      int tfBufferPoolSize = 2 * nwThreads * (wThreadFifoSize + 1) + 1;
+      int reservedSize = tfBufferReservedSize;
+      tfBufferPool = std::make_unique<RecyclingPool<std::vector<DataSetReference>>>(tfBufferPoolSize, [reservedSize](std::vector<DataSetReference>& v) { v.reserve(reservedSize); });
+      msgListPool = std::make_unique<RecyclingPool<std::vector<DDMessage>>>(tfBufferPoolSize, [reservedSize](std::vector<DDMessage>& v) { v.reserve(reservedSize); });
       for (int i=0; i<nwThreads; i++) {
         wThreads[i].input = std::make_unique<AliceO2::Common::Fifo<wThreadInput>>(wThreadFifoSize);
         wThreads[i].output = std::make_unique<AliceO2::Common::Fifo<wThreadOutput>>(wThreadFifoSize);
@@ -688,7 +719,7 @@ class ConsumerFMQchannel : public Consumer
      //printf("thread %d got TF %d parts\n", thIx, (int)tf->size());
 	
      wThreadOutput msglist;
-     msglist = std::make_shared<std::vector<DDMessage>>();
+     msglist = msgListPool->get();
      bool dropEntireTFonError = 0; // when set, the whole TF is dropped in case of issue on one link
      if (msglist == nullptr) {
        isError = 1;
@@ -848,13 +879,46 @@ int ConsumerFMQchannel::DDformatMessage(DataSetReference &bc, DDMessage &ddm) {
   int HBFpagescounter = 0; // number of pages in current HBF
   int HBFstop = 0; // number of stop bits for current HBF
   int HBFstopLast = 0; // stop bit value for last RDH in HBF
-  int HBFisOk = 1;
   int HBFisFirst = 1;
   int HBFincomplete = 0;
-  std::string HBFerr;
-  int HBFerrid = 0;
-  auto HBFincrerr = [&] () {
-    HBFerr += " (" + std::to_string(++HBFerrid) + ") ";
+  // HBF errors are recorded as flags and offending values, the message is formatted only when logged
+  enum HBFerrorFlags : uint32_t {
+    HBFerrorFirstPagesCounter = 1 << 0, // first pagesCounter not zero (reported, but HBF not considered incomplete)
+    HBFerrorPagesCounterJump = 1 << 1,  // pagesCounter not contiguous
+    HBFerrorStopBits = 1 << 2,          // number of stop bits not 1
+    HBFerrorNoLastStopBit = 1 << 3,     // no stop bit on last RDH
+  };
+  const uint32_t HBFerrorsIncomplete = HBFerrorPagesCounterJump | HBFerrorStopBits | HBFerrorNoLastStopBit;
+  uint32_t HBFerrors = 0;
+  int HBFjumps = 0; // number of pagesCounter jumps in HBF
+  uint16_t HBFjumpFrom = 0; // values of first pagesCounter jump in HBF
+  uint16_t HBFjumpTo = 0;
+  auto HBFerrorsToString = [&] () {
+    std::string err;
+    int errid = 0;
+    auto incrErr = [&] () {
+      err += " (" + std::to_string(++errid) + ") ";
+    };
+    if (HBFerrors & HBFerrorFirstPagesCounter) {
+      incrErr();
+      err += "first pagesCounter not zero: " + std::to_string((int)HBFpagescounterFirst);
+    }
+    if (HBFerrors & HBFerrorPagesCounterJump) {
+      incrErr();
+      err += "pagesCounter jump from " + std::to_string((int)HBFjumpFrom) + " to " + std::to_string((int)HBFjumpTo);
+      if (HBFjumps > 1) {
+        err += " (" + std::to_string(HBFjumps) + " jumps)";
+      }
+    }
+    if (HBFerrors & HBFerrorStopBits) {
+      incrErr();
+      err += "wrong number of stop bits: " + std::to_string((int)HBFstop);
+    }
+    if (HBFerrors & HBFerrorNoLastStopBit) {
+      incrErr();
+      err += "no stop bit on last RDH";
+    }
+    return err;
   };
   auto checkLastHB = [&] () {
     if (!checkIncomplete) return;
@@ -862,30 +926,34 @@ int ConsumerFMQchannel::DDformatMessage(DataSetReference &bc, DDMessage &ddm) {
       return; // no HBF seen so far
     }
     if (HBFstop != 1) {
-      HBFincrerr();
-      HBFerr += "wrong number of stop bits: " + std::to_string((int)HBFstop);
-      HBFisOk = 0;
+      HBFerrors |= HBFerrorStopBits;
     }
     if (HBFstopLast != 1) {
-      HBFincrerr();
-      HBFerr += "no stop bit on last RDH";
-      HBFisOk = 0;
+      HBFerrors |= HBFerrorNoLastStopBit;
     }
     //printf("HB 0x%X = %d pages\n",(int)lastHBid, (int)HBFpagescounter);
 
-    if (!HBFisOk) {
+    if (HBFerrors & HBFerrorsIncomplete) {
       HBFincomplete++;
-      theLog.log(tokenHBF, "TF%d equipment %d link %d HBF 0x%X is incomplete: %s", (int)stfHeader->timeframeId, (int)stfHeader->equipmentId, (int)stfHeader->linkId, (int)lastHBid, HBFerr.c_str());
+      theLog.log(tokenHBF, "TF%d equipment %d link %d HBF 0x%X is incomplete: %s", (int)stfHeader->timeframeId, (int)stfHeader->equipmentId, (int)stfHeader->linkId, (int)lastHBid, HBFerrorsToString().c_str());
     }
 
     // reset counters
     HBFpagescounter = 0;
     HBFstop = 0;
-    HBFisOk = 1;
     HBFisFirst = 1;
-    HBFerrid = 0;
-    HBFerr = "";
+    HBFerrors = 0;
+    HBFjumps = 0;
+  };
+
+  // HBF boundaries found while checking, used afterwards to cut messages: each page is scanned only once
+  struct HbfBoundary {
+    int blockIndex;   // index of block in data set
+    uint32_t offset;  // offset in block of first RDH of HBF
+    uint32_t hbOrbit; // HBF id
   };
+  static thread_local std::vector<HbfBoundary> hbfBoundaries;
+  hbfBoundaries.clear();
 
   for (auto& br : *bc) {
     ix++;
@@ -930,49 +998,48 @@ int ConsumerFMQchannel::DDformatMessage(DataSetReference &bc, DDMessage &ddm) {
     }
     // printf("block %d tf %d link %d\n",ix,b->header.timeframeId,b->header.linkId);
 
-    for (int offset = 0; offset + sizeof(o2::Header::RAWDataHeader) <= b->header.dataSize;) {
-      // printf("checking %p : %d\n",b,offset);
-      o2::Header::RAWDataHeader* rdh = (o2::Header::RAWDataHeader*)&b->data[offset];
-      if (rdh->heartbeatOrbit != lastHBid) {
+    // this function may be called concurrently by the worker threads, each uses its own scanner
+    static thread_local RdhScanner rdhScanner;
+    rdhScanner.scan(b->data, b->header.dataSize);
+    for (const RdhDescriptor& rdh : rdhScanner) {
+      // printf("checking %p : %d\n",b,rdh.offset);
+      if (rdh.hbOrbit != lastHBid) {
         // this is a new HBF, finalize checks of previous one and reset
         checkLastHB();
-        lastHBid = rdh->heartbeatOrbit;
-        // printf("offset %d - HBid=%d\n",offset,lastHBid);
+        lastHBid = rdh.hbOrbit;
+        hbfBoundaries.push_back({ ix - 1, rdh.offset, rdh.hbOrbit });
+        // printf("offset %d - HBid=%d\n",rdh.offset,lastHBid);
       }
-      if (stfHeader->linkId != rdh->linkId) {
+      if (stfHeader->linkId != rdh.linkId) {
         static InfoLogger::AutoMuteToken token(LogWarningSupport_(3004));
-        theLog.log(token, "TF%d equipment %d link Id mismatch %d != %d @ page offset %d", (int)stfHeader->timeframeId, (int)stfHeader->equipmentId, (int)stfHeader->linkId, (int)rdh->linkId, (int)offset);
+        theLog.log(token, "TF%d equipment %d link Id mismatch %d != %d @ page offset %d", (int)stfHeader->timeframeId, (int)stfHeader->equipmentId, (int)stfHeader->linkId, (int)rdh.linkId, (int)rdh.offset);
         // dumpRDH(rdh);
         // printf("block %p : offset %d = %p\n",b,offset,rdh);
       }
 
       if (checkIncomplete) {
-        uint16_t HBFpagescounterNew = (uint16_t)rdh->pagesCounter;
+        uint16_t HBFpagescounterNew = rdh.pagesCounter;
         if (HBFisFirst) {
           HBFpagescounterFirst = HBFpagescounterNew;
           HBFisFirst = 0;
           if (HBFpagescounterFirst != 0) {
-            HBFincrerr();
-            HBFerr += "first pagesCounter not zero: " + std::to_string((int)HBFpagescounterFirst);
+            HBFerrors |= HBFerrorFirstPagesCounter;
           }
         } else {
           if (HBFpagescounterNew != HBFpagescounterLast + 1) {
-            HBFincrerr();
-            HBFerr += "pagesCounter jump from " + std::to_string((int)HBFpagescounterLast)+ " to " + std::to_string( (int)HBFpagescounterNew);
-            HBFisOk = 0;
+            if (!HBFjumps) {
+              HBFjumpFrom = HBFpagescounterLast;
+              HBFjumpTo = HBFpagescounterNew;
+            }
+            HBFjumps++;
+            HBFerrors |= HBFerrorPagesCounterJump;
           }
         }
         HBFpagescounter++;
         HBFpagescounterLast = HBFpagescounterNew;
-        HBFstop += rdh->stopBit;
-        HBFstopLast = rdh->stopBit;
-      }
-
-      uint16_t offsetNextPacket = rdh->offsetNextPacket;
-      if (offsetNextPacket == 0) {
-        break;
+        HBFstop += rdh.stopBit;
+        HBFstopLast = rdh.stopBit;
       }
-      offset += offsetNextPacket;
     }
   }
   headerBlock->getData()->header.timeframeId = stfHeader->timeframeId;
@@ -1087,11 +1154,28 @@ int ConsumerFMQchannel::DDformatMessage(DataSetReference &bc, DDMessage &ddm) {
         theLog.log(token, "page size too small %d < %d", memoryPoolPageSize, totalSize);
         throw __LINE__;
       }
+      if ((repackAllocator != nullptr) && ((size_t)totalSize > repackAllocator->getChunkMaxSize())) {
+	static InfoLogger::AutoMuteToken token(LogWarningSupport_(3230));
+        theLog.log(token, "repack chunk too large %d > %d", totalSize, (int)repackAllocator->getChunkMaxSize());
+        throw __LINE__;
+      }
       DataBlockContainerReference copyBlock = nullptr;
       int isNewBlock = 0;
       int copyBlockMemSize = 0;
       try {
-	if (enablePackedCopy) {
+        if (repackAllocator != nullptr) {
+          // independent chunk, released as soon as the corresponding FMQ message is
+          bool isNewPage = false;
+          copyBlock = repackAllocator->getChunk(totalSize, &isNewPage);
+          isNewBlock = 1;
+          if (isNewPage) {
+            nPagesUsedForRepack++;
+          }
+          if (copyBlock != nullptr) {
+            copyBlockMemSize = copyBlock->getDataBufferSize();
+            initDataBlockStats(&copyBlock, copyBlockMemSize);
+          }
+        } else if (enablePackedCopy) {
 	  for (int i = 0; i<=2; i++) {
             // allocate new buffer for copies if needed
 	    if (copyBlockBuffer == nullptr) {
@@ -1173,35 +1257,31 @@ int ConsumerFMQchannel::DDformatMessage(DataSetReference &bc, DDMessage &ddm) {
   };
 
   try {
+    size_t nextBoundary = 0;
+    int blockIndex = 0;
     for (auto& br : *bc) {
       DataBlock* b = br->getData();
       initDataBlockStats(&br, br->getDataBufferSize());
 
+      // cut at HBF boundaries of this block, as found by the RDH scanner
       unsigned int HBstart = 0;
-      for (int offset = 0; offset + sizeof(o2::Header::RAWDataHeader) <= b->header.dataSize;) {
-        o2::Header::RAWDataHeader* rdh = (o2::Header::RAWDataHeader*)&b->data[offset];
-        // printf("CRU block %p = HB %d link %d @ %d\n",b,(int)rdh->heartbeatOrbit,(int)rdh->linkId,offset);
-        if (rdh->heartbeatOrbit != lastHBid) {
-          // printf("new HBf detected\n");
-          int HBlength = offset - HBstart;
-
-          if (HBlength) {
-            // add previous block to pending frames
-            pendingFramesAppend(HBstart, HBlength, lastHBid, br);
-          }
-          // send pending frames, if any
-          pendingFramesCollect();
-
-          // update new HB frame
-          HBstart = offset;
-          lastHBid = rdh->heartbeatOrbit;
-        }
-        uint16_t offsetNextPacket = rdh->offsetNextPacket;
-        if (offsetNextPacket == 0) {
-          break;
+      for (; (nextBoundary < hbfBoundaries.size()) && (hbfBoundaries[nextBoundary].blockIndex == blockIndex); nextBoundary++) {
+        const HbfBoundary& hb = hbfBoundaries[nextBoundary];
+        // printf("new HBf detected\n");
+        int HBlength = hb.offset - HBstart;
+
+        if (HBlength) {
+          // add previous block to pending frames
+          pendingFramesAppend(HBstart, HBlength, lastHBid, br);
         }
-        offset += offsetNextPacket;
+        // send pending frames, if any
+        pendingFramesCollect();
+
+        // update new HB frame
+        HBstart = hb.offset;
+        lastHBid = hb.hbOrbit;
       }
+      blockIndex++;
 
       // keep last piece for later, HBframe may continue in next block(s)
       if (HBstart < b->header.dataSize) {
@@ -1335,7 +1415,7 @@ int ConsumerFMQchannel::processForDataDistribution(DataSetReference& bc) {
   uint64_t newTimeframeId = b1->header.timeframeId;
   if ( newTimeframeId != currentTimeframeId) {
     pushCurrentTimeframe();
-    currentTimeframeBuffer = std::make_shared<std::vector<DataSetReference>>();
+    currentTimeframeBuffer = tfBufferPool->get();
     if (currentTimeframeId != undefinedTimeframeId) {
       // keep track of out-of-order TF
       if (newTimeframeId != (currentTimeframeId + 1)) {
@@ -1365,6 +1445,9 @@ int ConsumerFMQchannel::start() {
 
   repackSizeStats.reset();
   nPagesUsedForRepack = 0;
+  if (repackAllocator != nullptr) {
+    repackAllocator->resetStats();
+  }
   nPagesUsedInput = 0;
   nIncompleteHBF = 0;
   TFdropped = 0;
@@ -1372,6 +1455,12 @@ int ConsumerFMQchannel::start() {
   currentTimeframeId = undefinedTimeframeId;
 
   wThreadIxWrite = 0;
+  if (tfBufferPool != nullptr) {
+    tfBufferPool->resetStats();
+  }
+  if (msgListPool != nullptr) {
+    msgListPool->resetStats();
+  }
 
   return Consumer::start();
 }
@@ -1423,6 +1512,16 @@ int ConsumerFMQchannel::stop() {
   if (mp!=nullptr) {
     theLog.log(LogInfoDevel_(3003), "Consumer %s - memory pool statistics ... %s", name.c_str(), mp->getStats().c_str());
     theLog.log(LogInfoDevel_(3003), "Consumer %s - STFB repacking statistics ... number: %" PRIu64 " average page size: %" PRIu64 " max page size: %" PRIu64 " repacked/received = %" PRIu64 "/%" PRIu64 " = %.1f%%", name.c_str(), repackSizeStats.getCount(), (uint64_t)repackSizeStats.getAverage(), repackSizeStats.getMaximum(), nPagesUsedForRepack, nPagesUsedInput, nPagesUsedForRepack * 100.0 / nPagesUsedInput);
+    if (repackAllocator != nullptr) {
+      MemoryPagesBuddyAllocator::Stats rs = repackAllocator->getStats();
+      theLog.log(LogInfoDevel_(3003), "Consumer %s - STFB repacking sub-allocator statistics ... chunks: %" PRIu64 " requested/allocated = %.1f%% pages used: %" PRIu64 " max pages in use: %" PRIu64 " new page due to fragmentation: %" PRIu64 " failures: %" PRIu64, name.c_str(), rs.nChunks, (rs.bytesAllocated) ? rs.bytesRequested * 100.0 / rs.bytesAllocated : 0.0, rs.nPagesUsed, rs.nPagesInUseMax, rs.nFragmentedFailures, rs.nFailures);
+    }
+  }
+
+  if ((tfBufferPool != nullptr) && (msgListPool != nullptr)) {
+    if (tfBufferPool->getNumberOfHeapAllocations() || msgListPool->getNumberOfHeapAllocations()) {
+      theLog.log(LogInfoDevel_(3003), "Consumer %s - TF buffers pool (%d) exhausted, allocated from heap: %" PRIu64 " TF buffers, %" PRIu64 " message lists", name.c_str(), (int)tfBufferPool->getNumberOfObjects(), tfBufferPool->getNumberOfHeapAllocations(), msgListPool->getNumberOfHeapAllocations());
+    }
   }
 
   if (TFdropped) {
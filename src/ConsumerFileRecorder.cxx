@@ -520,8 +520,7 @@ class ConsumerFileRecorder : public Consumer
 
     // basic RDH check
     auto checkRdh = [&](RdhHandle& h) {
-      std::string errorDescription;
-      if (h.validateRdh(errorDescription)) {
+      if (h.getErrors()) {
         invalidRDH++;
         throw __LINE__;
       }
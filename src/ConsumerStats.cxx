@@ -21,6 +21,7 @@
 #include "DataBlock.h"
 #include "DataBlockContainer.h"
 #include "DataSet.h"
+#include "MemoryPagesPool.h"
 #include "ReadoutUtils.h"
 #include "ReadoutStats.h"
 #include "ReadoutMonitoringQueue.h"
@@ -34,6 +35,9 @@ using namespace o2::monitoring;
 extern std::string occRole;
 extern tRunNumber occRunNumber;
 
+static_assert(ReadoutStatsPageStates == (int)MemoryPage::PageState::Undefined);
+static_assert(ReadoutStatsPageLatencyBins == MemoryPage::latencyHistogramBins);
+
 class ConsumerStats : public Consumer
 {
  private:
@@ -65,6 +69,27 @@ class ConsumerStats : public Consumer
 
   bool isRunning = false;
 
+  // page state latency histograms, as of last publish, to compute values over last interval
+  uint64_t pageStateLatencyLast[ReadoutStatsMaxItems][ReadoutStatsPageStates][ReadoutStatsPageLatencyBins];
+
+  // get upper bound (in seconds) of the bin containing the given fraction of the histogram counts
+  // the last bin (overflow) has no upper bound: its lower bound is returned instead
+  static double getLatencyPercentile(const uint64_t* counts, uint64_t total, double fraction)
+  {
+    uint64_t n = 0;
+    int bin = 0;
+    for (bin = 0; bin < ReadoutStatsPageLatencyBins - 1; bin++) {
+      n += counts[bin];
+      if (n >= fraction * total) {
+        break;
+      }
+    }
+    if (bin == ReadoutStatsPageLatencyBins - 1) {
+      bin--;
+    }
+    return ((uint64_t)1 << bin) / 1000000.0;
+  }
+
 // zeroMQ publish
 #ifdef WITH_ZMQ
   void* zmqContext = nullptr;
@@ -85,6 +110,13 @@ class ConsumerStats : public Consumer
     intervalStartTime = 0;
     cpuUsedOverLastInterval = 0.0;
     equipmentStatsMap.clear();
+    for (int i = 0; i < ReadoutStatsMaxItems; i++) {
+      for (int j = 0; j < ReadoutStatsPageStates; j++) {
+        for (int k = 0; k < ReadoutStatsPageLatencyBins; k++) {
+          pageStateLatencyLast[i][j][k] = gReadoutStats.pageLatency.bufferPageStateLatency[i][j][k].load();
+        }
+      }
+    }
     monitoringUpdateTimer.reset(monitoringUpdatePeriod * 1000000);
     runningTime.reset();
   }
@@ -175,15 +207,63 @@ class ConsumerStats : public Consumer
       sendMetricNoException({ snapshot.ddPayloadPendingBytes, "readout.stfbDataBytesLocked"});
       sendMetricNoException({ snapshot.ddMemoryPendingBytes, "readout.stfbMemoryBytesLocked"});
 
+      // aggregator timeouts (seconds), when used
+      if (snapshot.aggregatorSliceTimeout.load() > 0) {
+        sendMetricNoException({ snapshot.aggregatorSliceTimeout.load(), "readout.aggregatorSliceTimeout"});
+      }
+      if (snapshot.aggregatorStfTimeout.load() > 0) {
+        sendMetricNoException({ snapshot.aggregatorStfTimeout.load(), "readout.aggregatorStfTimeout"});
+      }
+
+      // aggregator output FIFO occupancy (data sets)
+      sendMetricNoException({ (int)snapshot.aggregatorOutputPending.load(), "readout.aggregatorOutputPending"});
+
       // buffer stats
       for (int i = 0; i < ReadoutStatsMaxItems; i++) {
 	double r = snapshot.bufferUsage[i].load();
         uint64_t b = (uint64_t)(r * snapshot.bufferSize[i].load());
 	if (r >= 0) {
-	  sendMetricNoException(Metric{"readout.bufferUsage"}.addValue((int)(r*100), "value").addValue(b, "bytes").addTag(tags::Key::ID, i));
+	  sendMetricNoException(Metric{"readout.bufferUsage"}.addValue((int)(r*100), "value").addValue(b, "bytes").addValue(snapshot.bufferMemoryPageSize[i].load(), "pageSize").addTag(tags::Key::ID, i));
 	}
       }
 
+      // page state latency stats: for each buffer, median / 99th percentile / max time spent by pages in each state, over last interval
+      for (int i = 0; i < ReadoutStatsMaxItems; i++) {
+        if (snapshot.bufferSize[i].load() == 0) {
+          continue;
+        }
+        Metric m50{"readout.pageStateLatencyP50"};
+        Metric m99{"readout.pageStateLatencyP99"};
+        Metric mMax{"readout.pageStateLatencyMax"};
+        Metric mOverflow{"readout.pageStateLatencyOverflow"}; // number of pages above the histogram range, for which Max (or percentiles) is only a lower bound
+        bool isDefined = false;
+        for (int j = 0; j < ReadoutStatsPageStates; j++) {
+          uint64_t counts[ReadoutStatsPageLatencyBins];
+          uint64_t total = 0;
+          for (int k = 0; k < ReadoutStatsPageLatencyBins; k++) {
+            uint64_t v = gReadoutStats.pageLatency.bufferPageStateLatency[i][j][k].load();
+            counts[k] = (v >= pageStateLatencyLast[i][j][k]) ? v - pageStateLatencyLast[i][j][k] : v;
+            pageStateLatencyLast[i][j][k] = v;
+            total += counts[k];
+          }
+          if (total == 0) {
+            continue;
+          }
+          const char* stateName = MemoryPage::getPageStateString((MemoryPage::PageState)j);
+          m50.addValue(getLatencyPercentile(counts, total, 0.5), stateName);
+          m99.addValue(getLatencyPercentile(counts, total, 0.99), stateName);
+          mMax.addValue(getLatencyPercentile(counts, total, 1.0), stateName);
+          mOverflow.addValue(counts[ReadoutStatsPageLatencyBins - 1], stateName);
+          isDefined = true;
+        }
+        if (isDefined) {
+          sendMetricNoException(m50.addTag(tags::Key::ID, i));
+          sendMetricNoException(m99.addTag(tags::Key::ID, i));
+          sendMetricNoException(mMax.addTag(tags::Key::ID, i));
+          sendMetricNoException(mOverflow.addTag(tags::Key::ID, i));
+        }
+      }
+
       // publish measurements stored in monitoring queue
       auto ff = [&] (const ReadoutMonitoringMetric &m) -> void {
         sendMetricNoException(Metric{m.value, m.name}.addTag(tags::Key::ID, m.tag));
@@ -12,26 +12,36 @@
 #include "DataBlockAggregator.h"
 #include "readoutInfoLogger.h"
 #include "MemoryPagesPool.h"
+#include "ReadoutStats.h"
 #include <inttypes.h>
 
-DataBlockAggregator::DataBlockAggregator(AliceO2::Common::Fifo<DataSetReference>* v_output, std::string name)
+DataBlockAggregator::DataBlockAggregator(ReadoutFifo<DataSetReference>* v_output, std::string name)
 {
   output = v_output;
+  threadName = name;
+  inputBatch.resize(batchSize);
+  outputBatch.reserve(batchSize);
+  mergeBatch.resize(batchSize);
   aggregateThread = std::make_unique<Thread>(DataBlockAggregator::threadCallback, this, name, 1000);
   isIncompletePending = 0;
+  int reservedSize = dataSetReservedSize;
+  dataSetPool = std::make_unique<RecyclingPool<DataSet>>(dataSetPoolSize, [reservedSize](DataSet& ds) { ds.reserve(reservedSize); });
+  stfBuffer.resize(stfBufferSize);
 }
 
 DataBlockAggregator::~DataBlockAggregator()
 {
   // todo: flush out FIFOs ?
+  stopWorkers();
   aggregateThread->join();
 }
 
-int DataBlockAggregator::addInput(std::shared_ptr<AliceO2::Common::Fifo<DataBlockContainerReference>> input)
+int DataBlockAggregator::addInput(std::shared_ptr<ReadoutFifo<DataBlockContainerReference>> input)
 {
   // inputs.push_back(input);
   inputs.push_back(input);
   slicers.push_back(DataBlockSlicer());
+  slicers.back().dataSetPool = dataSetPool.get();
   return 0;
 }
 
@@ -59,17 +69,72 @@ Thread::CallbackResult DataBlockAggregator::threadCallback(void* arg)
 void DataBlockAggregator::start()
 {
   reset();
+
+  // timeouts, initially at configured values
+  sliceTimeouts = std::make_unique<std::atomic<double>[]>(inputs.size());
+  for (unsigned int i = 0; i < inputs.size(); i++) {
+    slicers[i].recordDelays = (cfgAdaptiveTimeouts) && (cfgSliceTimeout > 0);
+    slicers[i].sliceTimeout = cfgSliceTimeout;
+    slicers[i].nextTimeoutUpdate = adaptiveTimeoutInterval;
+    sliceTimeouts[i] = cfgSliceTimeout;
+  }
+  stfTimeout = cfgStfTimeout;
+  nextStfTimeoutUpdate = adaptiveTimeoutInterval;
+  publishTimeouts();
+  if (cfgAdaptiveTimeouts) {
+    theLog.log(LogInfoDevel_(3002), "Aggregator using adaptive timeouts, minimum %.3lfs", cfgAdaptiveTimeoutMin);
+  }
+
+  // create slicing threads, inputs are distributed between them
+  int nWorkers = cfgSlicingThreads;
+  if (nWorkers > (int)inputs.size()) {
+    nWorkers = (int)inputs.size();
+  }
+  if (nWorkers > 1) {
+    for (int k = 0; k < nWorkers; k++) {
+      std::unique_ptr<SliceWorker> w = std::make_unique<SliceWorker>();
+      w->aggregator = this;
+      w->id = k;
+      w->fifo = std::make_unique<ReadoutFifo<DataBlockSlicer::Slice>>(workerFifoSize);
+      w->inputBatch.resize(batchSize);
+      w->outputBatch.reserve(batchSize);
+      w->thread = std::make_unique<Thread>(DataBlockAggregator::workerThreadCallback, w.get(), threadName + "-" + std::to_string(k), 1000);
+      workers.push_back(std::move(w));
+    }
+    for (unsigned int i = 0; i < inputs.size(); i++) {
+      workers[i % nWorkers]->inputIndexes.push_back(i);
+    }
+    theLog.log(LogInfoDevel_(3002), "Aggregator using %d slicing threads", nWorkers);
+    for (auto& w : workers) {
+      w->thread->start();
+    }
+  }
+
   aggregateThread->start();
 }
 
 void DataBlockAggregator::stop(int waitStop)
 {
   doFlush = 0;
+  stopWorkers();
   aggregateThread->stop();
   if (waitStop) {
     aggregateThread->join();
   }
   theLog.log(LogInfoDevel_(3003), "Aggregator processed %llu blocks", totalBlocksIn);
+  if (totalBlocksDropped) {
+    theLog.log(LogWarningSupport_(3004), "Aggregator dropped %llu blocks on error", totalBlocksDropped);
+  }
+  if (cfgAdaptiveTimeouts) {
+    publishTimeouts();
+    theLog.log(LogInfoDevel_(3003), "Aggregator adaptive timeouts: slice = %.3lfs, STF = %.3lfs", gReadoutStats.counters.aggregatorSliceTimeout.load(), gReadoutStats.counters.aggregatorStfTimeout.load());
+  }
+  if (enableStfBuilding) {
+    theLog.log(LogInfoDevel_(3003), "Aggregator built %llu subtimeframes complete, %llu incomplete (%d sources, %d expected)", nStfComplete, nStfIncomplete, nSources, getStfSourcesExpected());
+  }
+  if (dataSetPool->getNumberOfHeapAllocations()) {
+    theLog.log(LogInfoDevel_(3003), "Aggregator data sets pool (%d) exhausted, %llu data sets allocated from heap", (int)dataSetPool->getNumberOfObjects(), (unsigned long long)dataSetPool->getNumberOfHeapAllocations());
+  }
   for (unsigned int i = 0; i < inputs.size(); i++) {
 
     // printf("aggregator input %d: in=%llu out=%llu\n",i,inputs[i]->getNumberIn(),inputs[i]->getNumberOut());
@@ -89,12 +154,37 @@ void DataBlockAggregator::stop(int waitStop)
   reset();
 }
 
+void DataBlockAggregator::pushOutput(DataSetReference ds)
+{
+  if (outputFree <= 0) {
+    // should not happen, free space is checked before
+    flushOutput();
+    output->push(ds);
+    return;
+  }
+  outputBatch.push_back(std::move(ds));
+  outputFree--;
+  if ((int)outputBatch.size() >= batchSize) {
+    flushOutput();
+  }
+}
+
+void DataBlockAggregator::flushOutput()
+{
+  if (outputBatch.size()) {
+    output->pushBatch(outputBatch.data(), (int)outputBatch.size());
+    outputBatch.clear();
+  }
+}
+
 Thread::CallbackResult DataBlockAggregator::executeCallback()
 {
 
   if (output->isFull()) {
     return Thread::CallbackResult::Idle;
   }
+  // only this thread pushes to output, free space checked now is available until the end of this iteration
+  outputFree = output->getNumberOfFreeSlots();
 
   unsigned int nInputs = inputs.size();
   unsigned int nBlocksIn = 0;
@@ -111,167 +201,547 @@ Thread::CallbackResult DataBlockAggregator::executeCallback()
     executeFlush = 1;
   }
 
-  for (unsigned int ix = 0; ix < nInputs; ix++) {
-    int i = (ix + nextIndex) % nInputs;
+  // when flushing, incomplete STFs are pushed out only when all slices have been received from slicing threads
+  // i.e. if they were all idle in flush mode before reading their fifos, and the fifos are now empty
+  bool workersFlushed = 1;
+  for (auto& w : workers) {
+    if (!w->isFlushed) {
+      workersFlushed = 0;
+    }
+  }
 
-    if (disableSlicing) {
-      // no slicing... pass through
-      if (output->isFull()) {
-        return Thread::CallbackResult::Idle;
+  unsigned int nWorkers = workers.size();
+  if (nWorkers) {
+    // merge stage: retrieve slices completed by slicing threads
+    const int maxLoop = 1024;
+    for (unsigned int ix = 0; ix < nWorkers; ix++) {
+      SliceWorker& w = *workers[(ix + nextIndex) % nWorkers];
+      for (int j = 0; j < maxLoop; j += batchSize) {
+        if (outputFree <= 0) {
+          flushOutput();
+          return Thread::CallbackResult::Idle;
+        }
+        int n = w.fifo->popBatch(mergeBatch.data(), (outputFree < batchSize) ? outputFree : batchSize);
+        for (int k = 0; k < n; k++) {
+          processSlice(mergeBatch[k], now);
+          nSlicesOut++;
+        }
+        if (n < batchSize) {
+          break;
+        }
+      }
+    }
+    // on next iteration, start from a different thread to balance emptying order
+    if (nWorkers > 1) {
+      nextIndex = (nextIndex + 1) % nWorkers;
+    }
+    for (auto& w : workers) {
+      if (!w->fifo->isEmpty()) {
+        workersFlushed = 0;
+      }
+    }
+  } else {
+    for (unsigned int ix = 0; ix < nInputs; ix++) {
+      int i = (ix + nextIndex) % nInputs;
+      Thread::CallbackResult r = sliceInput(i, nullptr, now, executeFlush, nBlocksIn, nSlicesOut);
+      if (r != Thread::CallbackResult::Ok) {
+        flushOutput();
+        return r;
       }
-      if (inputs[i]->isEmpty()) {
+    }
+    // on next iteration, start from a different input to balance equipments emptying order
+    if (nInputs > 1) {
+      nextIndex = (nextIndex + 1) % nInputs;
+    }
+  }
+
+  // in TF buffering mode, are there some complete timeframes?
+  // they are pushed in order of TF id, the first one not complete stops the loop
+  // a TF is complete when all expected sources have sent all their data for it, or on timeout (missing sources)
+  // a source is complete for a TF once one of its slices was closed by data of next TF (or by flush), not on slice timeout
+  // if not configured, the expected sources are the ones seen since start, once the first TF was sent (on timeout)
+  if (enableStfBuilding) {
+    while (stfBufferCount > 0) {
+      tStf& stf = stfBuffer[stfBufferFirst & stfBufferMask];
+      if (stf.sstf.empty()) {
+        // gap in timeframe ids
+        stfBufferFirst++;
         continue;
       }
-      DataBlockContainerReference b = nullptr;
-      inputs[i]->pop(b);
+      double age = now - stf.updateTime;
+      int nSourcesExpected = getStfSourcesExpected();
+      bool isComplete = (nSourcesExpected > 0) && (stf.nSourcesComplete >= nSourcesExpected);
+      if ((isComplete) || (age >= stfTimeout) || ((executeFlush) && (workersFlushed))) {
+        // printf("pushing age %.3f tf %d -> %d sources\n",age,(int)stf.tfId,(int)stf.sstf.size());
+        pushStf(stf);
+        stfBufferFirst++;
+      } else {
+        break;
+      }
+    }
+  }
+
+  flushOutput();
+
+  // update adaptive STF timeout from delays of sources observed in last period
+  if (now >= nextStfTimeoutUpdate) {
+    if ((cfgAdaptiveTimeouts) && (enableStfBuilding)) {
+      double delay = 0;
+      for (auto& h : knownSourcesDelays) {
+        double d = h.getPercentile(adaptiveTimeoutPercentile);
+        if (d > delay) {
+          delay = d;
+        }
+        h.clear();
+      }
+      stfTimeout = getAdaptiveTimeout(stfTimeout, delay, cfgStfTimeout);
+    }
+    publishTimeouts();
+    nextStfTimeoutUpdate = now + adaptiveTimeoutInterval;
+  }
+
+  if ((nBlocksIn == 0) && (nSlicesOut == 0)) {
+    if ((executeFlush) && (stfBufferCount == 0) && (workersFlushed)) {
+      doFlush = 0; // flushing is complete if we are now idle
+    }
+    return Thread::CallbackResult::Idle;
+  }
+
+  return Thread::CallbackResult::Ok;
+}
+
+Thread::CallbackResult DataBlockAggregator::sliceInput(int i, SliceWorker* w, double now, bool executeFlush, unsigned int& nBlocksIn, unsigned int& nSlicesOut)
+{
+  std::vector<DataBlockContainerReference>& batch = (w != nullptr) ? w->inputBatch : inputBatch;
+  int& freeSlots = (w != nullptr) ? w->outputFree : outputFree;
+  unsigned long long& blocksCounter = (w != nullptr) ? w->totalBlocksIn : totalBlocksIn;
+
+  if (disableSlicing) {
+    // no slicing... pass through
+    if (freeSlots <= 0) {
+      return Thread::CallbackResult::Idle;
+    }
+    int n = inputs[i]->popBatch(batch.data(), (freeSlots < batchSize) ? freeSlots : batchSize);
+    for (int k = 0; k < n; k++) {
+      DataBlockContainerReference& b = batch[k];
       nBlocksIn++;
-      totalBlocksIn++;
-      DataSetReference bcv = nullptr;
+      blocksCounter++;
+      DataBlockSlicer::Slice slice;
       try {
-        bcv = std::make_shared<DataSet>();
+        slice.data = dataSetPool->get();
       } catch (...) {
+        dropBatch(batch, k, n, w);
         return Thread::CallbackResult::Error;
       }
-      updatePageStateFromDataBlockContainerReference(b, MemoryPage::PageState::InAggregatorFifoOut);
-      bcv->push_back(b);
-      output->push(bcv);
+      slice.data->push_back(std::move(b));
+      emitSlice(w, slice, now);
       nSlicesOut++;
-      continue;
     }
+    return Thread::CallbackResult::Ok;
+  }
 
-    const int maxLoop = 1024;
+  const int maxLoop = 1024;
 
-    // populate slices
-    for (int j = 0; j < maxLoop; j++) {
-      if (inputs[i]->isEmpty()) {
-        break;
-      }
-      DataBlockContainerReference b = nullptr;
-      inputs[i]->pop(b);
+  // populate slices
+  for (int j = 0; j < maxLoop; j += batchSize) {
+    int n = inputs[i]->popBatch(batch.data(), batchSize);
+    for (int k = 0; k < n; k++) {
+      DataBlockContainerReference& b = batch[k];
       updatePageStateFromDataBlockContainerReference(b, MemoryPage::PageState::InAggregator);
       nBlocksIn++;
-      totalBlocksIn++;
+      blocksCounter++;
       // printf("Got block %d from dev %d eq %d link %d tf %d\n", (int)(b->getData()->header.blockId), i, (int)(b->getData()->header.equipmentId), (int)(b->getData()->header.linkId), (int)(b->getData()->header.timeframeId));
       if (slicers[i].appendBlock(b, now) <= 0) {
+        dropBatch(batch, k, n, w);
         return Thread::CallbackResult::Error;
       }
+      b = nullptr;
+    }
+    if (n < batchSize) {
+      break;
+    }
+  }
+
+  // close incomplete slices on timeout
+  if (cfgSliceTimeout) {
+    DataBlockSlicer& slicer = slicers[i];
+    if ((slicer.recordDelays) && (now >= slicer.nextTimeoutUpdate)) {
+      slicer.sliceTimeout = getAdaptiveTimeout(slicer.sliceTimeout, slicer.getDelayPercentile(adaptiveTimeoutPercentile), cfgSliceTimeout);
+      sliceTimeouts[i] = slicer.sliceTimeout;
+      slicer.nextTimeoutUpdate = now + adaptiveTimeoutInterval;
     }
+    slicer.completeSliceOnTimeout(now - slicer.sliceTimeout);
+  }
 
-    // close incomplete slices on timeout
-    if (cfgSliceTimeout) {
-      slicers[i].completeSliceOnTimeout(now - cfgSliceTimeout);
+  // retrieve completed slices
+  for (int j = 0; j < maxLoop; j++) {
+    if (freeSlots <= 0) {
+      return Thread::CallbackResult::Idle;
+    }
+    bool includeIncomplete = 0;
+    if ((executeFlush) && (inputs[i]->isEmpty())) {
+      includeIncomplete = 1;
     }
+    DataBlockSlicer::Slice slice = slicers[i].getSlice(includeIncomplete);
+    if (slice.data == nullptr) {
+      break;
+    }
+    emitSlice(w, slice, now);
+    nSlicesOut++;
+    // printf("Pushed STF : %d chunks\n",(int)bcv->size());
+  }
+  return Thread::CallbackResult::Ok;
+}
+
+void DataBlockAggregator::dropBatch(std::vector<DataBlockContainerReference>& batch, int first, int n, SliceWorker* w)
+{
+  // blocks not processed are released now, so that their pages go back to pool
+  unsigned long long& droppedCounter = (w != nullptr) ? w->totalBlocksDropped : totalBlocksDropped;
+  for (int k = first; k < n; k++) {
+    batch[k] = nullptr;
+    droppedCounter++;
+  }
+  static InfoLogger::AutoMuteToken token(LogWarningSupport_(3004));
+  theLog.log(token, "Aggregator failed to process input data, %d blocks dropped", n - first);
+}
+
+void DataBlockAggregator::emitSlice(SliceWorker* w, DataBlockSlicer::Slice& slice, double now)
+{
+  if (w == nullptr) {
+    processSlice(slice, now);
+    return;
+  }
+  w->outputBatch.push_back(std::move(slice));
+  w->outputFree--;
+  if ((int)w->outputBatch.size() >= batchSize) {
+    flushWorkerOutput(*w);
+  }
+}
 
-    // retrieve completed slices
-    for (int j = 0; j < maxLoop; j++) {
-      if (output->isFull()) {
-        return Thread::CallbackResult::Idle;
+void DataBlockAggregator::processSlice(DataBlockSlicer::Slice& slice, double now)
+{
+  DataSetReference& bcv = slice.data;
+  if ((enableStfBuilding) && (!disableSlicing)) {
+    // buffer timeframes
+    DataBlockContainerReference b = bcv->at(0);
+    DataBlock* db = b->getData();
+    uint64_t tfId = db->header.timeframeId;
+    uint64_t sourceId = (((uint64_t)db->header.equipmentId) << 32) | ((uint64_t)db->header.linkId);
+    if (tfId <= lastTimeframeId) {
+      static InfoLogger::AutoMuteToken token(LogWarningSupport_(3004));
+      theLog.log(token, "Discarding late data for TF %" PRIu64 " (source = 0x%" PRIx64 ")", tfId, sourceId);
+      if (cfgAdaptiveTimeouts) {
+        // timeout too short: increase it now
+        stfTimeout = getAdaptiveTimeout(stfTimeout, 2 * stfTimeout, cfgStfTimeout);
       }
-      bool includeIncomplete = 0;
-      if ((executeFlush) && (inputs[i]->isEmpty())) {
-        includeIncomplete = 1;
+    } else {
+      tStf* stf = getStf(tfId);
+      if (stf == nullptr) {
+        static InfoLogger::AutoMuteToken token(LogWarningSupport_(3004));
+        theLog.log(token, "Discarding data for TF %" PRIu64 " (source = 0x%" PRIx64 "), out of buffer range %" PRIu64 " - %" PRIu64, tfId, sourceId, stfBufferFirst, stfBufferLast);
+      } else {
+        // count distinct sources, for this STF and since start
+        // a source is complete for this STF once one of its slices was not closed on timeout
+        bool isNewSource = 1;
+        bool isSourceComplete = 0;
+        for (const auto& ss : stf->sstf) {
+          if (ss.sourceId == sourceId) {
+            isNewSource = 0;
+            if (!ss.isClosedOnTimeout) {
+              isSourceComplete = 1;
+              break;
+            }
+          }
+        }
+        int sourceIndex = -1;
+        for (unsigned int k = 0; k < knownSources.size(); k++) {
+          if (knownSources[k] == sourceId) {
+            sourceIndex = k;
+            break;
+          }
+        }
+        if (sourceIndex < 0) {
+          sourceIndex = knownSources.size();
+          knownSources.push_back(sourceId);
+          knownSourcesDelays.emplace_back();
+          nSources = knownSources.size();
+        }
+        if (isNewSource) {
+          stf->nSources++;
+          // data of a new TF: source is done with previous ones
+          completeSourceInPreviousStf(sourceId, tfId);
+        }
+        if ((!slice.isClosedOnTimeout) && (!isSourceComplete)) {
+          stf->nSourcesComplete++;
+        }
+        if (stf->sstf.empty()) {
+          stf->startTime = now;
+        }
+        if (cfgAdaptiveTimeouts) {
+          knownSourcesDelays[sourceIndex].add(now - stf->startTime);
+        }
+        stf->sstf.push_back({ sourceId, std::move(bcv), now, slice.isClosedOnTimeout });
+        stf->updateTime = now;
+        // theLog.log(LogDebugTrace, "aggregate - added tf %lu : source %lX",tfId,sourceId);
       }
-      DataSetReference bcv = slicers[i].getSlice(includeIncomplete);
-      if (bcv == nullptr) {
-        break;
+    }
+    bcv = nullptr;
+  } else {
+    for(auto const& b : *bcv) {
+        updatePageStateFromDataBlockContainerReference(b, MemoryPage::PageState::InAggregatorFifoOut);
+    }
+    // push directly out completed slices
+    pushOutput(std::move(bcv));
+  }
+}
+
+DataBlockAggregator::tStf* DataBlockAggregator::getStf(uint64_t tfId)
+{
+  if (stfBufferCount == 0) {
+    stfBufferFirst = tfId;
+    stfBufferLast = tfId;
+  } else if (tfId < stfBufferFirst) {
+    // older than all buffered TFs: window can be extended only if large enough
+    if (stfBufferLast - tfId >= stfBufferSize) {
+      return nullptr;
+    }
+    stfBufferFirst = tfId;
+  } else {
+    // newer TF out of window: oldest TFs are pushed out (even if incomplete) to make room
+    while ((stfBufferCount > 0) && (tfId - stfBufferFirst >= stfBufferSize)) {
+      tStf& old = stfBuffer[stfBufferFirst & stfBufferMask];
+      if (!old.sstf.empty()) {
+        static InfoLogger::AutoMuteToken token(LogWarningSupport_(3004));
+        theLog.log(token, "STF buffer full, pushing out TF %" PRIu64 " to make room for TF %" PRIu64, old.tfId, tfId);
+        pushStf(old);
       }
+      stfBufferFirst++;
+    }
+    if (stfBufferCount == 0) {
+      stfBufferFirst = tfId;
+      stfBufferLast = tfId;
+    }
+  }
+  tStf& stf = stfBuffer[tfId & stfBufferMask];
+  if (stf.sstf.empty()) {
+    // new TF in this slot. Vector capacity is kept from previous use, or preallocated for the number of sources.
+    stf.tfId = tfId;
+    stf.nSources = 0;
+    stf.nSourcesComplete = 0;
+    if ((nSources > 0) && (stf.sstf.capacity() < (size_t)nSources)) {
+      stf.sstf.reserve(nSources);
+    }
+    stfBufferCount++;
+    if (tfId > stfBufferLast) {
+      stfBufferLast = tfId;
+    }
+  }
+  return &stf;
+}
 
-      if (enableStfBuilding) {
-        // buffer timeframes
-        DataBlockContainerReference b = bcv->at(0);
-        DataBlock* db = b->getData();
-        uint64_t tfId = db->header.timeframeId;
-        uint64_t sourceId = (((uint64_t)db->header.equipmentId) << 32) | ((uint64_t)db->header.linkId);
-        if (tfId <= lastTimeframeId) {
-	  static InfoLogger::AutoMuteToken token(LogWarningSupport_(3004));
-          theLog.log(token, "Discarding late data for TF %" PRIu64 " (source = 0x%" PRIx64 ")", tfId, sourceId);
-        } else {
-          tStf& stf = stfBuffer[tfId];
-          stf.tfId = tfId;
-          stf.sstf.push_back({ sourceId, bcv, now });
-          stf.updateTime = now;
-          // theLog.log(LogDebugTrace, "aggregate - added tf %lu : source %lX",tfId,sourceId);
-        }
-      } else {
-        for(auto const& b : *bcv) {
-            updatePageStateFromDataBlockContainerReference(b, MemoryPage::PageState::InAggregatorFifoOut);
+int DataBlockAggregator::getStfSourcesExpected()
+{
+  // if not configured, the expected sources are the ones seen since start, once the first TF was sent
+  if ((cfgStfSources == 0) && (nStfComplete + nStfIncomplete > 0)) {
+    return nSources;
+  }
+  return cfgStfSources;
+}
+
+void DataBlockAggregator::completeSourceInPreviousStf(uint64_t sourceId, uint64_t tfId)
+{
+  // slices of a source arrive in order: when it sends data for a new TF, its last slice for older TFs was indeed the last one
+  for (uint64_t id = stfBufferFirst; (id < tfId) && (id <= stfBufferLast); id++) {
+    tStf& stf = stfBuffer[id & stfBufferMask];
+    if ((stf.sstf.empty()) || (stf.tfId != id)) {
+      continue;
+    }
+    tSstf* lastSlice = nullptr;
+    for (auto& ss : stf.sstf) {
+      if (ss.sourceId == sourceId) {
+        lastSlice = &ss;
+        if (!ss.isClosedOnTimeout) {
+          // already complete
+          lastSlice = nullptr;
+          break;
         }
-        // push directly out completed slices
-        output->push(bcv);
       }
+    }
+    if (lastSlice != nullptr) {
+      lastSlice->isClosedOnTimeout = 0;
+      stf.nSourcesComplete++;
+    }
+  }
+}
 
-      nSlicesOut++;
-      // printf("Pushed STF : %d chunks\n",(int)bcv->size());
+void DataBlockAggregator::pushStf(tStf& stf)
+{
+  // counted as complete when all expected sources have sent data
+  int nSourcesExpected = getStfSourcesExpected();
+  if ((nSourcesExpected > 0) && (stf.nSources >= nSourcesExpected)) {
+    nStfComplete++;
+  } else {
+    nStfIncomplete++;
+  }
+  double tmin = stf.updateTime;
+  double tmax = stf.updateTime;
+  int ix = 0;
+  for (auto& ss : stf.sstf) {
+    for(auto const& b : *ss.data) {
+      updatePageStateFromDataBlockContainerReference(b, MemoryPage::PageState::InAggregatorFifoOut);
+    }
+    ix++;
+    if (ix == (int)stf.sstf.size()) {
+      // this is the last piece of this TF, mark last block as such
+      ss.data->back()->getData()->header.flagEndOfTimeframe = 1;
+    }
+    pushOutput(std::move(ss.data));
+    if (ss.updateTime < tmin) {
+      tmin = ss.updateTime;
+    }
+    if (ss.updateTime > tmax) {
+      tmax = ss.updateTime;
     }
   }
-  // on next iteration, start from a different input to balance equipments emptying order
-  if (nInputs>1) {
-    nextIndex = (nextIndex + 1) % nInputs;
+  uint64_t newTimeframeId = stf.tfId;
+  if (newTimeframeId > lastTimeframeId + 1) {
+    static InfoLogger::AutoMuteToken token(LogWarningSupport_(3004));
+    theLog.log(token, "Gap in timeframe ids detected: previous = %" PRIu64 " new = %" PRIu64, lastTimeframeId, newTimeframeId);
   }
+  lastTimeframeId = newTimeframeId;
+  /*
+  if (lastTimeframeId % 10 == 1) {
+    theLog.log(LogDebugTrace, "LastTimeframeId=%lu deltaT=%f",lastTimeframeId,tmax-tmin);
+  }
+  */
+  stf.sstf.clear(); // slot is free, capacity kept
+  stfBufferCount--;
+}
 
-  // in TF buffering mode, are there some complete timeframes?
-  if (enableStfBuilding) {
-    int nDataSetPushed = 0;
-    int nStfPushed = 0;
-    auto it = stfBuffer.begin();
-    while (it != stfBuffer.end()) {
-      double age = now - it->second.updateTime;
-      if ((age >= cfgStfTimeout) || (executeFlush)) {
-        // printf("pushing age %.3f tf %d -> %d sources\n",age,(int)it->second.tfId,(int)it->second.sstf.size());
-        double tmin = it->second.updateTime;
-        double tmax = it->second.updateTime;
-        int ix = 0;
-        for (auto const& ss : it->second.sstf) {
-          for(auto const& b : *ss.data) {
-            updatePageStateFromDataBlockContainerReference(b, MemoryPage::PageState::InAggregatorFifoOut);
-          }
-          ix++;
-          if (ix == (int)it->second.sstf.size()) {
-            // this is the last piece of this TF, mark last block as such
-            ss.data->back()->getData()->header.flagEndOfTimeframe = 1;
-          }
-          output->push(ss.data);
-          nDataSetPushed++;
-          if (ss.updateTime < tmin) {
-            tmin = ss.updateTime;
-          }
-          if (ss.updateTime < tmax) {
-            tmax = ss.updateTime;
-          }
-        }
-        if (it->second.tfId == 1) {
-          nSources = it->second.sstf.size(); // keep track of number of sources in first TF
-        }
-        nStfPushed++;
-	uint64_t newTimeframeId = it->second.tfId;
-	if (newTimeframeId > lastTimeframeId + 1) {
-	  static InfoLogger::AutoMuteToken token(LogWarningSupport_(3004));
-          theLog.log(token, "Gap in timeframe ids detected: previous = %" PRIu64 " new = %" PRIu64, lastTimeframeId, newTimeframeId);
-	}
-        lastTimeframeId = newTimeframeId;
-        /*
-        if (lastTimeframeId % 10 == 1) {
-          theLog.log(LogDebugTrace, "LastTimeframeId=%lu deltaT=%f",lastTimeframeId,tmax-tmin);
-        }
-        */
-        it = stfBuffer.erase(it);
-      } else {
-        break;
+double DataBlockAggregator::getAdaptiveTimeout(double currentTimeout, double observedDelay, double maxTimeout)
+{
+  if (observedDelay <= 0) {
+    // nothing observed, keep current value
+    return currentTimeout;
+  }
+  double t = observedDelay * (1.0 + adaptiveTimeoutMargin);
+  if (t < currentTimeout * adaptiveTimeoutDecrease) {
+    t = currentTimeout * adaptiveTimeoutDecrease;
+  }
+  if (t < cfgAdaptiveTimeoutMin) {
+    t = cfgAdaptiveTimeoutMin;
+  }
+  if (t > maxTimeout) {
+    t = maxTimeout;
+  }
+  return t;
+}
+
+void DataBlockAggregator::publishTimeouts()
+{
+  // slice timeout: the largest one, all slicers together
+  double sliceTimeout = 0;
+  if ((cfgSliceTimeout > 0) && (!disableSlicing) && (sliceTimeouts != nullptr)) {
+    for (unsigned int i = 0; i < inputs.size(); i++) {
+      double t = sliceTimeouts[i].load();
+      if (t > sliceTimeout) {
+        sliceTimeout = t;
       }
     }
   }
+  double currentStfTimeout = ((enableStfBuilding) && (!disableSlicing)) ? stfTimeout : 0;
+  if ((gReadoutStats.counters.aggregatorSliceTimeout.load() != sliceTimeout) || (gReadoutStats.counters.aggregatorStfTimeout.load() != currentStfTimeout)) {
+    gReadoutStats.counters.aggregatorSliceTimeout = sliceTimeout;
+    gReadoutStats.counters.aggregatorStfTimeout = currentStfTimeout;
+    gReadoutStats.counters.notify++;
+  }
+}
+
+Thread::CallbackResult DataBlockAggregator::workerThreadCallback(void* arg)
+{
+  SliceWorker* w = (SliceWorker*)arg;
+  if ((w == NULL) || (w->aggregator == NULL)) {
+    return Thread::CallbackResult::Error;
+  }
+
+  if (!w->isThreadNamed) {
+    #ifdef _GNU_SOURCE
+      char threadName[16];
+      snprintf(threadName, sizeof(threadName), "aggregator-%d", w->id);
+      pthread_setname_np(pthread_self(), threadName);
+    #endif
+    w->isThreadNamed = 1;
+  }
+
+  return w->aggregator->executeWorkerCallback(*w);
+}
+
+Thread::CallbackResult DataBlockAggregator::executeWorkerCallback(SliceWorker& w)
+{
+  if (w.fifo->isFull()) {
+    return Thread::CallbackResult::Idle;
+  }
+  // only this thread pushes to its fifo, free space checked now is available until the end of this iteration
+  w.outputFree = w.fifo->getNumberOfFreeSlots();
+
+  unsigned int nInputs = w.inputIndexes.size();
+  unsigned int nBlocksIn = 0;
+  unsigned int nSlicesOut = 0;
+  double now = timeNow.getTime();
+  bool executeFlush = 0;
+  if (doFlush) {
+    executeFlush = 1;
+  } else {
+    w.isFlushed = 0;
+  }
+
+  for (unsigned int ix = 0; ix < nInputs; ix++) {
+    int i = w.inputIndexes[(ix + w.nextIndex) % nInputs];
+    Thread::CallbackResult r = sliceInput(i, &w, now, executeFlush, nBlocksIn, nSlicesOut);
+    if (r != Thread::CallbackResult::Ok) {
+      flushWorkerOutput(w);
+      return r;
+    }
+  }
+  if (nInputs > 1) {
+    w.nextIndex = (w.nextIndex + 1) % nInputs;
+  }
+  flushWorkerOutput(w);
 
   if ((nBlocksIn == 0) && (nSlicesOut == 0)) {
-    if ((executeFlush) && (stfBuffer.size() == 0)) {
-      doFlush = 0; // flushing is complete if we are now idle
+    if (executeFlush) {
+      w.isFlushed = 1;
     }
     return Thread::CallbackResult::Idle;
   }
-
+  w.isFlushed = 0;
   return Thread::CallbackResult::Ok;
 }
 
+void DataBlockAggregator::flushWorkerOutput(SliceWorker& w)
+{
+  if (w.outputBatch.size()) {
+    w.fifo->pushBatch(w.outputBatch.data(), (int)w.outputBatch.size());
+    w.outputBatch.clear();
+  }
+}
+
+void DataBlockAggregator::stopWorkers()
+{
+  for (auto& w : workers) {
+    w->thread->stop();
+  }
+  for (auto& w : workers) {
+    w->thread->join();
+    totalBlocksIn += w->totalBlocksIn;
+    w->totalBlocksIn = 0;
+    totalBlocksDropped += w->totalBlocksDropped;
+    w->totalBlocksDropped = 0;
+  }
+}
+
 DataBlockSlicer::DataBlockSlicer() {
+  slices.resize(slicesInitialSize);
   reset();
 }
 
@@ -280,33 +750,51 @@ DataBlockSlicer::~DataBlockSlicer() {}
 int DataBlockSlicer::appendBlock(DataBlockContainerReference const& block, double timestamp)
 {
   uint64_t tfId = block->getData()->header.timeframeId;
-  DataSourceId sourceId;
-  sourceId.linkId = block->getData()->header.linkId;
-  sourceId.equipmentId = block->getData()->header.equipmentId;
+  uint8_t linkId = block->getData()->header.linkId;
+  uint16_t equipmentId = block->getData()->header.equipmentId;
 
-  if (sourceId.linkId != undefinedLinkId) {
-    if (sourceId.linkId >= maxLinks) {
+  unsigned int linkSlot = maxLinks;
+  if (linkId != undefinedLinkId) {
+    if (linkId >= maxLinks) {
       static InfoLogger::AutoMuteToken token(LogWarningSupport_(3004));
-      theLog.log(token, "wrong link id %d > %d", sourceId.linkId, maxLinks - 1);
+      theLog.log(token, "wrong link id %d > %d", linkId, maxLinks - 1);
       return -1;
     }
+    linkSlot = linkId;
   }
 
-  // theLog.log(LogDebugTrace, "slicer %p append block eq %d link %d for tf %d", this,(int)sourceId.equipmentId,(int)sourceId.linkId,(int)tfId);
-  PartialSlice& s = partialSlices[sourceId];
+  // theLog.log(LogDebugTrace, "slicer %p append block eq %d link %d for tf %d", this,(int)equipmentId,(int)linkId,(int)tfId);
+  EquipmentSlices* eq = getEquipmentSlices(equipmentId);
+  if (eq == nullptr) {
+    return -1;
+  }
+  PartialSlice& s = eq->links[linkSlot];
 
   if (s.currentDataSet != nullptr) {
     // theLog.log(LogDebugTrace, "slice size = %d chunks",(int)s.currentDataSet->size());
     if ((s.tfId != tfId) || (tfId == undefinedTimeframeId)) {
       // the current slice is complete
-      // theLog.log(LogDebugTrace, "slicer %p TF %d eq %d link %d is complete (%d blocks)",this, (int)s.tfId,(int)sourceId.equipmentId,(int)sourceId.linkId,(int)s.currentDataSet->size());
-      slices.push(s.currentDataSet);
-      s.currentDataSet = nullptr;
+      // theLog.log(LogDebugTrace, "slicer %p TF %d eq %d link %d is complete (%d blocks)",this, (int)s.tfId,(int)equipmentId,(int)linkId,(int)s.currentDataSet->size());
+      pushSlice(s.currentDataSet);
+    }
+  }
+  if (recordDelays) {
+    if (s.currentDataSet != nullptr) {
+      // slice continues: keep track of delays between blocks
+      s.delays.add(timestamp - s.lastUpdateTime);
+    } else if ((s.isClosedOnTimeout) && (s.tfId == tfId) && (tfId != undefinedTimeframeId)) {
+      // slice was closed on timeout, but data of the same TF keeps coming: the gap is recorded so that timeout increases
+      s.delays.add(timestamp - s.lastUpdateTime);
     }
   }
+  s.isClosedOnTimeout = 0;
   if (s.currentDataSet == nullptr) {
     try {
-      s.currentDataSet = std::make_shared<DataSet>();
+      if (dataSetPool != nullptr) {
+        s.currentDataSet = dataSetPool->get();
+      } else {
+        s.currentDataSet = std::make_shared<DataSet>();
+      }
     } catch (...) {
       return -1;
     }
@@ -314,64 +802,131 @@ int DataBlockSlicer::appendBlock(DataBlockContainerReference const& block, doubl
   s.currentDataSet->push_back(block);
   s.tfId = tfId;
   s.lastUpdateTime = timestamp;
-  // printf(" %d,%d -> %d blocks\n",(int)sourceId.equipmentId,(int)sourceId.linkId,(int)s.currentDataSet->size());
+  // printf(" %d,%d -> %d blocks\n",(int)equipmentId,(int)linkId,(int)s.currentDataSet->size());
   return s.currentDataSet->size();
 }
 
-DataSetReference DataBlockSlicer::getSlice(bool includeIncomplete)
+DataBlockSlicer::Slice DataBlockSlicer::getSlice(bool includeIncomplete)
 {
-  // get a slice. get oldest from queue, or possibly currentDataSet when queue empty and includeIncomplete is true
-  DataSetReference bcv = nullptr;
-  if (slices.empty()) {
+  // get a slice. get oldest from ring, or possibly currentDataSet when ring empty and includeIncomplete is true
+  Slice bcv;
+  if (slicesCount == 0) {
     if (includeIncomplete) {
-      for (auto& s : partialSlices) {
-        bcv = s.second.currentDataSet;
-        if (bcv != nullptr) {
-          s.second.currentDataSet = nullptr;
-          break;
+      for (auto& eq : partialSlices) {
+        for (auto& s : eq.links) {
+          if (s.currentDataSet != nullptr) {
+            bcv.data = std::move(s.currentDataSet);
+            s.currentDataSet = nullptr;
+            return bcv;
+          }
         }
       }
-    } else {
-      return nullptr;
     }
+    return bcv;
   } else {
-    bcv = slices.front();
-    slices.pop();
+    bcv = std::move(slices[slicesHead]);
+    slices[slicesHead].data = nullptr;
+    slicesHead = (slicesHead + 1) & (slices.size() - 1);
+    slicesCount--;
   }
-  // printf("getSlice -> %p\n", bcv.get());
+  // printf("getSlice -> %p\n", bcv.data.get());
   return bcv;
 }
 
 int DataBlockSlicer::completeSliceOnTimeout(double timestamp)
 {
   int nFlushed = 0;
-  for (auto& s : partialSlices) {
-    // check if current data set needs to be flushed
-    if (s.second.currentDataSet != nullptr) {
-      if (s.second.lastUpdateTime <= timestamp) {
-        slices.push(s.second.currentDataSet);
-        s.second.currentDataSet = nullptr;
-        nFlushed++;
+  for (auto& eq : partialSlices) {
+    for (auto& s : eq.links) {
+      // check if current data set needs to be flushed
+      if (s.currentDataSet != nullptr) {
+        if (s.lastUpdateTime <= timestamp) {
+          pushSlice(s.currentDataSet, 1);
+          s.isClosedOnTimeout = 1;
+          nFlushed++;
+        }
       }
     }
   }
   return nFlushed;
 }
 
+double DataBlockSlicer::getDelayPercentile(double fraction)
+{
+  double delay = 0;
+  for (auto& eq : partialSlices) {
+    for (auto& s : eq.links) {
+      double d = s.delays.getPercentile(fraction);
+      if (d > delay) {
+        delay = d;
+      }
+      s.delays.clear();
+    }
+  }
+  return delay;
+}
+
+DataBlockSlicer::EquipmentSlices* DataBlockSlicer::getEquipmentSlices(uint16_t equipmentId)
+{
+  // usually, all blocks of a slicer come from the same equipment
+  if ((lastEquipmentIndex >= 0) && (partialSlices[lastEquipmentIndex].equipmentId == equipmentId)) {
+    return &partialSlices[lastEquipmentIndex];
+  }
+  unsigned int ix = 0;
+  for (; ix < partialSlices.size(); ix++) {
+    if (partialSlices[ix].equipmentId == equipmentId) {
+      lastEquipmentIndex = ix;
+      return &partialSlices[ix];
+    }
+    if (partialSlices[ix].equipmentId > equipmentId) {
+      break;
+    }
+  }
+  // new equipment, keep tables sorted by equipmentId
+  try {
+    partialSlices.insert(partialSlices.begin() + ix, EquipmentSlices());
+  } catch (...) {
+    return nullptr;
+  }
+  partialSlices[ix].equipmentId = equipmentId;
+  lastEquipmentIndex = ix;
+  return &partialSlices[ix];
+}
+
+void DataBlockSlicer::pushSlice(DataSetReference& ds, bool isClosedOnTimeout)
+{
+  size_t ringSize = slices.size();
+  if (slicesCount == ringSize) {
+    // ring full: double its size, keeping order
+    std::vector<Slice> newSlices(ringSize * 2);
+    for (size_t i = 0; i < slicesCount; i++) {
+      newSlices[i] = std::move(slices[(slicesHead + i) & (ringSize - 1)]);
+    }
+    slices.swap(newSlices);
+    slicesHead = 0;
+    ringSize = slices.size();
+  }
+  Slice& slice = slices[(slicesHead + slicesCount) & (ringSize - 1)];
+  slice.data = std::move(ds);
+  slice.isClosedOnTimeout = isClosedOnTimeout;
+  ds = nullptr;
+  slicesCount++;
+}
+
 void DataBlockSlicer::reset()
 {
   slicerId = -1;
   
   // empty buffers
-  while(!slices.empty()) {
-    auto bc = slices.front();
+  for (; slicesCount > 0; slicesCount--) {
+    auto& bc = slices[slicesHead].data;
     bc->clear();
-    slices.pop();
-  }
-  for (auto& s : partialSlices) {
-    s.second.currentDataSet = nullptr;
+    bc = nullptr;
+    slicesHead = (slicesHead + 1) & (slices.size() - 1);
   }
+  slicesHead = 0;
   partialSlices.clear();
+  lastEquipmentIndex = -1;
 }
 
 void DataBlockAggregator::reset()
@@ -383,21 +938,33 @@ void DataBlockAggregator::reset()
   }
   
   // reset buffers
-  for(auto const & m : stfBuffer) {
-    auto vsstf = m.second.sstf;
-    for (auto& sstf : vsstf) {
-      sstf.data = nullptr;
-    }
-    vsstf.clear();
+  for (auto& stf : stfBuffer) {
+    stf.sstf.clear();
+  }
+  stfBufferCount = 0;
+  stfBufferFirst = 0;
+  stfBufferLast = 0;
+  for (auto& b : inputBatch) {
+    b = nullptr;
+  }
+  outputBatch.clear();
+  for (auto& ds : mergeBatch) {
+    ds.data = nullptr;
   }
-  stfBuffer.clear();
+  workers.clear(); // slicing threads are created on start
   
   // reset counters
+  dataSetPool->resetStats();
   doFlush = 0;
   timeNow.reset();
   nSources = 0;
+  knownSources.clear();
+  knownSourcesDelays.clear();
+  nStfComplete = 0;
+  nStfIncomplete = 0;
   nextIndex = 0;
   totalBlocksIn = 0;
+  totalBlocksDropped = 0;
   lastTimeframeId = 0;
 }
 
@@ -13,20 +13,24 @@
 #include <Common/Fifo.h>
 #include <Common/Thread.h>
 #include <Common/Timer.h>
-#include <map>
+#include <atomic>
 #include <memory>
-#include <queue>
 #include <vector>
 
 #include "DataBlock.h"
 #include "DataBlockContainer.h"
 #include "DataSet.h"
+#include "DelayHistogram.h"
+#include "ReadoutFifo.h"
+#include "RecyclingPool.h"
 
 using namespace AliceO2::Common;
 
 // DataBlockAggregator
 //
 // One "slicer" per equipment: data blocks with same sourceId are grouped in a "slice" of blocks having the same TF id.
+// Slicing may be done by several threads, each one owning a subset of the inputs. The completed slices are then
+// merged by the aggregator thread, which builds the subtimeframes (if enabled) and fills the output FIFO.
 
 // a class to group blocks with same ID in slices
 class DataBlockSlicer
@@ -40,9 +44,15 @@ class DataBlockSlicer
   // returns the number of blocks in slice used
   int appendBlock(DataBlockContainerReference const& block, double timestamp = 0);
 
-  // get a slice, if available
+  // a completed slice
+  struct Slice {
+    DataSetReference data;
+    bool isClosedOnTimeout = 0; // set when slice was closed on timeout: more data of the same TF may follow. Otherwise, closed by data of next TF or by flush.
+  };
+
+  // get a slice, if available (data is nullptr otherwise)
   // if includeIncomplete is true, also retrieves current slice, even if incomplete otherwise, only a complete slice is returned, if any when iterated, returned in order of creation, older first
-  DataSetReference getSlice(bool includeIncomplete = false);
+  Slice getSlice(bool includeIncomplete = false);
 
   // consider the slices which have not been updated since timestamp as complete
   // they are flushed and moved to the "ready" slices
@@ -55,45 +65,54 @@ class DataBlockSlicer
   
   int slicerId;
 
- private:
-  // data source id used to group data
-  struct DataSourceId {
-    uint16_t equipmentId = undefinedEquipmentId;
-    uint8_t linkId = undefinedLinkId;
-  };
+  // when set, delays between consecutive blocks of a slice are recorded for each link (see getDelayPercentile())
+  bool recordDelays = 0;
+  // get the maximum over links of the given percentile (fraction between 0 and 1) of delays recorded since previous call
+  // returns 0 if none
+  double getDelayPercentile(double fraction);
+  double sliceTimeout = 0;        // current timeout for slices of this slicer, when adaptive
+  double nextTimeoutUpdate = 0;   // time of next update of sliceTimeout
 
-  struct PartialSlice {
-    uint64_t tfId;                   // timeframeId of this slice
-    double lastUpdateTime = 0;       // timestamp of last block pushed
-    DataSetReference currentDataSet; // currently associated data
-  };
+  RecyclingPool<DataSet>* dataSetPool = nullptr; // if set, data sets are taken from this pool instead of heap
 
-  struct CompareDataSourceId {
-    inline bool operator()(const DataSourceId& id1, const DataSourceId& id2) const
-    {
-      if (id1.equipmentId != id2.equipmentId) {
-        return id1.equipmentId < id2.equipmentId;
-      } else {
-        return id1.linkId < id2.linkId;
-      }
-    }
+ private:
+  struct PartialSlice {
+    uint64_t tfId = undefinedTimeframeId; // timeframeId of this slice
+    double lastUpdateTime = 0;            // timestamp of last block pushed
+    DataSetReference currentDataSet;      // currently associated data
+    DelayHistogram delays;                // delays between consecutive blocks of a slice, when recordDelays is set
+    bool isClosedOnTimeout = 0;           // set when slice was closed on timeout, until next block
   };
 
-  using PartialSliceMap = std::map<DataSourceId, PartialSlice, CompareDataSourceId>;
+  static constexpr unsigned int maxLinks = 32;             // maximum number of links
+  static constexpr unsigned int nLinkSlots = maxLinks + 1; // one slice per link, plus one for blocks with undefined link id
 
-  const unsigned int maxLinks = 32; // maximum number of links
-  PartialSliceMap partialSlices;    // slices being built (one per link)
+  // slices being built for one equipment, indexed by link id
+  struct EquipmentSlices {
+    uint16_t equipmentId = undefinedEquipmentId;
+    PartialSlice links[nLinkSlots];
+  };
 
-  std::queue<DataSetReference> slices; // data sets which have been built and are complete
+  std::vector<EquipmentSlices> partialSlices; // slices being built, one table per equipment (usually only one per slicer), sorted by equipmentId
+  int lastEquipmentIndex = -1;                // index in partialSlices of the equipment used for previous block
+  EquipmentSlices* getEquipmentSlices(uint16_t equipmentId); // get table for given equipment, created if needed. Returns nullptr on failure.
+
+  // data sets which have been built and are complete, in a ring (older first)
+  // the ring size is a power of 2, it is doubled when full
+  static constexpr size_t slicesInitialSize = 64;
+  std::vector<Slice> slices;
+  size_t slicesHead = 0;  // index of oldest slice in ring
+  size_t slicesCount = 0; // number of slices in ring
+  void pushSlice(DataSetReference& ds, bool isClosedOnTimeout = 0); // append a slice to the ring (moved)
 };
 
 class DataBlockAggregator
 {
  public:
-  DataBlockAggregator(AliceO2::Common::Fifo<DataSetReference>* output, std::string name = "Aggregator");
+  DataBlockAggregator(ReadoutFifo<DataSetReference>* output, std::string name = "Aggregator");
   ~DataBlockAggregator();
 
-  int addInput(std::shared_ptr<AliceO2::Common::Fifo<DataBlockContainerReference>> input); // add a FIFO to be used as input
+  int addInput(std::shared_ptr<ReadoutFifo<DataBlockContainerReference>> input); // add a FIFO to be used as input
 
   void start();                   // starts processing thread
   void stop(int waitStopped = 1); // stop processing thread (and possibly wait it terminates)
@@ -102,22 +121,85 @@ class DataBlockAggregator
 
   double cfgSliceTimeout = 0; // when set, slices not updated after timeout (seconds) are considered completed and are flushed
 
+  // when set, slice and STF timeouts are adjusted from observed delays, between cfgAdaptiveTimeoutMin and the configured values
+  bool cfgAdaptiveTimeouts = 0;
+  double cfgAdaptiveTimeoutMin = 0.01;
+  double getAdaptiveTimeout(double currentTimeout, double observedDelay, double maxTimeout); // compute new timeout value, from a delay observed in last period (0 if none) and the current value
+
+  int cfgSlicingThreads = 1; // number of threads used for slicing. When more than one, they feed a merge stage in the aggregator thread. Set before start().
+
   static Thread::CallbackResult threadCallback(void* arg);
 
   Thread::CallbackResult executeCallback();
 
-  bool doFlush = 0; // when set, flush slices including incomplete ones the flag is reset automatically when done
+  std::atomic<bool> doFlush = 0; // when set, flush slices including incomplete ones the flag is reset automatically when done
 
   bool enableStfBuilding = 0; // when set, STF are buffered until all sources have participated. Data from late sources are discarded.
-  double cfgStfTimeout = 0;   // timeout used with enableStfBuilding
-  int nSources = 0;           // accounted number of sources, on first timeframe
+  double cfgStfTimeout = 0;   // timeout used with enableStfBuilding, for STF with missing sources
+  int cfgStfSources = 0;      // number of sources expected in each STF, to send it as soon as complete. If zero, all sources seen since start are expected (after the first STF, sent on timeout). If negative, STF are sent on timeout only.
+  int nSources = 0;           // accounted number of sources, since start
 
   void reset(); // reset all internal buffers, counters and states
 
  private:
   bool isThreadNamed = 0; // flag to set once thread name
-  std::vector<std::shared_ptr<AliceO2::Common::Fifo<DataBlockContainerReference>>> inputs;
-  AliceO2::Common::Fifo<DataSetReference>* output; // todo: unique_ptr
+  std::string threadName; // name given to processing thread
+  std::vector<std::shared_ptr<ReadoutFifo<DataBlockContainerReference>>> inputs;
+  ReadoutFifo<DataSetReference>* output; // todo: unique_ptr
+
+  // fifos are accessed by batches
+  static const int batchSize = 64;                     // maximum number of items moved at once from/to fifos
+  std::vector<DataBlockContainerReference> inputBatch; // blocks retrieved from an input fifo
+  std::vector<DataSetReference> outputBatch;           // data sets pending push to output fifo
+  int outputFree = 0;                                  // number of free slots in output fifo, minus data sets pending in outputBatch
+  void pushOutput(DataSetReference ds);                // add a data set to output batch (pushed when batch is full, or on flushOutput())
+  void flushOutput();                                  // push pending data sets to output fifo
+
+  // a slicing thread, and the inputs it owns
+  // completed slices are pushed to a fifo read by the merge stage
+  struct SliceWorker {
+    DataBlockAggregator* aggregator = nullptr;
+    int id = 0;
+    bool isThreadNamed = 0;
+    std::unique_ptr<Thread> thread;
+    std::vector<int> inputIndexes;                       // inputs (and corresponding slicers) handled by this thread
+    int nextIndex = 0;                                   // index in inputIndexes to start with at next iteration
+    std::unique_ptr<ReadoutFifo<DataBlockSlicer::Slice>> fifo; // completed slices, to merge stage
+    std::vector<DataBlockContainerReference> inputBatch; // blocks retrieved from an input fifo
+    std::vector<DataBlockSlicer::Slice> outputBatch;     // slices pending push to fifo
+    int outputFree = 0;                                  // number of free slots in fifo, minus slices pending in outputBatch
+    std::atomic<bool> isFlushed = 0;                     // set when idle during a flush, i.e. all its data was given to merge stage
+    unsigned long long totalBlocksIn = 0;                // number of blocks received from inputs
+    unsigned long long totalBlocksDropped = 0;           // number of blocks received from inputs and released on error
+  };
+  std::vector<std::unique_ptr<SliceWorker>> workers; // slicing threads. If empty, slicing is done in aggregator thread.
+  std::vector<DataBlockSlicer::Slice> mergeBatch;    // slices retrieved from a slicing thread fifo
+  static const int workerFifoSize = 1024;             // size of fifo between a slicing thread and the merge stage
+
+  static Thread::CallbackResult workerThreadCallback(void* arg);
+  Thread::CallbackResult executeWorkerCallback(SliceWorker& w);
+  void flushWorkerOutput(SliceWorker& w);
+  void stopWorkers();
+
+  // adaptive timeouts: they are updated periodically from a high percentile of the delays observed in last period, plus a margin.
+  // the slice timeout is per slicer, from the delays between blocks of the same slice.
+  // the STF timeout is from the delays between first and next data of each source for the same TF.
+  // they increase immediately, and decrease slowly (limited step at each update).
+  static constexpr double adaptiveTimeoutInterval = 1.0;    // time between updates, in seconds
+  static constexpr double adaptiveTimeoutPercentile = 0.99; // percentile of delays used
+  static constexpr double adaptiveTimeoutMargin = 0.5;      // margin added, as a fraction of percentile value
+  static constexpr double adaptiveTimeoutDecrease = 0.9;    // maximum decrease factor at each update
+  std::unique_ptr<std::atomic<double>[]> sliceTimeouts;     // current slice timeout of each slicer, for monitoring
+  double stfTimeout = 0;                                    // current STF timeout
+  double nextStfTimeoutUpdate = 0;                          // time of next update of stfTimeout and of monitoring values
+  void publishTimeouts();                                   // update monitoring values with current timeouts
+
+  // read blocks from input i, slice them, and give completed slices to merge stage (directly, or through worker fifo if w is set)
+  // returns Ok, Idle (when no more space for output), or Error. Counters are incremented with the number of blocks and slices processed.
+  Thread::CallbackResult sliceInput(int i, SliceWorker* w, double now, bool executeFlush, unsigned int& nBlocksIn, unsigned int& nSlicesOut);
+  void dropBatch(std::vector<DataBlockContainerReference>& batch, int first, int n, SliceWorker* w); // release blocks first to n-1 of a batch on error, they are counted as dropped
+  void emitSlice(SliceWorker* w, DataBlockSlicer::Slice& slice, double now); // give a completed slice to merge stage
+  void processSlice(DataBlockSlicer::Slice& slice, double now);              // merge stage: buffer slice in STF, or push it to output
 
   std::unique_ptr<Thread> aggregateThread;
   AliceO2::Common::Timer incompletePendingTimer;
@@ -126,14 +208,22 @@ class DataBlockAggregator
   int isIncompletePending;
 
   std::vector<DataBlockSlicer> slicers;
+
+  // preallocated data sets, shared by all slicers
+  // this should be big enough to accomodate the output FIFO and the buffered slices, otherwise heap is used
+  const int dataSetPoolSize = 16384;
+  const int dataSetReservedSize = 32; // number of blocks reserved in each data set
+  std::unique_ptr<RecyclingPool<DataSet>> dataSetPool;
   int nextIndex = 0;                    // index of input channel to start with at next iteration to fill output fifo. not starting always from zero to avoid favorizing low-index channels.
   unsigned long long totalBlocksIn = 0; // number of blocks received from inputs
+  unsigned long long totalBlocksDropped = 0; // number of blocks received from inputs and released on error
 
   // container for sub-subtimeframe (i.e. all data pages of 1 timeframe for a given single source)
   struct tSstf {
     uint64_t sourceId;     // id of the source (equipmentId + linkId);
     DataSetReference data; // data pages for this sstf
     double updateTime;
+    bool isClosedOnTimeout; // set when slice closed on timeout, until later data of the source shows it was the last one for this TF
   };
 
   // container for one subtimeframe (i.e. sub-subtimeframes of all sources of 1 timeframe)
@@ -141,10 +231,26 @@ class DataBlockAggregator
     uint64_t tfId;           // timeframe id
     std::vector<tSstf> sstf; // vector of sub-subtimeframes (1 per source)
     double updateTime;
+    int nSources = 0;        // number of distinct sources in sstf
+    int nSourcesComplete = 0; // number of distinct sources in sstf which have sent all their data for this TF
+    double startTime;        // time of first data received
   };
 
-  typedef std::map<uint64_t, tStf> tStfMap;
-  tStfMap stfBuffer;            // buffer to hold pending subtimeframes
+  // buffer to hold pending subtimeframes: a ring indexed by timeframe id, for a window of consecutive ids
+  static const uint64_t stfBufferSize = 1024;             // maximum span of pending timeframe ids (power of 2)
+  static const uint64_t stfBufferMask = stfBufferSize - 1; // for fast modulo
+  std::vector<tStf> stfBuffer;                            // slots, a slot is free when it has no sstf
+  uint64_t stfBufferFirst = 0;                            // lowest timeframe id which may be in buffer
+  uint64_t stfBufferLast = 0;                             // highest timeframe id in buffer
+  int stfBufferCount = 0;                                 // number of subtimeframes in buffer
+  tStf* getStf(uint64_t tfId);                            // get buffer slot for given timeframe (created if needed, older ones pushed out if out of window). Returns nullptr if it does not fit.
+  void pushStf(tStf& stf);                                // push to output all data of a subtimeframe, and free its slot
+  int getStfSourcesExpected();                            // number of sources expected in a STF to be complete, as from cfgStfSources (0 or negative: none)
+  void completeSourceInPreviousStf(uint64_t sourceId, uint64_t tfId); // mark source as complete in buffered STF older than tfId, where its last slice was closed on timeout
+  std::vector<uint64_t> knownSources;                     // ids of sources seen since start
+  std::vector<DelayHistogram> knownSourcesDelays;         // for each known source, delays of its data since start of TF (when cfgAdaptiveTimeouts is set)
+  unsigned long long nStfComplete = 0;                    // number of STF sent with all expected sources
+  unsigned long long nStfIncomplete = 0;                  // number of STF sent with missing sources (or when no sources expected)
   uint64_t lastTimeframeId = 0; // counter for last timeframe id sent out
 };
 
@@ -72,8 +72,9 @@ class DataBlockContainer
   };
 
   MemoryPagesPool *memoryPagesPoolPtr = nullptr; // to keep track of owner of this container
+  int memoryPageIndex = -1; // index of page in memoryPagesPoolPtr, if known
 
-  static DataBlockContainerReference getChildBlock(DataBlockContainerReference parentBlock, uint64_t v_dataBufferSizeNeeded, uint64_t roundUp = 0) {
+  static DataBlockContainerReference getChildBlock(const DataBlockContainerReference& parentBlock, uint64_t v_dataBufferSizeNeeded, uint64_t roundUp = 0) {
     uint64_t bufferSize = v_dataBufferSizeNeeded + sizeof(DataBlock);
     if (roundUp) {
       uint64_t r = bufferSize % roundUp;
@@ -0,0 +1,77 @@
+// Copyright 2019-2020 CERN and copyright holders of ALICE O2.
+// See https://alice-o2.web.cern.ch/copyright for details of the copyright holders.
+// All rights not expressly granted are reserved.
+//
+// This software is distributed under the terms of the GNU General Public
+// License v3 (GPL Version 3), copied verbatim in the file "COPYING".
+//
+// In applying this license CERN does not waive the privileges and immunities
+// granted to it by virtue of its status as an Intergovernmental Organization
+// or submit itself to any jurisdiction.
+
+#ifndef _DELAYHISTOGRAM_H
+#define _DELAYHISTOGRAM_H
+
+#include <cmath>
+#include <stdint.h>
+
+// A histogram of delays, to get percentiles of a distribution without keeping all values.
+// Bins are on a logarithmic scale, with 4 bins per power of 2 microseconds:
+// bin 0 is below 1 microsecond, then bins go up to 2^24 microseconds (about 16 seconds), the last bin counts longer delays.
+// Percentiles are given as the upper bound of the corresponding bin, i.e. with less than 19% overestimation.
+// Not thread-safe: to be used by a single thread.
+
+class DelayHistogram
+{
+ public:
+  // count a delay, in seconds
+  void add(double seconds)
+  {
+    double us = seconds * 1000000.0;
+    int bin = 0;
+    if (us >= 1.0) {
+      bin = 1 + (int)(std::log2(us) * binsPerOctave);
+      if (bin >= nBins) {
+        bin = nBins - 1;
+      }
+    }
+    counts[bin]++;
+    total++;
+  }
+
+  // get given percentile (fraction between 0 and 1) of delays counted, in seconds. Returns 0 if empty.
+  double getPercentile(double fraction)
+  {
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t n = 0;
+    int bin = 0;
+    for (bin = 0; bin < nBins - 1; bin++) {
+      n += counts[bin];
+      if (n >= fraction * total) {
+        break;
+      }
+    }
+    return std::exp2((double)bin / binsPerOctave) / 1000000.0;
+  }
+
+  uint64_t getCount() { return total; } // number of delays counted
+
+  // reset histogram
+  void clear()
+  {
+    for (int i = 0; i < nBins; i++) {
+      counts[i] = 0;
+    }
+    total = 0;
+  }
+
+ private:
+  static const int binsPerOctave = 4;                 // number of bins per power of 2
+  static const int nBins = 24 * binsPerOctave + 1;    // number of bins
+  uint32_t counts[nBins] = {};                        // counts per bin
+  uint64_t total = 0;                                 // total counts
+};
+
+#endif // #ifndef _DELAYHISTOGRAM_H
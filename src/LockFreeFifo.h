@@ -0,0 +1,148 @@
+// Copyright 2019-2020 CERN and copyright holders of ALICE O2.
+// See https://alice-o2.web.cern.ch/copyright for details of the copyright holders.
+// All rights not expressly granted are reserved.
+//
+// This software is distributed under the terms of the GNU General Public
+// License v3 (GPL Version 3), copied verbatim in the file "COPYING".
+//
+// In applying this license CERN does not waive the privileges and immunities
+// granted to it by virtue of its status as an Intergovernmental Organization
+// or submit itself to any jurisdiction.
+
+#ifndef _LOCKFREEFIFO_H
+#define _LOCKFREEFIFO_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+// A bounded lock-free FIFO, safe for any number of concurrent producers and consumers.
+// Implementation follows the sequence-numbered ring buffer by D. Vyukov:
+// each slot carries a sequence number telling whether it is ready to be written (seq == pos)
+// or ready to be read (seq == pos + 1). Producers and consumers claim a position with a CAS
+// on their own index, then publish the slot with a release store on its sequence number.
+// The interface mirrors AliceO2::Common::Fifo (push/pop return 0 on success, -1 when full/empty).
+// Capacity is rounded up to the next power of 2.
+// push() fails only when the fifo is really full: it may wait (yield) for a consumer
+// which already claimed the slot but did not release it yet.
+// Items should be trivially copyable and cheap (typically, pointers).
+
+template <typename T>
+class LockFreeFifo
+{
+ public:
+  LockFreeFifo(size_t size)
+  {
+    capacity = 2;
+    while (capacity < size) {
+      capacity *= 2;
+    }
+    mask = capacity - 1;
+    slots = std::make_unique<Slot[]>(capacity);
+    for (size_t i = 0; i < capacity; i++) {
+      slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+    indexPush.store(0, std::memory_order_relaxed);
+    indexPop.store(0, std::memory_order_relaxed);
+  }
+
+  ~LockFreeFifo() {}
+
+  // insert an item. Returns 0 on success, -1 if fifo full.
+  int push(const T& item)
+  {
+    size_t pos = indexPush.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot& s = slots[pos & mask];
+      size_t seq = s.seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0) {
+        // slot is free, try to claim it
+        if (indexPush.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          s.value = item;
+          s.seq.store(pos + 1, std::memory_order_release);
+          return 0;
+        }
+        // pos was updated by failed CAS, retry
+      } else if (dif < 0) {
+        // slot not yet consumed since last round
+        // fifo is full only if all slots are claimed by producers. Otherwise, a consumer
+        // has claimed this slot and is about to release it: retry.
+        if ((intptr_t)(pos - indexPop.load(std::memory_order_acquire)) >= (intptr_t)capacity) {
+          return -1;
+        }
+        std::this_thread::yield();
+        pos = indexPush.load(std::memory_order_relaxed);
+      } else {
+        // another producer got it first, reload
+        pos = indexPush.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // retrieve an item. Returns 0 on success, -1 if fifo empty.
+  int pop(T& item)
+  {
+    size_t pos = indexPop.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot& s = slots[pos & mask];
+      size_t seq = s.seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (dif == 0) {
+        // slot is filled, try to claim it
+        if (indexPop.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          item = s.value;
+          s.seq.store(pos + mask + 1, std::memory_order_release);
+          return 0;
+        }
+      } else if (dif < 0) {
+        // slot not yet written: fifo empty
+        return -1;
+      } else {
+        pos = indexPop.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // number of items in fifo
+  // this is a snapshot, it may be outdated immediately when other threads are active
+  size_t getNumberOfUsedSlots()
+  {
+    size_t pop = indexPop.load(std::memory_order_acquire);
+    size_t push = indexPush.load(std::memory_order_acquire);
+    if (push <= pop) {
+      return 0;
+    }
+    size_t n = push - pop;
+    if (n > capacity) {
+      return capacity;
+    }
+    return n;
+  }
+
+  size_t getNumberOfFreeSlots() { return capacity - getNumberOfUsedSlots(); }
+  size_t getSize() { return capacity; }
+  bool isEmpty() { return getNumberOfUsedSlots() == 0; }
+  bool isFull() { return getNumberOfUsedSlots() == capacity; }
+
+ private:
+  static constexpr size_t cacheLineSize = 64;
+
+  struct alignas(cacheLineSize) Slot {
+    std::atomic<size_t> seq; // sequence number of this slot
+    T value;                 // item stored
+  };
+
+  std::unique_ptr<Slot[]> slots; // ring of slots
+  size_t capacity;               // number of slots (power of 2)
+  size_t mask;                   // capacity - 1, for fast modulo
+
+  // indexes are on separate cache lines, to avoid false sharing between producers and consumers
+  alignas(cacheLineSize) std::atomic<size_t> indexPush; // next position to write
+  alignas(cacheLineSize) std::atomic<size_t> indexPop;  // next position to read
+  char padding[cacheLineSize - sizeof(std::atomic<size_t>)];
+};
+
+#endif // #ifndef _LOCKFREEFIFO_H
@@ -11,9 +11,14 @@
 
 #include "MemoryBank.h"
 
+#include <cerrno>
+#include <cstdint>
 #include <cstring>
 #include <memory>
 #include <new>
+#include <sys/mman.h>
+#include <tuple>
+#include <unistd.h>
 
 #ifdef WITH_READOUTCARD
 #include <ReadoutCard/Exception.h>
@@ -23,6 +28,7 @@
 #include <utility>
 #include <vector>
 
+#include "ReadoutUtils.h"
 #include "readoutInfoLogger.h"
 
 /// generic base class
@@ -49,12 +55,63 @@ size_t MemoryBank::getSize() { return size; }
 
 std::string MemoryBank::getDescription() { return description; }
 
-void MemoryBank::clear()
+size_t MemoryBank::getMemoryPageSize() { return memoryPageSize; }
+
+void MemoryBank::clear(int nThreads, int numaNode)
 {
-  std::memset(baseAddress, 0, size);
+  if (numaRanges.size()) {
+    // clear each part from its own NUMA node
+    int n = nThreads / (int)numaRanges.size();
+    for (auto& r : numaRanges) {
+      memoryClear(&((char*)baseAddress)[r.offset], r.size, (n > 1) ? n : 1, r.numaNode);
+    }
+    return;
+  }
+  if ((nThreads <= 1) && (numaNode < 0)) {
+    std::memset(baseAddress, 0, size);
+    return;
+  }
+  memoryClear(baseAddress, size, nThreads, numaNode);
   return;
 }
 
+int MemoryBank::prefault()
+{
+  return memoryPrefault(baseAddress, size);
+}
+
+int MemoryBank::setNumaSplit(const std::vector<int>& numaNodes)
+{
+  numaRanges.clear();
+  if ((numaNodes.size() == 0) || (baseAddress == nullptr)) {
+    return -1;
+  }
+  // boundaries aligned on memory pages (at least system page)
+  size_t align = memoryPageSize;
+  if (align < (size_t)getpagesize()) {
+    align = getpagesize();
+  }
+  size_t partSize = ((size / numaNodes.size()) / align) * align;
+  if (partSize == 0) {
+    return -1;
+  }
+  for (unsigned int i = 0; i < numaNodes.size(); i++) {
+    NumaRange r;
+    r.offset = i * partSize;
+    r.size = (i + 1 == numaNodes.size()) ? size - r.offset : partSize;
+    r.numaNode = numaNodes[i];
+    if (numaBindMemory(&((char*)baseAddress)[r.offset], r.size, r.numaNode)) {
+      theLog.log(LogWarningSupport_(3230), "Memory bank %s : failed to bind range %lu - %lu to NUMA node %d", description.c_str(), (unsigned long)r.offset, (unsigned long)(r.offset + r.size), r.numaNode);
+      numaRanges.clear();
+      return -1;
+    }
+    numaRanges.push_back(r);
+  }
+  return 0;
+}
+
+const std::vector<MemoryBank::NumaRange>& MemoryBank::getNumaRanges() { return numaRanges; }
+
 /// MemoryBank implementation with malloc()
 
 class MemoryBankMalloc : public MemoryBank
@@ -71,6 +128,7 @@ MemoryBankMalloc::MemoryBankMalloc(size_t v_size, std::string v_description) : M
     throw std::bad_alloc();
   }
   size = v_size;
+  memoryPageSize = getpagesize();
   if (v_description.length() == 0) {
     description = "Bank malloc()";
   }
@@ -142,11 +200,107 @@ MemoryBankMemoryMappedFile::MemoryBankMemoryMappedFile(size_t v_size, std::strin
   size = mMemoryMappedFile->getSize();
   baseAddress = (void*)mMemoryMappedFile->getAddress();
   description = v_description;
+  memoryPageSize = hugePageSizeBytes;
 }
 
 MemoryBankMemoryMappedFile::~MemoryBankMemoryMappedFile() {}
 #endif
 
+/// MemoryBank implementation with anonymous hugepages
+/// Does not need a hugetlbfs mount. Tries explicit hugepages (1GB, then 2MB), and falls back to
+/// normal pages with transparent hugepages (THP) requested.
+
+class MemoryBankHugePages : public MemoryBank
+{
+ public:
+  MemoryBankHugePages(size_t size, std::string description);
+  ~MemoryBankHugePages();
+
+ private:
+  size_t mappedSize = 0; // size of the memory mapping (rounded up to page size)
+};
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+MemoryBankHugePages::MemoryBankHugePages(size_t v_size, std::string v_description) : MemoryBank(v_description)
+{
+  // declare available huge page size types, from biggest to smallest
+  const std::vector<std::tuple<size_t, int, std::string>> hpt = { { 1024 * 1024 * 1024UL, MAP_HUGE_1GB, "1GB" }, { 2 * 1024 * 1024UL, MAP_HUGE_2MB, "2MB" } };
+
+  std::string pageSizeDescription;
+  for (auto& a : hpt) {
+    size_t pageSize = std::get<0>(a);
+    if (v_size < pageSize) {
+      // do not waste memory for a small bank
+      continue;
+    }
+    size_t sz = ((v_size + pageSize - 1) / pageSize) * pageSize;
+    void* ptr = mmap(nullptr, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | std::get<1>(a), -1, 0);
+    if (ptr != MAP_FAILED) {
+      baseAddress = ptr;
+      mappedSize = sz;
+      memoryPageSize = pageSize;
+      pageSizeDescription = std::get<2>(a) + " hugepages";
+      break;
+    }
+    theLog.log(LogInfoDevel_(3008), "Memory bank %s : %s hugepages not available (%s)", v_description.c_str(), std::get<2>(a).c_str(), strerror(errno));
+  }
+
+  if (baseAddress == nullptr) {
+    // fallback to normal pages, aligned for transparent hugepages
+    // mapping is over-allocated by one hugepage, so that base address can be aligned. The slack at both ends is unmapped.
+    size_t pageSize = 2 * 1024 * 1024UL;
+    size_t sz = ((v_size + pageSize - 1) / pageSize) * pageSize;
+    void* rawPtr = mmap(nullptr, sz + pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rawPtr == MAP_FAILED) {
+      theLog.log(LogErrorSupport_(3230), "Memory bank %s : failed to allocate %lu bytes (%s)", v_description.c_str(), (unsigned long)sz, strerror(errno));
+      throw std::bad_alloc();
+    }
+    uintptr_t rawBegin = (uintptr_t)rawPtr;
+    uintptr_t alignedBegin = (rawBegin + pageSize - 1) & ~(uintptr_t)(pageSize - 1);
+    size_t slackBefore = alignedBegin - rawBegin;
+    size_t slackAfter = pageSize - slackBefore;
+    if (slackBefore) {
+      munmap(rawPtr, slackBefore);
+    }
+    if (slackAfter) {
+      munmap((void*)(alignedBegin + sz), slackAfter);
+    }
+    void* ptr = (void*)alignedBegin;
+    baseAddress = ptr;
+    mappedSize = sz;
+    memoryPageSize = getpagesize();
+    pageSizeDescription = std::to_string(memoryPageSize / 1024) + "kB pages";
+    #ifdef MADV_HUGEPAGE
+    if (madvise(ptr, sz, MADV_HUGEPAGE) == 0) {
+      pageSizeDescription += ", transparent hugepages requested";
+    }
+    #endif
+  }
+
+  size = v_size;
+  if (v_description.length() == 0) {
+    description = "Bank mmap()";
+  }
+  description += " (" + pageSizeDescription + ")";
+  theLog.log(LogInfoDevel_(3008), "Memory bank %s : using %s", v_description.c_str(), pageSizeDescription.c_str());
+}
+
+MemoryBankHugePages::~MemoryBankHugePages()
+{
+  if (baseAddress != nullptr) {
+    munmap(baseAddress, mappedSize);
+  }
+}
+
 // MemoryBank factory based on type
 std::shared_ptr<MemoryBank> getMemoryBank(size_t size, std::string type, std::string description)
 {
@@ -160,6 +314,8 @@ std::shared_ptr<MemoryBank> getMemoryBank(size_t size, std::string type, std::st
     theLog.log(LogWarningSupport_(3101), "MemoryMappedFile not supported by this build");
     return nullptr;
 #endif
+  } else if (type == "HugePages") {
+    return std::make_shared<MemoryBankHugePages>(size, description);
   }
   return nullptr;
 }
@@ -16,6 +16,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 // a class to handle a big block of contiguous memory.
 // constructor/destructor to be overloaded for different types of support.
@@ -35,19 +36,35 @@ class MemoryBank
   void* getBaseAddress();       // get the (virtual) base address of this memory bank
   std::size_t getSize();        // get the total size (bytes) of this memory bank
   std::string getDescription(); // get the description of this memory bank;
+  std::size_t getMemoryPageSize(); // get the size of the system memory pages (e.g. 4kB, or hugepage size) backing this bank. 0 if unknown.
 
-  void clear(); // write zeroes into the whole memory range
+  void clear(int nThreads = 1, int numaNode = -1); // write zeroes into the whole memory range, optionally with parallel threads bound to given NUMA node
+  int prefault();                                   // map all pages of the memory range in RAM, without changing content. Returns 0 on success.
+
+  // a part of the bank allocated on a given NUMA node
+  struct NumaRange {
+    std::size_t offset; // beginning of range (bytes, from base address)
+    std::size_t size;   // size of range (bytes)
+    int numaNode;       // NUMA node of the range
+  };
+
+  // split the bank in contiguous parts of equal size, one per NUMA node given, each being bound to its node.
+  // To be called before the memory is used. Returns 0 on success.
+  int setNumaSplit(const std::vector<int>& numaNodes);
+  const std::vector<NumaRange>& getNumaRanges(); // get the NUMA parts of the bank. Empty if not split.
 
  protected:
   void* baseAddress;               // base address (virtual) of buffer
   std::size_t size;                // size of buffer, in bytes
   std::string description;         // description of the memory bank (type/sypport, etc)
+  std::size_t memoryPageSize = 0;  // size of system memory pages used, in bytes. 0 if unknown.
+  std::vector<NumaRange> numaRanges; // NUMA parts of the bank, if split
   ReleaseCallback releaseCallback; // an optional user-callback to be called in destructor, when overloaded constructor has been used
 };
 
 // factory function to create a MemoryBank instance of a given type
 // size: size of the bank, in bytes
-// support: type of support to be used. Available choices: malloc, MemoryMappedFile
+// support: type of support to be used. Available choices: malloc, MemoryMappedFile, HugePages
 // description: optional description for the memory bank
 std::shared_ptr<MemoryBank> getMemoryBank(size_t size, std::string support, std::string description = "");
 
@@ -24,6 +24,10 @@
 
 #include "readoutInfoLogger.h"
 
+// global settings for memory initialization, c.f. readout.memoryClearMode
+int MemoryBankClearMode = 0;
+int MemoryBankClearThreads = 8;
+
 MemoryBankManager::MemoryBankManager() {
 }
 
@@ -65,6 +69,11 @@ std::shared_ptr<MemoryPagesPool> MemoryBankManager::getPagedPool(size_t pageSize
   size_t offset = 0;           // offset of new block (relative to baseAddress)
   size_t blockSize = 0;        // size of new block (in bytes)
   int newId = 0;
+  std::string poolBankName;    // name of bank used
+  size_t poolMemoryPageSize = 0; // system memory page size of bank used
+  bool isNumaSplit = false;    // set when block is taken from the NUMA part of a bank
+  int splitNumaNode = -1;      // NUMA node of the part of the bank used, when split
+  int callerNumaNode = numaGetBoundNode(); // NUMA binding of calling thread, restored on exit
 
   // disable concurrent execution of this block
   // automatic release of lock when going out of scope
@@ -107,8 +116,44 @@ std::shared_ptr<MemoryPagesPool> MemoryBankManager::getPagedPool(size_t pageSize
     offset = 0;
     blockSize = pageSize * (pageNumber + 1); // this is the maximum space to use... may loose some pages for alignment
 
+    // for banks split on NUMA nodes, use the part on requested node, or on the node of the calling thread
+    // the memory of each part is already bound to its node, no need to bind the calling thread
+    size_t rangeBegin = 0;
+    size_t rangeEnd = banks[ix].bank->getSize();
+    const std::vector<MemoryBank::NumaRange>& numaRanges = banks[ix].bank->getNumaRanges();
+    if (numaRanges.size()) {
+      int node = numaNode;
+      if (node < 0) {
+        node = callerNumaNode;
+      }
+      if (node < 0) {
+        node = numaGetCurrentNode();
+      }
+      const MemoryBank::NumaRange* r = &numaRanges[0];
+      bool nodeFound = false;
+      for (auto& nr : numaRanges) {
+        if (nr.numaNode == node) {
+          r = &nr;
+          nodeFound = true;
+          break;
+        }
+      }
+      if (!nodeFound) {
+        theLog.log(LogWarningSupport_(3230), "Memory bank '%s' has no part on NUMA node %d, using node %d", banks[ix].name.c_str(), node, r->numaNode);
+      }
+      rangeBegin = r->offset;
+      rangeEnd = r->offset + r->size;
+      splitNumaNode = r->numaNode;
+      isNumaSplit = true;
+      theLog.log(LogInfoDevel_(3008), "Allocating memory pool from bank '%s' part on NUMA node %d", banks[ix].name.c_str(), splitNumaNode);
+    }
+    offset = rangeBegin;
+
     // alloc new block after existing ranges already in use
     for (auto it = banks[ix].rangesInUse.begin(); it != banks[ix].rangesInUse.end(); ++it) {
+      if ((it->offset < rangeBegin) || (it->offset >= rangeEnd)) {
+        continue;
+      }
       size_t maxOffset = it->offset + it->size;
       if (maxOffset > offset) {
         offset = maxOffset;
@@ -133,25 +178,30 @@ std::shared_ptr<MemoryPagesPool> MemoryBankManager::getPagedPool(size_t pageSize
     }
 
     // check not exceeding bank size
-    if (offset + blockSize > banks[ix].bank->getSize()) {
-      theLog.log(LogErrorSupport_(3230), "Not enough space left in memory bank '%s' (need %ld bytes more)", banks[ix].name.c_str(), offset + blockSize - banks[ix].bank->getSize());
+    if (offset + blockSize > rangeEnd) {
+      theLog.log(LogErrorSupport_(3230), "Not enough space left in memory bank '%s' (need %ld bytes more)", banks[ix].name.c_str(), offset + blockSize - rangeEnd);
       throw std::bad_alloc();
     }
 
     // keep track of this new block
     banks[ix].rangesInUse.push_back({ offset, blockSize });
     newId = ++poolIndex;
+    poolBankName = banks[ix].name;
+    poolMemoryPageSize = banks[ix].bank->getMemoryPageSize();
   }
   // end of locked block
 
-  if (numaNode >= 0) {
+  if (isNumaSplit) {
+    numaNode = splitNumaNode;
+  } else if ((numaNode >= 0) && (numaNode != callerNumaNode)) {
       // actual memory assignment is done on first write, in particular for FMQ
       // so set NUMA node and zero the memory to lock it
       // or try to move the block ?
       numaBind(numaNode);
   }
 
-  theLog.log(LogInfoDevel, "Zero memory");
+  AliceO2::Common::Timer clearTimer;
+  clearTimer.reset();
   void *blockAddress = &(((char*)baseAddress)[offset]);
   // ensure pages stay in RAM
   #ifdef MLOCK_ONFAULT
@@ -161,38 +211,28 @@ std::shared_ptr<MemoryPagesPool> MemoryBankManager::getPagedPool(size_t pageSize
   #else
     mlock(blockAddress, blockSize);
   #endif
-  const int nMemThreads = 1;
-  if (nMemThreads <= 1) {
+  if (MemoryBankClearMode == 0) {
+    theLog.log(LogInfoDevel, "Zero memory");
     bzero(blockAddress, blockSize);
+    theLog.log(LogInfoDevel, "Memory pool %d from bank %s : zero memory done in %.3lf s", newId, poolBankName.c_str(), clearTimer.getTime());
   } else {
-    // parallel
-    std::thread memThreads[nMemThreads];
-    char *ptr = (char *)blockAddress;
-    char *ptrEnd = (char *)blockAddress + blockSize;
-    const size_t blockUnit = 128 * 1024UL * 1024UL; // block unit = 128MB
-    int nThreads = 0;
-    for (int i = 0; i<nMemThreads; i++) {
-      size_t sz = blockSize / nMemThreads;
-      sz = sz + (blockUnit - ((size_t)ptr + sz) % blockUnit); // round up to next block
-      if ((ptr + sz > ptrEnd) || (i + 1 == nMemThreads)) {
-        sz = ptrEnd - ptr;
+    // map the pages first, so that they are assigned to the current NUMA node (if set) before being cleared by other threads
+    memoryPrefault(blockAddress, blockSize);
+    double tPrefault = clearTimer.getTime();
+    if (MemoryBankClearMode == 1) {
+      int clearNumaNode = numaNode;
+      if (clearNumaNode < 0) {
+        numaGetNodeFromAddress(blockAddress, clearNumaNode);
       }
-      theLog.log(LogDebugDevel, "Thread %d  - zero %p - %llu", i, ptr, (unsigned long long)sz);
-      memThreads[i] = std::thread(bzero, ptr, sz);
-      ptr += sz;
-      nThreads++;
-      if (ptr >= ptrEnd) {
-        break;
-      }
-    }
-    for (int i = 0; i < nThreads; i++) {
-      memThreads[i].join();
+      memoryClear(blockAddress, blockSize, MemoryBankClearThreads, clearNumaNode);
+      theLog.log(LogInfoDevel, "Memory pool %d from bank %s : prefault done in %.3lf s, zero memory with %d threads on NUMA node %d done in %.3lf s", newId, poolBankName.c_str(), tPrefault, MemoryBankClearThreads, clearNumaNode, clearTimer.getTime() - tPrefault);
+    } else {
+      theLog.log(LogInfoDevel, "Memory pool %d from bank %s : prefault done in %.3lf s, pages will be zeroed on first use", newId, poolBankName.c_str(), tPrefault);
     }
   }
-  theLog.log(LogInfoDevel, "Zero memory done");
 
-  if (numaNode >= 0) {
-    numaBind(-1);
+  if (numaGetBoundNode() != callerNumaNode) {
+    numaBind(callerNumaNode);
   }
 
   int ptrNumaNode = -1;
@@ -211,6 +251,28 @@ std::shared_ptr<MemoryPagesPool> MemoryBankManager::getPagedPool(size_t pageSize
   try {
     mpp = std::make_shared<MemoryPagesPool>(pageSize, pageNumber, &(((char*)baseAddress)[offset]), blockSize, nullptr, firstPageOffset, newId);
     if (mpp != nullptr) {
+      if (MemoryBankClearMode == 2) {
+        mpp->setClearOnFirstUse();
+      }
+      mpp->setMemoryPageSize(poolMemoryPageSize);
+      if (isNumaSplit) {
+        mpp->setNumaNode(numaNode);
+        // verify placement of all pages
+        std::map<int, int> numaStats;
+        if (mpp->getNumaStats(numaStats) == 0) {
+          int nOk = 0;
+          int nTotal = 0;
+          for (auto& s : numaStats) {
+            nTotal += s.second;
+            if (s.first == numaNode) {
+              nOk += s.second;
+            }
+          }
+          if (nOk != nTotal) {
+            theLog.log(LogWarningSupport_(3230), "Memory pool %d : %d / %d MB on requested NUMA node %d", newId, nOk, nTotal, numaNode);
+          }
+        }
+      }
       // create FIFO for monitoring
       mkfifo(getMonitorFifoPath(newId).c_str(), S_IRUSR | S_IWUSR | S_IRGRP| S_IROTH);
       // keep reference to created pool for monitoring purpose
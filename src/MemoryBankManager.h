@@ -45,6 +45,9 @@ class MemoryBankManager
   // - firstPageOffset: to control alignment of first page in pool. With zero, start from beginning of big block.
   // - blockAlign: alignment of beginning of big memory block from which pool is created. Pool will start at a multiple of this value.
   // - numaNode: if >= 0, try to allocate the pool on given NUMA node.
+  //   For banks split on NUMA nodes, the pool is taken from the part on this node, or if not specified from the part on the node the calling thread is bound to,
+  //   or on the node where it runs. The node used is then available with getNumaNode() of the pool, so that the threads using it can be bound to it.
+  //   The NUMA binding of the calling thread is the same on return.
   // NB: trivial implementation, once a region from a bank has been used, it can not be reused after the corresponding pool of pages has been release ... don't want to deal with fragmentation etc
   std::shared_ptr<MemoryPagesPool> getPagedPool(size_t pageSize, size_t pageNumber, std::string bankName = "", size_t firstPageOffset = 0, size_t blockAlign = 0, int numaNode = -1);
 
@@ -0,0 +1,331 @@
+// Copyright 2019-2020 CERN and copyright holders of ALICE O2.
+// See https://alice-o2.web.cern.ch/copyright for details of the copyright holders.
+// All rights not expressly granted are reserved.
+//
+// This software is distributed under the terms of the GNU General Public
+// License v3 (GPL Version 3), copied verbatim in the file "COPYING".
+//
+// In applying this license CERN does not waive the privileges and immunities
+// granted to it by virtue of its status as an Intergovernmental Organization
+// or submit itself to any jurisdiction.
+
+#ifndef _MEMORYPAGESBUDDYALLOCATOR_H
+#define _MEMORYPAGESBUDDYALLOCATOR_H
+
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+#include "DataBlockContainer.h"
+#include "MemoryPagesPool.h"
+
+// A buddy sub-allocator on top of the pages of a MemoryPagesPool.
+// Chunks of size 2^k * minChunkSize are carved out of the pool pages, and returned as independent DataBlockContainer.
+// Each chunk starts with its DataBlock structure, followed by the payload.
+// When a chunk container is destroyed, the chunk is freed immediately and merged with its buddy when possible,
+// so that its space can be reused while other chunks of the same page are still in use.
+// A page is given back to the pool as soon as all its chunks are free.
+// For each page, the free space is tracked with a complete binary tree (one node per possible chunk)
+// storing the largest free order available in the corresponding subtree, so that no memory allocation is done
+// to get or release a chunk (apart from the container itself).
+// getChunk() and chunk release can be called concurrently from any thread.
+// The allocator internal state is kept until all chunks are released, even if the allocator is destroyed before.
+
+class MemoryPagesBuddyAllocator
+{
+ public:
+  // statistics on chunks allocated
+  struct Stats {
+    uint64_t nChunks = 0;            // number of chunks allocated
+    uint64_t bytesRequested = 0;     // total bytes requested (payload + DataBlock header)
+    uint64_t bytesAllocated = 0;     // total bytes allocated (sum of chunk sizes)
+    uint64_t nPagesUsed = 0;         // number of pages taken from the pool
+    uint64_t nPagesInUse = 0;        // number of pages currently held by the allocator
+    uint64_t nPagesInUseMax = 0;     // maximum number of pages held at the same time
+    uint64_t nFragmentedFailures = 0; // number of times a new page was needed, while pages held had enough free space (but not contiguous)
+    uint64_t nFailures = 0;          // number of requests which could not be satisfied
+  };
+
+  // constructor
+  // parameters:
+  // - pool from which to get pages
+  // - minimum chunk size, in bytes (rounded up to a power of 2)
+  MemoryPagesBuddyAllocator(const std::shared_ptr<MemoryPagesPool>& pool, size_t minChunkSize = 4096)
+  {
+    state = std::make_shared<State>();
+    state->pool = pool;
+    state->minOrder = 0;
+    while (((size_t)1 << state->minOrder) < minChunkSize) {
+      state->minOrder++;
+    }
+    size_t nMinChunks = pool->getDataBlockMaxSize() >> state->minOrder;
+    if (nMinChunks == 0) {
+      throw __LINE__;
+    }
+    state->nLevels = 1;
+    state->nLeaves = 1;
+    while (state->nLeaves < nMinChunks) {
+      state->nLeaves *= 2;
+      state->nLevels++;
+    }
+    state->nUsableLeaves = nMinChunks;
+    state->pages.resize(pool->getTotalNumberOfPages());
+    state->pagesInUse.reserve(state->pages.size());
+    state->pagesFree.reserve(state->pages.size());
+    for (auto& p : state->pages) {
+      p.tree.resize(2 * state->nLeaves - 1);
+      state->pagesFree.push_back(&p);
+    }
+  }
+
+  ~MemoryPagesBuddyAllocator() {}
+
+  // get a chunk with a payload of (at least) the given size
+  // returns nullptr if none available
+  // if isNewPage is set, the pointed variable tells if a new page was taken from the pool for this chunk
+  DataBlockContainerReference getChunk(size_t dataSize, bool* isNewPage = nullptr)
+  {
+    return state->getChunk(state, dataSize, isNewPage);
+  }
+
+  // maximum payload size of a chunk
+  size_t getChunkMaxSize()
+  {
+    size_t sz = ((size_t)1) << (state->minOrder + state->nLevels - 1);
+    while (sz > (state->nUsableLeaves << state->minOrder)) {
+      sz /= 2;
+    }
+    return sz - sizeof(DataBlock);
+  }
+
+  Stats getStats()
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    return state->stats;
+  }
+
+  // reset counters, eg between runs. Number of pages in use is kept.
+  void resetStats()
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    uint64_t n = state->stats.nPagesInUse;
+    state->stats = Stats();
+    state->stats.nPagesInUse = n;
+    state->stats.nPagesInUseMax = n;
+  }
+
+ private:
+  // a page of the pool used by the allocator
+  struct Page {
+    DataBlockContainerReference block = nullptr; // the pool page. Released when no chunk used.
+    char* data = nullptr;                        // base address of chunks
+    std::vector<uint8_t> tree;                   // binary tree of largest free order in subtree, plus one (0 = none free)
+    uint64_t nChunksInUse = 0;                   // number of chunks currently allocated
+    uint64_t bytesFree = 0;                      // free space in page
+  };
+
+  struct State;
+
+  // a container for a chunk, which frees it when destroyed
+  class DataBlockContainerFromBuddyAllocator : public DataBlockContainer
+  {
+   public:
+    DataBlockContainerFromBuddyAllocator(const std::shared_ptr<State>& s, Page* p, size_t ix, int o, DataBlock* b, uint64_t size) : DataBlockContainer(b, size), state(s), page(p), nodeIndex(ix), order(o) {}
+    ~DataBlockContainerFromBuddyAllocator()
+    {
+      state->releaseChunk(page, nodeIndex, order);
+    }
+
+   private:
+    std::shared_ptr<State> state; // allocator owning the chunk
+    Page* page;                   // page where the chunk is
+    size_t nodeIndex;             // position of the chunk in the page tree
+    int order;                    // chunk order, relative to minimum chunk size
+  };
+
+  struct State {
+    std::mutex mutex; // lock for all the fields below
+    std::shared_ptr<MemoryPagesPool> pool;
+    int minOrder;          // log2 of minimum chunk size
+    int nLevels;           // number of levels in tree
+    size_t nLeaves;        // number of minimum chunks in tree (power of 2)
+    size_t nUsableLeaves;  // number of minimum chunks fitting in a page
+    std::vector<Page> pages; // one item per pool page, so that a page is always available when pool returns one
+    std::vector<Page*> pagesInUse; // pages with at least one chunk allocated
+    std::vector<Page*> pagesFree;  // pages not in use (capacity reserved for all pages, no reallocation)
+    Stats stats;
+
+    // update value of a tree node from its children
+    void updateNode(Page& p, size_t ix, int nodeOrder)
+    {
+      uint8_t l = p.tree[2 * ix + 1];
+      uint8_t r = p.tree[2 * ix + 2];
+      if ((l == nodeOrder) && (r == nodeOrder)) {
+        p.tree[ix] = nodeOrder + 1;
+      } else {
+        p.tree[ix] = (l > r) ? l : r;
+      }
+    }
+
+    // initialize tree of a new page, with all usable space free
+    void initPage(Page& p)
+    {
+      size_t firstLeaf = nLeaves - 1;
+      for (size_t i = 0; i < nLeaves; i++) {
+        p.tree[firstLeaf + i] = (i < nUsableLeaves) ? 1 : 0;
+      }
+      size_t levelSize = nLeaves / 2;
+      for (int o = 1; o < nLevels; o++) {
+        for (size_t i = levelSize - 1; i < 2 * levelSize - 1; i++) {
+          updateNode(p, i, o);
+        }
+        levelSize /= 2;
+      }
+      p.nChunksInUse = 0;
+      p.bytesFree = nUsableLeaves << minOrder;
+    }
+
+    // allocate a chunk of given order in page. Returns node index, tree should have enough space.
+    size_t allocateInPage(Page& p, int order)
+    {
+      size_t ix = 0;
+      for (int o = nLevels - 1; o > order; o--) {
+        ix = (p.tree[2 * ix + 1] > order) ? 2 * ix + 1 : 2 * ix + 2;
+      }
+      p.tree[ix] = 0;
+      size_t k = ix;
+      for (int o = order + 1; o < nLevels; o++) {
+        k = (k - 1) / 2;
+        updateNode(p, k, o);
+      }
+      return ix;
+    }
+
+    DataBlockContainerReference getChunk(const std::shared_ptr<State>& self, size_t dataSize, bool* isNewPage)
+    {
+      if (isNewPage != nullptr) {
+        *isNewPage = false;
+      }
+      size_t sz = dataSize + sizeof(DataBlock);
+      int order = 0;
+      while ((((size_t)1) << (order + minOrder)) < sz) {
+        order++;
+      }
+      if (order >= nLevels) {
+        return nullptr;
+      }
+      size_t chunkSize = ((size_t)1) << (order + minOrder);
+
+      std::unique_lock<std::mutex> lock(mutex);
+
+      // look for space in pages in use
+      Page* p = nullptr;
+      bool isFragmented = false;
+      for (auto pp : pagesInUse) {
+        if (pp->tree[0] > order) {
+          p = pp;
+          break;
+        }
+        if (pp->bytesFree >= chunkSize) {
+          isFragmented = true;
+        }
+      }
+
+      // otherwise, get a new page
+      if (p == nullptr) {
+        DataBlockContainerReference newBlock = nullptr;
+        try {
+          newBlock = pool->getNewDataBlockContainer();
+        } catch (...) {
+        }
+        if (newBlock == nullptr) {
+          stats.nFailures++;
+          return nullptr;
+        }
+        if (pagesFree.empty()) {
+          stats.nFailures++;
+          return nullptr;
+        }
+        p = pagesFree.back();
+        initPage(*p);
+        if (p->tree[0] <= order) {
+          stats.nFailures++;
+          return nullptr;
+        }
+        pagesFree.pop_back();
+        pagesInUse.push_back(p);
+        p->block = newBlock;
+        p->data = (char*)newBlock->getData()->data;
+        stats.nPagesUsed++;
+        stats.nPagesInUse++;
+        if (stats.nPagesInUse > stats.nPagesInUseMax) {
+          stats.nPagesInUseMax = stats.nPagesInUse;
+        }
+        if (isFragmented) {
+          stats.nFragmentedFailures++;
+        }
+        if (isNewPage != nullptr) {
+          *isNewPage = true;
+        }
+      }
+
+      size_t ix = allocateInPage(*p, order);
+      size_t offset = ((ix + 1) - (nLeaves >> order)) * chunkSize;
+      p->nChunksInUse++;
+      p->bytesFree -= chunkSize;
+
+      DataBlock* b = (DataBlock*)&p->data[offset];
+      b->header = defaultDataBlockHeader;
+      b->header.dataSize = dataSize;
+      b->header.memorySize = chunkSize;
+      b->data = &(((char*)b)[sizeof(DataBlock)]);
+
+      DataBlockContainerReference chunk = nullptr;
+      try {
+        chunk = std::make_shared<DataBlockContainerFromBuddyAllocator>(self, p, ix, order, b, chunkSize);
+      } catch (...) {
+      }
+      if (chunk == nullptr) {
+        lock.unlock();
+        releaseChunk(p, ix, order);
+        return nullptr;
+      }
+
+      stats.nChunks++;
+      stats.bytesRequested += sz;
+      stats.bytesAllocated += chunkSize;
+      return chunk;
+    }
+
+    void releaseChunk(Page* p, size_t ix, int order)
+    {
+      DataBlockContainerReference releasedBlock = nullptr; // page released when going out of scope, out of locked section
+      std::unique_lock<std::mutex> lock(mutex);
+      p->tree[ix] = order + 1;
+      for (int o = order + 1; o < nLevels; o++) {
+        ix = (ix - 1) / 2;
+        updateNode(*p, ix, o);
+      }
+      p->bytesFree += ((size_t)1) << (order + minOrder);
+      p->nChunksInUse--;
+      if (p->nChunksInUse == 0) {
+        releasedBlock = std::move(p->block);
+        p->block = nullptr;
+        for (auto& pp : pagesInUse) {
+          if (pp == p) {
+            pp = pagesInUse.back();
+            pagesInUse.pop_back();
+            break;
+          }
+        }
+        pagesFree.push_back(p);
+        stats.nPagesInUse--;
+      }
+    }
+  };
+
+  std::shared_ptr<State> state;
+};
+
+#endif // #ifndef _MEMORYPAGESBUDDYALLOCATOR_H
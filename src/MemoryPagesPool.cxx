@@ -11,8 +11,11 @@
 
 #include "MemoryPagesPool.h"
 
+#include <atomic>
 #include <cassert>
+#include <cstddef>
 #include <cstdio>
+#include <strings.h>
 
 #include "ReadoutUtils.h"
 #define ENABLE_LOG_CODEWRONG
@@ -20,6 +23,78 @@
 
 
 int MemoryPagesPoolStatsEnabled = 0; // flag to control memory stats
+int MemoryPagesPoolMagazineSize = 0; // size of per-thread page caches for pools created. Zero to disable.
+int MemoryPagesPoolStateTiming = 1; // flag to control time accounting of page states. When zero, a state change is a single store.
+
+// registry of existing pools, so that pages from per-thread magazines are given back only to valid pools
+static std::mutex poolsRegistryMutex;
+static std::map<uint64_t, MemoryPagesPool*> poolsRegistry;
+static uint64_t poolsInstanceCounter = 0;
+
+thread_local MemoryPagesPool::ThreadMagazines MemoryPagesPool::threadMagazines;
+
+// a container for a page from a MemoryPagesPool
+// the page is given back to the pool when container is destroyed
+class DataBlockContainerFromMemoryPagesPool : public DataBlockContainer
+{
+ public:
+  DataBlockContainerFromMemoryPagesPool(MemoryPagesPool* pool, void* page, int pageIndex, DataBlock* b, uint64_t size) : DataBlockContainer(b, size), pagePtr(page)
+  {
+    memoryPagesPoolPtr = pool;
+    memoryPageIndex = pageIndex;
+  }
+
+  ~DataBlockContainerFromMemoryPagesPool()
+  {
+    memoryPagesPoolPtr->releasePage(pagePtr);
+  }
+
+ private:
+  void* pagePtr; // page to be released
+};
+
+// preallocated memory to store a DataBlockContainer and its shared_ptr control block
+// in the rare case where it is still in use when the page is reused (control block not yet freed by previous owner), heap is used.
+struct MemoryPagesPool::ContainerSlot {
+  static const size_t storageSize = 256;
+  alignas(std::max_align_t) char storage[storageSize];
+  std::atomic<bool> inUse = false;
+};
+
+// allocator for std::allocate_shared, using the ContainerSlot of a page
+template <typename T>
+struct MemoryPagesPool::ContainerSlotAllocator {
+  using value_type = T;
+  ContainerSlot* slot;
+
+  ContainerSlotAllocator(ContainerSlot* s) : slot(s) {}
+  template <typename U>
+  ContainerSlotAllocator(const ContainerSlotAllocator<U>& a) : slot(a.slot) {}
+
+  T* allocate(size_t n)
+  {
+    if ((sizeof(T) * n <= ContainerSlot::storageSize) && (alignof(T) <= alignof(std::max_align_t))) {
+      if (!slot->inUse.exchange(true, std::memory_order_acquire)) {
+        return (T*)slot->storage;
+      }
+    }
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n)
+  {
+    if ((void*)p == (void*)slot->storage) {
+      slot->inUse.store(false, std::memory_order_release);
+      return;
+    }
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <typename U>
+  bool operator==(const ContainerSlotAllocator<U>& a) const { return slot == a.slot; }
+  template <typename U>
+  bool operator!=(const ContainerSlotAllocator<U>& a) const { return slot != a.slot; }
+};
 
 MemoryPagesPool::MemoryPagesPool(size_t vPageSize, size_t vNumberOfPages, void* vBaseAddress, size_t vBaseSize, ReleaseCallback vCallback, size_t firstPageOffset, int vId)
 {
@@ -54,15 +129,19 @@ MemoryPagesPool::MemoryPagesPool(size_t vPageSize, size_t vNumberOfPages, void*
     numberOfPages = (baseBlockSize - firstPageOffset) / pageSize;
   }
 
+  // select clock source used for page states timing, before first timestamp is taken
+  TscClock::calibrate();
+
   // create metadata
   pages.resize(numberOfPages);
+  containerSlots = std::make_unique<ContainerSlot[]>(numberOfPages);
   for (auto &p : pages) {
     p.resetPageStates();
     p.setPageState(MemoryPage::PageState::Idle);
   }
 
   // create a fifo and store list of pages available
-  pagesAvailable = std::make_unique<AliceO2::Common::Fifo<void*>>(numberOfPages);
+  pagesAvailable = std::make_unique<LockFreeFifo<void*>>(numberOfPages);
   void* ptr = nullptr;
   int id = 0;
   for (size_t i = 0; i < numberOfPages; i++) {
@@ -104,12 +183,31 @@ MemoryPagesPool::MemoryPagesPool(size_t vPageSize, size_t vNumberOfPages, void*
     t4.enableHistogram(64, 1, 100000000);
   }
 
+  // per-thread page caches
+  magazineSize = MemoryPagesPoolMagazineSize;
+  if (magazineSize > magazineMaxSize) {
+    magazineSize = magazineMaxSize;
+  }
+  if (magazineSize < 0) {
+    magazineSize = 0;
+  }
+  if (magazineSize) {
+    std::unique_lock<std::mutex> lock(poolsRegistryMutex);
+    instance = ++poolsInstanceCounter;
+    poolsRegistry[instance] = this;
+  }
+
   // udpate buffer state
   updateBufferState();
 }
 
 MemoryPagesPool::~MemoryPagesPool()
 {
+  if (magazineSize) {
+    std::unique_lock<std::mutex> lock(poolsRegistryMutex);
+    poolsRegistry.erase(instance);
+  }
+
   if (MemoryPagesPoolStatsEnabled) {
     printf("memory pool statistics: \n");
     printf("getpage->getdatablock");
@@ -171,24 +269,56 @@ MemoryPagesPool::~MemoryPagesPool()
 
 void* MemoryPagesPool::getPage()
 {
-  // disable concurrent execution of this function
-  std::unique_lock<std::mutex> lock(pagesAvailableMutexPop);
-
   // update statistics
-  poolStats.set((CounterValue)getNumberOfPagesAvailable());
+  // skipped if another thread is already doing it, to avoid serializing concurrent calls
+  size_t nPagesAvailable = getNumberOfPagesAvailable();
+  std::unique_lock<std::mutex> lock(statsMutex, std::try_to_lock);
+  if (lock.owns_lock()) {
+    poolStats.set((CounterValue)nPagesAvailable);
+    lock.unlock();
+  }
 
   // get a page from fifo, if available
   void* ptr = nullptr;
-  pagesAvailable->pop(ptr);
+  PageMagazine* m = nullptr;
+  if (magazineSize) {
+    m = getMagazine(true);
+  }
+  if (m != nullptr) {
+    // use local magazine, refill it from fifo when empty
+    if (m->nPages == 0) {
+      int n = 0;
+      for (; n < (magazineSize + 1) / 2; n++) {
+        if (pagesAvailable->pop(m->pages[n]) != 0) {
+          break;
+        }
+      }
+      m->nPages = n;
+      nPagesInMagazines += n;
+    }
+    if (m->nPages > 0) {
+      m->nPages--;
+      ptr = m->pages[m->nPages];
+      nPagesInMagazines--;
+    }
+  } else if (pagesAvailable->pop(ptr) != 0) {
+    ptr = nullptr;
+  }
+
+  // lazy initialization of page content
+  if ((clearOnFirstUse) && (ptr != nullptr)) {
+    int ix = getPageIndexFromPagePtr(ptr);
+    if ((ix >= 0) && (pages[ix].needsClear)) {
+      bzero(ptr, pageSize);
+      pages[ix].needsClear = false;
+    }
+  }
 
   updatePageState(ptr, MemoryPage::PageState::Allocated);
 
   // udpate buffer state
   updateBufferState();
 
-  // the following does not need exclusive access, release lock
-  lock.unlock();
-  
   // stats
   if (MemoryPagesPoolStatsEnabled) {
     if (ptr != nullptr) {
@@ -231,19 +361,46 @@ void MemoryPagesPool::releasePage(void* address)
 
   updatePageState(address, MemoryPage::PageState::Idle);
 
-  // disable concurrent execution of this function
-  std::unique_lock<std::mutex> lock(pagesAvailableMutexPush);
-
   // put back page in list of available pages
-  pagesAvailable->push(address);
+  // fifo is sized for all pages of the pool, this can fail only if the same page is released twice
+  PageMagazine* m = nullptr;
+  if (magazineSize) {
+    m = getMagazine(false);
+  }
+  if (m != nullptr) {
+    // use local magazine, move half of it to fifo when full
+    if (m->nPages >= magazineSize) {
+      int n = (magazineSize + 1) / 2;
+      for (int i = 0; i < n; i++) {
+        m->nPages--;
+        if (pagesAvailable->push(m->pages[m->nPages]) != 0) {
+          LOG_CODEWRONG;
+        }
+      }
+      nPagesInMagazines -= n;
+    }
+    m->pages[m->nPages] = address;
+    m->nPages++;
+    nPagesInMagazines++;
+  } else if (pagesAvailable->push(address) != 0) {
+    LOG_CODEWRONG;
+  }
 
   // udpate buffer state
   updateBufferState();
 }
 
+void MemoryPagesPool::setClearOnFirstUse()
+{
+  for (auto& p : pages) {
+    p.needsClear = true;
+  }
+  clearOnFirstUse = true;
+}
+
 size_t MemoryPagesPool::getPageSize() { return pageSize; }
 size_t MemoryPagesPool::getTotalNumberOfPages() { return numberOfPages; }
-size_t MemoryPagesPool::getNumberOfPagesAvailable() { return pagesAvailable->getNumberOfUsedSlots(); }
+size_t MemoryPagesPool::getNumberOfPagesAvailable() { return pagesAvailable->getNumberOfUsedSlots() + nPagesInMagazines; }
 void* MemoryPagesPool::getBaseBlockAddress() { return baseBlockAddress; }
 size_t MemoryPagesPool::getBaseBlockSize() { return baseBlockSize; }
 
@@ -299,19 +456,15 @@ std::shared_ptr<DataBlockContainer> MemoryPagesPool::getNewDataBlockContainer(vo
   b->header.dataSize = getDataBlockMaxSize();
   b->header.memorySize = getPageSize();
 
-  // define a function to put it back in pool after use
-  auto releaseCallback = [this, newPage](void) -> void {
-    this->releasePage(newPage);
-    return;
-  };
-
-  // create a container and associate data page and release callback
-  std::shared_ptr<DataBlockContainer> bc = std::make_shared<DataBlockContainer>(releaseCallback, b, getPageSize());
+  // create a container for this page, which puts it back in pool after use
+  std::shared_ptr<DataBlockContainer> bc;
+  try {
+    bc = std::allocate_shared<DataBlockContainerFromMemoryPagesPool>(ContainerSlotAllocator<DataBlockContainerFromMemoryPagesPool>(&containerSlots[ix]), this, newPage, ix, b, getPageSize());
+  } catch (...) {
+  }
   if (bc == nullptr) {
-    releaseCallback();
+    releasePage(newPage);
     return nullptr;
-  } else {
-    bc->memoryPagesPoolPtr = this;
   }
 
   // printf("create dbc %p with data=%p stored=%p\n",bc,newPage,bc->getData());
@@ -358,6 +511,14 @@ void MemoryPagesPool::updateBufferState() {
     return;
   }
   double r = 1.0 - (getNumberOfPagesAvailable() * 1.0 / getTotalNumberOfPages());
+  if (pBufferState != nullptr) {
+    pBufferState->store(r);
+  }
+  // state transitions are not thread-safe. If another thread is doing it, skip this update: it will be done on next call.
+  std::unique_lock<std::mutex> lock(statsMutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return;
+  }
   if ((r == 1.0) && (state != BufferState::full)) {
     state = BufferState::full;
     log("buffer full");
@@ -368,36 +529,50 @@ void MemoryPagesPool::updateBufferState() {
     state = BufferState::empty;
     log("buffer usage back to reasonable level");
   }
-  if (pBufferState != nullptr) {
-    pBufferState->store(r);
-  }
 }
 
 int MemoryPagesPool::getId() {
   return id;
 }
 
+size_t MemoryPagesPool::getMemoryPageSize() { return memoryPageSize; }
+void MemoryPagesPool::setMemoryPageSize(size_t sz) { memoryPageSize = sz; }
+int MemoryPagesPool::getNumaNode() { return numaNode; }
+void MemoryPagesPool::setNumaNode(int node) { numaNode = node; }
+
 void MemoryPagesPool::setBufferStateVariable(std::atomic<double> *bufferStateVar) {
   pBufferState=bufferStateVar;
   updateBufferState();
   //printf("buffer usage = %lf @ 0x%p\n", pBufferState->load(),pBufferState);
 }
 
+void MemoryPagesPool::setPageStateLatencyHistogram(std::atomic<uint64_t> *histogram) {
+  for (auto &p : pages) {
+    p.latencyHistogram = histogram;
+  }
+}
+
 int MemoryPagesPool::getNumaStats(std::map<int,int> &pagesCountPerNumaNode) {
   int err=0;
   pagesCountPerNumaNode.clear();
   uint64_t np = 0;
-  for(char *ptr = (char *)baseBlockAddress; ptr < &((char*)baseBlockAddress)[baseBlockSize]; ptr += 4096) {
+  // check each system memory page
+  size_t step = 4096;
+  if (memoryPageSize > step) {
+    step = memoryPageSize;
+  }
+  std::map<int, uint64_t> bytesPerNumaNode;
+  for(char *ptr = (char *)baseBlockAddress; ptr < &((char*)baseBlockAddress)[baseBlockSize]; ptr += step) {
     int numaNode = -1;
     if (numaGetNodeFromAddress(ptr, numaNode) == 0) {
       if (numaNode>=0) {
         np++;
-	pagesCountPerNumaNode[numaNode]++;
+	bytesPerNumaNode[numaNode] += step;
       }
     }
   }
-  for (auto &c : pagesCountPerNumaNode) {
-    c.second = c.second / 250; // report in MB
+  for (auto &c : bytesPerNumaNode) {
+    pagesCountPerNumaNode[c.first] = (int)(c.second / (1024 * 1024)); // report in MB
   }
 
 /*  for (auto& p : pagesMap) {
@@ -438,6 +613,12 @@ int MemoryPagesPool::updatePageState(void *ptr, MemoryPage::PageState state) {
   return 0;
 }
 
+int MemoryPagesPool::updatePageState(int pageIndex, MemoryPage::PageState state) {
+  if ((pageIndex < 0) || (pageIndex >= (int)pages.size())) return -1;
+  pages[pageIndex].setPageState(state);
+  return 0;
+}
+
 MemoryPage::MemoryPage() {
   resetPageStates();
   pagePtr = nullptr;
@@ -452,22 +633,42 @@ MemoryPage::~MemoryPage() {
 }
 
 void MemoryPage::setPageState(PageState s) {
+  if (!MemoryPagesPoolStateTiming) {
+    currentPageState = s;
+    return;
+  }
   if (s != currentPageState) {
+    uint64_t now = TscClock::now();
     if (currentPageState != PageState::Undefined) {
       if (pageStateTimes[(int)currentPageState].t0IsValid) {
-        pageStateTimes[(int)currentPageState].duration +=
-          (std::chrono::duration<double>(std::chrono::steady_clock::now() - pageStateTimes[(int)currentPageState].t0)).count();
+        uint64_t dt = now - pageStateTimes[(int)currentPageState].t0;
+        pageStateTimes[(int)currentPageState].duration += dt;
+        if (latencyHistogram != nullptr) {
+          int bin = getLatencyHistogramBin(TscClock::toMicroseconds(dt));
+          latencyHistogram[(int)currentPageState * latencyHistogramBins + bin].fetch_add(1, std::memory_order_relaxed);
+        }
       }
       pageStateTimes[(int)currentPageState].t0IsValid = 0;
     }
     if (s != PageState::Undefined) {
-      pageStateTimes[(int)s].t0 = std::chrono::steady_clock::now();
+      pageStateTimes[(int)s].t0 = now;
       pageStateTimes[(int)s].t0IsValid = 1;
     }
     currentPageState = s;
   }
 }
 
+int MemoryPage::getLatencyHistogramBin(uint64_t microseconds) {
+  if (microseconds == 0) {
+    return 0;
+  }
+  int bin = 64 - __builtin_clzll(microseconds);
+  if (bin >= latencyHistogramBins) {
+    bin = latencyHistogramBins - 1;
+  }
+  return bin;
+}
+
 void MemoryPage::resetPageStates() {
   currentPageState = PageState::Undefined;
   for (int i=0; i<(int)PageState::Undefined; i++) {
@@ -479,7 +680,7 @@ void MemoryPage::resetPageStates() {
 
 double MemoryPage::getPageStateDuration(PageState s) {
   if (s != PageState::Undefined) {
-    return pageStateTimes[(int)s].duration;
+    return TscClock::toSeconds(pageStateTimes[(int)s].duration);
   }
   return 0;
 }
@@ -501,7 +702,7 @@ const char* MemoryPage::getPageStateString(PageState s) {
   return "Unknown";
 }
 
-int updatePageStateFromDataBlockContainerReference(DataBlockContainerReference b, MemoryPage::PageState state) {
+int updatePageStateFromDataBlockContainerReference(const DataBlockContainerReference& b, MemoryPage::PageState state) {
   int err = __LINE__;
   MemoryPagesPool *mp = nullptr;
   DataBlock *db = nullptr;
@@ -513,7 +714,8 @@ int updatePageStateFromDataBlockContainerReference(DataBlockContainerReference b
     }
     mp = ((MemoryPagesPool *)b->memoryPagesPoolPtr);
     if (mp == nullptr) {
-      err = __LINE__;
+      // block not from a pool (e.g. a child block referencing a pool page): not tracked
+      err = 0;
       break;
     }
     db = b->getData();
@@ -521,6 +723,10 @@ int updatePageStateFromDataBlockContainerReference(DataBlockContainerReference b
       err = __LINE__;
       break;
     }
+    if (b->memoryPageIndex >= 0) {
+      err = mp->updatePageState(b->memoryPageIndex, state);
+      break;
+    }
     pagePtr = db->data;
     err = mp->updatePageState(pagePtr, state);
     break;
@@ -592,8 +798,8 @@ std::string MemoryPagesPool::getDetailedStats() {
 void MemoryPagesPool::getDetailedStats(Stats &s) {
   s.id = id;
   s.t0 = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()/1000000.0;
-  auto now = std::chrono::steady_clock::now();
-  std::unique_lock<std::mutex> lock(pagesAvailableMutexPush);
+  uint64_t now = TscClock::now();
+  // no lock: this is a snapshot, page states may be updated concurrently
   s.states.resize(pages.size());
   for(unsigned int ix = 0 ; ix < pages.size(); ix++) {
     auto ps = pages[ix].currentPageState;
@@ -601,7 +807,8 @@ void MemoryPagesPool::getDetailedStats(Stats &s) {
     double t = 0;
     if (ps != MemoryPage::PageState::Undefined) {
       if (pages[ix].pageStateTimes[(int)ps].t0IsValid) {
-        t = (std::chrono::duration<double>(now - pages[ix].pageStateTimes[(int)ps].t0)).count();
+        uint64_t t0 = pages[ix].pageStateTimes[(int)ps].t0;
+        t = (now > t0) ? TscClock::toSeconds(now - t0) : 0;
       }
     }
     s.states[ix].timeInCurrentState = t;
@@ -609,6 +816,62 @@ void MemoryPagesPool::getDetailedStats(Stats &s) {
   s.t1 = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()/1000000.0;
 }
 
+MemoryPagesPool::PageMagazine* MemoryPagesPool::getMagazine(bool create)
+{
+  PageMagazine* freeSlot = nullptr;
+  for (int i = 0; i < magazinesPerThread; i++) {
+    PageMagazine& m = threadMagazines.magazines[i];
+    if ((m.pool == this) && (m.poolInstance == instance)) {
+      return &m;
+    }
+    if ((freeSlot == nullptr) && (m.pool == nullptr)) {
+      freeSlot = &m;
+    }
+  }
+  if (!create) {
+    return nullptr;
+  }
+  if (freeSlot == nullptr) {
+    // all magazines in use, give back pages of one of them
+    freeSlot = &threadMagazines.magazines[threadMagazines.nextEvicted];
+    threadMagazines.nextEvicted = (threadMagazines.nextEvicted + 1) % magazinesPerThread;
+    flushMagazine(*freeSlot);
+  }
+  freeSlot->pool = this;
+  freeSlot->poolInstance = instance;
+  freeSlot->nPages = 0;
+  return freeSlot;
+}
+
+void MemoryPagesPool::flushMagazine(PageMagazine& m)
+{
+  if (m.nPages) {
+    // registry locked while pages are pushed, so that pool is not destroyed meanwhile
+    std::unique_lock<std::mutex> lock(poolsRegistryMutex);
+    auto it = poolsRegistry.find(m.poolInstance);
+    if ((it != poolsRegistry.end()) && (it->second == m.pool)) {
+      for (int i = 0; i < m.nPages; i++) {
+        if (m.pool->pagesAvailable->push(m.pages[i]) != 0) {
+          LOG_CODEWRONG;
+        }
+      }
+      m.pool->nPagesInMagazines -= m.nPages;
+      m.pool->updateBufferState();
+    }
+    // otherwise, pool does not exist anymore and pages can be forgotten
+  }
+  m.pool = nullptr;
+  m.poolInstance = 0;
+  m.nPages = 0;
+}
+
+MemoryPagesPool::ThreadMagazines::~ThreadMagazines()
+{
+  for (int i = 0; i < magazinesPerThread; i++) {
+    flushMagazine(magazines[i]);
+  }
+}
+
 
 // todo:
 // add FMQ release rate
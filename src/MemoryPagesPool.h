@@ -22,6 +22,8 @@
 
 #include "CounterStats.h"
 #include "DataBlockContainer.h"
+#include "LockFreeFifo.h"
+#include "TscClock.h"
 
 // This class is used to store metadata associated to a data page
 class MemoryPage {
@@ -54,6 +56,11 @@ class MemoryPage {
   static const char* getPageStateString(PageState s);
   void reportPageStates();
 
+  // number of bins of page state latency histograms (see MemoryPagesPool::setPageStateLatencyHistogram)
+  // bin 0 counts durations below 1 microsecond, bin i durations in [2^(i-1), 2^i[ microseconds, last bin all longer durations (> 4s)
+  static const int latencyHistogramBins = 24;
+  static int getLatencyHistogramBin(uint64_t microseconds);
+
   friend class MemoryPagesPool;
 
   protected:
@@ -64,21 +71,23 @@ class MemoryPage {
 
   struct TimeCounter {
     bool t0IsValid; // flag to mark valid/invalid t0
-    std::chrono::time_point<std::chrono::steady_clock> t0; // time of entering given state
-    double duration; // cumulated time in seconds in given state
+    uint64_t t0; // time of entering given state (TscClock ticks)
+    uint64_t duration; // cumulated time in given state (TscClock ticks)
   };
 
   TimeCounter pageStateTimes[(int)PageState::Undefined];
   // CounterStats pageStateTimeStats[(int)PageState::Undefined];
   PageState currentPageState;
   unsigned long long nTimeUsed;
+  std::atomic<uint64_t>* latencyHistogram = nullptr; // if set, histogram of time spent in each state, updated when leaving a state. Shared by all pages of a pool.
 
   int pageId; // index of page in memory pool
+  bool needsClear = false; // when set, page content is zeroed on next getPage()
 };
 
 
 // This class creates a pool of data pages from a memory block
-// Optimized for 1-1 consumers (1 thread to get the page, 1 thread to release them)
+// Pages can be get/released concurrently by any number of threads (lock-free fifo)
 // No check is done on validity of address of data pages pushed back in queue Base address should be kept while object is in use
 
 class MemoryPagesPool
@@ -105,7 +114,7 @@ class MemoryPagesPool
   ~MemoryPagesPool();
 
   // methods to get and release page
-  // the two functions can be called concurrently without locking (but a lock is needed if calling the same function concurrently)
+  // the two functions can be called concurrently from any number of threads, without locking
   void* getPage();                 // get a new page from the pool (if available, nullptr if none)
   void releasePage(void* address); // insert back page to the pool after use, to make it available again
 
@@ -116,12 +125,17 @@ class MemoryPagesPool
   void* getBaseBlockAddress();        // get the base address of memory pool block
   size_t getBaseBlockSize();          // get the  size of memory pool block. All pages guaranteed to be within &baseBlockAddress[0] and &baseBlockAddress[baseBlockSize]
   int getId();                        // get pool identifier, as set on creation
+  size_t getMemoryPageSize();         // get size of system memory pages backing the pool (e.g. 4kB, or hugepage size). 0 if unknown.
+  void setMemoryPageSize(size_t sz);  // set size of system memory pages backing the pool, as known from memory bank
+  int getNumaNode();                  // get NUMA node of the pool memory, when chosen by the memory bank (bank split on NUMA nodes). -1 otherwise.
+  void setNumaNode(int node);         // set NUMA node of the pool memory
 
   // get an empty data block container from the pool
   // parameters:
   // - data = a given page, retrieved previously by getPage(), or new page if null) from the pool.
   // Page will be put back in pool after use (when released).
   // The base header is filled, in particular block->header.dataSize has usable page size and block->data points to it.
+  // The container and its reference counter are created in storage preallocated for each page (no heap allocation).
   std::shared_ptr<DataBlockContainer> getNewDataBlockContainer(void* page = nullptr);
 
   size_t getDataBlockMaxSize(); // returns usable payload size of blocks returned by getNewDataBlockContainer()
@@ -150,8 +164,11 @@ class MemoryPagesPool
 
   void setWarningCallback(const LogCallback& cb, double thHigh = 0.9, double thOk = 0.8);
   void setBufferStateVariable(std::atomic<double> *bufferStateVar); // the provided variable is updated continuously with the buffer usage ratio (0.0 empty -> 1.0 full)
+  void setPageStateLatencyHistogram(std::atomic<uint64_t> *histogram); // the provided array of PageState::Undefined x MemoryPage::latencyHistogramBins counters is incremented each time a page leaves a state, in the bin corresponding to the time spent in it. Only when page state timing is enabled. To be called before pool is used.
+
+  int getNumaStats(std::map<int,int> &pagesCountPerNumaNode); // get amount of memory (MB) of the pool on each NUMA node. Returns 0 on success.
 
-  int getNumaStats(std::map<int,int> &pagesCountPerNumaNode);
+  void setClearOnFirstUse(); // pages will be zeroed individually the first time they are given by getPage(), instead of clearing the whole pool upfront. To be called before pool is used.
 
   const static size_t headerReservedSpace = 0; // sizeof(DataBlock); // number of bytes reserved at top of each page for datablock header. Otherwise, stored separately.
 
@@ -166,9 +183,32 @@ class MemoryPagesPool
   void updateBufferState();
   std::atomic<double> *pBufferState = nullptr; // when set, the pointed variable is updated everytime updateBufferState() is called
 
-  std::unique_ptr<AliceO2::Common::Fifo<void*>> pagesAvailable; // a buffer to keep track of individual pages
-  std::mutex pagesAvailableMutexPush; // a lock to avoid concurrent push-back of free pages to fifo
-  std::mutex pagesAvailableMutexPop; // a lock to avoid concurrent get free pages from fifo
+  std::unique_ptr<LockFreeFifo<void*>> pagesAvailable; // a buffer to keep track of individual pages
+
+  // optional per-thread caches of free pages ("magazines"), to limit traffic on the shared fifo
+  // a magazine is accessed only by its owner thread, without lock. It is created by getPage(), and refilled from the shared fifo by batches of half a magazine.
+  // releasePage() caches pages only in threads which also get pages from this pool: pages released by other threads go directly to the shared fifo, where they are available to all.
+  // when a magazine is full, half of it is given back to the shared fifo. Pages kept in magazines are still counted as available.
+  static const int magazineMaxSize = 256; // maximum number of pages in a magazine
+  static const int magazinesPerThread = 8; // maximum number of pools cached by a thread (others are evicted)
+  struct PageMagazine {
+    MemoryPagesPool* pool = nullptr; // pool owning the pages
+    uint64_t poolInstance = 0;       // instance of pool owning the pages, to detect reuse of a pool address
+    int nPages = 0;                  // number of pages in magazine
+    void* pages[magazineMaxSize];    // stack of free pages
+  };
+  struct ThreadMagazines {
+    PageMagazine magazines[magazinesPerThread];
+    int nextEvicted = 0; // index of next magazine to be evicted when all are in use
+    ~ThreadMagazines();  // pages are given back to their pool when thread exits
+  };
+  static thread_local ThreadMagazines threadMagazines;
+  static void flushMagazine(PageMagazine& m); // give back all pages of a magazine to its pool, if still existing
+  PageMagazine* getMagazine(bool create); // get the magazine of current thread for this pool. If not existing, it is created when requested, otherwise nullptr is returned.
+  int magazineSize = 0; // number of pages in per-thread magazines. Zero when disabled.
+  uint64_t instance = 0; // unique identifier of this pool instance
+  std::atomic<size_t> nPagesInMagazines = 0; // number of free pages currently kept in per-thread magazines
+  std::mutex statsMutex; // a lock to protect non thread-safe statistics (poolStats, buffer state). Only try_lock() is used in get/release, these are updated on a best-effort basis.
 
   size_t numberOfPages;                           // number of pages
   size_t pageSize;                                // size of each page, in bytes
@@ -206,15 +246,24 @@ class MemoryPagesPool
   int id = -1; // unique identifier for this pool
 
   std::vector<MemoryPage> pages; // an array to store for each page defined in block some corresponding support metadata
+  bool clearOnFirstUse = false; // if set, pages are zeroed on first getPage()
+  size_t memoryPageSize = 0;    // size of system memory pages, if known
+  int numaNode = -1;            // NUMA node of the pool memory, if set
+
+  // storage for the DataBlockContainer (and shared_ptr control block) associated to each page
+  struct ContainerSlot;
+  template <typename T> struct ContainerSlotAllocator;
+  std::unique_ptr<ContainerSlot[]> containerSlots; // one per page, same index as pages[]
   int getPageIndexFromPagePtr(void *ptr, int checkValidity = 1); // returns index of page (in pages[]) at given address. -1 on error.
 
   public:
   int updatePageState(void *ptr, MemoryPage::PageState state);
+  int updatePageState(int pageIndex, MemoryPage::PageState state); // same, with index of page in pool (as stored in DataBlockContainer::memoryPageIndex), avoiding the address lookup
 };
 
 
 // Perform MemoryPagesPool::updatePageState from a datablock ref, with some pointers checks.
-int updatePageStateFromDataBlockContainerReference(DataBlockContainerReference b, MemoryPage::PageState state);
+int updatePageStateFromDataBlockContainerReference(const DataBlockContainerReference& b, MemoryPage::PageState state);
 
 #endif // #ifndef _MEMORYPAGESPOOL_H
 
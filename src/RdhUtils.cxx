@@ -10,6 +10,14 @@
 // or submit itself to any jurisdiction.
 
 #include "RdhUtils.h"
+
+#include <cstddef>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RDHSCANNER_HAS_AVX2
+#endif
 RdhHandle::RdhHandle(void* data) { rdhPtr = (o2::Header::RAWDataHeader*)data; }
 
 RdhHandle::~RdhHandle() {}
@@ -67,43 +75,36 @@ void RdhHandle::dumpRdh(long offset, bool singleLine)
 
 int RdhHandle::validateRdh(std::string& err)
 {
-  int retCode = 0;
-  // expecting RDH v5 or v6 or v7
-  if ((getHeaderVersion() != 5) && (getHeaderVersion() != 6) && (getHeaderVersion() != 7)) {
-    if (err.length()) err += ", ";
-    err += "Wrong header version";
-    retCode++;
+  uint32_t errors = getErrors();
+  if (errors == 0) {
+    return 0;
   }
-  // check header size
-  if (getHeaderSize() != sizeof(o2::Header::RAWDataHeader)) {
+  return rdhErrorsToString(errors, getHeaderVersion(), getHeaderSize(), getLinkId(), getOffsetNextPacket(), err);
+}
+
+int rdhErrorsToString(uint32_t errors, uint8_t version, uint8_t headerSize, uint8_t linkId, uint16_t offsetNextPacket, std::string& err)
+{
+  int nErrors = 0;
+  auto addError = [&](const char* description, int value) {
     if (err.length()) err += ", ";
-    err += "Wrong header size";
-    retCode++;
+    err += description;
+    err += " ";
+    err += std::to_string(value);
+    nErrors++;
+  };
+  if (errors & RdhErrorHeaderVersion) {
+    addError("Wrong header version", version);
   }
-  // expecting linkId 0-31
-  if (getLinkId() > RdhMaxLinkId) {
-    if (err.length()) err += ", ";
-    err += "Wrong link ID";
-    retCode++;
+  if (errors & RdhErrorHeaderSize) {
+    addError("Wrong header size", headerSize);
   }
-
-  // expecting offset next packet at least the size of the header
-  if ((getOffsetNextPacket() > 0) && (getOffsetNextPacket() < sizeof(o2::Header::RAWDataHeader))) {
-    if (err.length()) err += ", ";
-    err += "Wrong offsetNextPacket";
-    retCode++;
+  if (errors & RdhErrorLinkId) {
+    addError("Wrong link ID", linkId);
   }
-
-  /*
-  // expecting block length <= 8kB
-  if (getBlockLength()>8*1024) {
-    err+="Wrong block length " + std::to_string(getBlockLength()) +"\n";
-    retCode++;
+  if (errors & RdhErrorOffsetNextPacket) {
+    addError("Wrong offsetNextPacket", offsetNextPacket);
   }
-  */
-
-  // check FEE Id ?
-  return retCode;
+  return nErrors;
 }
 
 RdhBlockHandle::RdhBlockHandle(void* ptr, size_t size) : blockPtr(ptr), blockSize(size) {}
@@ -185,3 +186,129 @@ std::string RdhHandle::toHexaString() {
       }
   return s;
 }
+
+
+// RdhScanner implementation
+
+// the vectorized implementation decodes RDH fields from their 32-bit word index
+static_assert(offsetof(o2::Header::RAWDataHeader, word0) == 0 * sizeof(uint32_t));
+static_assert(offsetof(o2::Header::RAWDataHeader, word2) == 2 * sizeof(uint32_t));
+static_assert(offsetof(o2::Header::RAWDataHeader, word3) == 3 * sizeof(uint32_t));
+static_assert(offsetof(o2::Header::RAWDataHeader, word5) == 5 * sizeof(uint32_t));
+static_assert(offsetof(o2::Header::RAWDataHeader, word8) == 8 * sizeof(uint32_t));
+static_assert(offsetof(o2::Header::RAWDataHeader, word9) == 9 * sizeof(uint32_t));
+static_assert(offsetof(o2::Header::RAWDataHeader, word12) == 12 * sizeof(uint32_t));
+static_assert(offsetof(o2::Header::RAWDataHeader, word3) == 12); // linkId is first byte of word3
+
+static const uint32_t rdhScannerHeaderSize = sizeof(o2::Header::RAWDataHeader);
+
+// fill descriptor from RDH in memory
+static inline void rdhScannerFill(RdhDescriptor& d, const uint8_t* base, uint32_t offset)
+{
+  const o2::Header::RAWDataHeader* rdh = (const o2::Header::RAWDataHeader*)(base + offset);
+  d.offset = offset;
+  d.hbOrbit = rdh->heartbeatOrbit;
+  d.triggerOrbit = rdh->triggerOrbit;
+  d.triggerType = rdh->triggerType;
+  d.detectorField = rdh->detectorField;
+  d.offsetNextPacket = rdh->offsetNextPacket;
+  d.memorySize = rdh->memorySize;
+  d.pagesCounter = rdh->pagesCounter;
+  d.version = rdh->version;
+  d.headerSize = rdh->headerSize;
+  d.linkId = rdh->linkId;
+  d.packetCounter = rdh->packetCounter;
+  d.stopBit = rdh->stopBit;
+  d.reserved = 0;
+}
+
+// scalar implementation: follow the chain
+static int rdhScannerScalar(const uint8_t* base, size_t size, RdhDescriptor* out, uint32_t& errors)
+{
+  int n = 0;
+  for (size_t offset = 0; offset + rdhScannerHeaderSize <= size;) {
+    rdhScannerFill(out[n], base, (uint32_t)offset);
+    errors |= out[n].getErrors();
+    uint32_t next = out[n].offsetNextPacket;
+    n++;
+    if (next < rdhScannerHeaderSize) {
+      break;
+    }
+    offset += next;
+  }
+  return n;
+}
+
+#ifdef RDHSCANNER_HAS_AVX2
+// vectorized implementation: each RDH is loaded with two 256-bit reads, and the descriptor
+// is assembled in register with permutes/shuffles, then written with a single 256-bit store
+// (the descriptor layout is chosen for this: 8 x 32-bit words)
+__attribute__((target("avx2"))) static int rdhScannerAvx2(const uint8_t* base, size_t size, RdhDescriptor* out, uint32_t& errors)
+{
+  // descriptor words from RDH words 0-7: hbOrbit, triggerOrbit (w5), offsetNextPacket + memorySize (w2), version + headerSize (w0), linkId + packetCounter (w3)
+  const __m256i permLow = _mm256_setr_epi32(0, 5, 5, 0, 0, 2, 0, 3);
+  // descriptor words from RDH words 8-15: triggerType (w8), detectorField (w12), pagesCounter + stopBit (w9)
+  const __m256i permHigh = _mm256_setr_epi32(0, 0, 0, 0, 4, 0, 1, 1);
+  // move version + headerSize to bytes 26-27, clear byte 31 (0x80 = zero)
+  const __m256i shuffleLow = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                              0, 1, 2, 3, 4, 5, 6, 7, 0x80, 0x80, 8, 9, 12, 13, 0x80, 0x80);
+  // bytes taken from high part: triggerType, detectorField, pagesCounter, stopBit
+  const __m256i blendMask = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, -1,
+                                             -1, -1, -1, -1, 0, 0, 0, 0, -1, -1, 0, 0, 0, 0, -1, 0);
+
+  int n = 0;
+  for (size_t offset = 0; offset + rdhScannerHeaderSize <= size;) {
+    const uint8_t* ptr = base + offset;
+    uint32_t next = ((const o2::Header::RAWDataHeader*)ptr)->offsetNextPacket;
+    __m256i low = _mm256_loadu_si256((const __m256i*)ptr);
+    __m256i high = _mm256_loadu_si256((const __m256i*)(ptr + 32));
+    __m256i a = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(low, permLow), shuffleLow);
+    __m256i b = _mm256_permutevar8x32_epi32(high, permHigh);
+    __m256i d = _mm256_insert_epi32(_mm256_blendv_epi8(a, b, blendMask), (int)offset, 0);
+    _mm256_storeu_si256((__m256i*)&out[n], d);
+    // validate from RDH bytes (version, header size, link id) rather than reading back the descriptor just stored
+    errors |= rdhCheckFields(ptr[0], ptr[1], ptr[12], (uint16_t)next);
+    n++;
+    if (next < rdhScannerHeaderSize) {
+      break;
+    }
+    offset += next;
+  }
+  return n;
+}
+#endif
+
+RdhScanner::RdhScanner(bool v_useSimd)
+{
+#ifdef RDHSCANNER_HAS_AVX2
+  if (v_useSimd) {
+    useSimd = __builtin_cpu_supports("avx2");
+  }
+#else
+  (void)v_useSimd;
+#endif
+}
+
+RdhScanner::~RdhScanner() {}
+
+int RdhScanner::scan(const void* pagePtr, size_t pageSize)
+{
+  nDescriptors = 0;
+  errors = 0;
+  if ((pagePtr == nullptr) || (pageSize < rdhScannerHeaderSize)) {
+    return 0;
+  }
+  // maximum number of RDHs in page, given the minimum stride
+  size_t maxDescriptors = pageSize / rdhScannerHeaderSize;
+  if (descriptors.size() < maxDescriptors) {
+    descriptors.resize(maxDescriptors);
+  }
+#ifdef RDHSCANNER_HAS_AVX2
+  if ((useSimd) && (pageSize <= (size_t)std::numeric_limits<uint32_t>::max())) {
+    nDescriptors = rdhScannerAvx2((const uint8_t*)pagePtr, pageSize, descriptors.data(), errors);
+    return nDescriptors;
+  }
+#endif
+  nDescriptors = rdhScannerScalar((const uint8_t*)pagePtr, pageSize, descriptors.data(), errors);
+  return nDescriptors;
+}
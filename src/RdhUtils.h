@@ -15,12 +15,40 @@
 #define RDHUTILS_H
 
 #include <string>
+#include <vector>
 
 #include "RAWDataHeader.h"
 
 // Some constants
 const unsigned int RdhMaxLinkId = 31; // maximum ID of a linkId in RDH
 
+// RDH validation errors, combined in a bitmask
+enum RdhErrorFlags : uint32_t {
+  RdhErrorHeaderVersion = 1 << 0,    // header version not supported (expecting 5, 6 or 7)
+  RdhErrorHeaderSize = 1 << 1,       // header size different from RDH size
+  RdhErrorLinkId = 1 << 2,           // link id above RdhMaxLinkId
+  RdhErrorOffsetNextPacket = 1 << 3, // offset of next packet not null but smaller than header
+};
+
+// check RDH fields
+// returns 0 on success, a bitmask of RdhErrorFlags otherwise
+// written without branches, so that cost is constant and low when called for every RDH
+inline uint32_t rdhCheckFields(uint8_t version, uint8_t headerSize, uint8_t linkId, uint16_t offsetNextPacket)
+{
+  uint32_t errors = 0;
+  errors |= ((uint8_t)(version - 5) > 2) * RdhErrorHeaderVersion;                  // expecting RDH v5 or v6 or v7
+  errors |= (headerSize != sizeof(o2::Header::RAWDataHeader)) * RdhErrorHeaderSize; // check header size
+  errors |= (linkId > RdhMaxLinkId) * RdhErrorLinkId;                              // expecting linkId 0-31
+  // expecting offset next packet at least the size of the header (or zero)
+  errors |= ((uint16_t)(offsetNextPacket - 1) < sizeof(o2::Header::RAWDataHeader) - 1) * RdhErrorOffsetNextPacket;
+  // check FEE Id ?
+  return errors;
+}
+
+// append to err the description of errors returned by rdhCheckFields(), with the offending values
+// returns number of errors
+int rdhErrorsToString(uint32_t errors, uint8_t version, uint8_t headerSize, uint8_t linkId, uint16_t offsetNextPacket, std::string& err);
+
 // Utility class to access RDH fields and check them
 class RdhHandle
 {
@@ -36,6 +64,10 @@ class RdhHandle
   // Error message sets accordingly
   int validateRdh(std::string& err);
 
+  // check RDH content, without building error message
+  // returns 0 on success, a bitmask of RdhErrorFlags otherwise
+  inline uint32_t getErrors() { return rdhCheckFields(getHeaderVersion(), getHeaderSize(), getLinkId(), getOffsetNextPacket()); }
+
   // print RDH content
   // offset is a value to be displayed as address. if -1, memory address is used.
   // singleLine: when set, RDH content printed in single line with top header printed once
@@ -95,5 +127,71 @@ class RdhBlockHandle
   size_t blockSize; // size of memory block
 };
 
+// Compact copy of the main fields of a RDH, as extracted by RdhScanner
+struct RdhDescriptor {
+  uint32_t offset;           // offset of RDH from beginning of page, in bytes
+  uint32_t hbOrbit;          // heartbeat orbit
+  uint32_t triggerOrbit;     // trigger orbit
+  uint32_t triggerType;      // trigger type
+  uint32_t detectorField;    // detector field
+  uint16_t offsetNextPacket; // offset of next RDH, relative to this one
+  uint16_t memorySize;       // size of RDH + payload
+  uint16_t pagesCounter;     // pages counter in HBF
+  uint8_t version;           // header version
+  uint8_t headerSize;        // header size
+  uint8_t linkId;            // link id
+  uint8_t packetCounter;     // packet counter
+  uint8_t stopBit;           // stop bit
+  uint8_t reserved;          // padding
+
+  // check RDH content
+  // returns 0 on success, a bitmask of RdhErrorFlags otherwise
+  inline uint32_t getErrors() const { return rdhCheckFields(version, headerSize, linkId, offsetNextPacket); }
+
+  // append to err the description of errors returned by getErrors()
+  inline void getErrorsDescription(uint32_t errors, std::string& err) const { rdhErrorsToString(errors, version, headerSize, linkId, offsetNextPacket, err); }
+};
+static_assert(sizeof(RdhDescriptor) == 32);
+
+// Utility class to walk the chain of RDHs in a memory page, extracting their main fields in a single pass.
+// The result is an array of RdhDescriptor, one per RDH, which is reused from one page to the next.
+// The walk stops on the first RDH with offsetNextPacket smaller than the header size (this RDH is included),
+// or when next RDH would not fit in page. RDHs are validated on the way (see getErrors()).
+// On CPUs with AVX2 (detected at runtime), each RDH is read with two vector loads and its descriptor
+// assembled in register, instead of one load per field. A scalar implementation is used otherwise.
+class RdhScanner
+{
+ public:
+  // constructor
+  // when useSimd is set, the vectorized implementation is used if the CPU supports it
+  RdhScanner(bool useSimd = true);
+
+  // destructor
+  ~RdhScanner();
+
+  // scan page and fill descriptors array (previous content is replaced)
+  // returns number of RDHs found
+  int scan(const void* pagePtr, size_t pageSize);
+
+  // access result of last scan
+  inline int size() const { return nDescriptors; }
+  inline const RdhDescriptor& operator[](int i) const { return descriptors[i]; }
+  inline const RdhDescriptor* begin() const { return descriptors.data(); }
+  inline const RdhDescriptor* end() const { return descriptors.data() + nDescriptors; }
+
+  // get errors found in last page scanned (RdhErrorFlags of all RDHs combined)
+  // when 0, no need to check the RDHs one by one
+  inline uint32_t getErrors() const { return errors; }
+
+  // tells if vectorized implementation is used
+  inline bool isUsingSimd() const { return useSimd; }
+
+ private:
+  std::vector<RdhDescriptor> descriptors; // descriptors of RDHs found in last page scanned (only first nDescriptors valid)
+  int nDescriptors = 0;                   // number of RDHs found in last page scanned
+  uint32_t errors = 0;                    // errors found in last page scanned
+  bool useSimd = false;                   // set when vectorized implementation used
+};
+
 #endif
 
@@ -51,6 +51,9 @@ ReadoutEquipment::ReadoutEquipment(ConfigFile& cfg, std::string cfgEntryPoint, b
   cfgIdleSleepTime = 200;
   cfg.getOptionalValue<int>(cfgEntryPoint + ".idleSleepTime", cfgIdleSleepTime);
 
+  // configuration parameter: | equipment-* | idleMode | int | 0 | Thread idle strategy. 0: sleep idleSleepTime after each iteration without data. 1 (opt-in): adaptive, spin then yield then sleep with exponential backoff up to idleSleepTime. The maximum sleep is reduced to half the average interval between pages when they come at high rate, and equipments able to signal new data wake up the thread immediately. |
+  cfg.getOptionalValue<int>(cfgEntryPoint + ".idleMode", cfgIdleMode);
+
   // size of equipment output FIFO
   // configuration parameter: | equipment-* | outputFifoSize | int | -1 | Size of output fifo (number of pages). If -1, set to the same value as memoryPoolNumberOfPages (this ensures that nothing can block the equipment while there are free pages). |
   int cfgOutputFifoSize = -1;
@@ -108,6 +111,9 @@ ReadoutEquipment::ReadoutEquipment(ConfigFile& cfg, std::string cfgEntryPoint, b
   cfgDisableTimeframes = 0;
   cfg.getOptionalValue<int>("readout.disableTimeframes", cfgDisableTimeframes);
 
+  // get flush timeout from toplevel config, used to drain the RDH checkers at stop
+  cfg.getOptionalValue<double>("readout.flushEquipmentTimeout", cfgFlushEquipmentTimeout);
+
   // get superpage debug settings
   // configuration parameter: | equipment-* | saveErrorPagesMax | int | 0 | If set, pages found with data error are saved to disk up to given maximum. |
   cfgSaveErrorPagesMax = 0;
@@ -120,7 +126,7 @@ ReadoutEquipment::ReadoutEquipment(ConfigFile& cfg, std::string cfgEntryPoint, b
   cfg.getOptionalValue<std::string>(cfgEntryPoint + ".dataPagesLogPath", cfgDataPagesLogPath);
   
   // log config summary
-  theLog.log(LogInfoDevel_(3002), "Equipment %s: from config [%s], id=%d, max rate=%lf Hz, idleSleepTime=%d us, outputFifoSize=%d", name.c_str(), cfgEntryPoint.c_str(), (int)cfgEquipmentId, readoutRate, cfgIdleSleepTime, cfgOutputFifoSize);
+  theLog.log(LogInfoDevel_(3002), "Equipment %s: from config [%s], id=%d, max rate=%lf Hz, idleSleepTime=%d us, idleMode=%d, outputFifoSize=%d", name.c_str(), cfgEntryPoint.c_str(), (int)cfgEquipmentId, readoutRate, cfgIdleSleepTime, cfgIdleMode, cfgOutputFifoSize);
   theLog.log(LogInfoDevel_(3008), "Equipment %s: requesting memory pool %d pages x %d bytes from bank '%s', block aligned @ 0x%X, 1st page offset @ 0x%X", name.c_str(), (int)memoryPoolNumberOfPages, (int)memoryPoolPageSize, memoryBankName.c_str(), (int)cfgBlockAlign, (int)cfgFirstPageOffset);
   if (disableOutput) {
     theLog.log(LogWarningDevel_(3002), "Equipment %s: output DISABLED ! Data will be readout and dropped immediately", name.c_str());
@@ -157,6 +163,21 @@ ReadoutEquipment::ReadoutEquipment(ConfigFile& cfg, std::string cfgEntryPoint, b
     cfgRdhCheckDetectorField = 1;
   }
 
+  // configuration parameter: | equipment-* | rdhCheckThreads | int | 0 | If set, the RDH checks (rdhCheckEnabled) are done in parallel by this number of threads, after the equipment readout thread. Pages of a given link always go to the same thread, so that their order is kept. Not used with ctpMode or rdhDumpEnabled. |
+  cfg.getOptionalValue<int>(cfgEntryPoint + ".rdhCheckThreads", cfgRdhCheckThreads);
+  if (cfgRdhCheckThreads > 0) {
+    if ((!cfgRdhCheckEnabled) || (!cfgRdhUseFirstInPageEnabled) || (disableOutput)) {
+      cfgRdhCheckThreads = 0;
+    } else if ((cfgCtpMode) || (cfgRdhDumpEnabled)) {
+      theLog.log(LogInfoDevel_(3002), "rdhCheckThreads not used with ctpMode or rdhDumpEnabled, RDH checks done in equipment thread");
+      cfgRdhCheckThreads = 0;
+    } else {
+      theLog.log(LogInfoDevel_(3002), "RDH checks done by %d threads", cfgRdhCheckThreads);
+    }
+  } else {
+    cfgRdhCheckThreads = 0;
+  }
+
   // configuration parameter: | equipment-* | verbose | int | 0 | If set, extra debug messages may be logged. |
   cfg.getOptionalValue<int>(cfgEntryPoint + ".verbose", cfgVerbose);
 
@@ -228,6 +249,8 @@ ReadoutEquipment::ReadoutEquipment(ConfigFile& cfg, std::string cfgEntryPoint, b
     if ((mp->getId() >= 0) && (mp->getId() < ReadoutStatsMaxItems)) {
       mp -> setBufferStateVariable(&gReadoutStats.counters.bufferUsage[mp->getId()]);
       gReadoutStats.counters.bufferSize[mp->getId()] = (uint64_t)memoryPoolPageSize * (uint64_t)memoryPoolNumberOfPages;
+      gReadoutStats.counters.bufferMemoryPageSize[mp->getId()] = mp->getMemoryPageSize();
+      mp -> setPageStateLatencyHistogram(&gReadoutStats.pageLatency.bufferPageStateLatency[mp->getId()][0][0]);
     }
     theLog.log(LogInfoDevel_(3008), "Using memory pool [%d]: %d pages x %d bytes", mp->getId(), memoryPoolNumberOfPages, memoryPoolPageSize);
 
@@ -239,18 +262,38 @@ ReadoutEquipment::ReadoutEquipment(ConfigFile& cfg, std::string cfgEntryPoint, b
       }
       theLog.log(LogInfoDevel_(3008), "Memory pool pages NUMA distribution : %s", numaStatsStr.c_str());
     }
+
+    // keep threads close to the memory, when the pool NUMA node was chosen by the memory bank
+    threadsNumaNode = mp->getNumaNode();
+    if (threadsNumaNode >= 0) {
+      theLog.log(LogInfoDevel_(3008), "Equipment threads will be bound to NUMA node %d", threadsNumaNode);
+    }
   }
   // todo: move page align to MemoryPool class
   assert(MemoryPagesPool::headerReservedSpace == mp->getPageSize() - mp->getDataBlockMaxSize());
 
   // create output fifo
-  dataOut = std::make_shared<AliceO2::Common::Fifo<DataBlockContainerReference>>(cfgOutputFifoSize);
+  dataOut = std::make_shared<ReadoutFifo<DataBlockContainerReference>>(cfgOutputFifoSize);
   if (dataOut == nullptr) {
     throw __LINE__;
   }
+  outputBatch.reserve(outputBatchSize);
+
+  // create RDH checkers, with their input and output fifos. Threads are started with the equipment.
+  for (int i = 0; i < cfgRdhCheckThreads; i++) {
+    auto checker = std::make_unique<RdhChecker>();
+    checker->input = std::make_unique<ReadoutFifo<DataBlockContainerReference>>(cfgOutputFifoSize);
+    checker->output = std::make_unique<ReadoutFifo<DataBlockContainerReference>>(cfgOutputFifoSize);
+    checker->idleWait = std::make_unique<AdaptiveIdle>(cfgIdleSleepTime);
+    rdhCheckers.push_back(std::move(checker));
+  }
 
   // create thread
-  readoutThread = std::make_unique<Thread>(ReadoutEquipment::threadCallback, this, name, cfgIdleSleepTime);
+  // in adaptive idle mode, the wait is done in the thread callback
+  if (cfgIdleMode == 1) {
+    idleWait = std::make_unique<AdaptiveIdle>(cfgIdleSleepTime);
+  }
+  readoutThread = std::make_unique<Thread>(ReadoutEquipment::threadCallback, this, name, (idleWait != nullptr) ? 0 : cfgIdleSleepTime);
   if (readoutThread == nullptr) {
     throw __LINE__;
   }
@@ -289,10 +332,23 @@ void ReadoutEquipment::start()
   // reset TF rate clock
   TFregulator.init(cfgTfRateLimit);
   throttlePendingBlock = nullptr;
+  throttlePendingPages.clear();
   
   // reset stats timer
   consoleStatsTimer.reset(cfgConsoleStatsUpdateTime * 1000000);
 
+  if (idleWait != nullptr) {
+    idleWait->resetStats();
+  }
+  readoutThreadNumaBound = false;
+
+  // start RDH checker threads, if any
+  rdhCheckersRunning = true;
+  for (auto& checker : rdhCheckers) {
+    checker->idleWait->resetStats();
+    checker->thread = std::make_unique<std::thread>(&ReadoutEquipment::rdhCheckerLoop, this, std::ref(*checker));
+  }
+
   readoutThread->start();
 }
 
@@ -307,6 +363,35 @@ void ReadoutEquipment::stop()
   // printf("%llu blocks in %.3lf seconds => %.1lf block/s\n",nBlocksOut,clk0.getTimer(),nBlocksOut/clk0.getTime());
   readoutThread->join();
 
+  // stop RDH checker threads, after they processed pending pages, and collect last checked pages
+  // checked pages keep going to output while it is emptied, for at most the flush timeout
+  if (rdhCheckers.size()) {
+    AliceO2::Common::Timer flushTimer;
+    flushTimer.reset(cfgFlushEquipmentTimeout * 1000000);
+    for (;;) {
+      collectCheckedPages();
+      size_t nPagesPending = throttlePendingPages.size();
+      for (auto& checker : rdhCheckers) {
+        nPagesPending += checker->input->getNumberOfUsedSlots() + checker->output->getNumberOfUsedSlots();
+      }
+      if ((nPagesPending == 0) || (flushTimer.isTimeout())) {
+        break;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    stopRdhCheckers();
+    collectCheckedPages();
+    statsRdhCheckPagesDiscarded += throttlePendingPages.size();
+    throttlePendingPages.clear();
+    for (auto& checker : rdhCheckers) {
+      statsRdhCheckPagesDiscarded += checker->output->getNumberOfUsedSlots();
+      checker->output->clear();
+    }
+    if (statsRdhCheckPagesDiscarded.load()) {
+      theLog.log(LogWarningDevel_(3235), "Equipment %s : %llu checked pages discarded at stop, output fifo still full after %.1fs", name.c_str(), statsRdhCheckPagesDiscarded.load(), cfgFlushEquipmentTimeout);
+    }
+  }
+
   this->finalCounters();
   ReadoutEquipment::finalCounters();
 
@@ -325,6 +410,10 @@ void ReadoutEquipment::stop()
   theLog.log(LogInfoDevel_(3003), "Average fifoready occupancy: %.1f", equipmentStats[EquipmentStatsIndexes::fifoOccupancyFreeBlocks].get() * 1.0 / (equipmentStats[EquipmentStatsIndexes::nLoop].get() - equipmentStats[EquipmentStatsIndexes::nIdle].get()));
   theLog.log(LogInfoDevel_(3003), "Average data throughput: %s", ReadoutUtils::NumberOfBytesToString(equipmentStats[EquipmentStatsIndexes::nBytesOut].get() / runningTime, "B/s").c_str());
   theLog.log(LogInfoDevel_(3003), "Links used: %s", equipmentLinksUsed.to_string().c_str());
+  if (idleWait != nullptr) {
+    AdaptiveIdle::Stats s = idleWait->getStats();
+    theLog.log(LogInfoDevel_(3003), "Idle waits: spin=%llu yield=%llu sleep=%llu (woken up: %llu), max sleep time = %d us", (unsigned long long)s.nSpin, (unsigned long long)s.nYield, (unsigned long long)s.nSleep, (unsigned long long)s.nWakeup, idleWait->getCurrentMaxSleep());
+  }
 
   std::string perLinkStats;
   for (unsigned int i = 0; i<= RdhMaxLinkId; i++) {
@@ -338,6 +427,8 @@ void ReadoutEquipment::stop()
 ReadoutEquipment::~ReadoutEquipment()
 {
   readoutThread = nullptr;
+  stopRdhCheckers();
+  rdhCheckers.clear();
   dataOut->clear();
 
   if (mp != nullptr) {
@@ -369,6 +460,12 @@ Thread::CallbackResult ReadoutEquipment::threadCallback(void* arg)
   // set thread name
   setThreadName(ptr->getName().c_str());
 
+  // bind thread to NUMA node, if needed
+  if ((ptr->threadsNumaNode >= 0) && (!ptr->readoutThreadNumaBound)) {
+    numaBind(ptr->threadsNumaNode);
+    ptr->readoutThreadNumaBound = true;
+  }
+
   // flag to identify if something was done in this iteration
   bool isActive = false;
 
@@ -394,10 +491,18 @@ Thread::CallbackResult ReadoutEquipment::threadCallback(void* arg)
       if ((!ptr->clk.isTimeout()) && (nBlocksOut != 0) && (maxBlocksToRead <= 0)) {
         // target block rate exceeded, wait a bit
         ptr->equipmentStats[EquipmentStatsIndexes::nThrottle].increment();
+        ptr->setIdleWaitLimit(ptr->clk.getRemainingTime());
         break;
       }
     }
 
+    // move pages checked in parallel to output FIFO
+    if (ptr->rdhCheckers.size()) {
+      if (ptr->collectCheckedPages()) {
+        isActive = true;
+      }
+    }
+
     // check status of output FIFO
     ptr->equipmentStats[EquipmentStatsIndexes::fifoOccupancyOutBlocks].set(ptr->dataOut->getNumberOfUsedSlots());
 
@@ -412,11 +517,15 @@ Thread::CallbackResult ReadoutEquipment::threadCallback(void* arg)
     }
 
     // try to get new blocks
+    // they are pushed to output FIFO by batches. Only this thread pushes, so free space checked now is available until the end of the loop.
     int nPushedOut = 0;
+    // when RDH checks are done in parallel, pages go first to checker threads
+    int nOutputFree = ptr->rdhCheckers.size() ? ptr->getRdhCheckersFreeSlots() : ptr->dataOut->getNumberOfFreeSlots();
+    bool isAccountedNow = (ptr->rdhCheckers.size() == 0);
     for (int i = 0; i < maxBlocksToRead; i++) {
 
       // check output FIFO status so that we are sure we can push next block, if any
-      if (ptr->dataOut->isFull()) {
+      if (i >= nOutputFree) {
         ptr->equipmentStats[EquipmentStatsIndexes::nOutputFull].increment();
         break;
       }
@@ -453,10 +562,7 @@ Thread::CallbackResult ReadoutEquipment::threadCallback(void* arg)
 	if (ptr->cfgRdhUseFirstInPageEnabled) {
           if ((ptr->processRdh(nextBlock)) && ptr->cfgDropPagesWithError) {
             // drop pages with error when configured to do so
-            ptr->statsRdhCheckPagesDropped++;
-            static InfoLogger::AutoMuteToken logPageErrorDrop(LogWarningSupport_(3235), 10, 60);
-            theLog.log(logPageErrorDrop, "Equipment %s : page with RDH error has been discarded (total: %llu)", ptr->name.c_str(), ptr->statsRdhCheckPagesDropped);
-            nextBlock = nullptr;
+            ptr->dropPageWithError(nextBlock, ptr->rdhCheckLogTokens);
             continue;
           }
 	}
@@ -499,40 +605,15 @@ Thread::CallbackResult ReadoutEquipment::threadCallback(void* arg)
 	nextBlock->getData()->header.runNumber = occRunNumber;
       }
       
-      // check TF id of new block
-      uint64_t tfId = nextBlock->getData()->header.timeframeId;
-      if (tfId > ptr->lastTimeframe) {
-        // data from all links are not necessarily synchronized:
-	// at a given point in time the tfIds might be mixed between different links, some beeing still sending data for previous TF
-        // tfId != ptr->lastTimeframe instead of > is too strict, as there could be some (small) jumps back (usually lastTimeframe-1)
-	// the data aggregator buffer will reorder them later when needed
-
-	// regulate TF rate if needed
-	if (!ptr->TFregulator.next()) {
+      // check TF id of new block, and update output stats
+      // with parallel RDH checks, this is done when checked pages are collected, so that dropped pages are not counted
+      if (isAccountedNow) {
+        if (ptr->accountOutputBlock(nextBlock)) {
+          // TF rate limit reached
           ptr->throttlePendingBlock = std::move(nextBlock); // keep block with new TF for later
-	  isActive = false; // ask for delay before retry
-	  break;
-	}
-
-        static InfoLogger::AutoMuteToken logTFdiscontinuityToken(LogWarningSupport_(3004), 10, 60);
-        static InfoLogger::AutoMuteToken logTFdiscontinuityTokenError(LogErrorSupport_(3004), 10, 60);
-
-	ptr->statsNumberOfTimeframes++;
-	// detect gaps in TF id continuity
-	if (tfId != ptr->lastTimeframe + 1) {
-	  if (ptr->cfgRdhDumpWarningEnabled) {
-            theLog.log(logTFdiscontinuityToken, "Non-contiguous timeframe IDs %llu ... %llu", (unsigned long long)ptr->lastTimeframe, (unsigned long long)tfId);
-            // check if difference is large and orbit consistant with timestamp
-            double now = ptr->firstTimeframeTimestamp.getTime();
-            double dt = (nextBlock->getData()->header.orbitFirstInBlock - ptr->firstTimeframeHbOrbitBegin) * 1.0 / ptr->LHCOrbitRate; // diff in orbit / orbit rate = should be close to current timestamp
-            uint32_t expected = ptr->firstTimeframeHbOrbitBegin + (uint32_t)(now * ptr->LHCOrbitRate);
-            if (fabs(dt - now) > 10) {
-              theLog.log(logTFdiscontinuityTokenError, "Equipment %s link %d - Orbit 0x%X seems inconsistent from expected ~0x%X (orbit rate %u, elapsed time %.1fs)",
-                ptr->name.c_str(), (int)nextBlock->getData()->header.linkId, (int)nextBlock->getData()->header.orbitFirstInBlock, expected, ptr->LHCOrbitRate, now);
-            }
-	  }
-	}
-	ptr->lastTimeframe = tfId;
+          isActive = false; // ask for delay before retry
+          break;
+        }
       }
 
       // update rate-limit clock
@@ -540,11 +621,7 @@ Thread::CallbackResult ReadoutEquipment::threadCallback(void* arg)
         ptr->clk.increment();
       }
 
-      // update stats
       nPushedOut++;
-      ptr->equipmentStats[EquipmentStatsIndexes::nBytesOut].increment(nextBlock->getData()->header.dataSize);
-      gReadoutStats.counters.bytesReadout += nextBlock->getData()->header.dataSize;
-      gReadoutStats.counters.notify++;
       isActive = true;
 
       // print block debug info
@@ -564,10 +641,16 @@ Thread::CallbackResult ReadoutEquipment::threadCallback(void* arg)
       if (!ptr->disableOutput) {
         // push new page to output fifo
         updatePageStateFromDataBlockContainerReference(nextBlock, MemoryPage::PageState::InEquipmentFifoOut);
-        ptr->dataOut->push(nextBlock);
+        ptr->outputBatch.push_back(std::move(nextBlock));
+        if ((int)ptr->outputBatch.size() >= outputBatchSize) {
+          ptr->flushOutputBatch();
+        }
       }
     }
-    ptr->equipmentStats[EquipmentStatsIndexes::nBlocksOut].increment(nPushedOut);
+    ptr->flushOutputBatch();
+    if (isAccountedNow) {
+      ptr->equipmentStats[EquipmentStatsIndexes::nBlocksOut].increment(nPushedOut);
+    }
 
     // prepare next blocks
     if (ptr->isDataOn) {
@@ -584,11 +667,9 @@ Thread::CallbackResult ReadoutEquipment::threadCallback(void* arg)
       }
     }
 
-    // consider inactive if we have not pushed much compared to free space in output fifo
-    // todo: instead, have dynamic 'inactive sleep time' as function of actual outgoing page rate to optimize polling interval
-    if (nPushedOut < ptr->dataOut->getNumberOfFreeSlots() / 4) {
-      // disabled, should not depend on output fifo size
-      // isActive=0;
+    // in adaptive idle mode, the idle wait time is tuned from the outgoing page rate
+    if ((isActive) && (ptr->idleWait != nullptr)) {
+      ptr->idleWait->setActive(nPushedOut);
     }
 
     // todo: add SLICER to aggregate together time-range data
@@ -612,11 +693,239 @@ Thread::CallbackResult ReadoutEquipment::threadCallback(void* arg)
 
   if (!isActive) {
     ptr->equipmentStats[EquipmentStatsIndexes::nIdle].increment();
+    if (ptr->idleWait != nullptr) {
+      // wait here, thread does not need to sleep
+      ptr->idleWait->wait();
+      return Thread::CallbackResult::Ok;
+    }
     return Thread::CallbackResult::Idle;
   }
   return Thread::CallbackResult::Ok;
 }
 
+int ReadoutEquipment::accountOutputBlock(DataBlockContainerReference& block)
+{
+  // check TF id of new block
+  uint64_t tfId = block->getData()->header.timeframeId;
+  if (tfId > lastTimeframe) {
+    // data from all links are not necessarily synchronized:
+    // at a given point in time the tfIds might be mixed between different links, some beeing still sending data for previous TF
+    // tfId != lastTimeframe instead of > is too strict, as there could be some (small) jumps back (usually lastTimeframe-1)
+    // the data aggregator buffer will reorder them later when needed
+
+    // regulate TF rate if needed
+    if (!TFregulator.next()) {
+      return -1;
+    }
+
+    static InfoLogger::AutoMuteToken logTFdiscontinuityToken(LogWarningSupport_(3004), 10, 60);
+    static InfoLogger::AutoMuteToken logTFdiscontinuityTokenError(LogErrorSupport_(3004), 10, 60);
+
+    statsNumberOfTimeframes++;
+    // detect gaps in TF id continuity
+    if (tfId != lastTimeframe + 1) {
+      if (cfgRdhDumpWarningEnabled) {
+        theLog.log(logTFdiscontinuityToken, "Non-contiguous timeframe IDs %llu ... %llu", (unsigned long long)lastTimeframe, (unsigned long long)tfId);
+      }
+      if ((cfgRdhDumpWarningEnabled) && (isDefinedFirstTimeframeHbOrbitBegin.load(std::memory_order_acquire))) {
+        // check if difference is large and orbit consistant with timestamp
+        double now = firstTimeframeTimestamp.getTime();
+        double dt = (block->getData()->header.orbitFirstInBlock - firstTimeframeHbOrbitBegin) * 1.0 / LHCOrbitRate; // diff in orbit / orbit rate = should be close to current timestamp
+        uint32_t expected = firstTimeframeHbOrbitBegin + (uint32_t)(now * LHCOrbitRate);
+        if (fabs(dt - now) > 10) {
+          theLog.log(logTFdiscontinuityTokenError, "Equipment %s link %d - Orbit 0x%X seems inconsistent from expected ~0x%X (orbit rate %u, elapsed time %.1fs)",
+            name.c_str(), (int)block->getData()->header.linkId, (int)block->getData()->header.orbitFirstInBlock, expected, LHCOrbitRate, now);
+        }
+      }
+    }
+    lastTimeframe = tfId;
+  }
+
+  // update stats
+  equipmentStats[EquipmentStatsIndexes::nBytesOut].increment(block->getData()->header.dataSize);
+  gReadoutStats.counters.bytesReadout += block->getData()->header.dataSize;
+  gReadoutStats.counters.notify++;
+  return 0;
+}
+
+void ReadoutEquipment::flushOutputBatch()
+{
+  if (outputBatch.size()) {
+    if (rdhCheckers.size()) {
+      for (auto& b : outputBatch) {
+        dispatchToRdhChecker(b);
+      }
+      for (auto& checker : rdhCheckers) {
+        checker->idleWait->notify();
+      }
+    } else {
+      dataOut->pushBatch(outputBatch.data(), (int)outputBatch.size());
+    }
+    outputBatch.clear();
+  }
+}
+
+void ReadoutEquipment::dropPageWithError(DataBlockContainerReference& block, RdhCheckLogTokens& logTokens)
+{
+  unsigned long long nDropped = ++statsRdhCheckPagesDropped;
+  theLog.log(logTokens.pageDropped, "Equipment %s : page with RDH error has been discarded (total: %llu)", name.c_str(), nDropped);
+  block = nullptr;
+}
+
+void ReadoutEquipment::rdhCheckerLoop(RdhChecker& checker)
+{
+  setThreadName((name + "-rdh").c_str());
+  if (threadsNumaNode >= 0) {
+    numaBind(threadsNumaNode);
+  }
+  DataBlockContainerReference pages[outputBatchSize];
+  for (;;) {
+    int nPages = checker.input->popBatch(pages, outputBatchSize);
+    if (nPages == 0) {
+      // stop only when input is empty, so that all pages dispatched are checked
+      if (!rdhCheckersRunning) {
+        break;
+      }
+      checker.idleWait->wait();
+      continue;
+    }
+    checker.idleWait->setActive(nPages);
+
+    // check pages, and remove those to be dropped
+    int nOk = 0;
+    for (int i = 0; i < nPages; i++) {
+      if ((checkRdhPage(pages[i], checker.rdhScanner, checker.logTokens, false)) && cfgDropPagesWithError) {
+        dropPageWithError(pages[i], checker.logTokens);
+        continue;
+      }
+      if (nOk != i) {
+        pages[nOk] = std::move(pages[i]);
+      }
+      nOk++;
+    }
+
+    // push checked pages to output, waiting for space if needed (equipment thread keeps input small enough that this is rare)
+    int nPushed = 0;
+    for (;;) {
+      nPushed += checker.output->pushBatch(&pages[nPushed], nOk - nPushed);
+      if ((nPushed == nOk) || (!rdhCheckersRunning)) {
+        break;
+      }
+      notifyDataReady();
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    // pages not pushed at stop time are released
+    if (nPushed < nOk) {
+      statsRdhCheckPagesDiscarded += nOk - nPushed;
+    }
+    for (int i = nPushed; i < nOk; i++) {
+      pages[i] = nullptr;
+    }
+    notifyDataReady();
+  }
+}
+
+void ReadoutEquipment::stopRdhCheckers()
+{
+  rdhCheckersRunning = false;
+  for (auto& checker : rdhCheckers) {
+    if (checker->thread != nullptr) {
+      checker->idleWait->notify();
+      checker->thread->join();
+      checker->thread = nullptr;
+    }
+  }
+}
+
+int ReadoutEquipment::pushCheckedPages(DataBlockContainerReference* pages, int nPages)
+{
+  int nPushed = 0;
+  for (; nPushed < nPages; nPushed++) {
+    if (accountOutputBlock(pages[nPushed])) {
+      // TF rate limit reached
+      break;
+    }
+  }
+  dataOut->pushBatch(pages, nPushed);
+  equipmentStats[EquipmentStatsIndexes::nBlocksOut].increment(nPushed);
+  return nPushed;
+}
+
+int ReadoutEquipment::collectCheckedPages()
+{
+  // only this thread pushes to output fifo, free space checked is available
+  DataBlockContainerReference pages[outputBatchSize];
+  int nCollected = 0;
+
+  // pages set aside on TF rate limit go first
+  if (throttlePendingPages.size()) {
+    int nFree = dataOut->getNumberOfFreeSlots();
+    int nPages = (nFree < (int)throttlePendingPages.size()) ? nFree : (int)throttlePendingPages.size();
+    nCollected = pushCheckedPages(throttlePendingPages.data(), nPages);
+    throttlePendingPages.erase(throttlePendingPages.begin(), throttlePendingPages.begin() + nCollected);
+    if (throttlePendingPages.size()) {
+      return nCollected;
+    }
+  }
+
+  for (auto& checker : rdhCheckers) {
+    for (;;) {
+      int nFree = dataOut->getNumberOfFreeSlots();
+      if (nFree <= 0) {
+        return nCollected;
+      }
+      int nPages = checker->output->popBatch(pages, (nFree < outputBatchSize) ? nFree : outputBatchSize);
+      if (nPages == 0) {
+        break;
+      }
+      int nPushed = pushCheckedPages(pages, nPages);
+      nCollected += nPushed;
+      if (nPushed < nPages) {
+        // keep pages not pushed for later, in order
+        for (int i = nPushed; i < nPages; i++) {
+          throttlePendingPages.push_back(std::move(pages[i]));
+        }
+        return nCollected;
+      }
+    }
+  }
+  return nCollected;
+}
+
+int ReadoutEquipment::getRdhCheckersFreeSlots()
+{
+  // pages may go to any checker, depending on link, so the minimum is taken
+  int nFree = -1;
+  for (auto& checker : rdhCheckers) {
+    int n = checker->input->getNumberOfFreeSlots();
+    if ((nFree < 0) || (n < nFree)) {
+      nFree = n;
+    }
+  }
+  return (nFree > 0) ? nFree : 0;
+}
+
+void ReadoutEquipment::dispatchToRdhChecker(DataBlockContainerReference& block)
+{
+  // same link always goes to same checker, to keep pages order per link
+  unsigned int linkId = block->getData()->header.linkId;
+  rdhCheckers[linkId % rdhCheckers.size()]->input->pushBatch(&block, 1);
+}
+
+void ReadoutEquipment::notifyDataReady()
+{
+  if (idleWait != nullptr) {
+    idleWait->notify();
+  }
+}
+
+void ReadoutEquipment::setIdleWaitLimit(double seconds)
+{
+  if (idleWait != nullptr) {
+    idleWait->setWaitLimit(seconds);
+  }
+}
+
 void ReadoutEquipment::setDataOn() { isDataOn = true; }
 
 void ReadoutEquipment::setDataOff() { isDataOn = false; }
@@ -640,6 +949,7 @@ void ReadoutEquipment::initCounters()
   statsRdhCheckErr = 0;
   statsRdhCheckStreamErr = 0;
   statsRdhCheckPagesDropped = 0;
+  statsRdhCheckPagesDiscarded = 0;
 
   statsNumberOfTimeframes = 0;
 
@@ -671,31 +981,35 @@ void ReadoutEquipment::initCounters()
 void ReadoutEquipment::finalCounters()
 {
   if (cfgRdhCheckEnabled) {
-    theLog.log(LogInfoDevel_(3003), "Equipment %s : %llu timeframes, RDH checks %llu ok, %llu errors, %llu stream inconsistencies, %llu pages with error dropped",
-      name.c_str(), statsNumberOfTimeframes, statsRdhCheckOk, statsRdhCheckErr, statsRdhCheckStreamErr, statsRdhCheckPagesDropped);
+    theLog.log(LogInfoDevel_(3003), "Equipment %s : %llu timeframes, RDH checks %llu ok, %llu errors, %llu stream inconsistencies, %llu pages with error dropped, %llu checked pages discarded at stop",
+      name.c_str(), statsNumberOfTimeframes, statsRdhCheckOk.load(), statsRdhCheckErr.load(), statsRdhCheckStreamErr.load(), statsRdhCheckPagesDropped.load(), statsRdhCheckPagesDiscarded.load());
   }
 };
 
 uint64_t ReadoutEquipment::getTimeframeFromOrbit(uint32_t hbOrbit)
 {
-  if (!isDefinedFirstTimeframeHbOrbitBegin) {
-    firstTimeframeHbOrbitBegin = hbOrbit;
-    firstTimeframeTimestamp.reset();
-    isDefinedFirstTimeframeHbOrbitBegin = 1;
-    bool isOk = true;
-    gReadoutStats.mutex.lock();
-    if (gReadoutStats.counters.firstOrbit == undefinedOrbit) {
-      gReadoutStats.counters.firstOrbit = firstTimeframeHbOrbitBegin;
-      gReadoutStats.counters.notify++;
-    } else if (gReadoutStats.counters.firstOrbit != firstTimeframeHbOrbitBegin) {
-      isOk = false;
-    }
-    gReadoutStats.mutex.unlock();
-    theLog.log(LogInfoDevel_(3011), "Equipment %s : first HB orbit = %X", name.c_str(), (unsigned int)firstTimeframeHbOrbitBegin);
-    if (!isOk) {
-      if (cfgRdhCheckFirstOrbit) {
-        theLog.log(LogErrorOps_(3241), "Equipment %s : first HB orbit is different from other equipments", name.c_str());
-        isFatalError++;
+  // this may be called from another thread than the equipment thread (e.g. player prefetch): first orbit is defined once, under lock
+  if (!isDefinedFirstTimeframeHbOrbitBegin.load(std::memory_order_acquire)) {
+    std::unique_lock<std::mutex> lock(firstTimeframeMutex);
+    if (!isDefinedFirstTimeframeHbOrbitBegin.load(std::memory_order_relaxed)) {
+      firstTimeframeHbOrbitBegin = hbOrbit;
+      firstTimeframeTimestamp.reset();
+      isDefinedFirstTimeframeHbOrbitBegin.store(true, std::memory_order_release);
+      bool isOk = true;
+      gReadoutStats.mutex.lock();
+      if (gReadoutStats.counters.firstOrbit == undefinedOrbit) {
+        gReadoutStats.counters.firstOrbit = firstTimeframeHbOrbitBegin;
+        gReadoutStats.counters.notify++;
+      } else if (gReadoutStats.counters.firstOrbit != firstTimeframeHbOrbitBegin) {
+        isOk = false;
+      }
+      gReadoutStats.mutex.unlock();
+      theLog.log(LogInfoDevel_(3011), "Equipment %s : first HB orbit = %X", name.c_str(), (unsigned int)firstTimeframeHbOrbitBegin);
+      if (!isOk) {
+        if (cfgRdhCheckFirstOrbit) {
+          theLog.log(LogErrorOps_(3241), "Equipment %s : first HB orbit is different from other equipments", name.c_str());
+          isFatalError++;
+        }
       }
     }
   }
@@ -731,8 +1045,10 @@ int ReadoutEquipment::tagDatablockFromRdh(RdhHandle& h, DataBlockHeader& bh)
   static InfoLogger::AutoMuteToken logRdhErrorsToken(LogWarningSupport_(3004), 30, 5);
 
   // check that it is a correct RDH
-  std::string errorDescription;
-  if (h.validateRdh(errorDescription) != 0) {
+  uint32_t rdhErrors = h.getErrors();
+  if (rdhErrors) {
+    std::string errorDescription;
+    h.validateRdh(errorDescription);
     theLog.log(logRdhErrorsToken, "First RDH in page is wrong (link %s): %s", (bh.linkId == undefinedLinkId) ? "undefined" : std::to_string((int)bh.linkId).c_str(), errorDescription.c_str());
     isError = 1;
   } else {
@@ -788,69 +1104,6 @@ int ReadoutEquipment::processRdh(DataBlockContainerReference& block)
     return -1;
   }
 
-  // function to detect changes in detector bits field
-  auto checkChangesInDetectorField = [&] (RdhHandle &h, int pageOffset) {
-    int hasChanged = 0;
-    uint8_t lid = h.getLinkId();
-    if (lid>RdhMaxLinkId) {return -1;}
-    if (cfgRdhCheckDetectorField) {
-      if (isDefinedLastDetectorField[lid]) {
-	if (h.getDetectorField() != lastDetectorField[lid]) {
-          if (cfgVerbose) {
-	    theLog.log(LogInfoDevel_(3011), "Equipment %s Link %d: change in detector field detected: 0x%X -> 0x%X (orbit 0x%X page offset 0x%X)",
-	      name.c_str(), (int)lid, (int)lastDetectorField[lid], (int)h.getDetectorField(), (int)h.getHbOrbit(), (int)pageOffset);
-	  }
-	  hasChanged = 1;
-
-	  if (cfgCtpMode) {
-	    // check how many bits have changed
-	    try {
-	      auto bitsChanged = std::bitset<sizeof(uint32_t)>(h.getDetectorField() ^ lastDetectorField[lid]);
-	      uint32_t nChanged = bitsChanged.count();
-	      if (nChanged == 1) {
-	        int bitChanged = bitsChanged.size();
-		#ifdef __linux__
-	          bitChanged = bitsChanged._Find_first();
-		#else
-		  for(int bitix = 0; bitix < (int)bitsChanged.size(); bitix++) {
-                    if (bitsChanged[bitix]) {
-                      bitChanged = bitix;
-		      break;
-		    }
-                  }
-		#endif
-		bool isSet = std::bitset<sizeof(uint32_t)>(h.getDetectorField()).test(bitChanged);
-
-		//theLog.log(LogInfoDevel_(3011), "bitChanged=%d isSet=%d ctpRunBit=%d discardData=%d", (int)bitChanged, (int)isSet, (int)ctpRunBit, (int)discardData);
-
-		if ((ctpRunBit == -1) && (isSet) && (discardData == 1)) {
-		  // start of run detected
-		  ctpRunBit = bitChanged;
-		  discardData = 0;
-		  theLog.log(LogInfoDevel_(3011), "Start of run detected (pattern 0x%X bit %d), enabling data", (int)h.getDetectorField(), (int)bitChanged);
-		} else if ((ctpRunBit != -1) && (!isSet) && (ctpRunBit == bitChanged)) {
-                  // end of run detected
-                  ctpRunBit = -1;
-		  discardData = 2; // no data on next other run
-                  theLog.log(LogInfoDevel_(3011), "End of run detected (pattern 0x%X bit %d), disabling data", (int)h.getDetectorField(), (int)bitChanged);
-		}
-	      }
-	    }
-	    catch(...) {
-	    }
-	  }
-	}
-      } else {
-        if (cfgVerbose) {
-	  theLog.log(LogInfoDevel_(3011), "Equipment %s link %d: first detector field : 0x%X", name.c_str(), (int)lid, (int)h.getDetectorField());
-	}
-      }
-      lastDetectorField[lid] = h.getDetectorField();
-      isDefinedLastDetectorField[lid] = 1;
-    }
-    return hasChanged;
-  };
-
   // retrieve metadata from RDH, if configured to do so
   if ((cfgRdhUseFirstInPageEnabled) || (cfgRdhCheckEnabled)) {
     RdhHandle h(blockData);
@@ -930,157 +1183,254 @@ int ReadoutEquipment::processRdh(DataBlockContainerReference& block)
   }
 
   // validate RDH structure, if configured to do so
-  if (cfgRdhCheckEnabled) {
-    std::string errorDescription;
-    size_t blockSize = blockHeader.dataSize;
-    uint8_t* baseAddress = (uint8_t*)(blockData);
-    int rdhIndexInPage = 0;
-    int linkId = undefinedLinkId;
+  // when done by checker threads, it is called later, after the page left the equipment thread
+  if ((cfgRdhCheckEnabled) && (!cfgRdhCheckThreads)) {
+    isPageError = checkRdhPage(block, rdhScanner, rdhCheckLogTokens, true);
+  }
+
+  return isPageError;
+}
 
-    static InfoLogger::AutoMuteToken logRdhErrorsToken(LogWarningSupport_(3004), 30, 5);
+// detect changes in detector bits field
+int ReadoutEquipment::checkChangesInDetectorField(RdhHandle& h, int pageOffset)
+{
+  int hasChanged = 0;
+  uint8_t lid = h.getLinkId();
+  if (lid>RdhMaxLinkId) {return -1;}
+  if (cfgRdhCheckDetectorField) {
+    if (isDefinedLastDetectorField[lid]) {
+      if (h.getDetectorField() != lastDetectorField[lid]) {
+        if (cfgVerbose) {
+          theLog.log(LogInfoDevel_(3011), "Equipment %s Link %d: change in detector field detected: 0x%X -> 0x%X (orbit 0x%X page offset 0x%X)",
+            name.c_str(), (int)lid, (int)lastDetectorField[lid], (int)h.getDetectorField(), (int)h.getHbOrbit(), (int)pageOffset);
+        }
+        hasChanged = 1;
+
+        if (cfgCtpMode) {
+          // check how many bits have changed
+          try {
+            auto bitsChanged = std::bitset<sizeof(uint32_t)>(h.getDetectorField() ^ lastDetectorField[lid]);
+            uint32_t nChanged = bitsChanged.count();
+            if (nChanged == 1) {
+              int bitChanged = bitsChanged.size();
+              #ifdef __linux__
+                bitChanged = bitsChanged._Find_first();
+              #else
+                for(int bitix = 0; bitix < (int)bitsChanged.size(); bitix++) {
+                  if (bitsChanged[bitix]) {
+                    bitChanged = bitix;
+                    break;
+                  }
+                }
+              #endif
+              bool isSet = std::bitset<sizeof(uint32_t)>(h.getDetectorField()).test(bitChanged);
+
+              //theLog.log(LogInfoDevel_(3011), "bitChanged=%d isSet=%d ctpRunBit=%d discardData=%d", (int)bitChanged, (int)isSet, (int)ctpRunBit, (int)discardData);
+
+              if ((ctpRunBit == -1) && (isSet) && (discardData == 1)) {
+                // start of run detected
+                ctpRunBit = bitChanged;
+                discardData = 0;
+                theLog.log(LogInfoDevel_(3011), "Start of run detected (pattern 0x%X bit %d), enabling data", (int)h.getDetectorField(), (int)bitChanged);
+              } else if ((ctpRunBit != -1) && (!isSet) && (ctpRunBit == bitChanged)) {
+                // end of run detected
+                ctpRunBit = -1;
+                discardData = 2; // no data on next other run
+                theLog.log(LogInfoDevel_(3011), "End of run detected (pattern 0x%X bit %d), disabling data", (int)h.getDetectorField(), (int)bitChanged);
+              }
+            }
+          }
+          catch(...) {
+          }
+        }
+      }
+    } else {
+      if (cfgVerbose) {
+        theLog.log(LogInfoDevel_(3011), "Equipment %s link %d: first detector field : 0x%X", name.c_str(), (int)lid, (int)h.getDetectorField());
+      }
+    }
+    lastDetectorField[lid] = h.getDetectorField();
+    isDefinedLastDetectorField[lid] = 1;
+  }
+  return hasChanged;
+}
 
-    for (size_t pageOffset = 0; pageOffset < blockSize;) {
-      RdhHandle h(baseAddress + pageOffset);
-      rdhIndexInPage++;
+// check all RDHs of a page
+int ReadoutEquipment::checkRdhPage(DataBlockContainerReference& block, RdhScanner& scanner, RdhCheckLogTokens& logTokens, bool isSerial)
+{
+  bool isPageError = 0; // flag set when some errors found
 
-      // printf("RDH %d @ 0x%X : next block @ +%d bytes\n",rdhIndexInPage,(unsigned int)pageOffset,h.getOffsetNextPacket());
+  DataBlockHeader& blockHeader = block->getData()->header;
+  void* blockData = block->getData()->data;
+  if (blockData == nullptr) {
+    return -1;
+  }
 
-      if (h.validateRdh(errorDescription)) {
-        if ((cfgRdhDumpEnabled) || (cfgRdhDumpErrorEnabled)) {
-          for (int i = 0; i < 16; i++) {
-            printf("%08X ", (int)(((uint32_t*)baseAddress)[i]));
-          }
-          printf("\n");
-          printf("Page 0x%p + %ld\n%s\n", (void*)baseAddress, pageOffset, errorDescription.c_str());
-          h.dumpRdh(pageOffset, 1);
+  size_t blockSize = blockHeader.dataSize;
+  uint8_t* baseAddress = (uint8_t*)(blockData);
+  int rdhIndexInPage = 0;
+  int linkId = undefinedLinkId;
+
+  InfoLogger::AutoMuteToken& logRdhErrorsToken = logTokens.rdhErrors;
+  unsigned long long nRdhOk = 0; // shared counter updated once per page
+
+  scanner.scan(baseAddress, blockSize);
+  for (const RdhDescriptor& d : scanner) {
+    size_t pageOffset = d.offset;
+    RdhHandle h(baseAddress + pageOffset);
+    rdhIndexInPage++;
+
+    // printf("RDH %d @ 0x%X : next block @ +%d bytes\n",rdhIndexInPage,(unsigned int)pageOffset,h.getOffsetNextPacket());
+
+    uint32_t rdhErrors = scanner.getErrors() ? d.getErrors() : 0; // RDHs checked one by one only if errors in page
+    if (rdhErrors) {
+      // error message built only when needed
+      std::string errorDescription;
+      d.getErrorsDescription(rdhErrors, errorDescription);
+      if ((cfgRdhDumpEnabled) || (cfgRdhDumpErrorEnabled)) {
+        for (int i = 0; i < 16; i++) {
+          printf("%08X ", (int)(((uint32_t*)baseAddress)[i]));
         }
-        statsRdhCheckErr++;
-	isPageError = 1;
-        theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : invalid RDH: %s", id, rdhIndexInPage, (unsigned int)pageOffset, errorDescription.c_str());
-        // stop on first RDH error (should distinguich valid/invalid block length)
-	errorDescription.clear();
-        break;
-      } else {
-        statsRdhCheckOk++;
+        printf("\n");
+        printf("Page 0x%p + %ld\n%s\n", (void*)baseAddress, pageOffset, errorDescription.c_str());
+        h.dumpRdh(pageOffset, 1);
+      }
+      statsRdhCheckErr++;
+      isPageError = 1;
+      theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : invalid RDH: %s", id, rdhIndexInPage, (unsigned int)pageOffset, errorDescription.c_str());
+      // stop on first RDH error (should distinguich valid/invalid block length)
+      break;
+    } else {
+      nRdhOk++;
 
-        if (cfgRdhDumpEnabled) {
-          h.dumpRdh(pageOffset, 1);
-          for (int i = 0; i < 16; i++) {
-            printf("%08X ", (int)(((uint32_t*)baseAddress + pageOffset)[i]));
-          }
-          printf("\n");
+      if (cfgRdhDumpEnabled) {
+        h.dumpRdh(pageOffset, 1);
+        for (int i = 0; i < 16; i++) {
+          printf("%08X ", (int)(((uint32_t*)baseAddress + pageOffset)[i]));
         }
+        printf("\n");
       }
+    }
 
-      // linkId should be same everywhere in page
-      if (pageOffset == 0) {
-        linkId = h.getLinkId(); // keep link of 1st RDH
+    // linkId should be same everywhere in page
+    if (pageOffset == 0) {
+      linkId = d.linkId; // keep link of 1st RDH
+    }
+    if (linkId != d.linkId) {
+      if (cfgRdhDumpWarningEnabled) {
+        theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : inconsistent link ids: %d != %d", id, rdhIndexInPage, (unsigned int)pageOffset, linkId, (int)d.linkId);
+        isPageError = 1;
       }
-      if (linkId != h.getLinkId()) {
-        if (cfgRdhDumpWarningEnabled) {
-          theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : inconsistent link ids: %d != %d", id, rdhIndexInPage, (unsigned int)pageOffset, linkId, h.getLinkId());
+      statsRdhCheckStreamErr++;
+      break; // stop checking this page
+    }
+
+    // check no timeframe overlap in page
+    if (!cfgDisableTimeframes) {
+      if (((blockHeader.timeframeOrbitFirst < blockHeader.timeframeOrbitLast) && ((d.triggerOrbit < blockHeader.timeframeOrbitFirst) || (d.triggerOrbit > blockHeader.timeframeOrbitLast))) || ((blockHeader.timeframeOrbitFirst > blockHeader.timeframeOrbitLast) && ((d.triggerOrbit < blockHeader.timeframeOrbitFirst) && (d.triggerOrbit > blockHeader.timeframeOrbitLast)))) {
+        if (cfgRdhDumpErrorEnabled) {
+          theLog.log(logRdhErrorsToken, "Equipment %d Link %d RDH %d @ 0x%X : TimeFrame ID change in page not allowed : orbit 0x%08X not in range [0x%08X,0x%08X]", id, (int)blockHeader.linkId, rdhIndexInPage, (unsigned int)pageOffset, (int)d.triggerOrbit, (int)blockHeader.timeframeOrbitFirst, (int)blockHeader.timeframeOrbitLast);
           isPageError = 1;
         }
         statsRdhCheckStreamErr++;
         break; // stop checking this page
       }
+    }
 
-      // check no timeframe overlap in page
-      if (!cfgDisableTimeframes) {
-	if (((blockHeader.timeframeOrbitFirst < blockHeader.timeframeOrbitLast) && ((h.getTriggerOrbit() < blockHeader.timeframeOrbitFirst) || (h.getTriggerOrbit() > blockHeader.timeframeOrbitLast))) || ((blockHeader.timeframeOrbitFirst > blockHeader.timeframeOrbitLast) && ((h.getTriggerOrbit() < blockHeader.timeframeOrbitFirst) && (h.getTriggerOrbit() > blockHeader.timeframeOrbitLast)))) {
-          if (cfgRdhDumpErrorEnabled) {
-            theLog.log(logRdhErrorsToken, "Equipment %d Link %d RDH %d @ 0x%X : TimeFrame ID change in page not allowed : orbit 0x%08X not in range [0x%08X,0x%08X]", id, (int)blockHeader.linkId, rdhIndexInPage, (unsigned int)pageOffset, (int)h.getTriggerOrbit(), (int)blockHeader.timeframeOrbitFirst, (int)blockHeader.timeframeOrbitLast);
-            isPageError = 1;
-          }
-          statsRdhCheckStreamErr++;
-          break; // stop checking this page
-	}
+    // detector field should not change within page
+    // when not called in sequence, the link history is not available: compare to first RDH of page
+    if (pageOffset) {
+      bool hasChanged = 0;
+      if (isSerial) {
+        hasChanged = isDefinedLastDetectorField[linkId] && checkChangesInDetectorField(h, pageOffset);
+      } else {
+        hasChanged = cfgRdhCheckDetectorField && (d.detectorField != scanner[0].detectorField);
       }
-      
-      if ((isDefinedLastDetectorField[linkId])&&(pageOffset)) {
-        if (checkChangesInDetectorField(h, pageOffset)) {
-	   if (cfgRdhDumpWarningEnabled) {
-             theLog.log(logRdhErrorsToken, "Equipment %d Link %d RDH %d @ 0x%X : detector field changed not at page beginning", id, (int)blockHeader.linkId, rdhIndexInPage, (unsigned int)pageOffset);
+      if (hasChanged) {
+         if (cfgRdhDumpWarningEnabled) {
+           theLog.log(logRdhErrorsToken, "Equipment %d Link %d RDH %d @ 0x%X : detector field changed not at page beginning", id, (int)blockHeader.linkId, rdhIndexInPage, (unsigned int)pageOffset);
+          isPageError = 1;
+        }
+        statsRdhCheckStreamErr++;
+        break; // stop checking this page
+      }
+    }
+
+    // check trigger counters
+    if (cfgRdhCheckTrigger) {
+      o2::Header::RDHTriggerType tt;
+      tt.word0 = d.triggerType;
+      if (tt.TF) {
+        // TF boundary should be aligned with TF length
+        if (d.hbOrbit % timeframePeriodOrbits) {
+          if (cfgRdhDumpErrorEnabled) {
+            theLog.log(logRdhErrorsToken, "Equipment %d Link %d RDH %d @ 0x%X : TriggerType TF bit set, but orbit 0x%08X not aligned with TF period = %d", id, (int)blockHeader.linkId, rdhIndexInPage, (unsigned int)pageOffset, (int)d.triggerOrbit, (int)timeframePeriodOrbits);
             isPageError = 1;
           }
           statsRdhCheckStreamErr++;
           break; // stop checking this page
-	}
-      }
-
-      // check trigger counters
-      if (cfgRdhCheckTrigger) {
-        if (h.getTriggerTypeStruct().TF) {
-          // TF boundary should be aligned with TF length
-          if (h.getHbOrbit() % timeframePeriodOrbits) {
-            if (cfgRdhDumpErrorEnabled) {
-              theLog.log(logRdhErrorsToken, "Equipment %d Link %d RDH %d @ 0x%X : TriggerType TF bit set, but orbit 0x%08X not aligned with TF period = %d", id, (int)blockHeader.linkId, rdhIndexInPage, (unsigned int)pageOffset, (int)h.getTriggerOrbit(), (int)timeframePeriodOrbits);
-              isPageError = 1;
-            }
-            statsRdhCheckStreamErr++;
-            break; // stop checking this page
-          }
         }
       }
+    }
 
-      /*
-      // check packetCounter is contiguous
-      if (cfgRdhCheckPacketCounterContiguous) {
-        uint8_t newCount = h.getPacketCounter();
-        // no boundary check necessary to verify linkId<=RdhMaxLinkId, this was done in validateRDH()
-        if (newCount != RdhLastPacketCounter[linkId]) {
-          if (newCount !=
-              (uint8_t)(RdhLastPacketCounter[linkId] + (uint8_t)1)) {
-            theLog.log(LogDebugTrace,
-                       "RDH %d @ 0x%X : possible packets dropped for link %d, packetCounter jump from %d to %d",
-                       rdhIndexInPage, (unsigned int)pageOffset,
-                       (int)linkId, (int)RdhLastPacketCounter[linkId],
-                       (int)newCount);
-          }
-          RdhLastPacketCounter[linkId] = newCount;
+    /*
+    // check packetCounter is contiguous
+    if (cfgRdhCheckPacketCounterContiguous) {
+      uint8_t newCount = h.getPacketCounter();
+      // no boundary check necessary to verify linkId<=RdhMaxLinkId, this was done in validateRDH()
+      if (newCount != RdhLastPacketCounter[linkId]) {
+        if (newCount !=
+            (uint8_t)(RdhLastPacketCounter[linkId] + (uint8_t)1)) {
+          theLog.log(LogDebugTrace,
+                     "RDH %d @ 0x%X : possible packets dropped for link %d, packetCounter jump from %d to %d",
+                     rdhIndexInPage, (unsigned int)pageOffset,
+                     (int)linkId, (int)RdhLastPacketCounter[linkId],
+                     (int)newCount);
         }
+        RdhLastPacketCounter[linkId] = newCount;
       }
-      */
+    }
+    */
 
-      // todo: check counter increasing all have same TF id
+    // todo: check counter increasing all have same TF id
 
-      uint16_t offsetNextPacket = h.getOffsetNextPacket();
-      if (offsetNextPacket == 0) {
+    uint16_t offsetNextPacket = d.offsetNextPacket;
+    if (offsetNextPacket == 0) {
 
-        // provision for further checks on superpage size
-        /*
-        theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : offsetNextPacket is null", id, rdhIndexInPage, (unsigned int)pageOffset);
-        statsRdhCheckErr++;
-        isPageError = 1;
-        break;
-      }
-      if ((pageOffset + h.getMemorySize() == blockSize)&&(pageOffset + offsetNextPacket == blockSize)) {
-        // this is normal end of page: the last packet fills the end of the page
-        theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : end packet size ok: offsetNextpacket = %d bytes, memorySize = %d bytes, page = %d bytes", id, rdhIndexInPage, (unsigned int)pageOffset, (int)offsetNextPacket, (int)h.getMemorySize(),  (int)blockSize);
-        break;
-      }
-      if ((pageOffset + offsetNextPacket == blockSize)||(pageOffset + h.getMemorySize() == blockSize)) {
-        theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : end packet size mismatch: offsetNextpacket = %d bytes, memorySize = %d bytes, page = %d bytes", id, rdhIndexInPage, (unsigned int)pageOffset, (int)offsetNextPacket, (int)h.getMemorySize(),  (int)blockSize);
-        // this is normal end of page: the last packet fills the end of the page
-        break;
-      }
-      if (pageOffset + offsetNextPacket > blockSize) {
-        theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : next packet (+ %d bytes) is outside of page (%d bytes)", id, rdhIndexInPage, (unsigned int)pageOffset, (int)offsetNextPacket, (int)blockSize);
-        statsRdhCheckErr++;
-        isPageError = 1;
-        */
+      // provision for further checks on superpage size
+      /*
+      theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : offsetNextPacket is null", id, rdhIndexInPage, (unsigned int)pageOffset);
+      statsRdhCheckErr++;
+      isPageError = 1;
+      break;
+    }
+    if ((pageOffset + h.getMemorySize() == blockSize)&&(pageOffset + offsetNextPacket == blockSize)) {
+      // this is normal end of page: the last packet fills the end of the page
+      theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : end packet size ok: offsetNextpacket = %d bytes, memorySize = %d bytes, page = %d bytes", id, rdhIndexInPage, (unsigned int)pageOffset, (int)offsetNextPacket, (int)h.getMemorySize(),  (int)blockSize);
+      break;
+    }
+    if ((pageOffset + offsetNextPacket == blockSize)||(pageOffset + h.getMemorySize() == blockSize)) {
+      theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : end packet size mismatch: offsetNextpacket = %d bytes, memorySize = %d bytes, page = %d bytes", id, rdhIndexInPage, (unsigned int)pageOffset, (int)offsetNextPacket, (int)h.getMemorySize(),  (int)blockSize);
+      // this is normal end of page: the last packet fills the end of the page
+      break;
+    }
+    if (pageOffset + offsetNextPacket > blockSize) {
+      theLog.log(logRdhErrorsToken, "Equipment %d RDH %d @ 0x%X : next packet (+ %d bytes) is outside of page (%d bytes)", id, rdhIndexInPage, (unsigned int)pageOffset, (int)offsetNextPacket, (int)blockSize);
+      statsRdhCheckErr++;
+      isPageError = 1;
+      */
 
-        break;
-      }
-      pageOffset += offsetNextPacket;
+      break;
     }
   }
-  
+
+  statsRdhCheckOk += nRdhOk;
+
   if (isPageError) {
-    if (saveErrorPagesCount < cfgSaveErrorPagesMax) {
-      saveErrorPagesCount++;
+    int saveErrorPagesIndex = ++saveErrorPagesCount;
+    if (saveErrorPagesIndex <= cfgSaveErrorPagesMax) {
       char fn[256];
-      snprintf(fn, 256, "%s/readout-t%d-eq%d-superpage.%d.raw", cfgSaveErrorPagesPath.c_str(), (int)time(NULL), (int)id, (int)saveErrorPagesCount);
+      snprintf(fn, 256, "%s/readout-t%d-eq%d-superpage.%d.raw", cfgSaveErrorPagesPath.c_str(), (int)time(NULL), (int)id, saveErrorPagesIndex);
       theLog.log(LogInfoSupport, "Equipment %d : saving superpage %p with errors to disk : %s (%d bytes)", id, blockData, fn, blockHeader.dataSize);
       FILE *fp;
       bool success = 0;
@@ -1096,7 +1446,7 @@ int ReadoutEquipment::processRdh(DataBlockContainerReference& block)
       }
     }
   }
-  
+
   return isPageError;
 }
 
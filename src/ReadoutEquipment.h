@@ -13,9 +13,13 @@
 #include <Common/Fifo.h>
 #include <Common/Thread.h>
 #include <Common/Timer.h>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <bitset>
+#include <thread>
 
+#include "AdaptiveIdle.h"
 #include "CounterStats.h"
 #include "DataBlock.h"
 #include "DataBlockContainer.h"
@@ -24,6 +28,8 @@
 #include "MemoryHandler.h"
 #include "RdhUtils.h"
 #include "RateRegulator.h"
+#include "ReadoutFifo.h"
+#include "readoutInfoLogger.h"
 
 using namespace AliceO2::Common;
 
@@ -55,7 +61,7 @@ class ReadoutEquipment
 
   // protected:
   // todo: give direct access to output FIFO?
-  std::shared_ptr<AliceO2::Common::Fifo<DataBlockContainerReference>> dataOut;
+  std::shared_ptr<ReadoutFifo<DataBlockContainerReference>> dataOut;
 
   // get current memory pool usage (available and total)
   int getMemoryUsage(size_t& numberOfPagesAvailable, size_t& numberOfPagesInPool);
@@ -150,12 +156,26 @@ class ReadoutEquipment
   int debugFirstPages = 0; // print debug info on first number of pages read
 
   int cfgIdleSleepTime; // the idle sleep time for the equipment thread
+  int cfgIdleMode = 0;  // 0: fixed idle sleep time, 1: adaptive (see AdaptiveIdle)
+
+  // wake up the equipment thread, if waiting idle. Can be called from any thread, e.g. when new data is ready.
+  void notifyDataReady();
+
+  // limit next idle wait of the equipment thread, e.g. when the time of next data is known (delay in seconds). To be called from equipment thread.
+  void setIdleWaitLimit(double seconds);
 
  private:
+  std::unique_ptr<AdaptiveIdle> idleWait; // adaptive idle wait of equipment thread, if enabled
+  int threadsNumaNode = -1;               // NUMA node to bind equipment threads to, when the memory pool was taken from a bank split on NUMA nodes
+  bool readoutThreadNumaBound = false;    // set once the readout thread is bound to threadsNumaNode
+  static const int outputBatchSize = 64;   // maximum number of blocks pushed at once to output fifo
+  std::vector<DataBlockContainerReference> outputBatch; // blocks pending push to output fifo
+  void flushOutputBatch();                                // push pending blocks to output fifo
   int tagDatablockFromRdh(RdhHandle& RDH, DataBlockHeader& h);
   unsigned long long statsNumberOfTimeframes = 0; // number of timeframes read out
   uint32_t firstTimeframeHbOrbitBegin = 0;        // HbOrbit of beginning of first timeframe
-  bool isDefinedFirstTimeframeHbOrbitBegin = 0;
+  std::atomic<bool> isDefinedFirstTimeframeHbOrbitBegin = 0; // set once first orbit defined, fields above are then constant until next start
+  std::mutex firstTimeframeMutex;                            // to define first orbit once, getTimeframeFromOrbit() may be called from other threads
   AliceO2::Common::Timer firstTimeframeTimestamp; // timestamp of first timeframe/orbit received, for consistency checks
 
   AliceO2::Common::Timer timeframeClock; // timeframe id should be increased at each clock cycle
@@ -184,6 +204,8 @@ class ReadoutEquipment
   int cfgDisableTimeframes = 0;        // When set, all TF features disabled
   RateRegulator TFregulator;           // clock counter for TF rate checks
   DataBlockContainerReference throttlePendingBlock; // in case TF rate limit was reached, a block may be set aside for later (when it belongs to next TF)
+  std::vector<DataBlockContainerReference> throttlePendingPages; // same, for checked pages collected from the RDH checkers
+  int accountOutputBlock(DataBlockContainerReference& block); // check TF id and update output stats of a block going out. Returns -1 if TF rate limit reached (block not accounted), 0 otherwise.
   int cfgAutoTimeframeId = 0; // when set, TFids are generated incrementally instead of taken from RDH BC.
   uint64_t autoTimeframeIdLatestFromBC = undefinedTimeframeId; // latest TFid (computed from BC)
   uint64_t autoTimeframeIdCounter = 0; // TFid counter for sequence
@@ -200,11 +222,46 @@ class ReadoutEquipment
   int cfgVerbose = 0; // extra debug info printed
 
   int processRdh(DataBlockContainerReference& nextBlock);
+  RdhScanner rdhScanner; // to walk the RDHs of a page
+  int checkChangesInDetectorField(RdhHandle& h, int pageOffset); // detect changes in detector field, returns 1 if changed
+
+  // check all RDHs of a page. Returns 1 if errors found, 0 otherwise.
+  // isSerial: set when called from equipment thread, in order of the pages received. Otherwise, checks depending on previous pages are not done.
+  // log tokens of RDH checks, one set for each thread doing checks (AutoMuteToken is not thread-safe)
+  struct RdhCheckLogTokens {
+    InfoLogger::AutoMuteToken rdhErrors{LogWarningSupport_(3004), 30, 5};
+    InfoLogger::AutoMuteToken pageDropped{LogWarningSupport_(3235), 10, 60};
+  };
+  RdhCheckLogTokens rdhCheckLogTokens; // tokens for checks done in equipment thread
+  int checkRdhPage(DataBlockContainerReference& block, RdhScanner& scanner, RdhCheckLogTokens& logTokens, bool isSerial);
+
+  // parallel RDH checks
+  // pages are dispatched to checker threads by link id, so that pages from a given link stay in order
+  // only the equipment thread pushes to dataOut: checked pages are collected from the checker threads output fifos
+  int cfgRdhCheckThreads = 0; // number of threads for RDH checks (0: checks done in equipment thread)
+  struct RdhChecker {
+    std::unique_ptr<ReadoutFifo<DataBlockContainerReference>> input;  // pages to be checked
+    std::unique_ptr<ReadoutFifo<DataBlockContainerReference>> output; // pages checked
+    std::unique_ptr<AdaptiveIdle> idleWait;                           // wait for new pages
+    std::unique_ptr<std::thread> thread;
+    RdhScanner rdhScanner;
+    RdhCheckLogTokens logTokens;
+  };
+  std::vector<std::unique_ptr<RdhChecker>> rdhCheckers;
+  std::atomic<bool> rdhCheckersRunning = false;               // flag to stop checker threads
+  void rdhCheckerLoop(RdhChecker& checker);                   // checker thread main loop
+  int collectCheckedPages();                                  // move checked pages to output fifo. Returns number of pages moved.
+  int pushCheckedPages(DataBlockContainerReference* pages, int nPages); // account and push checked pages to output fifo, until TF rate limit. Returns number of pages pushed.
+  double cfgFlushEquipmentTimeout = 1;                        // time to wait at stop for checked pages to go to output fifo
+  int getRdhCheckersFreeSlots();                              // number of pages which can be dispatched to checkers for sure
+  void dispatchToRdhChecker(DataBlockContainerReference& block); // give page to checker (checked for space with getRdhCheckersFreeSlots())
+  void stopRdhCheckers();                                     // stop checker threads, once their input is empty
+  void dropPageWithError(DataBlockContainerReference& block, RdhCheckLogTokens& logTokens); // release a page with RDH error (dropPagesWithError)
 
   // data debugging to disk
   int cfgSaveErrorPagesMax; // maximum number of pages to write to disk for debugging, in case of data error
   std::string cfgSaveErrorPagesPath; // path to write data pages
-  int saveErrorPagesCount; // counter for number of pages dumped so far
+  std::atomic<int> saveErrorPagesCount; // counter for number of pages dumped so far
   std::string cfgDataPagesLogPath; // path to write to disk a summary for each data page received
   FILE *fpDataPagesLog = nullptr; // handle to data page log file
   int cfgDropPagesWithError = 0; // if set, pages with RDH errors are dropped by readout
@@ -216,14 +273,17 @@ class ReadoutEquipment
   uint64_t getCurrentTimeframe();
 
   uint32_t getTimeframePeriodOrbits() { return timeframePeriodOrbits; }
+  unsigned int getLHCOrbitRate() { return LHCOrbitRate; }
 
   // compute range of orbits for given timeframe
   void getTimeframeOrbitRange(uint64_t tfId, uint32_t& hbOrbitMin, uint32_t& hbOrbitMax);
 
-  unsigned long long statsRdhCheckOk = 0;        // number of RDH structs which have passed check ok
-  unsigned long long statsRdhCheckErr = 0;       // number of RDH structs which have not passed check
-  unsigned long long statsRdhCheckStreamErr = 0; // number of inconsistencies in RDH stream (e.g. ids/timing compared to previous RDH)
-  unsigned long long statsRdhCheckPagesDropped = 0; // number of pages discarded because of RDH errors (when configured to do so)
+  // RDH check counters, may be updated concurrently by checker threads
+  std::atomic<unsigned long long> statsRdhCheckOk = 0;        // number of RDH structs which have passed check ok
+  std::atomic<unsigned long long> statsRdhCheckErr = 0;       // number of RDH structs which have not passed check
+  std::atomic<unsigned long long> statsRdhCheckStreamErr = 0; // number of inconsistencies in RDH stream (e.g. ids/timing compared to previous RDH)
+  std::atomic<unsigned long long> statsRdhCheckPagesDropped = 0; // number of pages discarded because of RDH errors (when configured to do so)
+  std::atomic<unsigned long long> statsRdhCheckPagesDiscarded = 0; // number of pages checked by RDH checker threads, but discarded at stop because output fifo was full
 };
 
 std::unique_ptr<ReadoutEquipment> getReadoutEquipmentDummy(ConfigFile& cfg, std::string cfgEntryPoint);
@@ -14,12 +14,62 @@
 #include <stdlib.h>
 #include <random>
 #include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "RAWDataHeader.h"
 #include "ReadoutEquipment.h"
 #include "ReadoutUtils.h"
 #include "readoutInfoLogger.h"
 
+// fast pseudo-random number generator (splitmix64), to be used with one instance per thread or link
+// compatible with the standard random distributions
+class FastRandom
+{
+ public:
+  using result_type = uint64_t;
+  FastRandom(uint64_t seed = 0) : state(seed) {}
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT64_MAX; }
+  result_type operator()()
+  {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+  double uniform() { return ((*this)() >> 11) * (1.0 / 9007199254740992.0); } // uniform in [0,1)
+
+ private:
+  uint64_t state;
+};
+
+// write a RDH in a data page
+// non-temporal vector stores are used when available: the page is not read back by the generator,
+// this avoids loading the destination cache lines. _mm_sfence() should be called before the page is handed over.
+static inline void storeRdh(void* dst, const o2::Header::RAWDataHeader& rdh)
+{
+#if defined(__SSE2__)
+  static_assert(sizeof(o2::Header::RAWDataHeader) == 64, "RDH size should be 64 bytes");
+  if (((uintptr_t)dst & 15) == 0) {
+    const __m128i* src = (const __m128i*)&rdh;
+    __m128i* d = (__m128i*)dst;
+    _mm_stream_si128(d, _mm_loadu_si128(src));
+    _mm_stream_si128(d + 1, _mm_loadu_si128(src + 1));
+    _mm_stream_si128(d + 2, _mm_loadu_si128(src + 2));
+    _mm_stream_si128(d + 3, _mm_loadu_si128(src + 3));
+    return;
+  }
+#endif
+  memcpy(dst, &rdh, sizeof(rdh));
+}
+
 class ReadoutEquipmentCruEmulator : public ReadoutEquipment
 {
 
@@ -59,21 +109,43 @@ class ReadoutEquipmentCruEmulator : public ReadoutEquipment
   double cfgPayloadSizeStdev = 0.0; // standard deviation of randomized payload size
 
   std::random_device payloadRd{};
-  std::mt19937 payloadGen{payloadRd()};
-  std::normal_distribution<double> payloadDistrib{};
 
   double cfgTriggerRate = 0.0; // if set, generate blocks at given rate instead of continuously
   unsigned long long nBlocksPerLink = 0; // number of blocks sent
 
-  class linkState
+  class alignas(64) linkState // aligned to avoid false sharing between generator threads
   {
    public:
     int HBpagecount = 0;
     int isEmpty = 0;
     int payloadBytesLeft = -1;
     unsigned char packetCounter = 0;
+    o2::Header::RAWDataHeader rdhTemplate;           // RDH with the fields constant for this link
+    FastRandom rng;                                  // random generator for this link
+    std::normal_distribution<double> payloadDistrib; // random payload size
+    uint32_t endOrbit = 0;                           // LHC clock after last page filled
+    uint32_t endBc = 0;
+    uint32_t rdhWritten = 0;                         // number of RDH written in last page filled
   };
-  std::map<int, linkState> perLinkState;
+  std::vector<linkState> perLinkState; // state of each link, indexed from 0 (first link)
+
+  void fillLinkPage(int currentLink); // fill data page of given link, starting from current LHC clock
+  void fillLinkPages(int worker);     // fill data pages of the links assigned to given worker (0 = equipment thread)
+
+  // pages can be filled in parallel by additional threads, links being shared between them and the equipment thread
+  int cfgGeneratorThreads = 0;
+  std::vector<std::thread> generatorThreads;
+  std::mutex generatorMutex;
+  std::condition_variable generatorStart; // wake up workers when new pages to be filled
+  std::condition_variable generatorDone;  // wake up equipment thread when all pages filled
+  uint64_t generatorRound = 0;            // incremented for each new set of pages
+  int generatorPending = 0;               // number of workers still filling pages of current round
+  bool generatorShutdown = false;         // set to stop workers
+  void generatorLoop(int worker);         // worker thread main loop
+
+  double generatorTime = 0;           // time spent filling pages (seconds)
+  uint64_t generatorBytes = 0;        // number of bytes in pages filled (nominal, payload is not written)
+  uint64_t generatorBytesWritten = 0; // number of bytes actually written in pages (RDH only)
 
   uint32_t LHCorbit = 0; // current LHC orbit
   uint32_t LHCbc = 0;    // current LHC bunch crossing
@@ -103,6 +175,7 @@ ReadoutEquipmentCruEmulator::ReadoutEquipmentCruEmulator(ConfigFile& cfg, std::s
   // configuration parameter: | equipment-cruemulator-* | PayloadSizeStdev | double | 0.0 | Standard deviation of randomized PayloadSize (no unit, as a fraction of PayloadSize). |
   // configuration parameter: | equipment-cruemulator-* | triggerRate | double | 0 | If set, the HB frame rate is limited to given value in Hz (1 HBF per data page). |
   // configuration parameter: | equipment-cruemulator-* | linkThroughput | double | 3.2 | The data throughput of each link, in Gbps. |
+  // configuration parameter: | equipment-cruemulator-* | generatorThreads | int | 0 | Number of threads to fill data pages in addition to the equipment thread, links being shared between them. The maximum throughput of the generator (from the time spent filling pages) is reported at end of run, both nominal (full pages) and for the bytes actually written (RDH only, payload is not written). |
   cfg.getOptionalValue<int>(cfgEntryPoint + ".maxBlocksPerPage", cfgMaxBlocksPerPage, (int)0);
   cfg.getOptionalValue<int>(cfgEntryPoint + ".cruBlockSize", cruBlockSize, (int)8192);
   cfg.getOptionalValue<int>(cfgEntryPoint + ".numberOfLinks", cfgNumberOfLinks, (int)1);
@@ -117,9 +190,16 @@ ReadoutEquipmentCruEmulator::ReadoutEquipmentCruEmulator(ConfigFile& cfg, std::s
   cfg.getOptionalValue<double>(cfgEntryPoint + ".PayloadSizeStdev", cfgPayloadSizeStdev);
   cfg.getOptionalValue<double>(cfgEntryPoint + ".triggerRate", cfgTriggerRate);
   cfg.getOptionalValue<double>(cfgEntryPoint + ".linkThroughput", cfgGbtLinkThroughput);
+  cfg.getOptionalValue<int>(cfgEntryPoint + ".generatorThreads", cfgGeneratorThreads, (int)0);
+  if (cfgGeneratorThreads >= cfgNumberOfLinks) {
+    cfgGeneratorThreads = cfgNumberOfLinks - 1;
+  }
+  if (cfgGeneratorThreads < 0) {
+    cfgGeneratorThreads = 0;
+  }
 
   // log config summary
-  theLog.log(LogInfoDevel_(3002), "Equipment %s: maxBlocksPerPage=%d cruBlockSize=%d numberOfLinks=%d systemId=%d cruId=%d dpwId=%d feeId=%d linkId=%d HBperiod=%d EmptyHbRatio=%f PayloadSize=%d PayloadSizeStdev=%f TriggerRate=%f linkThroughput=%f", name.c_str(), cfgMaxBlocksPerPage, cruBlockSize, cfgNumberOfLinks, cfgSystemId, cfgCruId, cfgDpwId, cfgFeeId, cfgLinkId, cfgHBperiod, cfgEmptyHbRatio, cfgPayloadSize, cfgPayloadSizeStdev, cfgTriggerRate, cfgGbtLinkThroughput);
+  theLog.log(LogInfoDevel_(3002), "Equipment %s: maxBlocksPerPage=%d cruBlockSize=%d numberOfLinks=%d systemId=%d cruId=%d dpwId=%d feeId=%d linkId=%d HBperiod=%d EmptyHbRatio=%f PayloadSize=%d PayloadSizeStdev=%f TriggerRate=%f linkThroughput=%f generatorThreads=%d", name.c_str(), cfgMaxBlocksPerPage, cruBlockSize, cfgNumberOfLinks, cfgSystemId, cfgCruId, cfgDpwId, cfgFeeId, cfgLinkId, cfgHBperiod, cfgEmptyHbRatio, cfgPayloadSize, cfgPayloadSizeStdev, cfgTriggerRate, cfgGbtLinkThroughput, cfgGeneratorThreads);
 
   // initialize array of pending blocks (to be filled with data)
   pendingBlocks.resize(cfgNumberOfLinks);
@@ -134,12 +214,62 @@ ReadoutEquipmentCruEmulator::ReadoutEquipmentCruEmulator(ConfigFile& cfg, std::s
   bcStep = (int)ceil(LHCBCRate * (double)(cfgPayloadSize + sizeof(o2::Header::RAWDataHeader) * ceil(cfgPayloadSize * 1.0 / (cruBlockSize - sizeof(o2::Header::RAWDataHeader)))) * 8 / (cfgGbtLinkThroughput * 1000 * 1000 * 1000));
   theLog.log(LogInfoDevel_(3002), "Equipment %s: using block rate = %d BC", name.c_str(), bcStep);
 
-  // random payload distribution
-  payloadDistrib = std::normal_distribution<> (cfgPayloadSize, cfgPayloadSizeStdev * cfgPayloadSize);
+  // init links: RDH template, random payload distribution
+  perLinkState.resize(cfgNumberOfLinks);
+  for (int i = 0; i < cfgNumberOfLinks; i++) {
+    linkState& ls = perLinkState[i];
+    o2::Header::RAWDataHeader& rdh = ls.rdhTemplate;
+    rdh.systemId = cfgSystemId;
+    rdh.cruId = cfgCruId;
+    rdh.dpwId = cfgDpwId;
+    rdh.feeId = cfgFeeId;
+    rdh.linkId = cfgLinkId + i;
+    rdh.offsetNextPacket = cruBlockSize;
+    rdh.stopBit = 0;
+    ls.rng = FastRandom(((uint64_t)payloadRd() << 32) | payloadRd());
+    ls.payloadDistrib = std::normal_distribution<double>(cfgPayloadSize, cfgPayloadSizeStdev * cfgPayloadSize);
+  }
+
+  // start page generator threads
+  for (int i = 1; i <= cfgGeneratorThreads; i++) {
+    generatorThreads.emplace_back(&ReadoutEquipmentCruEmulator::generatorLoop, this, i);
+  }
 }
 
 ReadoutEquipmentCruEmulator::~ReadoutEquipmentCruEmulator() {
   abortThread();
+  {
+    std::unique_lock<std::mutex> lock(generatorMutex);
+    generatorShutdown = true;
+  }
+  generatorStart.notify_all();
+  for (auto& t : generatorThreads) {
+    t.join();
+  }
+}
+
+void ReadoutEquipmentCruEmulator::generatorLoop(int worker)
+{
+  setThreadName((name + "-gen" + std::to_string(worker)).c_str());
+  uint64_t lastRound = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(generatorMutex);
+      generatorStart.wait(lock, [&] { return (generatorShutdown) || (generatorRound != lastRound); });
+      if (generatorShutdown) {
+        break;
+      }
+      lastRound = generatorRound;
+    }
+    fillLinkPages(worker);
+    {
+      std::unique_lock<std::mutex> lock(generatorMutex);
+      generatorPending--;
+      if (generatorPending == 0) {
+        generatorDone.notify_one();
+      }
+    }
+  }
 }
 
 Thread::CallbackResult ReadoutEquipmentCruEmulator::prepareBlocks()
@@ -155,11 +285,13 @@ Thread::CallbackResult ReadoutEquipmentCruEmulator::prepareBlocks()
   if (cfgTriggerRate != 0.0) {
     LHCorbit = (t-t0) * LHCOrbitRate;
     if (nBlocksPerLink > cfgTriggerRate * (t-t0)) {
+      setIdleWaitLimit(nBlocksPerLink / cfgTriggerRate - (t - t0));
       return Thread::CallbackResult::Idle;
     }
   }
 
   if (LHCorbit > (uint32_t)((t - t0) * LHCOrbitRate)) {
+    setIdleWaitLimit(LHCorbit * 1.0 / LHCOrbitRate - (t - t0));
     return Thread::CallbackResult::Idle;
   }
 
@@ -191,157 +323,183 @@ Thread::CallbackResult ReadoutEquipmentCruEmulator::prepareBlocks()
   }
 
   // at this point, we have 1 free page per link... fill it!
+  auto tFillBegin = std::chrono::steady_clock::now();
+
+  // TF of first orbit is set on first call, do it here before workers are involved
+  getTimeframeFromOrbit(LHCorbit);
+
+  if (generatorThreads.size()) {
+    {
+      std::unique_lock<std::mutex> lock(generatorMutex);
+      generatorRound++;
+      generatorPending = (int)generatorThreads.size();
+    }
+    generatorStart.notify_all();
+    fillLinkPages(0);
+    std::unique_lock<std::mutex> lock(generatorMutex);
+    generatorDone.wait(lock, [&] { return generatorPending == 0; });
+  } else {
+    fillLinkPages(0);
+  }
+
+  for (int currentLink = 0; currentLink < cfgNumberOfLinks; currentLink++) {
+    generatorBytes += pendingBlocks[currentLink]->getData()->header.dataSize;
+    generatorBytesWritten += perLinkState[currentLink].rdhWritten * sizeof(o2::Header::RAWDataHeader);
+    readyBlocks->push(pendingBlocks[currentLink]);
+    pendingBlocks[currentLink] = nullptr;
+  }
+  generatorTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - tFillBegin).count();
+
+  nBlocksPerLink++;
+  LHCorbit = perLinkState[cfgNumberOfLinks - 1].endOrbit;
+  LHCbc = perLinkState[cfgNumberOfLinks - 1].endBc;
+
+  return Thread::CallbackResult::Ok;
+}
+
+void ReadoutEquipmentCruEmulator::fillLinkPages(int worker)
+{
+  int nWorkers = (int)generatorThreads.size() + 1;
+  for (int currentLink = worker; currentLink < cfgNumberOfLinks; currentLink += nWorkers) {
+    fillLinkPage(currentLink);
+  }
+#if defined(__SSE2__)
+  // make non-temporal stores visible before pages are handed over
+  _mm_sfence();
+#endif
+}
+
+void ReadoutEquipmentCruEmulator::fillLinkPage(int currentLink)
+{
+  // fill the new data page for this link
+  DataBlock* b = pendingBlocks[currentLink]->getData();
+
+  // printf ("data block %p data=%p\n",b,b->data);
 
-  o2::Header::RAWDataHeader defaultRDH; // a default RDH
+  int offset; // number of bytes used in page
 
   unsigned int nowOrbit = LHCorbit;
   unsigned int nowBc = LHCbc;
+  uint64_t nowId = getTimeframeFromOrbit(nowOrbit);
 
-  for (int currentLink = 0; currentLink < cfgNumberOfLinks; currentLink++) {
+  int linkId = cfgLinkId + currentLink;
+  int bytesAvailableInPage = b->header.dataSize; // a bit less than memoryPoolPageSize;
+  // printf("bytes available: %d bytes\n",bytesAvailableInPage);
 
-    // fill the new data page for this link
-    DataBlock* b = pendingBlocks[currentLink]->getData();
-
-    // printf ("data block %p data=%p\n",b,b->data);
-
-    int offset; // number of bytes used in page
-    int nBlocksInPage = 0;
-
-    nowOrbit = LHCorbit;
-    nowBc = LHCbc;
-    uint64_t nowId = getTimeframeFromOrbit(nowOrbit);
-
-    int linkId = cfgLinkId + currentLink;
-    int bytesAvailableInPage = b->header.dataSize; // a bit less than memoryPoolPageSize;
-    // printf("bytes available: %d bytes\n",bytesAvailableInPage);
-
-    linkState& ls = perLinkState[linkId];
-    // printf("link %d: %d\n",linkId,ls.payloadBytesLeft);
-
-    for (offset = 0; offset + cruBlockSize <= bytesAvailableInPage; offset += cruBlockSize) {
-
-      bool isNewTF = 0;
-      if ((ls.payloadBytesLeft < 0)) {
-        // this is a new HB frame
-
-	if ((cfgTriggerRate != 0.0) && (offset !=0)) {
-          // single HB frame in trigger mode
-	  break;
-	}
-
-        unsigned int nextBc = nowBc + bcStep;
-        unsigned int nextOrbit = nowOrbit;
-        if (nextBc >= LHCBunches) {
-          nextOrbit += nextBc / LHCBunches;
-          nextBc = nextBc % LHCBunches;
-          unsigned int nextId = getTimeframeFromOrbit(nextOrbit); // timeframe ID
-          if (nextId != nowId) {
-            isNewTF = 1;
-            if (offset) {
-              // force page change on timeframe boundary
-              // printf("TF boundary : %d != %d\n",nextId,nowId);
-              break;
-            } else {
-              // ok to change TFid when it's the first clock step
-              nowId = nextId;
-            }
-          }
-        }
-        nowBc = nextBc;
-        nowOrbit = nextOrbit;
+  linkState& ls = perLinkState[currentLink];
+  // printf("link %d: %d\n",linkId,ls.payloadBytesLeft);
 
-        ls.HBpagecount = 0;
+  ls.rdhWritten = 0;
+  for (offset = 0; offset + cruBlockSize <= bytesAvailableInPage; offset += cruBlockSize) {
 
-        // create empty HB?
-        if (rand() < cfgEmptyHbRatio * RAND_MAX) {
-          ls.isEmpty = 1;
-          ls.payloadBytesLeft = 0;
-        } else {
-          // HB with random payload size
-          ls.isEmpty = 0;
-          ls.payloadBytesLeft = std::round(payloadDistrib(payloadGen));
-          if (ls.payloadBytesLeft < 0 ) {
-            ls.payloadBytesLeft = 0;
-          }
-        }
+    bool isNewTF = 0;
+    if ((ls.payloadBytesLeft < 0)) {
+      // this is a new HB frame
 
-      } else {
-        // continue with current HB
-        ls.HBpagecount++;
+      if ((cfgTriggerRate != 0.0) && (offset !=0)) {
+        // single HB frame in trigger mode
+        break;
       }
 
-      int nowHb = nowOrbit / cfgHBperiod;
-      // printf("orbit=%d bc=%d HB=%d\n",nowOrbit,nowBc,nowHb);
-
-      // rdh as defined in:
-      // https://docs.google.com/document/d/1KUoLnEw5PndVcj4FKR5cjV-MBN3Bqfx_B0e6wQOIuVE/edit#heading=h.5q65he8hp62c
-
-      o2::Header::RAWDataHeader* rdh = (o2::Header::RAWDataHeader*)&b->data[offset];
-      // printf("rdh=%p block=%p delta=%d\n",rdh,b->data,(int)((char *)rdh-(char *)b->data));
-
-      *rdh = defaultRDH; // reset fields to defaults
-      rdh->triggerOrbit = nowOrbit;
-      rdh->triggerBC = nowBc;
-      rdh->heartbeatOrbit = nowHb;
-      rdh->systemId = cfgSystemId;
-      rdh->cruId = cfgCruId;
-      rdh->dpwId = cfgDpwId;
-      rdh->feeId = cfgFeeId;
-      rdh->linkId = linkId;
-      rdh->offsetNextPacket = cruBlockSize;
-      rdh->stopBit = 0;
-      rdh->packetCounter = ls.packetCounter;
-      ls.packetCounter++;
-      if (isNewTF) {
-        rdh->triggerType = (uint32_t)1 << 11;
-      } else {
-        rdh->triggerType = 0;
+      unsigned int nextBc = nowBc + bcStep;
+      unsigned int nextOrbit = nowOrbit;
+      if (nextBc >= LHCBunches) {
+        nextOrbit += nextBc / LHCBunches;
+        nextBc = nextBc % LHCBunches;
+        unsigned int nextId = getTimeframeFromOrbit(nextOrbit); // timeframe ID
+        if (nextId != nowId) {
+          isNewTF = 1;
+          if (offset) {
+            // force page change on timeframe boundary
+            // printf("TF boundary : %d != %d\n",nextId,nowId);
+            break;
+          } else {
+            // ok to change TFid when it's the first clock step
+            nowId = nextId;
+          }
+        }
       }
+      nowBc = nextBc;
+      nowOrbit = nextOrbit;
 
-      rdh->pagesCounter = ls.HBpagecount;
-      if (ls.payloadBytesLeft > 0) {
-        int bytesNow = ls.payloadBytesLeft;
-        if (bytesNow + (int)sizeof(o2::Header::RAWDataHeader) > cruBlockSize) {
-          bytesNow = cruBlockSize - sizeof(o2::Header::RAWDataHeader);
-        }
-        ls.payloadBytesLeft -= bytesNow;
-        rdh->memorySize = sizeof(o2::Header::RAWDataHeader) + bytesNow;
-        if (ls.payloadBytesLeft <= 0) {
-          ls.payloadBytesLeft = 0;
-          rdh->stopBit = 1;
-          ls.payloadBytesLeft = -1;
-        }
+      ls.HBpagecount = 0;
+
+      // create empty HB?
+      if (ls.rng.uniform() < cfgEmptyHbRatio) {
+        ls.isEmpty = 1;
+        ls.payloadBytesLeft = 0;
       } else {
-        rdh->memorySize = sizeof(o2::Header::RAWDataHeader);
-        if (!((ls.isEmpty) && (ls.HBpagecount == 0))) {
-          rdh->stopBit = 1;
-          ls.payloadBytesLeft = -1;
+        // HB with random payload size
+        ls.isEmpty = 0;
+        ls.payloadBytesLeft = std::round(ls.payloadDistrib(ls.rng));
+        if (ls.payloadBytesLeft < 0 ) {
+          ls.payloadBytesLeft = 0;
         }
       }
 
-      // printf("block %p offset %d / %d, link %d @ %p data=%p\n",b,offset,memPoolElementSize,linkId,rdh,b->data);
-      // dumpRDH(rdh);
-      nBlocksInPage++;
+    } else {
+      // continue with current HB
+      ls.HBpagecount++;
     }
 
-    // size used (bytes) in page is last offset
-    int dSize = offset;
-
-    // printf("wrote %d bytes\n",dSize);
+    int nowHb = nowOrbit / cfgHBperiod;
+    // printf("orbit=%d bc=%d HB=%d\n",nowOrbit,nowBc,nowHb);
+
+    // rdh as defined in:
+    // https://docs.google.com/document/d/1KUoLnEw5PndVcj4FKR5cjV-MBN3Bqfx_B0e6wQOIuVE/edit#heading=h.5q65he8hp62c
+
+    // RDH built from link template, and written at once in page
+    o2::Header::RAWDataHeader rdh = ls.rdhTemplate;
+    rdh.triggerOrbit = nowOrbit;
+    rdh.triggerBC = nowBc;
+    rdh.heartbeatOrbit = nowHb;
+    rdh.packetCounter = ls.packetCounter;
+    ls.packetCounter++;
+    if (isNewTF) {
+      rdh.triggerType = (uint32_t)1 << 11;
+    } else {
+      rdh.triggerType = 0;
+    }
 
-    // no need to fill header defaults, this is done by getNewDataBlockContainer()
-    // only adjust payload size
-    b->header.dataSize = dSize;
-    b->header.linkId = linkId;
+    rdh.pagesCounter = ls.HBpagecount;
+    if (ls.payloadBytesLeft > 0) {
+      int bytesNow = ls.payloadBytesLeft;
+      if (bytesNow + (int)sizeof(o2::Header::RAWDataHeader) > cruBlockSize) {
+        bytesNow = cruBlockSize - sizeof(o2::Header::RAWDataHeader);
+      }
+      ls.payloadBytesLeft -= bytesNow;
+      rdh.memorySize = sizeof(o2::Header::RAWDataHeader) + bytesNow;
+      if (ls.payloadBytesLeft <= 0) {
+        ls.payloadBytesLeft = 0;
+        rdh.stopBit = 1;
+        ls.payloadBytesLeft = -1;
+      }
+    } else {
+      rdh.memorySize = sizeof(o2::Header::RAWDataHeader);
+      if (!((ls.isEmpty) && (ls.HBpagecount == 0))) {
+        rdh.stopBit = 1;
+        ls.payloadBytesLeft = -1;
+      }
+    }
+    storeRdh(&b->data[offset], rdh);
+    ls.rdhWritten++;
 
-    readyBlocks->push(pendingBlocks[currentLink]);
-    pendingBlocks[currentLink] = nullptr;
+    // printf("block %p offset %d / %d, link %d @ %p data=%p\n",b,offset,memPoolElementSize,linkId,rdh,b->data);
+    // dumpRDH(rdh);
   }
-  nBlocksPerLink++;
-  LHCorbit = nowOrbit;
-  LHCbc = nowBc;
 
-  return Thread::CallbackResult::Ok;
+  // size used (bytes) in page is last offset
+  int dSize = offset;
+
+  // printf("wrote %d bytes\n",dSize);
+
+  // no need to fill header defaults, this is done by getNewDataBlockContainer()
+  // only adjust payload size
+  b->header.dataSize = dSize;
+  b->header.linkId = linkId;
+
+  ls.endOrbit = nowOrbit;
+  ls.endBc = nowBc;
 }
 
 DataBlockContainerReference ReadoutEquipmentCruEmulator::getNextBlock()
@@ -368,12 +526,15 @@ void ReadoutEquipmentCruEmulator::initCounters()
   LHCbc = 0;
 
   nBlocksPerLink = 0;
+  generatorTime = 0;
+  generatorBytes = 0;
+  generatorBytesWritten = 0;
 
   for (auto& ls : perLinkState) {
-    ls.second.HBpagecount = 0;
-    ls.second.isEmpty = 0;
-    ls.second.payloadBytesLeft = -1;
-    ls.second.packetCounter = 0;
+    ls.HBpagecount = 0;
+    ls.isEmpty = 0;
+    ls.payloadBytesLeft = -1;
+    ls.packetCounter = 0;
   }
 }
 
@@ -386,6 +547,12 @@ void ReadoutEquipmentCruEmulator::finalCounters()
       break;
     }
   }
+
+  // report generator performance
+  if (generatorTime > 0) {
+    // page bytes are nominal: only the RDH are written in pages, payload is left as is
+    theLog.log(LogInfoDevel_(3003), "Equipment %s: %s of pages generated in %.3lf s of page filling time, max generator throughput = %s nominal, %s actually written (RDH only) (%d threads)", name.c_str(), NumberOfBytesToString(generatorBytes, "B").c_str(), generatorTime, NumberOfBytesToString(generatorBytes / generatorTime, "B/s").c_str(), NumberOfBytesToString(generatorBytesWritten / generatorTime, "B/s").c_str(), cfgGeneratorThreads + 1);
+  }
 }
 
 std::unique_ptr<ReadoutEquipment> getReadoutEquipmentCruEmulator(ConfigFile& cfg, std::string cfgEntryPoint) { return std::make_unique<ReadoutEquipmentCruEmulator>(cfg, cfgEntryPoint); }
@@ -9,7 +9,11 @@
 // granted to it by virtue of its status as an Intergovernmental Organization
 // or submit itself to any jurisdiction.
 
+#include <fstream>
+#include <glob.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "MemoryBankManager.h"
 #include "RdhUtils.h"
@@ -24,15 +28,28 @@ class ReadoutEquipmentPlayer : public ReadoutEquipment
   ReadoutEquipmentPlayer(ConfigFile& cfg, std::string name = "filePlayerReadout");
   ~ReadoutEquipmentPlayer();
   DataBlockContainerReference getNextBlock();
+  void setDataOn();
 
  private:
   void initCounters();
+  void finalCounters();
 
   Thread::CallbackResult populateFifoOut(); // iterative callback
 
   std::string filePath = "";        // path to data file
+  std::vector<std::string> fileList; // files to be replayed, in order
+  int fileIndex = 0;                 // index of current file in list
   size_t fileSize = 0;              // data file size
   std::unique_ptr<char[]> fileData; // copy of file content
+  const char* fileContent = nullptr; // file content in memory (copy, mapping, or hugepage buffer), if any
+
+  int cfgMmap = 0;                       // if set, file is memory-mapped (1), or loaded in a hugepage-backed buffer (2)
+  void* fileMap = nullptr;               // file memory mapping
+  std::shared_ptr<MemoryBank> fileBank; // hugepage-backed copy of current file. Only one file is kept in memory.
+  int fileBankIndex = -1;               // index of file in fileBank
+
+  std::string openFile(int index); // open given file from list, and map it if configured. Returns an error description, empty on success.
+  void closeFile();                // close current file
 
   int preLoad;       // if set, data preloaded in the memory pool
   int fillPage;      // if set, page is filled multiple time
@@ -57,13 +74,59 @@ class ReadoutEquipmentPlayer : public ReadoutEquipment
   int cfgUpdateOrbits = 1; // when set, all RDHs are modified to update orbit, according to orbitOffset
 
   void copyFileDataToPage(void* page); // fill given page with file data according to current settings
+  DataBlockContainerReference readNextBlock(); // get a new page filled with next chunk of file (autoChunk mode) or file copy
+
+  // pages can be read ahead of time by a separate thread
+  int cfgPrefetchPages = 0;                                                // maximum number of pages read ahead
+  std::unique_ptr<ReadoutFifo<DataBlockContainerReference>> prefetchFifo; // pages ready
+  std::unique_ptr<AdaptiveIdle> prefetchIdle;                              // wait when nothing to do
+  std::unique_ptr<std::thread> prefetchThread;
+  std::atomic<bool> prefetchRunning = false;
+  void prefetchLoop();  // prefetch thread main loop
+  void stopPrefetch();  // stop prefetch thread, and release pages read ahead
+  DataBlockContainerReference fetchNextBlock(); // get next page, from prefetch thread or read now
+
+  // pages can be emitted at the pace of the data, from the orbit of their first RDH
+  double cfgReplaySpeed = 0;                       // speed-up factor compared to LHC orbit rate (0: disabled)
+  DataBlockContainerReference replayPendingBlock;  // next page, waiting for its time
+  AliceO2::Common::Timer replayClock;              // time since first page emitted
+  bool replayClockStarted = false;                 // set when first page emitted
+  uint32_t replayFirstOrbit = 0;                   // orbit of first page emitted
+  double replayTimeOffset = 0;                     // shift applied to page times, after long gaps are skipped
+  unsigned long long replayGapsSkipped = 0;        // number of long gaps skipped
+  DataBlockContainerReference getNextBlockPaced(); // get next page, if its time has come
 };
 
+// get list of files for a given path: a file, a directory (all files inside), or a pattern with wildcards
+// files are sorted alphabetically. Returns 0 on success.
+static int getFileList(const std::string& path, std::vector<std::string>& files)
+{
+  struct stat st;
+  std::string pattern = path;
+  if ((stat(path.c_str(), &st) == 0) && (S_ISDIR(st.st_mode))) {
+    pattern = path + "/*";
+  } else if (path.find_first_of("*?[") == std::string::npos) {
+    files.push_back(path);
+    return 0;
+  }
+  glob_t g;
+  if (glob(pattern.c_str(), 0, nullptr, &g) != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < g.gl_pathc; i++) {
+    if ((stat(g.gl_pathv[i], &st) == 0) && (S_ISREG(st.st_mode))) {
+      files.push_back(g.gl_pathv[i]);
+    }
+  }
+  globfree(&g);
+  return 0;
+}
+
 void ReadoutEquipmentPlayer::copyFileDataToPage(void* page)
 {
   if (page == nullptr)
     return;
-  if (fileData == nullptr)
+  if (fileContent == nullptr)
     return;
   if (fileSize == 0)
     return;
@@ -73,7 +136,7 @@ void ReadoutEquipmentPlayer::copyFileDataToPage(void* page)
   }
   char* ptr = (char*)page;
   for (int i = 0; i < nCopy; i++) {
-    memcpy(ptr, fileData.get(), fileSize);
+    memcpy(ptr, fileContent, fileSize);
     ptr += fileSize;
   }
 }
@@ -82,16 +145,35 @@ ReadoutEquipmentPlayer::ReadoutEquipmentPlayer(ConfigFile& cfg, std::string cfgE
 {
 
   auto errorHandler = [&](const std::string& err) {
-    if (fp != nullptr) {
-      fclose(fp);
-      fp = nullptr;
-    }
+    closeFile();
     throw err;
   };
 
   // get configuration values
-  // configuration parameter: | equipment-player-* | filePath | string | | Path of file containing data to be injected in readout. |
-  filePath = cfg.getValue<std::string>(cfgEntryPoint + ".filePath");
+  // configuration parameter: | equipment-player-* | playlist | string | | Path of a text file listing the data files to be replayed one after the other (one path per line, empty lines and lines starting with # are ignored). When set, filePath is not used. Multiple files can be replayed only in autoChunk mode. |
+  std::string cfgPlaylist;
+  cfg.getOptionalValue<std::string>(cfgEntryPoint + ".playlist", cfgPlaylist);
+  if (cfgPlaylist.length()) {
+    std::ifstream playlist(cfgPlaylist);
+    if (!playlist.is_open()) {
+      errorHandler(std::string("Failed to open playlist ") + cfgPlaylist);
+    }
+    std::string line;
+    while (std::getline(playlist, line)) {
+      line.erase(0, line.find_first_not_of(" \t\r"));
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if ((line.length()) && (line[0] != '#')) {
+        fileList.push_back(line);
+      }
+    }
+    filePath = cfgPlaylist;
+  } else {
+    // configuration parameter: | equipment-player-* | filePath | string | | Path of file containing data to be injected in readout. It can also be a directory, or a pattern with wildcards (e.g. /data/run/*.raw): all matching files are then replayed one after the other, in alphabetical order. Multiple files can be replayed only in autoChunk mode. |
+    filePath = cfg.getValue<std::string>(cfgEntryPoint + ".filePath");
+    if (getFileList(filePath, fileList)) {
+      errorHandler(std::string("No file matching ") + filePath);
+    }
+  }
   // configuration parameter: | equipment-player-* | preLoad | int | 1 | If 1, data pages preloaded with file content on startup. If 0, data is copied at runtime. |
   cfg.getOptionalValue<int>(cfgEntryPoint + ".preLoad", preLoad, 1);
   // configuration parameter: | equipment-player-* | fillPage | int | 1 | If 1, content of data file is copied multiple time in each data page until page is full (or almost full: on the last iteration, there is no partial copy if remaining space is smaller than full file size). If 0, data file is copied exactly once in each data page. |
@@ -102,32 +184,38 @@ ReadoutEquipmentPlayer::ReadoutEquipmentPlayer(ConfigFile& cfg, std::string cfgE
   cfg.getOptionalValue<int>(cfgEntryPoint + ".autoChunkLoop", autoChunkLoop, 0);
   // configuration parameter: | equipment-player-* | updateOrbits | int | 1 | When set, trigger orbit counters in all RDH are modified for iterations after the first one (in file loop replay mode), so that they keep increasing. |
   cfg.getOptionalValue<int>(cfgEntryPoint + ".updateOrbits", cfgUpdateOrbits, 1);
+  // configuration parameter: | equipment-player-* | mmap | int | 0 | If 1, the file is memory-mapped (with sequential read-ahead) and pages are filled directly from the mapping, instead of being read with file I/O calls. If 2, the file is loaded once in a hugepage-backed buffer, and later replay loops do not access the file again (file must fit in memory). When several files are replayed, only the current one is kept in memory: each file is loaded again on the next replay loop. |
+  cfg.getOptionalValue<int>(cfgEntryPoint + ".mmap", cfgMmap, 0);
+  // configuration parameter: | equipment-player-* | prefetchPages | int | 0 | If set, data pages are filled ahead of time by a separate thread, up to this number of pages taken from the memory pool. File reading and switching between files then do not delay the equipment readout thread. Used in autoChunk mode only. |
+  cfg.getOptionalValue<int>(cfgEntryPoint + ".prefetchPages", cfgPrefetchPages, 0);
+  // configuration parameter: | equipment-player-* | replaySpeed | double | 0 | If set, pages are emitted at the pace of the original data: the heartbeat orbit of the first RDH in each page gives its emission time, at the LHC orbit rate multiplied by this factor (1 = real time, 2 = twice faster). Bursts in the data are kept. Gaps longer than 10 seconds are skipped. Used in autoChunk mode only. |
+  cfg.getOptionalValue<double>(cfgEntryPoint + ".replaySpeed", cfgReplaySpeed, 0.0);
 
   // log config summary
-  theLog.log(LogInfoDevel_(3002), "Equipment %s: using data source file=%s preLoad=%d fillPage=%d autoChunk=%d autoChunkLoop=%d updateOrbits=%d", name.c_str(), filePath.c_str(), preLoad, fillPage, autoChunk, autoChunkLoop, cfgUpdateOrbits);
+  theLog.log(LogInfoDevel_(3002), "Equipment %s: using data source file=%s preLoad=%d fillPage=%d autoChunk=%d autoChunkLoop=%d updateOrbits=%d mmap=%d prefetchPages=%d replaySpeed=%.2f", name.c_str(), filePath.c_str(), preLoad, fillPage, autoChunk, autoChunkLoop, cfgUpdateOrbits, cfgMmap, cfgPrefetchPages, cfgReplaySpeed);
   if ((!cfgUpdateOrbits)&&(autoChunkLoop)) {
     theLog.log(LogWarningDevel_(3104), "Equipment %s: RDH orbits auto-update is disabled, generated data will be inconsistent (TFid and orbit counters mismatch)", name.c_str());
   }
-
-  // open data file
-  fp = fopen(filePath.c_str(), "rb");
-  if (fp == nullptr) {
-    errorHandler(std::string("open failed: ") + strerror(errno));
+  if (fileList.size() == 0) {
+    errorHandler(std::string("No file to replay"));
   }
-  fpOk = true;
-
-  // get file size
-  if (fseek(fp, 0L, SEEK_END) < 0) {
-    errorHandler(std::string("seek failed: ") + strerror(errno));
+  if (fileList.size() > 1) {
+    if (!autoChunk) {
+      errorHandler(std::string("Multiple files can be replayed only in autoChunk mode"));
+    }
+    theLog.log(LogInfoDevel_(3002), "Equipment %s: %d files to replay, from %s to %s", name.c_str(), (int)fileList.size(), fileList.front().c_str(), fileList.back().c_str());
   }
-  long fs = ftell(fp);
-  if (fs < 0) {
-    errorHandler(std::string("ftell failed: ") + strerror(errno));
+
+  if ((cfgReplaySpeed > 0) && (!autoChunk)) {
+    theLog.log(LogWarningDevel_(3102), "Equipment %s: replaySpeed is used in autoChunk mode only, ignored", name.c_str());
+    cfgReplaySpeed = 0;
   }
-  if (fs == 0) {
-    errorHandler(std::string("file is empty"));
+
+  // open first data file
+  std::string err = openFile(0);
+  if (err.length()) {
+    errorHandler(err);
   }
-  fileSize = (size_t)fs;
 
   // reset counters
   initCounters();
@@ -135,6 +223,10 @@ ReadoutEquipmentPlayer::ReadoutEquipmentPlayer(ConfigFile& cfg, std::string cfgE
   if (autoChunk) {
     bytesPerPage = mp->getDataBlockMaxSize();
     theLog.log(LogInfoDevel, "Will load file = %lu bytes in chunks of maximum %lu bytes", (unsigned long)fileSize, (unsigned long)bytesPerPage);
+    if (cfgPrefetchPages > 0) {
+      prefetchFifo = std::make_unique<ReadoutFifo<DataBlockContainerReference>>(cfgPrefetchPages);
+      prefetchIdle = std::make_unique<AdaptiveIdle>(cfgIdleSleepTime);
+    }
     return;
   }
 
@@ -146,19 +238,22 @@ ReadoutEquipmentPlayer::ReadoutEquipmentPlayer(ConfigFile& cfg, std::string cfgE
     errorHandler(std::string("memoryPoolPageSize too small, need at least ") + std::to_string(fileSize + mp->getPageSize() - mp->getDataBlockMaxSize()) + std::string(" bytes"));
   }
 
-  // allocate a buffer
-  fileData = std::make_unique<char[]>(fileSize);
-  if (fileData == nullptr) {
-    errorHandler(std::string("memory allocation failure"));
-  }
+  // load file, if not in memory already
+  if (fileContent == nullptr) {
+    // allocate a buffer
+    fileData = std::make_unique<char[]>(fileSize);
+    if (fileData == nullptr) {
+      errorHandler(std::string("memory allocation failure"));
+    }
 
-  // load file
-  if (fread(fileData.get(), fileSize, 1, fp) != 1) {
-    errorHandler(std::string("Failed to load file"));
-  };
-  fclose(fp);
-  fp = nullptr;
-  fpOk = false;
+    if (fread(fileData.get(), fileSize, 1, fp) != 1) {
+      errorHandler(std::string("Failed to load file"));
+    };
+    fclose(fp);
+    fp = nullptr;
+    fpOk = false;
+    fileContent = fileData.get();
+  }
 
   // init variables
   if (fillPage) {
@@ -188,12 +283,112 @@ ReadoutEquipmentPlayer::ReadoutEquipmentPlayer(ConfigFile& cfg, std::string cfgE
 ReadoutEquipmentPlayer::~ReadoutEquipmentPlayer()
 {
   abortThread();
+  stopPrefetch();
   fpLock.lock();
+  closeFile();
+  fpLock.unlock();
+}
+
+std::string ReadoutEquipmentPlayer::openFile(int index)
+{
+  closeFile();
+  fileIndex = index;
+  const std::string& path = fileList[index];
+  auto failure = [&](const std::string& err) {
+    closeFile();
+    return path + ": " + err;
+  };
+
+  // file already loaded in memory
+  if ((fileBank != nullptr) && (fileBankIndex == index)) {
+    fileContent = (const char*)fileBank->getBaseAddress();
+    fileSize = fileBank->getSize();
+    return "";
+  }
+
+  // open data file
+  fp = fopen(path.c_str(), "rb");
+  if (fp == nullptr) {
+    return failure(std::string("open failed: ") + strerror(errno));
+  }
+
+  // get file size
+  if (fseek(fp, 0L, SEEK_END) < 0) {
+    return failure(std::string("seek failed: ") + strerror(errno));
+  }
+  long fs = ftell(fp);
+  if (fs < 0) {
+    return failure(std::string("ftell failed: ") + strerror(errno));
+  }
+  if (fs == 0) {
+    return failure("file is empty");
+  }
+  fileSize = (size_t)fs;
+  if (fseek(fp, 0L, SEEK_SET) < 0) {
+    return failure(std::string("seek failed: ") + strerror(errno));
+  }
+
+  // map file in memory
+  if (cfgMmap) {
+    fileMap = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (fileMap == MAP_FAILED) {
+      fileMap = nullptr;
+      return failure(std::string("mmap failed: ") + strerror(errno));
+    }
+    // data accessed in order: ask the kernel for aggressive read-ahead
+    madvise(fileMap, fileSize, MADV_SEQUENTIAL);
+    fileContent = (const char*)fileMap;
+    if (cfgMmap == 2) {
+      // load file once in a hugepage-backed buffer, the mapping is not needed afterwards
+      // pages are filled with a copy of the data, so the buffer of previous file can be released now
+      fileBank = nullptr;
+      fileBankIndex = -1;
+      madvise(fileMap, fileSize, MADV_WILLNEED);
+      std::shared_ptr<MemoryBank> bank;
+      try {
+        bank = getMemoryBank(fileSize, "HugePages", name + " file " + std::to_string(index));
+      } catch (...) {
+      }
+      if (bank == nullptr) {
+        return failure("memory allocation failure");
+      }
+      memcpy(bank->getBaseAddress(), fileMap, fileSize);
+      munmap(fileMap, fileSize);
+      fileMap = nullptr;
+      fileContent = (const char*)bank->getBaseAddress();
+      fileBank = bank;
+      fileBankIndex = index;
+      theLog.log(LogInfoDevel, "File loaded in memory buffer: %s", bank->getDescription().c_str());
+    }
+    // file content now accessed from memory only
+    fclose(fp);
+    fp = nullptr;
+  }
+  return "";
+}
+
+void ReadoutEquipmentPlayer::closeFile()
+{
   if (fp != nullptr) {
     fclose(fp);
     fp = nullptr;
   }
-  fpLock.unlock();
+  if (fileMap != nullptr) {
+    munmap(fileMap, fileSize);
+    fileMap = nullptr;
+  }
+  fileContent = fileData.get();
+}
+
+void ReadoutEquipmentPlayer::setDataOn()
+{
+  // pages read ahead by prefetch thread, started with data
+  // counters and file state are reset on start, they are not used concurrently by this thread
+  if ((prefetchFifo != nullptr) && (prefetchThread == nullptr)) {
+    prefetchRunning = true;
+    prefetchThread = std::make_unique<std::thread>(&ReadoutEquipmentPlayer::prefetchLoop, this);
+  }
+  ReadoutEquipment::setDataOn();
 }
 
 DataBlockContainerReference ReadoutEquipmentPlayer::getNextBlock()
@@ -201,7 +396,96 @@ DataBlockContainerReference ReadoutEquipmentPlayer::getNextBlock()
   if (!isDataOn) {
     return nullptr;
   }
+  if (cfgReplaySpeed > 0) {
+    return getNextBlockPaced();
+  }
+  return fetchNextBlock();
+}
+
+DataBlockContainerReference ReadoutEquipmentPlayer::fetchNextBlock()
+{
+  if (prefetchFifo != nullptr) {
+    DataBlockContainerReference nextBlock = nullptr;
+    if (prefetchFifo->pop(nextBlock) == 0) {
+      prefetchIdle->notify();
+    }
+    return nextBlock;
+  }
+  return readNextBlock();
+}
+
+DataBlockContainerReference ReadoutEquipmentPlayer::getNextBlockPaced()
+{
+  const double replayMaxGap = 10.0; // longer gaps (seconds) are skipped
+
+  if (replayPendingBlock == nullptr) {
+    replayPendingBlock = fetchNextBlock();
+    if (replayPendingBlock == nullptr) {
+      return nullptr;
+    }
+  }
+
+  // time of page, from orbit of first RDH
+  DataBlock* b = replayPendingBlock->getData();
+  RdhHandle h(b->data);
+  uint32_t orbit = h.getHbOrbit() + b->header.orbitOffset;
+  if (!replayClockStarted) {
+    replayClock.reset();
+    replayClockStarted = true;
+    replayFirstOrbit = orbit;
+    replayTimeOffset = 0;
+  }
+  // signed difference, pages slightly back in time (e.g. from other links) are emitted immediately
+  double t = (int32_t)(orbit - replayFirstOrbit) * 1.0 / getLHCOrbitRate() / cfgReplaySpeed - replayTimeOffset;
+  double delay = t - replayClock.getTime();
+  if (delay > replayMaxGap) {
+    static InfoLogger::AutoMuteToken logGapToken(LogInfoDevel_(3011), 10, 60);
+    theLog.log(logGapToken, "Equipment %s: skipping gap of %.1fs in data (orbit 0x%X)", name.c_str(), delay, (unsigned int)orbit);
+    replayTimeOffset += delay;
+    replayGapsSkipped++;
+    delay = 0;
+  }
+  if (delay > 0) {
+    // not yet: come back when it is time
+    setIdleWaitLimit(delay);
+    return nullptr;
+  }
+  return std::move(replayPendingBlock);
+}
+
+void ReadoutEquipmentPlayer::prefetchLoop()
+{
+  setThreadName((name + "-prefetch").c_str());
+  while (prefetchRunning) {
+    DataBlockContainerReference nextBlock = nullptr;
+    if ((fpOk) && (!prefetchFifo->isFull())) {
+      nextBlock = readNextBlock();
+    }
+    if (nextBlock != nullptr) {
+      prefetchFifo->push(nextBlock);
+      prefetchIdle->setActive();
+      notifyDataReady();
+    } else {
+      prefetchIdle->wait();
+    }
+  }
+}
 
+void ReadoutEquipmentPlayer::stopPrefetch()
+{
+  if (prefetchThread != nullptr) {
+    prefetchRunning = false;
+    prefetchIdle->notify();
+    prefetchThread->join();
+    prefetchThread = nullptr;
+  }
+  if (prefetchFifo != nullptr) {
+    prefetchFifo->clear();
+  }
+}
+
+DataBlockContainerReference ReadoutEquipmentPlayer::readNextBlock()
+{
   // query memory pool for a free block
   DataBlockContainerReference nextBlock = nullptr;
   try {
@@ -225,20 +509,44 @@ DataBlockContainerReference ReadoutEquipmentPlayer::getNextBlock()
       bool isOk = 1;
       // read from file
       fpLock.lock();
-      if ((fp != nullptr) && (fpOk)) {
-        size_t nBytes = fread(b->data, 1, bytesPerPage, fp);
+      if (((fp != nullptr) || (fileContent != nullptr)) && (fpOk)) {
+        // data is scanned from the page (read from file), or in place (file in memory) and then copied to page
+        uint8_t* data = (uint8_t*)b->data;
+        size_t nBytes = 0;
+        if (fileContent != nullptr) {
+          data = (uint8_t*)fileContent + fileOffset;
+          nBytes = std::min(bytesPerPage, fileSize - fileOffset);
+        } else {
+          nBytes = fread(b->data, 1, bytesPerPage, fp);
+        }
+        bool isInPage = (data == (uint8_t*)b->data);
         if (nBytes == 0) {
           isOk = 0;
-          if (ferror(fp)) {
+          if ((fp != nullptr) && (ferror(fp))) {
             theLog.log(LogErrorSupport_(3232), "File %s read error, aborting replay", name.c_str());
           }
-          if (feof(fp)) {
-            if ((!autoChunkLoop) || ((loopCount + 1 + autoChunkLoop) == 0)) {
+          if ((fp == nullptr) || (feof(fp))) {
+            if (fileIndex + 1 < (int)fileList.size()) {
+              // continue with next file of the list. Orbits are expected to follow.
+              std::string err = openFile(fileIndex + 1);
+              if (err.length()) {
+                theLog.log(LogErrorSupport_(3232), "%s, aborting replay", err.c_str());
+              } else {
+                fileOffset = 0;
+                isOk = 1;
+              }
+            } else if ((!autoChunkLoop) || ((loopCount + 1 + autoChunkLoop) == 0)) {
               theLog.log(LogInfoDevel, "File %s replay completed (%lu loops)", name.c_str(), (unsigned long)(loopCount + 1));
             } else {
-              // replay file
-              if (fseek(fp, 0, SEEK_SET)) {
-                theLog.log(LogErrorSupport_(3232), "Failed to rewind file, aborting replay");
+              // replay file(s)
+              std::string err;
+              if (fileList.size() > 1) {
+                err = openFile(0);
+              } else if ((fp != nullptr) && (fseek(fp, 0, SEEK_SET))) {
+                err = "Failed to rewind file";
+              }
+              if (err.length()) {
+                theLog.log(LogErrorSupport_(3232), "%s, aborting replay", err.c_str());
               } else {
                 if (loopCount == 0) {
                   theLog.log(LogInfoDevel, "File %s replay - 1st loop completed", name.c_str());
@@ -259,16 +567,16 @@ DataBlockContainerReference ReadoutEquipmentPlayer::getNextBlock()
             if (pageOffset + sizeof(o2::Header::RAWDataHeader) > nBytes) {
               break;
             }
-            RdhHandle h(((uint8_t*)b->data) + pageOffset);
-            std::string errorDescription;
-            int nErr = h.validateRdh(errorDescription);
-            if (nErr) {
+            RdhHandle h(data + pageOffset);
+            if (h.getErrors()) {
+              std::string errorDescription;
+              h.validateRdh(errorDescription);
               theLog.log(LogErrorSupport_(3004), "File %s RDH error, aborting replay @ 0x%lX: %s", name.c_str(), (unsigned long)(fileOffset + pageOffset), errorDescription.c_str());
               isOk = 0;
               break;
             }
-            if (cfgUpdateOrbits) {
-              // update RDH orbit when applicable
+            if ((cfgUpdateOrbits) && (isInPage)) {
+              // update RDH orbit when applicable (file data in memory is updated after copy to page)
               h.incrementHbOrbit(orbitOffset);
             }
 
@@ -277,7 +585,7 @@ DataBlockContainerReference ReadoutEquipmentPlayer::getNextBlock()
             currentPacketHeader.linkId = (int)h.getLinkId();
             currentPacketHeader.equipmentId = (int)(h.getCruId() * 10 + h.getEndPointId());
 
-            int hbOrbit = h.getHbOrbit() + b->header.orbitOffset;
+            int hbOrbit = h.getHbOrbit() + b->header.orbitOffset + (((cfgUpdateOrbits) && (!isInPage)) ? orbitOffset : 0);
             currentPacketHeader.timeframeId = getTimeframeFromOrbit(hbOrbit);
 
             // fill page metadata
@@ -321,7 +629,20 @@ DataBlockContainerReference ReadoutEquipmentPlayer::getNextBlock()
           b->header.dataSize = nBytes;
           fileOffset += nBytes;
           // printf ("bytes = %d    delta = %d    new file Offset = %lu\n", nBytes, delta, fileOffset);
-          if (delta > 0) {
+          if (!isInPage) {
+            // copy only the page content from memory, no need to rewind
+            memcpy(b->data, data, nBytes);
+            if ((cfgUpdateOrbits) && (orbitOffset)) {
+              for (size_t offset = 0; offset < nBytes;) {
+                RdhHandle h(((uint8_t*)b->data) + offset);
+                h.incrementHbOrbit(orbitOffset);
+                if (h.getOffsetNextPacket() == 0) {
+                  break;
+                }
+                offset += h.getOffsetNextPacket();
+              }
+            }
+          } else if (delta > 0) {
             // rewind if necessary
             if (fseek(fp, fileOffset, SEEK_SET)) {
               theLog.log(LogErrorSupport_(3232), "Failed to seek in file, aborting replay");
@@ -360,6 +681,13 @@ DataBlockContainerReference ReadoutEquipmentPlayer::getNextBlock()
 void ReadoutEquipmentPlayer::initCounters()
 {
   fpOk = false;
+  if (fileIndex != 0) {
+    // back to first file
+    std::string err = openFile(0);
+    if (err.length()) {
+      theLog.log(LogErrorSupport_(3232), "%s, aborting replay", err.c_str());
+    }
+  }
   if (fp != nullptr) {
     if (fseek(fp, 0L, SEEK_SET) != 0) {
       theLog.log(LogErrorSupport_(3232), "Failed to rewind file, aborting replay");
@@ -367,13 +695,28 @@ void ReadoutEquipmentPlayer::initCounters()
       fpOk = true;
     }
   }
+  if (fileContent != nullptr) {
+    fpOk = true;
+  }
   fileOffset = 0;
   loopCount = 0;
+  replayPendingBlock = nullptr;
+  replayClockStarted = false;
+  replayGapsSkipped = 0;
   lastPacketHeader.timeframeId = undefinedTimeframeId;
   lastPacketHeader.linkId = undefinedLinkId;
   lastPacketHeader.equipmentId = undefinedEquipmentId;
   orbitOffset = 0;
 }
 
+void ReadoutEquipmentPlayer::finalCounters()
+{
+  stopPrefetch();
+  replayPendingBlock = nullptr;
+  if (replayGapsSkipped) {
+    theLog.log(LogInfoDevel_(3003), "Equipment %s: %llu gaps in data skipped during replay", name.c_str(), replayGapsSkipped);
+  }
+}
+
 std::unique_ptr<ReadoutEquipment> getReadoutEquipmentPlayer(ConfigFile& cfg, std::string cfgEntryPoint) { return std::make_unique<ReadoutEquipmentPlayer>(cfg, cfgEntryPoint); }
 
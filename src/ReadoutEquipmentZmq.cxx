@@ -42,16 +42,16 @@ class ReadoutEquipmentZmq : public ReadoutEquipment
   std::atomic<int> shutdownSnapshotThread = 0;
   std::unique_ptr<std::thread> snapshotThread;
   void loopSnapshot(void);
-  std::unique_ptr<unsigned char[]> snapshotData = nullptr; // latestSnapshot
+  DataBlockContainerReference snapshotPage = nullptr; // latest snapshot, received directly in a page from the pool
+  DataBlockContainerReference getSnapshotBlock(const DataBlockContainerReference& snapshot); // create a block sharing snapshot page data
 
   struct SnapshotDescriptor {
-    int maxSize = 0;
     int currentSize = 0;
     int timestamp = 0;
   };
 
   SnapshotDescriptor snapshotMetadata;
-  std::mutex snapshotLock; // to access snapshotData/Metadata
+  std::mutex snapshotLock; // to access snapshotPage/Metadata
 
   std::unique_ptr<ZmqClient> tfClient;
   int tfClientCallback(void* msg, int msgSize);
@@ -62,6 +62,8 @@ class ReadoutEquipmentZmq : public ReadoutEquipment
   
   uint64_t bytesRx = 0;
   uint64_t blocksRx = 0;
+  uint64_t multipartRx = 0; // number of messages received in several parts
+  bool isMultipart = 0;     // set when last part received was not the last of its message
 };
 
 ReadoutEquipmentZmq::ReadoutEquipmentZmq(ConfigFile& cfg, std::string cfgEntryPoint) : ReadoutEquipment(cfg, cfgEntryPoint)
@@ -71,7 +73,7 @@ ReadoutEquipmentZmq::ReadoutEquipmentZmq(ConfigFile& cfg, std::string cfgEntryPo
   int zmqRxBuffer = 16 * 1024 * 1024;
   
   std::string cfgMode = "stream";
-  // configuration parameter: | equipment-zmq-* | mode | string | stream | Possible values: stream (1 input ZMQ message = 1 output data page), snapshot (last ZMQ message = one output data page per TF). |
+  // configuration parameter: | equipment-zmq-* | mode | string | stream | Possible values: stream (1 input ZMQ message part = 1 output data page), snapshot (last ZMQ message, all parts concatenated = one output data page per TF, shared by reference). |
   cfg.getOptionalValue<std::string>(cfgEntryPoint + ".mode", cfgMode);
   theLog.log(LogInfoDevel_(3002), "Using mode %s", cfgMode.c_str());
   if (cfgMode == "snapshot") {
@@ -172,15 +174,9 @@ ReadoutEquipmentZmq::ReadoutEquipmentZmq(ConfigFile& cfg, std::string cfgEntryPo
       }
     }
 
-    // allocate data for snapshot
-    snapshotMetadata.maxSize = memoryPoolPageSize;
+    // snapshots are received directly in pages from the pool
     snapshotMetadata.currentSize = 0;
     snapshotMetadata.timestamp = 0;
-    snapshotData = std::make_unique<unsigned char[]>(snapshotMetadata.maxSize);
-    if (snapshotData == nullptr) {
-      theLog.log(LogErrorSupport_(3230), "Failed to allocate memory (%d bytes)", snapshotMetadata.maxSize);
-      throw __LINE__;
-    }
 
     // starting snapshot thread
     shutdownSnapshotThread = 0;
@@ -213,12 +209,12 @@ ReadoutEquipmentZmq::~ReadoutEquipmentZmq()
 
   // release memory
   snapshotLock.lock();
-  snapshotData = nullptr;
+  snapshotPage = nullptr;
   snapshotLock.unlock();
 
   tfClient = nullptr;
   
-  theLog.log(LogInfoDevel_(3003), "ZeroMQ subscribe stats: %" PRIu64 " blocks %" PRIu64 " bytes", blocksRx, bytesRx);
+  theLog.log(LogInfoDevel_(3003), "ZeroMQ subscribe stats: %" PRIu64 " blocks %" PRIu64 " bytes %" PRIu64 " multipart messages", blocksRx, bytesRx, multipartRx);
 }
 
 void ReadoutEquipmentZmq::loopSnapshot(void)
@@ -228,39 +224,65 @@ void ReadoutEquipmentZmq::loopSnapshot(void)
   bool doLogSnapshot = 1; // flag to display message on next successful snapshot (1st on start or after error)
 
   for (; !shutdownSnapshotThread;) {
+    linerr = 0;
+    zmqerr = 0;
     for (; !shutdownSnapshotThread;) {
-      zmq_msg_t msg;
-      zmqerr = zmq_msg_init(&msg);
-      if (zmqerr) {
-        linerr = __LINE__;
-        break;
+      // get a page from the pool to receive the snapshot
+      // if none available, message is received and discarded, previous snapshot is kept
+      DataBlockContainerReference page = nullptr;
+      try {
+        page = mp->getNewDataBlockContainer();
+      } catch (...) {
       }
-
-      int nbytes = zmq_recvmsg(zh, &msg, 0);
-      if (nbytes <= 0) {
-        zmqerr = zmq_errno();
-        if (zmqerr) {
+      DataBlock* b = (page != nullptr) ? page->getData() : nullptr;
+      int maxSize = (b != nullptr) ? (int)b->header.dataSize : 0;
+
+      // receive all parts of the message, concatenated in the page
+      int msgSize = 0;
+      int nParts = 0;
+      int more = 0;
+      do {
+        int avail = (msgSize < maxSize) ? maxSize - msgSize : 0;
+        int nbytes = zmq_recv(zh, (avail > 0) ? &b->data[msgSize] : nullptr, avail, 0);
+        if (nbytes < 0) {
+          zmqerr = zmq_errno();
           linerr = __LINE__;
           break;
         }
+        msgSize += nbytes; // size of part, even if truncated
+        nParts++;
+        size_t moreSize = sizeof(more);
+        if (zmq_getsockopt(zh, ZMQ_RCVMORE, &more, &moreSize)) {
+          more = 0;
+        }
+      } while (more);
+      if (linerr) {
+        break;
       }
 
-      int msgSize = zmq_msg_size(&msg);
-      if (msgSize < snapshotMetadata.maxSize) {
+      if (b == nullptr) {
+        static InfoLogger::AutoMuteToken token(LogWarningSupport_(3230));
+        theLog.log(token, "No free page to receive snapshot, message discarded (%d bytes)", msgSize);
+      } else if (msgSize > maxSize) {
+        theLog.log(LogErrorSupport_(3230), "Received message bigger than buffer: %d > %d", msgSize, maxSize);
+      } else {
+        b->header.dataSize = msgSize;
+        // replace previous snapshot. It is released when last block using it is released.
+        DataBlockContainerReference previousPage = nullptr;
         snapshotLock.lock();
-        memcpy(snapshotData.get(), zmq_msg_data(&msg), msgSize);
+        previousPage = std::move(snapshotPage);
+        snapshotPage = page;
         snapshotMetadata.currentSize = msgSize;
         snapshotMetadata.timestamp = time(NULL);
         snapshotLock.unlock();
+        notifyDataReady();
         if (doLogSnapshot) {
-          theLog.log(LogInfoDevel_(3003), "Received snapshot (%d bytes)", msgSize);
+          theLog.log(LogInfoDevel_(3003), "Received snapshot (%d bytes, %d parts)", msgSize, nParts);
           doLogSnapshot = 0;
         }
-      } else {
-        theLog.log(LogErrorSupport_(3230), "Received message bigger than buffer: %d > %d", msgSize, snapshotMetadata.maxSize);
       }
+      page = nullptr;
 
-      zmq_msg_close(&msg);
       usleep(100000);
     }
 
@@ -295,24 +317,31 @@ DataBlockContainerReference ReadoutEquipmentZmq::getNextBlock()
       }
     }
 
-    // query memory pool for a free block
+    // get latest snapshot, if recent enough
+    DataBlockContainerReference snapshot = nullptr;
+    snapshotLock.lock();
+    if (time(NULL) - snapshotMetadata.timestamp < 5) {
+      snapshot = snapshotPage;
+    }
+    snapshotLock.unlock();
+
     DataBlockContainerReference nextBlock = nullptr;
-    try {
-      nextBlock = mp->getNewDataBlockContainer();
-    } catch (...) {
+    if (snapshot != nullptr) {
+      // the snapshot page is shared by all the TFs using it, no copy
+      nextBlock = getSnapshotBlock(snapshot);
+    } else {
+      // no valid snapshot: publish an empty page from the pool
+      try {
+        nextBlock = mp->getNewDataBlockContainer();
+      } catch (...) {
+      }
+      if (nextBlock != nullptr) {
+        nextBlock->getData()->header.dataSize = 0;
+      }
     }
 
     // format data block
     if (nextBlock != nullptr) {
-      DataBlock* b = nextBlock->getData();
-
-      snapshotLock.lock();
-      if ((time(NULL) - snapshotMetadata.timestamp < 5) && (snapshotMetadata.currentSize < (int)b->header.dataSize)) {
-	b->header.dataSize = snapshotMetadata.currentSize;
-	memcpy(b->data, snapshotData.get(), snapshotMetadata.currentSize);
-      }
-      snapshotLock.unlock();
-
       // TODO: set TF id, timestamp, etc
       nBlocks++;
       // printf("publish DCS for tf %d / maxTf %d\n", nBlocks, (int)maxTf);
@@ -332,8 +361,20 @@ DataBlockContainerReference ReadoutEquipmentZmq::getNextBlock()
     DataBlock* b = nextBlock->getData();
     int bsz = nextBlock->getDataBufferSize();
     
+    // receive directly in the page. Each part of a multipart message goes to a separate page.
     int nb = 0;
     nb = zmq_recv(zh, b->data, bsz, ZMQ_DONTWAIT);
+    if (nb >= 0) {
+      int more = 0;
+      size_t moreSize = sizeof(more);
+      if (zmq_getsockopt(zh, ZMQ_RCVMORE, &more, &moreSize)) {
+        more = 0;
+      }
+      if ((more) && (!isMultipart)) {
+        multipartRx++;
+      }
+      isMultipart = more;
+    }
     if (nb >= bsz) {
       // buffer was too small to get full message
       theLog.log(LogWarningDevel, "ZMQ message bigger than buffer, skipping");
@@ -350,6 +391,27 @@ DataBlockContainerReference ReadoutEquipmentZmq::getNextBlock()
   return nextBlock;
 }
 
+DataBlockContainerReference ReadoutEquipmentZmq::getSnapshotBlock(const DataBlockContainerReference& snapshot)
+{
+  // new header, pointing to the snapshot page data
+  // the snapshot page is kept until all blocks using it are released
+  DataBlock* db = new DataBlock;
+  *db = *snapshot->getData();
+  db->header.memorySize = 0; // memory is accounted for the snapshot page only
+  DataBlockContainerReference parent = snapshot;
+  DataBlockContainerReference b = nullptr;
+  try {
+    b = std::make_shared<DataBlockContainer>([db, parent]() { delete db; }, db, snapshot->getDataBufferSize());
+  } catch (...) {
+    delete db;
+    return nullptr;
+  }
+  // child blocks are not pool pages: only the snapshot page itself is tracked in the pool
+  b->memoryPagesPoolPtr = nullptr;
+  b->memoryPageIndex = -1;
+  return b;
+}
+
 int ReadoutEquipmentZmq::tfClientCallback(void* msg, int msgSize)
 {
   uint64_t tf;
@@ -366,6 +428,7 @@ int ReadoutEquipmentZmq::tfClientCallback(void* msg, int msgSize)
       nBlocks = maxTf;
     }
     maxTf = tf;
+    notifyDataReady();
     return 0;
   }
   return -1;
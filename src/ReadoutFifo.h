@@ -0,0 +1,183 @@
+// Copyright 2019-2020 CERN and copyright holders of ALICE O2.
+// See https://alice-o2.web.cern.ch/copyright for details of the copyright holders.
+// All rights not expressly granted are reserved.
+//
+// This software is distributed under the terms of the GNU General Public
+// License v3 (GPL Version 3), copied verbatim in the file "COPYING".
+//
+// In applying this license CERN does not waive the privileges and immunities
+// granted to it by virtue of its status as an Intergovernmental Organization
+// or submit itself to any jurisdiction.
+
+#ifndef _READOUTFIFO_H
+#define _READOUTFIFO_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdint.h>
+#include <utility>
+
+// A bounded FIFO for one producer thread and one consumer thread, used between the readout pipeline stages.
+// The interface mirrors AliceO2::Common::Fifo (push/pop return 0 on success, -1 when full/empty),
+// with in addition pushBatch() / popBatch() to move several items at once.
+// Each side keeps a cached copy of the other side index, which is refreshed only when the fifo looks full (producer)
+// or empty (consumer), and a batch operation publishes its index once for all items: shared indexes are touched
+// once per batch instead of several times per item.
+// Items are moved in and out of the fifo, so that no reference is kept in the fifo after pop().
+// clear() should not be called concurrently with push/pop.
+
+template <typename T>
+class ReadoutFifo
+{
+ public:
+  ReadoutFifo(int size)
+  {
+    this->size = (size > 0) ? size : 1;
+    capacity = 1;
+    while (capacity < (uint64_t)this->size) {
+      capacity *= 2;
+    }
+    mask = capacity - 1;
+    slots = std::make_unique<T[]>(capacity);
+    indexPush.store(0, std::memory_order_relaxed);
+    indexPop.store(0, std::memory_order_relaxed);
+  }
+
+  ~ReadoutFifo() {}
+
+  // insert an item. Returns 0 on success, -1 if fifo full.
+  int push(const T& item)
+  {
+    uint64_t pos = indexPush.load(std::memory_order_relaxed);
+    if (getFreeForPush(pos) == 0) {
+      return -1;
+    }
+    slots[pos & mask] = item;
+    indexPush.store(pos + 1, std::memory_order_release);
+    return 0;
+  }
+
+  // insert up to n items (moved from array). Returns number of items inserted.
+  int pushBatch(T* items, int n)
+  {
+    uint64_t pos = indexPush.load(std::memory_order_relaxed);
+    uint64_t nFree = getFreeForPush(pos, n);
+    if ((uint64_t)n > nFree) {
+      n = (int)nFree;
+    }
+    for (int i = 0; i < n; i++) {
+      slots[(pos + i) & mask] = std::move(items[i]);
+    }
+    if (n > 0) {
+      indexPush.store(pos + n, std::memory_order_release);
+    }
+    return n;
+  }
+
+  // retrieve an item. Returns 0 on success, -1 if fifo empty.
+  int pop(T& item)
+  {
+    uint64_t pos = indexPop.load(std::memory_order_relaxed);
+    if (getUsedForPop(pos) == 0) {
+      return -1;
+    }
+    item = std::move(slots[pos & mask]);
+    indexPop.store(pos + 1, std::memory_order_release);
+    return 0;
+  }
+
+  // retrieve up to n items (moved to array). Returns number of items retrieved.
+  int popBatch(T* items, int n)
+  {
+    uint64_t pos = indexPop.load(std::memory_order_relaxed);
+    uint64_t nUsed = getUsedForPop(pos, n);
+    if ((uint64_t)n > nUsed) {
+      n = (int)nUsed;
+    }
+    for (int i = 0; i < n; i++) {
+      items[i] = std::move(slots[(pos + i) & mask]);
+    }
+    if (n > 0) {
+      indexPop.store(pos + n, std::memory_order_release);
+    }
+    return n;
+  }
+
+  // get a copy of the first item, without removing it. Returns 0 on success, -1 if fifo empty. To be called by consumer.
+  int front(T& item)
+  {
+    uint64_t pos = indexPop.load(std::memory_order_relaxed);
+    if (getUsedForPop(pos) == 0) {
+      return -1;
+    }
+    item = slots[pos & mask];
+    return 0;
+  }
+
+  // remove all items
+  void clear()
+  {
+    T item;
+    while (pop(item) == 0) {
+    }
+  }
+
+  // number of items in fifo
+  // this is a snapshot, it may be outdated immediately when other threads are active
+  int getNumberOfUsedSlots()
+  {
+    uint64_t pop = indexPop.load(std::memory_order_acquire);
+    uint64_t push = indexPush.load(std::memory_order_acquire);
+    if (push <= pop) {
+      return 0;
+    }
+    return (int)(push - pop);
+  }
+
+  int getNumberOfFreeSlots() { return size - getNumberOfUsedSlots(); }
+  int getSize() { return size; }
+  bool isEmpty() { return getNumberOfUsedSlots() == 0; }
+  bool isFull() { return getNumberOfUsedSlots() >= size; }
+
+ private:
+  static constexpr size_t cacheLineSize = 64;
+
+  std::unique_ptr<T[]> slots; // ring of slots
+  int size;                   // maximum number of items
+  uint64_t capacity;          // number of slots (power of 2, at least size)
+  uint64_t mask;              // capacity - 1, for fast modulo
+
+  // producer side, on its own cache line
+  alignas(cacheLineSize) std::atomic<uint64_t> indexPush; // next position to write
+  uint64_t cachedIndexPop = 0;                            // last value of indexPop seen by producer
+
+  // consumer side, on its own cache line
+  alignas(cacheLineSize) std::atomic<uint64_t> indexPop; // next position to read
+  uint64_t cachedIndexPush = 0;                          // last value of indexPush seen by consumer
+  char padding[cacheLineSize - sizeof(std::atomic<uint64_t>) - sizeof(uint64_t)];
+
+  // number of free slots for producer, refreshing consumer index only if less than wanted
+  uint64_t getFreeForPush(uint64_t pos, int wanted = 1)
+  {
+    uint64_t nFree = size - (pos - cachedIndexPop);
+    if (nFree < (uint64_t)wanted) {
+      cachedIndexPop = indexPop.load(std::memory_order_acquire);
+      nFree = size - (pos - cachedIndexPop);
+    }
+    return nFree;
+  }
+
+  // number of used slots for consumer, refreshing producer index only if less than wanted
+  uint64_t getUsedForPop(uint64_t pos, int wanted = 1)
+  {
+    uint64_t nUsed = cachedIndexPush - pos;
+    if (nUsed < (uint64_t)wanted) {
+      cachedIndexPush = indexPush.load(std::memory_order_acquire);
+      nUsed = cachedIndexPush - pos;
+    }
+    return nUsed;
+  }
+};
+
+#endif // #ifndef _READOUTFIFO_H
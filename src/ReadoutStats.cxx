@@ -31,6 +31,8 @@ ReadoutStats gReadoutStats;
 ReadoutStats::ReadoutStats() { 
   counters.version = ReadoutStatsCountersVersion;
   bzero(&counters.source, sizeof(counters.source));
+  pageLatency.version = ReadoutStatsPageLatencyVersion;
+  bzero(&pageLatency.source, sizeof(pageLatency.source));
   reset();
 
   shutdownThread = 0;
@@ -74,10 +76,20 @@ void ReadoutStats::reset(bool lightReset)
     for (unsigned int i = 0; i < ReadoutStatsMaxItems; i++) {
       counters.bufferUsage[i] = -1.0;
       counters.bufferSize[i] = 0;
+      counters.bufferMemoryPageSize[i] = 0;
+      for (unsigned int j = 0; j < ReadoutStatsPageStates; j++) {
+        for (unsigned int k = 0; k < ReadoutStatsPageLatencyBins; k++) {
+          pageLatency.bufferPageStateLatency[i][j][k] = 0;
+        }
+      }
     }
   }
 
   counters.runNumber = undefinedRunNumber;
+
+  counters.aggregatorSliceTimeout = 0;
+  counters.aggregatorStfTimeout = 0;
+  counters.aggregatorOutputPending = 0;
 }
 
 void ReadoutStats::print()
@@ -249,6 +261,15 @@ void ReadoutStats::publishNow() {
 	lastUpdate = newUpdate;
 	lastPublishTimestamp = snapshot.timestamp;
       }
+      if ((pageLatencyEnabled) && (snapshot.timestamp.load() - lastPageLatencyPublishTimestamp > pageLatencyPublishFactor * publishInterval - 0.1)) {
+        // publish page latency histograms, less often
+        std::unique_ptr<ReadoutStatsPageLatency> latencySnapshot = std::make_unique<ReadoutStatsPageLatency>();
+        memcpy((void *)latencySnapshot.get(), (void *)&gReadoutStats.pageLatency, sizeof(ReadoutStatsPageLatency));
+        memcpy(latencySnapshot->source, snapshot.source, sizeof(latencySnapshot->source));
+        latencySnapshot->timestamp = snapshot.timestamp.load();
+        zmq_send(zmqHandle, latencySnapshot.get(), sizeof(ReadoutStatsPageLatency), ZMQ_DONTWAIT);
+        lastPageLatencyPublishTimestamp = snapshot.timestamp;
+      }
     }
     publishMutex.unlock();
   }
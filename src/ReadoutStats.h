@@ -25,6 +25,8 @@
 #endif
 
 const int ReadoutStatsMaxItems = 25;
+const int ReadoutStatsPageStates = 9; // number of memory page states (see MemoryPage::PageState)
+const int ReadoutStatsPageLatencyBins = 24; // number of bins of page state latency histograms (see MemoryPage::latencyHistogramBins)
 
 struct ReadoutStatsCounters {
   uint32_t version; // version number of this header
@@ -54,14 +56,33 @@ struct ReadoutStatsCounters {
   std::atomic<uint64_t> ddMemoryPendingBytes;       // Data Distribution: number of bytes pending release in ConsumerFMQ (real memory)
   std::atomic<uint64_t> ddPayloadPendingBytes;      // Data Distribution: number of bytes pending release in ConsumerFMQ (payload only, not accounting for memory fragmentation overhead)
   std::atomic<uint64_t> runNumber;                  // current run number (valid only in running state)
+  std::atomic<uint64_t> bufferMemoryPageSize[ReadoutStatsMaxItems]; // size of system memory pages (e.g. 4kB, or hugepage size) backing buffer, in bytes. 0 means unknown.
+  std::atomic<double> aggregatorSliceTimeout;       // current timeout used by aggregator to close slices, in seconds. 0 if not used.
+  std::atomic<double> aggregatorStfTimeout;         // current timeout used by aggregator to send incomplete subtimeframes, in seconds. 0 if not used.
+  std::atomic<uint32_t> aggregatorOutputPending;    // number of data sets waiting in aggregator output FIFO, sampled before they are retrieved by main loop
 };
 
 // version number of this struct
-const uint32_t ReadoutStatsCountersVersion = 0xA0000004;
+const uint32_t ReadoutStatsCountersVersion = 0xA0000008;
 
 // need to be able to easily transmit this struct as a whole
 static_assert(std::is_trivially_copyable<ReadoutStatsCounters>::value);
 
+// histograms of time spent by memory pages in each state
+// this is published separately from ReadoutStatsCounters (bigger, less often, and only when page state timing is enabled)
+struct ReadoutStatsPageLatency {
+  uint32_t version; // version number of this header
+  char source[32]; // name of the source providing these counters
+  std::atomic<double> timestamp;
+  std::atomic<uint64_t> bufferPageStateLatency[ReadoutStatsMaxItems][ReadoutStatsPageStates][ReadoutStatsPageLatencyBins]; // for each buffer and page state, histogram of time spent by pages in this state (cumulated counts). Bin 0: below 1 microsecond, bin i: [2^(i-1), 2^i[ microseconds, last bin: overflow, 2^(ReadoutStatsPageLatencyBins-2) microseconds or more.
+};
+
+// version number of this struct
+const uint32_t ReadoutStatsPageLatencyVersion = 0xA1000001;
+
+static_assert(std::is_trivially_copyable<ReadoutStatsPageLatency>::value);
+static_assert(sizeof(ReadoutStatsPageLatency) != sizeof(ReadoutStatsCounters)); // messages are identified by their size
+
 // utility to assign strings to uint64
 uint64_t stringToUint64(const char*);
 
@@ -74,7 +95,10 @@ class ReadoutStats
   void print();
 
   ReadoutStatsCounters counters;
+  ReadoutStatsPageLatency pageLatency;
   bool isFairMQ; // flag to report when FairMQ used
+  std::atomic<bool> pageLatencyEnabled = false; // when set, pageLatency is published (every pageLatencyPublishFactor publish intervals)
+  static const int pageLatencyPublishFactor = 10;
   
   int startPublish(const std::string &cfgZmqPublishAddress, double cfgZmqPublishInterval);
   int stopPublish();
@@ -97,6 +121,7 @@ class ReadoutStats
   #endif
   uint64_t lastUpdate = (uint64_t)-1;
   double lastPublishTimestamp = 0;
+  double lastPageLatencyPublishTimestamp = 0;
 };
 
 extern ReadoutStats gReadoutStats;
@@ -12,10 +12,15 @@
 #include "ReadoutUtils.h"
 
 #include <math.h>
+#include <sched.h>
 #include <sstream>
 #include <stdio.h>
 #include <unistd.h>
 #include <filesystem>
+#include <strings.h>
+#include <sys/mman.h>
+#include <thread>
+#include <vector>
 
 #include "RAWDataHeader.h"
 #include "readoutInfoLogger.h"
@@ -306,6 +311,158 @@ int numaGetNodeFromAddress(void *ptr, int &node) {
   return -1;
 }
 
+int numaGetCurrentNode() {
+  #ifdef WITH_NUMA
+    if (numa_available() >= 0) {
+      int cpu = sched_getcpu();
+      if (cpu >= 0) {
+        return numa_node_of_cpu(cpu);
+      }
+    }
+  #endif
+  return -1;
+}
+
+int numaGetBoundNode() {
+  int node = -1;
+  #ifdef WITH_NUMA
+    if (numa_available() >= 0) {
+      struct bitmask* bound = numa_get_membind();
+      struct bitmask* allowed = numa_get_mems_allowed();
+      if ((bound != nullptr) && (allowed != nullptr)) {
+        if ((numa_bitmask_weight(bound) == 1) && (numa_bitmask_weight(allowed) > 1)) {
+          for (int i = 0; i <= numa_max_node(); i++) {
+            if (numa_bitmask_isbitset(bound, i)) {
+              node = i;
+              break;
+            }
+          }
+        }
+      }
+      if (bound != nullptr) {
+        numa_free_nodemask(bound);
+      }
+      if (allowed != nullptr) {
+        numa_free_nodemask(allowed);
+      }
+    }
+  #endif
+  return node;
+}
+
+int numaGetNodes(std::vector<int> &nodes) {
+  nodes.clear();
+  #ifdef WITH_NUMA
+    if (numa_available() >= 0) {
+      struct bitmask* nodemask = numa_get_mems_allowed();
+      if (nodemask != nullptr) {
+        for (int i = 0; i <= numa_max_node(); i++) {
+          if (numa_bitmask_isbitset(nodemask, i)) {
+            nodes.push_back(i);
+          }
+        }
+        numa_free_nodemask(nodemask);
+        return 0;
+      }
+    }
+  #endif
+  return -1;
+}
+
+int numaBindMemory(void *ptr, size_t size, int numaNode) {
+  (void)ptr;
+  (void)size;
+  (void)numaNode;
+  #ifdef WITH_NUMA
+    if ((numa_available() < 0) || (numaNode < 0) || (numaNode > numa_max_node())) {
+      return -1;
+    }
+    size_t systemPageSize = getpagesize();
+    size_t begin = (((size_t)ptr + systemPageSize - 1) / systemPageSize) * systemPageSize;
+    size_t end = (((size_t)ptr + size) / systemPageSize) * systemPageSize;
+    if (end <= begin) {
+      return -1;
+    }
+    struct bitmask* nodemask = numa_allocate_nodemask();
+    if (nodemask == nullptr) {
+      return -1;
+    }
+    numa_bitmask_clearall(nodemask);
+    numa_bitmask_setbit(nodemask, numaNode);
+    int err = mbind((void *)begin, end - begin, MPOL_BIND, nodemask->maskp, nodemask->size + 1, MPOL_MF_MOVE);
+    numa_free_nodemask(nodemask);
+    if (err == 0) {
+      return 0;
+    }
+  #endif
+  return -1;
+}
+
+int memoryPrefault(void *ptr, size_t size) {
+  if ((ptr == nullptr) || (size == 0)) {
+    return -1;
+  }
+  size_t systemPageSize = getpagesize();
+  char *begin = (char *)((size_t)ptr - ((size_t)ptr % systemPageSize));
+  char *end = (char *)ptr + size;
+  #ifdef MADV_POPULATE_WRITE
+    // only on recent Linux kernels. Pages already mapped are not modified.
+    if (madvise(begin, end - begin, MADV_POPULATE_WRITE) == 0) {
+      return 0;
+    }
+  #endif
+  // fallback: write each page with its own content
+  for (volatile char *p = (volatile char *)ptr; p < end; p += systemPageSize) {
+    *p = *p;
+  }
+  return 0;
+}
+
+int memoryClear(void *ptr, size_t size, int nThreads, int numaNode) {
+  if ((ptr == nullptr) || (size == 0)) {
+    return -1;
+  }
+  if ((nThreads <= 1) && (numaNode < 0)) {
+    bzero(ptr, size);
+    return 0;
+  }
+  if (nThreads < 1) {
+    nThreads = 1;
+  }
+  // split in chunks aligned on system pages
+  size_t systemPageSize = getpagesize();
+  size_t chunkSize = size / nThreads;
+  chunkSize += systemPageSize - (chunkSize % systemPageSize);
+  std::vector<std::thread> threads;
+  char *p = (char *)ptr;
+  char *end = (char *)ptr + size;
+  try {
+    for (; p < end; p += chunkSize) {
+      size_t sz = ((size_t)(end - p) < chunkSize) ? end - p : chunkSize;
+      threads.emplace_back([p, sz, numaNode]() {
+        setThreadName("readout-clear");
+        #ifdef WITH_NUMA
+          // run close to the memory, without changing memory policy (pages are already mapped)
+          if (numaNode >= 0) {
+            numa_run_on_node(numaNode);
+          }
+        #endif
+        bzero(p, sz);
+      });
+    }
+  }
+  catch (...) {
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  if (p < end) {
+    // thread creation failed, finish here
+    bzero(p, end - p);
+  }
+  return 0;
+}
+
 // function to set a name for current thread
 void setThreadName(const char* name) {
   #ifdef _GNU_SOURCE
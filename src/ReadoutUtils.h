@@ -85,6 +85,34 @@ int numaBind(int numaNode);
 // returns 0 on success, or an error code
 int numaGetNodeFromAddress(void *ptr, int &node);
 
+// function to get NUMA node of the CPU running the calling thread
+// returns node id, or -1 if unknown
+int numaGetCurrentNode();
+
+// function to get NUMA node the calling thread memory is bound to (eg with numaBind())
+// returns node id, or -1 if not bound to a single node
+int numaGetBoundNode();
+
+// function to get the list of NUMA nodes with memory available
+// returns 0 on success, or an error code
+int numaGetNodes(std::vector<int> &nodes);
+
+// function to set the NUMA policy of a memory range, so that its pages are allocated on given node.
+// Pages already allocated are moved. The range is reduced to the system pages fully inside it.
+// returns 0 on success, or an error code
+int numaBindMemory(void *ptr, size_t size, int numaNode);
+
+// function to map all pages of a memory range in RAM (prefault) without changing its content,
+// so that the physical memory is assigned (following the NUMA policy of the calling thread) and later accesses do not fault.
+// Uses madvise(MADV_POPULATE_WRITE) when available, otherwise touches each system page.
+// returns 0 on success, or an error code
+int memoryPrefault(void *ptr, size_t size);
+
+// function to write zeroes in a memory range, split between nThreads threads.
+// If numaNode >= 0, threads are bound to this NUMA node.
+// returns 0 on success, or an error code
+int memoryClear(void *ptr, size_t size, int nThreads = 1, int numaNode = -1);
+
 // function to set a name for current thread
 void setThreadName(const char*name);
 
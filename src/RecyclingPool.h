@@ -0,0 +1,125 @@
+// Copyright 2019-2020 CERN and copyright holders of ALICE O2.
+// See https://alice-o2.web.cern.ch/copyright for details of the copyright holders.
+// All rights not expressly granted are reserved.
+//
+// This software is distributed under the terms of the GNU General Public
+// License v3 (GPL Version 3), copied verbatim in the file "COPYING".
+//
+// In applying this license CERN does not waive the privileges and immunities
+// granted to it by virtue of its status as an Intergovernmental Organization
+// or submit itself to any jurisdiction.
+
+#ifndef _RECYCLINGPOOL_H
+#define _RECYCLINGPOOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "LockFreeFifo.h"
+
+// A pool of preallocated objects (typically, containers like std::vector), handed out as std::shared_ptr.
+// When the last reference is released, the object is cleared (keeping its capacity) and put back in the pool.
+// The shared_ptr control block is stored with the object, so that no heap allocation is done in steady state.
+// If the pool is empty, objects are allocated from the heap (and counted).
+// The object type should provide a clear() method.
+// get() and release can be called concurrently from any thread.
+// The pool storage is kept until all objects are released, even if the pool is destroyed before.
+
+template <typename T>
+class RecyclingPool
+{
+ public:
+  // constructor
+  // parameters:
+  // - number of objects to preallocate
+  // - an optional function called once on each object, e.g. to reserve capacity
+  RecyclingPool(size_t numberOfObjects, std::function<void(T&)> init = nullptr)
+  {
+    storage = std::make_shared<Storage>(numberOfObjects);
+    for (auto& s : storage->slots) {
+      if (init != nullptr) {
+        init(s.object);
+      }
+      storage->available.push(&s);
+    }
+  }
+
+  ~RecyclingPool() {}
+
+  // get an empty object from the pool
+  std::shared_ptr<T> get()
+  {
+    Slot* s = nullptr;
+    if (storage->available.pop(s) != 0) {
+      storage->nHeapAllocations++;
+      return std::make_shared<T>();
+    }
+    return std::shared_ptr<T>(&s->object, Deleter(), Allocator<T>(storage, s));
+  }
+
+  size_t getNumberOfObjects() { return storage->slots.size(); }                       // number of objects in pool
+  size_t getNumberOfObjectsAvailable() { return storage->available.getNumberOfUsedSlots(); } // number of objects currently available
+  uint64_t getNumberOfHeapAllocations() { return storage->nHeapAllocations; }         // number of objects allocated from the heap because pool was empty
+  void resetStats() { storage->nHeapAllocations = 0; }                                // reset counters, eg between runs
+
+ private:
+  static const size_t controlBlockSize = 128; // space reserved for shared_ptr control block
+
+  struct Slot {
+    T object;
+    alignas(std::max_align_t) char controlBlock[controlBlockSize];
+  };
+
+  struct Storage {
+    Storage(size_t n) : slots(n), available(n) {}
+    std::vector<Slot> slots;            // preallocated objects
+    LockFreeFifo<Slot*> available;      // objects ready to be used
+    std::atomic<uint64_t> nHeapAllocations = 0;
+  };
+  std::shared_ptr<Storage> storage;
+
+  // when last reference is released, object is emptied (but memory is kept)
+  struct Deleter {
+    void operator()(T* p) { p->clear(); }
+  };
+
+  // allocator for the control block of a given slot
+  // the slot is put back in pool when control block is released, i.e. when it is not used at all anymore
+  template <typename U>
+  struct Allocator {
+    using value_type = U;
+    std::shared_ptr<Storage> storage;
+    Slot* slot;
+
+    Allocator(const std::shared_ptr<Storage>& st, Slot* s) : storage(st), slot(s) {}
+    template <typename V>
+    Allocator(const Allocator<V>& a) : storage(a.storage), slot(a.slot) {}
+
+    U* allocate(size_t n)
+    {
+      if ((sizeof(U) * n <= controlBlockSize) && (alignof(U) <= alignof(std::max_align_t))) {
+        return (U*)slot->controlBlock;
+      }
+      return std::allocator<U>().allocate(n);
+    }
+
+    void deallocate(U* p, size_t n)
+    {
+      if ((void*)p != (void*)slot->controlBlock) {
+        std::allocator<U>().deallocate(p, n);
+      }
+      storage->available.push(slot);
+    }
+
+    template <typename V>
+    bool operator==(const Allocator<V>& a) const { return slot == a.slot; }
+    template <typename V>
+    bool operator!=(const Allocator<V>& a) const { return slot != a.slot; }
+  };
+};
+
+#endif // #ifndef _RECYCLINGPOOL_H
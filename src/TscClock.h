@@ -0,0 +1,120 @@
+// Copyright 2019-2020 CERN and copyright holders of ALICE O2.
+// See https://alice-o2.web.cern.ch/copyright for details of the copyright holders.
+// All rights not expressly granted are reserved.
+//
+// This software is distributed under the terms of the GNU General Public
+// License v3 (GPL Version 3), copied verbatim in the file "COPYING".
+//
+// In applying this license CERN does not waive the privileges and immunities
+// granted to it by virtue of its status as an Intergovernmental Organization
+// or submit itself to any jurisdiction.
+
+#ifndef _TSCCLOCK_H
+#define _TSCCLOCK_H
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TSCCLOCK_HAS_RDTSC
+#endif
+
+// A low-overhead monotonic clock, for timing of frequent events.
+// On x86, timestamps are read from the CPU time stamp counter (rdtsc), calibrated once against steady_clock.
+// The TSC is used only if the CPU reports it is invariant (constant_tsc and nonstop_tsc flags),
+// otherwise (or on other architectures), timestamps are steady_clock nanoseconds.
+// calibrate() should be called once before timestamps are taken (it is called by getSecondsPerTick() otherwise),
+// timestamps taken before are not consistent with the ones taken after.
+
+class TscClock
+{
+ public:
+  // get current timestamp, in ticks
+  static inline uint64_t now()
+  {
+#ifdef TSCCLOCK_HAS_RDTSC
+    if (useTsc.load(std::memory_order_relaxed)) {
+      return __rdtsc();
+    }
+#endif
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // convert a number of ticks to seconds
+  static inline double toSeconds(uint64_t ticks) { return ticks * getSecondsPerTick(); }
+
+  // convert a number of ticks to microseconds (rounded down)
+  static inline uint64_t toMicroseconds(uint64_t ticks) { return (uint64_t)(ticks * getSecondsPerTick() * 1E6); }
+
+  // get duration of a tick, in seconds
+  static double getSecondsPerTick()
+  {
+    calibrate();
+    return secondsPerTick;
+  }
+
+  // select clock source and measure tick duration. Executed only once, subsequent calls return immediately.
+  static void calibrate()
+  {
+    std::call_once(calibrationFlag, []() {
+#ifdef TSCCLOCK_HAS_RDTSC
+      if (isTscInvariant()) {
+        const int nLoops = 3;
+        double best = 0;
+        for (int i = 0; i < nLoops; i++) {
+          auto t0 = std::chrono::steady_clock::now();
+          uint64_t c0 = __rdtsc();
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+          auto t1 = std::chrono::steady_clock::now();
+          uint64_t c1 = __rdtsc();
+          if (c1 <= c0) {
+            best = 0;
+            break;
+          }
+          double v = std::chrono::duration<double>(t1 - t0).count() / (c1 - c0);
+          if ((best == 0) || (v < best)) {
+            best = v;
+          }
+        }
+        if (best > 0) {
+          secondsPerTick = best;
+          useTsc.store(true, std::memory_order_relaxed);
+        }
+      }
+#endif
+    });
+  }
+
+  // tells if TSC is used as clock source
+  static bool isUsingTsc()
+  {
+    calibrate();
+    return useTsc.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static inline std::atomic<bool> useTsc = false; // when set, TSC is used
+  static inline double secondsPerTick = 1E-9; // tick duration
+  static inline std::once_flag calibrationFlag;
+
+  // check TSC is invariant (increments at constant rate, also in idle states)
+  static bool isTscInvariant()
+  {
+    std::ifstream f("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(f, line)) {
+      if (line.compare(0, 5, "flags") == 0) {
+        return (line.find(" constant_tsc") != std::string::npos) && (line.find(" nonstop_tsc") != std::string::npos);
+      }
+    }
+    return false;
+  }
+};
+
+#endif // #ifndef _TSCCLOCK_H
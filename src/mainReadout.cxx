@@ -74,6 +74,7 @@
 #include "DataBlockAggregator.h"
 #include "MemoryBankManager.h"
 #include "ReadoutEquipment.h"
+#include "ReadoutFifo.h"
 #include "ReadoutStats.h"
 #include "ReadoutUtils.h"
 #include "ReadoutVersion.h"
@@ -390,6 +391,10 @@ class Readout
   int cfgDisableAggregatorSlicing;
   double cfgAggregatorSliceTimeout;
   double cfgAggregatorStfTimeout;
+  int cfgAggregatorSlicingThreads;
+  int cfgAggregatorStfSources;
+  int cfgAggregatorAdaptiveTimeouts;
+  double cfgAggregatorAdaptiveTimeoutMin;
   double cfgTfRateLimit;
   int cfgTfRateLimitMode;
   int cfgLogbookEnabled;
@@ -420,7 +425,7 @@ class Readout
                                                     // to push data
   std::vector<std::unique_ptr<ReadoutEquipment>> readoutDevices;
   std::unique_ptr<DataBlockAggregator> agg;
-  std::unique_ptr<AliceO2::Common::Fifo<DataSetReference>> agg_output;
+  std::unique_ptr<ReadoutFifo<DataSetReference>> agg_output;
 
   int isRunning = 0;                          // set to 1 when running, 0 when not running (or should stop running)
   AliceO2::Common::Timer startTimer;          // time counter from start()
@@ -1142,6 +1147,27 @@ int Readout::_configure(const boost::property_tree::ptree& properties)
   cfg.getOptionalValue<int>("readout.memoryPoolStatsEnabled", cfgMemoryPoolStatsEnabled);
   extern int MemoryPagesPoolStatsEnabled;
   MemoryPagesPoolStatsEnabled = cfgMemoryPoolStatsEnabled;
+  // configuration parameter: | readout | memoryPoolMagazineSize | int | 0 | If set, each thread getting pages keeps a local cache of up to this number of free pages for each memory pool (max 256), exchanged by batches with the pool. This reduces contention on the pool. Pages released by a thread are cached only if it also gets pages from the same pool, otherwise they are given back to the pool directly. |
+  int cfgMemoryPoolMagazineSize = 0;
+  cfg.getOptionalValue<int>("readout.memoryPoolMagazineSize", cfgMemoryPoolMagazineSize);
+  extern int MemoryPagesPoolMagazineSize;
+  MemoryPagesPoolMagazineSize = cfgMemoryPoolMagazineSize;
+  // configuration parameter: | readout | memoryPoolPageStateTiming | int | 1 | If set, time spent by memory pages in each state is accounted (reported at end of run when memoryPoolStatsEnabled is set). Histograms of these times are sent for each buffer as metrics readout.pageStateLatency*, and published with the stats (statsPublishAddress) every 10 intervals. Timestamps are taken from the CPU time stamp counter when it is invariant, or from the system monotonic clock otherwise. When disabled, a page state change is a single store. |
+  int cfgMemoryPoolPageStateTiming = 1;
+  cfg.getOptionalValue<int>("readout.memoryPoolPageStateTiming", cfgMemoryPoolPageStateTiming);
+  extern int MemoryPagesPoolStateTiming;
+  MemoryPagesPoolStateTiming = cfgMemoryPoolPageStateTiming;
+  gReadoutStats.pageLatencyEnabled = (cfgMemoryPoolPageStateTiming != 0);
+  // configuration parameter: | readout | memoryClearMode | int | 0 | Select how memory banks and pools are initialized. 0: banks and pools are zeroed upfront with a single thread. 1: banks and pools are prefaulted (mapped in RAM on their NUMA node), then zeroed with memoryClearThreads parallel threads bound to the corresponding NUMA node. 2: banks and pools are prefaulted only, and each page of a pool is zeroed when it is used for the first time. Time spent is logged for each bank and pool. |
+  int cfgMemoryClearMode = 0;
+  cfg.getOptionalValue<int>("readout.memoryClearMode", cfgMemoryClearMode);
+  // configuration parameter: | readout | memoryClearThreads | int | 8 | Number of threads used to zero memory when memoryClearMode = 1. |
+  int cfgMemoryClearThreads = 8;
+  cfg.getOptionalValue<int>("readout.memoryClearThreads", cfgMemoryClearThreads);
+  extern int MemoryBankClearMode;
+  extern int MemoryBankClearThreads;
+  MemoryBankClearMode = cfgMemoryClearMode;
+  MemoryBankClearThreads = cfgMemoryClearThreads;
   // configuration parameter: | readout | disableAggregatorSlicing | int | 0 | When set, the aggregator slicing is disabled, data pages are passed through without grouping/slicing. |
   cfgDisableAggregatorSlicing = 0;
   cfg.getOptionalValue<int>("readout.disableAggregatorSlicing", cfgDisableAggregatorSlicing);
@@ -1151,6 +1177,18 @@ int Readout::_configure(const boost::property_tree::ptree& properties)
   // configuration parameter: | readout | aggregatorStfTimeout | double | 0 | When set, subtimeframes are buffered until timeout (otherwise, sent immediately and independently for each data source). |
   cfgAggregatorStfTimeout = 0;
   cfg.getOptionalValue<double>("readout.aggregatorStfTimeout", cfgAggregatorStfTimeout);
+  // configuration parameter: | readout | aggregatorStfSources | int | 0 | Used with aggregatorStfTimeout. Number of data sources (equipment/link) expected in each subtimeframe: when all have sent all their data for it (i.e. they sent data of a next timeframe, a slice closed on aggregatorSliceTimeout is not enough), the subtimeframe is sent immediately, and the timeout only applies to subtimeframes with missing sources. If zero, the expected sources are the ones seen since start (learned from the first subtimeframe). If negative, subtimeframes are sent on timeout only. |
+  cfgAggregatorStfSources = 0;
+  cfg.getOptionalValue<int>("readout.aggregatorStfSources", cfgAggregatorStfSources);
+  // configuration parameter: | readout | aggregatorAdaptiveTimeouts | int | 0 | When set, aggregatorSliceTimeout and aggregatorStfTimeout (if defined) are used as maximum values, and the timeouts are adjusted every second from the delays observed: between pages of a slice (per equipment), and between data of each source and the first data of the same subtimeframe. The timeout is the 99th percentile of delays plus 50%, within aggregatorAdaptiveTimeoutMin and the configured value. Current values are published as metrics readout.aggregatorSliceTimeout and readout.aggregatorStfTimeout. |
+  cfgAggregatorAdaptiveTimeouts = 0;
+  cfg.getOptionalValue<int>("readout.aggregatorAdaptiveTimeouts", cfgAggregatorAdaptiveTimeouts);
+  // configuration parameter: | readout | aggregatorAdaptiveTimeoutMin | double | 0.01 | Minimum value of the aggregator timeouts, in seconds, when aggregatorAdaptiveTimeouts is set. |
+  cfgAggregatorAdaptiveTimeoutMin = 0.01;
+  cfg.getOptionalValue<double>("readout.aggregatorAdaptiveTimeoutMin", cfgAggregatorAdaptiveTimeoutMin);
+  // configuration parameter: | readout | aggregatorSlicingThreads | int | 1 | Number of threads used to slice data in the aggregator. When more than one, equipments are distributed between these threads, and their output is merged (including subtimeframe building) by the aggregator thread. |
+  cfgAggregatorSlicingThreads = 1;
+  cfg.getOptionalValue<int>("readout.aggregatorSlicingThreads", cfgAggregatorSlicingThreads);
   // configuration parameter: | readout | tfRateLimit | double | 0 | When set, the output is limited to a given timeframe rate. |
   cfgTfRateLimit = 0;
   cfg.getOptionalValue<double>("readout.tfRateLimit", cfgTfRateLimit);
@@ -1256,7 +1294,7 @@ int Readout::_configure(const boost::property_tree::ptree& properties)
     }
 
     // bank type
-    // configuration parameter: | bank-* | type | string| | Support used to allocate memory. Possible values: malloc, MemoryMappedFile. |
+    // configuration parameter: | bank-* | type | string| | Support used to allocate memory. Possible values: malloc, MemoryMappedFile, HugePages. MemoryMappedFile uses hugepages from hugetlbfs mount points (size must be a multiple of hugepage size). HugePages uses anonymous hugepages (1GB or 2MB, depending on bank size and availability), without the need of a hugetlbfs mount, and falls back to transparent hugepages. The page size obtained is reported in the bank description. |
     std::string cfgType = "";
     cfg.getOptionalValue<std::string>(kName + ".type", cfgType);
     if (cfgType.length() == 0) {
@@ -1269,6 +1307,32 @@ int Readout::_configure(const boost::property_tree::ptree& properties)
     int cfgNumaNode = -1;
     cfg.getOptionalValue<int>(kName + ".numaNode", cfgNumaNode);
 
+    // split on numa nodes
+    // configuration parameter: | bank-* | numaSplit | string | | If set, the bank is split in contiguous parts of equal size, one per NUMA node, each part being allocated on its node. Value is a comma-separated list of NUMA nodes, or "all" for all nodes available. Memory pools are then taken from the part on the NUMA node of the equipment using it: its numaNode if set, otherwise the node where it is created. The equipment threads are then bound to this node. numaNode is ignored when this is set. |
+    std::string cfgNumaSplit;
+    cfg.getOptionalValue<std::string>(kName + ".numaSplit", cfgNumaSplit);
+    std::vector<int> numaSplitNodes;
+    if (cfgNumaSplit.length()) {
+      if (cfgNumaSplit == "all") {
+        numaGetNodes(numaSplitNodes);
+      } else {
+        std::vector<std::string> items;
+        getListFromString(cfgNumaSplit, items);
+        try {
+          for (auto& i : items) {
+            numaSplitNodes.push_back(std::stoi(i));
+          }
+        } catch (...) {
+          numaSplitNodes.clear();
+        }
+      }
+      if (numaSplitNodes.size() == 0) {
+        theLog.log(LogErrorSupport_(3100), "Skipping memory bank %s:  wrong numaSplit %s", kName.c_str(), cfgNumaSplit.c_str());
+        continue;
+      }
+      cfgNumaNode = -1;
+    }
+
     // instanciate new memory pool
     if (cfgNumaNode >= 0) {
 #ifdef WITH_NUMA
@@ -1295,11 +1359,36 @@ int Readout::_configure(const boost::property_tree::ptree& properties)
       theLog.log(LogErrorSupport_(3230), "Failed to create memory bank %s", kName.c_str());
       continue;
     }
+    // bind memory parts to NUMA nodes, before memory is used
+    if (numaSplitNodes.size()) {
+      if (b->setNumaSplit(numaSplitNodes)) {
+        theLog.log(LogErrorSupport_(3230), "Failed to split memory bank %s on NUMA nodes %s", kName.c_str(), cfgNumaSplit.c_str());
+        continue;
+      }
+      for (auto& r : b->getNumaRanges()) {
+        theLog.log(LogInfoDevel, "Bank %s : range 0x%lX - 0x%lX on NUMA node %d", kName.c_str(), (unsigned long)r.offset, (unsigned long)(r.offset + r.size), r.numaNode);
+      }
+    }
+
     // cleanup the memory range
-    b->clear();
+    AliceO2::Common::Timer clearTimer;
+    clearTimer.reset();
+    if (cfgMemoryClearMode == 0) {
+      b->clear();
+      theLog.log(LogInfoDevel, "Bank %s : zero memory done in %.3lf s", kName.c_str(), clearTimer.getTime());
+    } else {
+      b->prefault();
+      double tPrefault = clearTimer.getTime();
+      if (cfgMemoryClearMode == 1) {
+        b->clear(cfgMemoryClearThreads, cfgNumaNode);
+        theLog.log(LogInfoDevel, "Bank %s : prefault done in %.3lf s, zero memory with %d threads done in %.3lf s", kName.c_str(), tPrefault, cfgMemoryClearThreads, clearTimer.getTime() - tPrefault);
+      } else {
+        theLog.log(LogInfoDevel, "Bank %s : prefault done in %.3lf s, zero memory deferred to first use of pages", kName.c_str(), tPrefault);
+      }
+    }
     // add bank to list centrally managed
     theMemoryBankManager.addBank(b, kName);
-    theLog.log(LogInfoDevel, "Bank %s added", kName.c_str());
+    theLog.log(LogInfoDevel, "Bank %s added: %s, memory page size %lu bytes", kName.c_str(), b->getDescription().c_str(), (unsigned long)b->getMemoryPageSize());
   }
 
   // releasing memory bind policy
@@ -1572,7 +1661,7 @@ int Readout::_configure(const boost::property_tree::ptree& properties)
 
   // aggregator
   theLog.log(LogInfoDevel, "Creating aggregator");
-  agg_output = std::make_unique<AliceO2::Common::Fifo<DataSetReference>>(10000);
+  agg_output = std::make_unique<ReadoutFifo<DataSetReference>>(10000);
   int nEquipmentsAggregated = 0;
   agg = std::make_unique<DataBlockAggregator>(agg_output.get(), "Aggregator");
 
@@ -1670,9 +1759,16 @@ int Readout::_start()
     if (cfgAggregatorStfTimeout > 0) {
       theLog.log(LogInfoDevel, "Aggregator subtimeframe timeout = %.2lf seconds", cfgAggregatorStfTimeout);
       agg->cfgStfTimeout = cfgAggregatorStfTimeout;
+      agg->cfgStfSources = cfgAggregatorStfSources;
       agg->enableStfBuilding = 1;
     }
   }
+  if (cfgAggregatorSlicingThreads > 1) {
+    theLog.log(LogInfoDevel, "Aggregator slicing threads = %d", cfgAggregatorSlicingThreads);
+  }
+  agg->cfgSlicingThreads = cfgAggregatorSlicingThreads;
+  agg->cfgAdaptiveTimeouts = (cfgAggregatorAdaptiveTimeouts != 0);
+  agg->cfgAdaptiveTimeoutMin = cfgAggregatorAdaptiveTimeoutMin;
 
   agg->start();
 
@@ -1743,15 +1839,29 @@ void Readout::loopRunning()
   //ProfilerStart(gperfOutputFile.c_str());
 #endif
 
+  // data sets are retrieved by batches from incoming fifo
+  const int aggBatchSize = 64;
+  std::vector<DataSetReference> aggBatch(aggBatchSize);
+  int aggBatchCount = 0; // number of data sets in batch
+  int aggBatchIndex = 0; // index of next data set to process in batch
+
   try {
   for (;;) {
     if ((!isRunning) && ((cfgFlushEquipmentTimeout <= 0) || (stopTimer.isTimeout()))) {
       break;
     }
 
-    DataSetReference bc = nullptr;
-    // check first element from incoming fifo
-    if (agg_output->front(bc) == 0) {
+    // get new data sets from incoming fifo, when all previous ones have been processed
+    // fifo level is sampled before, so that it includes the data sets retrieved
+    if (aggBatchIndex == aggBatchCount) {
+      gReadoutStats.counters.aggregatorOutputPending = (uint32_t)agg_output->getNumberOfUsedSlots();
+      aggBatchCount = agg_output->popBatch(aggBatch.data(), aggBatchSize);
+      aggBatchIndex = 0;
+    }
+
+    // check first element pending
+    if (aggBatchIndex < aggBatchCount) {
+      DataSetReference& bc = aggBatch[aggBatchIndex];
 
       if (bc != nullptr) {
         // count number of subtimeframes
@@ -1805,8 +1915,9 @@ void Readout::loopRunning()
         }
       }
 
-      // actually remove element from incoming fifo
-      agg_output->pop(bc);
+      // actually remove element from pending ones
+      bc = nullptr;
+      aggBatchIndex++;
 
     } else {
       // we are idle...
@@ -256,6 +256,10 @@ int main(int argc, const char** argv)
       // nothing received
       continue;
     }
+    if (nb == sizeof(ReadoutStatsPageLatency)) {
+      // page state latency histograms, not used here (message truncated to buffer size)
+      continue;
+    }
     if (nb != sizeof(ReadoutStatsCounters)) {
       // wrong message size
       theLog.log(LogWarningDevel, "ZMQ message: unexpected size %d", nb);
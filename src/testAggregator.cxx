@@ -0,0 +1,595 @@
+// Copyright 2019-2020 CERN and copyright holders of ALICE O2.
+// See https://alice-o2.web.cern.ch/copyright for details of the copyright holders.
+// All rights not expressly granted are reserved.
+//
+// This software is distributed under the terms of the GNU General Public
+// License v3 (GPL Version 3), copied verbatim in the file "COPYING".
+//
+// In applying this license CERN does not waive the privileges and immunities
+// granted to it by virtue of its status as an Intergovernmental Organization
+// or submit itself to any jurisdiction.
+
+// test program to check DataBlockAggregator
+// blocks are pushed to the aggregator inputs, and the data sets it outputs are checked
+
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DataBlockAggregator.h"
+#include "DelayHistogram.h"
+
+// logs in console mode
+#include "TtyChecker.h"
+TtyChecker theTtyChecker;
+
+#include <InfoLogger/InfoLogger.hxx>
+AliceO2::InfoLogger::InfoLogger theLog;
+
+// create a block with given ids. Payload is empty.
+DataBlockContainerReference newBlock(uint64_t tfId, uint16_t equipmentId, uint8_t linkId, uint64_t blockId)
+{
+  DataBlock* db = new DataBlock;
+  db->header = defaultDataBlockHeader;
+  db->header.timeframeId = tfId;
+  db->header.equipmentId = equipmentId;
+  db->header.linkId = linkId;
+  db->header.blockId = blockId;
+  db->header.dataSize = 0;
+  db->data = nullptr;
+  return std::make_shared<DataBlockContainer>([db]() { delete db; }, db, 0);
+}
+
+// fifo between pipeline stages: full/empty conditions, batches, and wraparound of indexes
+// returns 0 on success
+int testReadoutFifo()
+{
+  int nErrors = 0;
+  auto check = [&](bool ok, const char* what) {
+    if (!ok) {
+      printf("ReadoutFifo: %s failed\n", what);
+      nErrors++;
+    }
+  };
+
+  // size not a power of 2: capacity is bigger, but not more than size items accepted
+  const int fifoSize = 5;
+  ReadoutFifo<int> f(fifoSize);
+  int v = 0;
+  check(f.isEmpty() && (f.getNumberOfFreeSlots() == fifoSize), "empty at start");
+  check(f.pop(v) == -1, "pop when empty");
+  check(f.front(v) == -1, "front when empty");
+  for (int i = 0; i < fifoSize; i++) {
+    check(f.push(i) == 0, "push");
+  }
+  check(f.isFull() && (f.getNumberOfUsedSlots() == fifoSize), "full");
+  check(f.push(100) == -1, "push when full");
+  int batch[8] = { 100, 101, 102 };
+  check(f.pushBatch(batch, 3) == 0, "pushBatch when full");
+  check((f.front(v) == 0) && (v == 0), "front");
+  for (int i = 0; i < fifoSize; i++) {
+    check((f.pop(v) == 0) && (v == i), "pop order");
+  }
+  check(f.isEmpty() && (f.pop(v) == -1), "empty after pop");
+  check(f.popBatch(batch, 8) == 0, "popBatch when empty");
+
+  // batches partially accepted/retrieved, and many cycles so that indexes wrap around the ring
+  int nextIn = 0;
+  int nextOut = 0;
+  for (int cycle = 0; cycle < 1000; cycle++) {
+    int nIn = 1 + cycle % 7;
+    int items[8];
+    for (int i = 0; i < nIn; i++) {
+      items[i] = nextIn + i;
+    }
+    int nFree = f.getNumberOfFreeSlots();
+    int nPushed = f.pushBatch(items, nIn);
+    check(nPushed == ((nIn < nFree) ? nIn : nFree), "pushBatch count");
+    nextIn += nPushed;
+    int nOut = 1 + (cycle * 3) % 8;
+    int nUsed = f.getNumberOfUsedSlots();
+    int nPopped = f.popBatch(items, nOut);
+    check(nPopped == ((nOut < nUsed) ? nOut : nUsed), "popBatch count");
+    for (int i = 0; i < nPopped; i++) {
+      check(items[i] == nextOut++, "popBatch order");
+    }
+  }
+  check(f.getNumberOfUsedSlots() == nextIn - nextOut, "used slots after wraparound");
+
+  // items are moved out: no reference kept in fifo after pop
+  ReadoutFifo<std::shared_ptr<int>> fp(4);
+  auto p = std::make_shared<int>(1);
+  fp.push(p);
+  std::shared_ptr<int> pp[4];
+  check(fp.popBatch(pp, 4) == 1, "popBatch of shared_ptr");
+  pp[0] = nullptr;
+  check(p.use_count() == 1, "no reference kept after pop");
+
+  // one producer and one consumer thread, with batches
+  const int nItems = 1000000;
+  ReadoutFifo<int> fc(100);
+  int nOrderErrors = 0;
+  std::thread consumer([&]() {
+    int items[16];
+    int expected = 0;
+    while (expected < nItems) {
+      int n = fc.popBatch(items, 1 + expected % 16);
+      for (int i = 0; i < n; i++) {
+        if (items[i] != expected++) {
+          nOrderErrors++;
+        }
+      }
+    }
+  });
+  int items[16];
+  for (int next = 0; next < nItems;) {
+    int n = 1 + next % 13;
+    if (n > nItems - next) {
+      n = nItems - next;
+    }
+    for (int i = 0; i < n; i++) {
+      items[i] = next + i;
+    }
+    next += fc.pushBatch(items, n);
+  }
+  consumer.join();
+  check(nOrderErrors == 0, "concurrent batches order");
+  check(fc.isEmpty(), "empty after concurrent batches");
+
+  printf("ReadoutFifo : %d errors\n", nErrors);
+  if (nErrors) {
+    printf("ReadoutFifo test failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// ask aggregator to flush, and wait until done
+// returns 0 on success
+int flushAggregator(DataBlockAggregator& agg)
+{
+  agg.doFlush = true;
+  for (int i = 0; i < 5000; i++) {
+    if (!agg.doFlush) {
+      return 0;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  printf("Aggregator flush timeout\n");
+  return -1;
+}
+
+// multi-threaded slicing: blocks of several inputs are sliced by a few threads, and merged
+// check that no block is lost or duplicated, that each slice is for a single link and timeframe,
+// and that the order of blocks (and timeframes) of each link is kept through the merge, including across a flush
+// returns 0 on success
+int testSlicingThreads(int nThreads, bool stfBuilding)
+{
+  const int nInputs = 6;
+  const int nLinks = 4;
+  const int nTf = 200;
+  const int nBlocksPerTf = 3;   // blocks per link and timeframe
+  const int tfFlush = nTf / 2; // flush after this timeframe
+  const int nBlocks = nInputs * nLinks * nTf * nBlocksPerTf;
+
+  ReadoutFifo<DataSetReference> output(nBlocks);
+  DataBlockAggregator agg(&output, "agg-test");
+  std::vector<std::shared_ptr<ReadoutFifo<DataBlockContainerReference>>> inputs;
+  for (int i = 0; i < nInputs; i++) {
+    inputs.push_back(std::make_shared<ReadoutFifo<DataBlockContainerReference>>(nBlocks));
+    agg.addInput(inputs.back());
+  }
+  agg.cfgSlicingThreads = nThreads;
+  if (stfBuilding) {
+    agg.enableStfBuilding = 1;
+    agg.cfgStfTimeout = 10;
+    agg.cfgStfSources = nInputs * nLinks;
+  }
+  agg.start();
+
+  int nErrors = 0;
+  uint64_t blockId = 0;
+  for (int tf = 1; tf <= nTf; tf++) {
+    // links of an input are interleaved, like in a real equipment
+    for (int k = 0; k < nBlocksPerTf; k++) {
+      for (int i = 0; i < nInputs; i++) {
+        for (int l = 0; l < nLinks; l++) {
+          inputs[i]->push(newBlock(tf, i, l, blockId++));
+        }
+      }
+    }
+    if (tf == tfFlush) {
+      nErrors += flushAggregator(agg);
+    }
+  }
+  nErrors += flushAggregator(agg);
+
+  // output is checked before stop, which clears it
+  std::vector<int> blockCount(nBlocks, 0);
+  std::map<uint32_t, uint64_t> lastBlockOfLink; // last blockId seen for each equipment/link
+  std::map<uint32_t, uint64_t> lastTfOfLink;    // last timeframe seen for each equipment/link
+  uint64_t lastTf = 0;
+  int nEndOfTf = 0;
+  int nSlices = 0;
+  DataSetReference ds;
+  while (!output.pop(ds)) {
+    nSlices++;
+    DataBlockHeader& h0 = ds->at(0)->getData()->header;
+    uint32_t linkKey = (((uint32_t)h0.equipmentId) << 8) | h0.linkId;
+    if (lastTfOfLink.count(linkKey) && (h0.timeframeId < lastTfOfLink[linkKey])) {
+      printf("Link %d:%d : TF %d after TF %d\n", (int)h0.equipmentId, (int)h0.linkId, (int)h0.timeframeId, (int)lastTfOfLink[linkKey]);
+      nErrors++;
+    }
+    lastTfOfLink[linkKey] = h0.timeframeId;
+    if (stfBuilding) {
+      if (h0.timeframeId < lastTf) {
+        printf("TF %d after TF %d\n", (int)h0.timeframeId, (int)lastTf);
+        nErrors++;
+      }
+      lastTf = h0.timeframeId;
+      if (ds->back()->getData()->header.flagEndOfTimeframe) {
+        nEndOfTf++;
+      }
+    }
+    for (auto& b : *ds) {
+      DataBlockHeader& h = b->getData()->header;
+      if ((h.timeframeId != h0.timeframeId) || (h.equipmentId != h0.equipmentId) || (h.linkId != h0.linkId)) {
+        printf("Slice with mixed blocks: TF %d link %d:%d and TF %d link %d:%d\n", (int)h0.timeframeId, (int)h0.equipmentId, (int)h0.linkId, (int)h.timeframeId, (int)h.equipmentId, (int)h.linkId);
+        nErrors++;
+      }
+      if (h.blockId >= (uint64_t)nBlocks) {
+        nErrors++;
+        continue;
+      }
+      blockCount[h.blockId]++;
+      if (lastBlockOfLink.count(linkKey) && (h.blockId <= lastBlockOfLink[linkKey])) {
+        printf("Link %d:%d : block %d after block %d\n", (int)h.equipmentId, (int)h.linkId, (int)h.blockId, (int)lastBlockOfLink[linkKey]);
+        nErrors++;
+      }
+      lastBlockOfLink[linkKey] = h.blockId;
+    }
+  }
+  agg.stop();
+
+  int nLost = 0;
+  int nDuplicated = 0;
+  for (auto c : blockCount) {
+    if (c == 0) {
+      nLost++;
+    } else if (c > 1) {
+      nDuplicated++;
+    }
+  }
+  if ((stfBuilding) && (nEndOfTf != nTf)) {
+    printf("%d timeframes ended, %d expected\n", nEndOfTf, nTf);
+    nErrors++;
+  }
+  printf("Slicing threads = %d, STF building = %d : %d slices, %d blocks lost, %d blocks duplicated, %d errors\n", nThreads, (int)stfBuilding, nSlices, nLost, nDuplicated, nErrors);
+  if (nLost || nDuplicated || nErrors) {
+    printf("Slicing threads test failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// a step of subtimeframe buffer test: blocks pushed (timeframe, link), and timeframes of data sets expected in output
+struct StfTestStep {
+  std::vector<std::pair<uint64_t, uint8_t>> blocks;
+  std::vector<uint64_t> expected;
+  bool restart = false; // when set, aggregator is stopped and started again (i.e. reset) before the step
+};
+
+// subtimeframe buffer: a window of 1024 consecutive timeframe ids
+// 2 sources (links) are expected in each subtimeframe, so that a timeframe with a single link stays buffered
+// slices are closed on timeout between steps: a source is complete for a TF only once it sent data for a later TF
+// returns 0 on success
+int testStfBuffer(const char* testName, const std::vector<StfTestStep>& steps)
+{
+  ReadoutFifo<DataSetReference> output(1024);
+  auto input = std::make_shared<ReadoutFifo<DataBlockContainerReference>>(1024);
+  DataBlockAggregator agg(&output, "agg-test");
+  agg.addInput(input);
+  agg.cfgSliceTimeout = 0.001; // slices are closed quickly
+  agg.enableStfBuilding = 1;
+  agg.cfgStfTimeout = 10; // incomplete subtimeframes are not sent on timeout during the test
+  agg.cfgStfSources = 2;
+  agg.start();
+
+  int nErrors = 0;
+  uint64_t blockId = 0;
+  int stepId = 0;
+  for (auto const& step : steps) {
+    stepId++;
+    if (step.restart) {
+      agg.stop();
+      agg.start();
+    }
+    for (auto const& b : step.blocks) {
+      input->push(newBlock(b.first, 0, b.second, blockId++));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::vector<uint64_t> tf;
+    DataSetReference ds;
+    while (!output.pop(ds)) {
+      tf.push_back(ds->at(0)->getData()->header.timeframeId);
+    }
+    if (tf != step.expected) {
+      std::string got, expected;
+      for (auto t : tf) {
+        got += " " + std::to_string(t);
+      }
+      for (auto t : step.expected) {
+        expected += " " + std::to_string(t);
+      }
+      printf("STF buffer %s, step %d: got TF [%s ] expected [%s ]\n", testName, stepId, got.c_str(), expected.c_str());
+      nErrors++;
+    }
+  }
+  agg.stop();
+
+  printf("STF buffer %s : %d errors\n", testName, nErrors);
+  if (nErrors) {
+    printf("STF buffer test failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// delays histogram: percentiles are the upper bound of the bin of the value, i.e. less than 19% above it
+// returns 0 on success
+int testDelayHistogram()
+{
+  int nErrors = 0;
+  DelayHistogram h;
+  auto check = [&](const char* what, double value, double expected) {
+    if ((value < expected) || (value > expected * 1.19)) {
+      printf("Delay histogram %s: %g, expected %g\n", what, value, expected);
+      nErrors++;
+    }
+  };
+
+  if ((h.getCount() != 0) || (h.getPercentile(0.5) != 0)) {
+    printf("Delay histogram not empty\n");
+    nErrors++;
+  }
+  for (int i = 0; i < 99; i++) {
+    h.add(0.001);
+  }
+  h.add(0.1);
+  if (h.getCount() != 100) {
+    printf("Delay histogram count %d != 100\n", (int)h.getCount());
+    nErrors++;
+  }
+  check("median", h.getPercentile(0.5), 0.001);
+  check("99th percentile", h.getPercentile(0.99), 0.001);
+  check("maximum", h.getPercentile(1.0), 0.1);
+
+  // all values within bounds of their bin
+  for (double v = 0.000001; v < 10; v *= 1.07) {
+    h.clear();
+    h.add(v);
+    check("single value", h.getPercentile(1.0), v);
+  }
+
+  // below 1 microsecond, and above largest bin (about 16 seconds)
+  h.clear();
+  h.add(0.0000001);
+  check("small value", h.getPercentile(1.0), 0.000001);
+  h.clear();
+  h.add(100);
+  check("large value", h.getPercentile(1.0), std::exp2(24) / 1000000.0);
+
+  h.clear();
+  if ((h.getCount() != 0) || (h.getPercentile(1.0) != 0)) {
+    printf("Delay histogram not empty after clear\n");
+    nErrors++;
+  }
+
+  printf("Delay histogram : %d errors\n", nErrors);
+  if (nErrors) {
+    printf("Delay histogram test failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// adaptive timeouts: limits, and convergence for a constant delay
+// returns 0 on success
+int testAdaptiveTimeout()
+{
+  int nErrors = 0;
+  ReadoutFifo<DataSetReference> output(16);
+  DataBlockAggregator agg(&output, "agg-test");
+  agg.cfgAdaptiveTimeoutMin = 0.01;
+  const double maxTimeout = 1.0;
+
+  // no delay observed: unchanged
+  if (agg.getAdaptiveTimeout(0.5, 0, maxTimeout) != 0.5) {
+    printf("Adaptive timeout changed without delay observed\n");
+    nErrors++;
+  }
+  // limits
+  if (agg.getAdaptiveTimeout(0.5, 10, maxTimeout) != maxTimeout) {
+    printf("Adaptive timeout above maximum\n");
+    nErrors++;
+  }
+  if (agg.getAdaptiveTimeout(0.01, 0.000001, maxTimeout) != agg.cfgAdaptiveTimeoutMin) {
+    printf("Adaptive timeout below minimum\n");
+    nErrors++;
+  }
+  // increase at once, above observed delay
+  double t = agg.getAdaptiveTimeout(0.01, 0.2, maxTimeout);
+  if (t <= 0.2) {
+    printf("Adaptive timeout %g not above observed delay 0.2\n", t);
+    nErrors++;
+  }
+  // decrease slowly
+  t = agg.getAdaptiveTimeout(maxTimeout, 0.02, maxTimeout);
+  if ((t >= maxTimeout) || (t < maxTimeout / 2)) {
+    printf("Adaptive timeout decrease from %g to %g\n", maxTimeout, t);
+    nErrors++;
+  }
+
+  // converge to the same stable value, from above and from below
+  const double delay = 0.05;
+  double stable[2];
+  int ix = 0;
+  for (double t0 : { maxTimeout, agg.cfgAdaptiveTimeoutMin }) {
+    t = t0;
+    int nUpdates = 0;
+    for (; nUpdates < 1000; nUpdates++) {
+      double tNew = agg.getAdaptiveTimeout(t, delay, maxTimeout);
+      if (tNew == t) {
+        break;
+      }
+      t = tNew;
+    }
+    if ((nUpdates >= 1000) || (t <= delay) || (t > maxTimeout)) {
+      printf("Adaptive timeout from %g did not converge: %g after %d updates, delay %g\n", t0, t, nUpdates, delay);
+      nErrors++;
+    }
+    stable[ix++] = t;
+  }
+  if (stable[0] != stable[1]) {
+    printf("Adaptive timeout converged to %g from above, %g from below\n", stable[0], stable[1]);
+    nErrors++;
+  }
+
+  printf("Adaptive timeout : %d errors\n", nErrors);
+  if (nErrors) {
+    printf("Adaptive timeout test failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// slice delays recorded for adaptive timeout, including the gap after a slice closed on timeout
+// returns 0 on success
+int testSliceDelays()
+{
+  int nErrors = 0;
+  DataBlockSlicer slicer;
+  slicer.recordDelays = 1;
+
+  // gap between blocks of the same slice
+  slicer.appendBlock(newBlock(1, 0, 0, 0), 1.0);
+  slicer.appendBlock(newBlock(1, 0, 0, 1), 1.02);
+  double d = slicer.getDelayPercentile(1.0);
+  if ((d < 0.02) || (d > 0.02 * 1.19)) {
+    printf("Slice delay %g, expected 0.02\n", d);
+    nErrors++;
+  }
+
+  // slice closed on timeout, then more data for the same TF: the gap is recorded
+  slicer.completeSliceOnTimeout(1.05);
+  slicer.appendBlock(newBlock(1, 0, 0, 2), 1.3);
+  d = slicer.getDelayPercentile(1.0);
+  if ((d < 0.28) || (d > 0.28 * 1.19)) {
+    printf("Slice delay after timeout %g, expected 0.28\n", d);
+    nErrors++;
+  }
+
+  // slice closed on timeout, then data for the next TF: nothing recorded
+  slicer.completeSliceOnTimeout(1.35);
+  slicer.appendBlock(newBlock(2, 0, 0, 3), 2.0);
+  d = slicer.getDelayPercentile(1.0);
+  if (d != 0) {
+    printf("Slice delay %g recorded for new TF\n", d);
+    nErrors++;
+  }
+
+  printf("Slice delays : %d errors\n", nErrors);
+  if (nErrors) {
+    printf("Slice delays test failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+int main()
+{
+  int nFailed = 0;
+
+  if (testReadoutFifo()) {
+    nFailed++;
+  }
+
+  if (testDelayHistogram()) {
+    nFailed++;
+  }
+  if (testAdaptiveTimeout()) {
+    nFailed++;
+  }
+  if (testSliceDelays()) {
+    nFailed++;
+  }
+
+  for (int nThreads = 2; nThreads <= 3; nThreads++) {
+    for (bool stfBuilding : { false, true }) {
+      if (testSlicingThreads(nThreads, stfBuilding)) {
+        nFailed++;
+      }
+    }
+  }
+
+  // TF older than first one buffered: window is extended backwards, unless out of range
+  if (testStfBuffer("older TF", {
+        { { { 10, 0 } }, {} },
+        { { { 5, 0 } }, {} },
+        { { { 5, 1 }, { 10, 1 }, { 11, 0 }, { 11, 1 } }, { 5, 5, 10, 10 } },
+        { { { 3000, 0 }, { 1500, 0 } }, { 11, 11 } }, // TF 11 pushed out to make room for TF 3000, TF 1500 is too old for the window ending at TF 3000, it is discarded
+        { { { 3000, 1 }, { 3001, 1 } }, { 3000, 3000 } },
+      })) {
+    nFailed++;
+  }
+
+  // TF more than 1024 ahead: oldest incomplete TF is pushed out to make room
+  if (testStfBuffer("newer TF", {
+        { { { 1, 0 }, { 2, 0 } }, {} },
+        { { { 1025, 0 } }, { 1 } },
+        { { { 1026, 0 } }, { 2 } },
+        { { { 1025, 1 }, { 1026, 1 }, { 1027, 0 }, { 1027, 1 } }, { 1025, 1025, 1026, 1026 } },
+      })) {
+    nFailed++;
+  }
+
+  // gaps in TF ids: empty slots are skipped, TF are sent in order
+  if (testStfBuffer("gaps", {
+        { { { 1, 0 }, { 4, 0 }, { 1, 1 } }, {} },
+        { { { 4, 1 }, { 7, 0 }, { 7, 1 } }, { 1, 1, 4, 4 } },
+        { { { 8, 0 }, { 8, 1 } }, { 7, 7 } },
+      })) {
+    nFailed++;
+  }
+
+  // reset: buffered TF are released, and the TF ids window starts again from next TF received
+  if (testStfBuffer("reset", {
+        { { { 2000, 0 } }, {} },
+        { { { 1, 0 }, { 1, 1 }, { 2, 0 }, { 2, 1 } }, { 1, 1 }, true },
+        { { { 3, 0 }, { 3, 1 } }, { 2, 2 } },
+      })) {
+    nFailed++;
+  }
+
+  // TF received in 2 slices separated by more than slice timeout: the first ones do not complete the TF,
+  // so that the second ones are not discarded as late data
+  if (testStfBuffer("split TF", {
+        { { { 1, 0 }, { 1, 1 } }, {} },
+        { { { 1, 0 }, { 1, 1 }, { 2, 0 }, { 2, 1 } }, { 1, 1, 1, 1 } },
+        { { { 3, 0 }, { 3, 1 } }, { 2, 2 } },
+      })) {
+    nFailed++;
+  }
+
+  if (nFailed) {
+    printf("%d tests failed\n", nFailed);
+    return -1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}
@@ -11,10 +11,18 @@
 
 // simple test program to exercise the classes related to memory banks
 
+#include <atomic>
+#include <cstring>
+#include <map>
 #include <memory>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include "MemoryBank.h"
 #include "MemoryBankManager.h"
+#include "MemoryPagesBuddyAllocator.h"
+#include "ReadoutUtils.h"
 
 // logs in console mode
 #include "TtyChecker.h"
@@ -23,6 +31,355 @@ TtyChecker theTtyChecker;
 #include <InfoLogger/InfoLogger.hxx>
 AliceO2::InfoLogger::InfoLogger theLog;
 
+// concurrent access test
+// some threads get pages and keep them for a while, others release pages obtained by other threads
+// each page has an ownership flag, set when page is obtained and cleared when released: it should never be taken twice
+// returns 0 on success
+int testConcurrentAccess(MemoryBankManager& bm, const std::string& bankName, int magazineSize)
+{
+  int nStressPages = 64;
+  int nStressLoops = 200000;
+  int nStressThreads = 4; // number of threads of each kind
+  extern int MemoryPagesPoolMagazineSize;
+  MemoryPagesPoolMagazineSize = magazineSize;
+  std::shared_ptr<MemoryPagesPool> stressPool;
+  try {
+    stressPool = bm.getPagedPool(4096, nStressPages, bankName);
+  } catch (...) {
+  }
+  if (stressPool == nullptr) {
+    printf("Failed to create stress test pool\n");
+    return -1;
+  }
+  nStressPages = (int)stressPool->getTotalNumberOfPages();
+  char* stressBase = (char*)stressPool->getBaseBlockAddress();
+  size_t stressBaseSize = stressPool->getBaseBlockSize();
+  std::vector<std::atomic<int>> pageOwned(stressBaseSize / 4096 + 1);
+  for (auto& o : pageOwned) {
+    o = 0;
+  }
+  std::atomic<int> nErrors(0);
+  std::atomic<int> nGetters(nStressThreads);
+  LockFreeFifo<void*> handover(nStressPages); // pages passed from getters to releasers
+
+  auto pageIndex = [&](void* p) { return ((char*)p - stressBase) / 4096; };
+  auto takePage = [&](void* p) {
+    if (pageOwned[pageIndex(p)].exchange(1) != 0) {
+      nErrors++; // page given twice
+    }
+  };
+  auto givePage = [&](void* p) {
+    if (pageOwned[pageIndex(p)].exchange(0) != 1) {
+      nErrors++; // page released but not owned
+    }
+    stressPool->releasePage(p);
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nStressThreads; i++) {
+    // getters: keep a few pages locally, release half of them directly, pass the other half to releasers
+    threads.emplace_back([&, i]() {
+      std::vector<void*> local;
+      for (int n = 0; n < nStressLoops; n++) {
+        void* p = stressPool->getPage();
+        if (p != nullptr) {
+          takePage(p);
+          local.push_back(p);
+        }
+        if ((local.size() > 4) || ((p == nullptr) && (local.size() > 0))) {
+          void* q = local.back();
+          local.pop_back();
+          if ((n + i) % 2) {
+            givePage(q);
+          } else if (handover.push(q) != 0) {
+            givePage(q);
+          }
+        }
+      }
+      for (auto q : local) {
+        givePage(q);
+      }
+      nGetters--;
+    });
+    // releasers: release pages obtained by other threads
+    threads.emplace_back([&]() {
+      for (;;) {
+        void* p = nullptr;
+        if (handover.pop(p) == 0) {
+          givePage(p);
+        } else if (nGetters == 0) {
+          if (handover.isEmpty()) {
+            break;
+          }
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // all pages should be back in pool, each exactly once
+  std::set<void*> pagesBack;
+  for (;;) {
+    void* p = stressPool->getPage();
+    if (p == nullptr) {
+      break;
+    }
+    if (!pagesBack.insert(p).second) {
+      nErrors++; // duplicate page
+    }
+  }
+  printf("Pool: %d/%d pages recovered after stress test, %d errors\n", (int)pagesBack.size(), nStressPages, (int)nErrors);
+  if ((nErrors != 0) || ((int)pagesBack.size() != nStressPages)) {
+    printf("Concurrent access test failed\n");
+    return -1;
+  }
+  for (auto p : pagesBack) {
+    stressPool->releasePage(p);
+  }
+
+  // pages released by a thread which does not get pages should still be available to others while this thread is alive
+  if (magazineSize) {
+    std::vector<void*> pagesTaken;
+    for (void* p = stressPool->getPage(); p != nullptr; p = stressPool->getPage()) {
+      pagesTaken.push_back(p);
+    }
+    std::atomic<int> releaserState(0);
+    std::thread releaser([&]() {
+      for (auto p : pagesTaken) {
+        stressPool->releasePage(p);
+      }
+      releaserState = 1;
+      while (releaserState != 2) {
+        std::this_thread::yield();
+      }
+    });
+    while (releaserState != 1) {
+      std::this_thread::yield();
+    }
+    int nAvailable = (int)stressPool->getNumberOfPagesAvailable();
+    pagesTaken.clear();
+    for (void* p = stressPool->getPage(); p != nullptr; p = stressPool->getPage()) {
+      pagesTaken.push_back(p);
+    }
+    releaserState = 2;
+    releaser.join();
+    printf("Pool: %d/%d pages available after release by another thread, %d obtained\n", nAvailable, nStressPages, (int)pagesTaken.size());
+    if ((nAvailable != nStressPages) || ((int)pagesTaken.size() != nStressPages)) {
+      printf("Magazines test failed\n");
+      return -1;
+    }
+    for (auto p : pagesTaken) {
+      stressPool->releasePage(p);
+    }
+  }
+
+  // pages should be given back to pool when their container is released
+  for (int n = 0; n < 10; n++) {
+    std::vector<DataBlockContainerReference> blocks;
+    for (;;) {
+      auto b = stressPool->getNewDataBlockContainer();
+      if (b == nullptr) {
+        break;
+      }
+      blocks.push_back(b);
+    }
+    if ((int)blocks.size() != nStressPages) {
+      printf("Containers test failed: got %d/%d pages\n", (int)blocks.size(), nStressPages);
+      return -1;
+    }
+  }
+  MemoryPagesPoolMagazineSize = 0;
+
+  return 0;
+}
+
+// buddy sub-allocator test
+// chunks of random size are allocated and released in random order, each one filled with its own pattern:
+// the pattern should be intact on release (no overlap between chunks), and all pages should be back in pool at the end
+// returns 0 on success
+int testBuddyAllocator(MemoryBankManager& bm, const std::string& bankName)
+{
+  int nPages = 8;
+  size_t pageSize = 128 * 1024;
+  std::shared_ptr<MemoryPagesPool> pool;
+  try {
+    pool = bm.getPagedPool(pageSize, nPages, bankName);
+  } catch (...) {
+  }
+  if (pool == nullptr) {
+    printf("Failed to create buddy allocator test pool\n");
+    return -1;
+  }
+  nPages = (int)pool->getTotalNumberOfPages();
+  int nErrors = 0;
+  {
+    MemoryPagesBuddyAllocator allocator(pool, 1024);
+    std::vector<DataBlockContainerReference> chunks;
+    uint64_t nNewPages = 0;
+    uint32_t seed = 12345;
+    auto rnd = [&seed](uint32_t max) { seed = seed * 1103515245 + 12345; return (seed >> 8) % max; };
+    auto checkAndRelease = [&](size_t ix) {
+      DataBlock* b = chunks[ix]->getData();
+      uint8_t pattern = (uint8_t)b->header.blockId;
+      for (uint32_t j = 0; j < b->header.dataSize; j++) {
+        if ((uint8_t)b->data[j] != pattern) {
+          nErrors++;
+          break;
+        }
+      }
+      chunks[ix] = chunks.back();
+      chunks.pop_back();
+    };
+    for (int i = 0; i < 100000; i++) {
+      if ((chunks.size() < 50) && (rnd(3) != 0)) {
+        size_t sz = 1 + rnd((uint32_t)allocator.getChunkMaxSize() / (1 + rnd(16)));
+        bool isNewPage = false;
+        auto c = allocator.getChunk(sz, &isNewPage);
+        if (isNewPage) {
+          nNewPages++;
+        }
+        if (c == nullptr) {
+          continue;
+        }
+        DataBlock* b = c->getData();
+        if ((b->header.dataSize != sz) || (b->header.memorySize < sz + sizeof(DataBlock))) {
+          nErrors++;
+        }
+        b->header.blockId = i;
+        memset(b->data, (uint8_t)i, sz);
+        chunks.push_back(c);
+      } else if (chunks.size()) {
+        checkAndRelease(rnd((uint32_t)chunks.size()));
+      }
+    }
+    while (chunks.size()) {
+      checkAndRelease(chunks.size() - 1);
+    }
+    MemoryPagesBuddyAllocator::Stats st = allocator.getStats();
+    printf("Buddy allocator: %llu chunks, requested/allocated = %.1f%%, pages used: %llu, max pages in use: %llu, new page due to fragmentation: %llu, failures: %llu\n", (unsigned long long)st.nChunks, st.bytesRequested * 100.0 / st.bytesAllocated, (unsigned long long)st.nPagesUsed, (unsigned long long)st.nPagesInUseMax, (unsigned long long)st.nFragmentedFailures, (unsigned long long)st.nFailures);
+    if ((st.nPagesInUse != 0) || (st.nPagesUsed != nNewPages)) {
+      nErrors++;
+    }
+    if (allocator.getChunk(allocator.getChunkMaxSize() + 1) != nullptr) {
+      nErrors++; // chunk too large
+    }
+  }
+  if ((int)pool->getNumberOfPagesAvailable() != nPages) {
+    printf("Buddy allocator test: %d/%d pages back in pool\n", (int)pool->getNumberOfPagesAvailable(), nPages);
+    nErrors++;
+  }
+  if (nErrors) {
+    printf("Buddy allocator test failed: %d errors\n", nErrors);
+    return -1;
+  }
+  return 0;
+}
+
+// memory initialization test
+// banks are filled with a non-zero pattern: pool pages should be zero when obtained, whatever the clear mode
+// returns 0 on success
+int testClearMode(MemoryBankManager& bm, const std::string& bankName, int clearMode)
+{
+  extern int MemoryBankClearMode;
+  MemoryBankClearMode = clearMode;
+  size_t pageSize = 64 * 1024;
+  std::shared_ptr<MemoryPagesPool> pool;
+  try {
+    pool = bm.getPagedPool(pageSize, 16, bankName);
+  } catch (...) {
+  }
+  MemoryBankClearMode = 0;
+  if (pool == nullptr) {
+    printf("Failed to create clear mode %d test pool\n", clearMode);
+    return -1;
+  }
+  int nErrors = 0;
+  std::vector<void*> pagesUsed;
+  for (;;) {
+    char* p = (char*)pool->getPage();
+    if (p == nullptr) {
+      break;
+    }
+    for (size_t i = 0; i < pageSize; i++) {
+      if (p[i] != 0) {
+        nErrors++;
+        break;
+      }
+    }
+    memset(p, 1, pageSize);
+    pagesUsed.push_back(p);
+  }
+  // pages should be zeroed only once
+  for (auto p : pagesUsed) {
+    pool->releasePage(p);
+  }
+  void* p = pool->getPage();
+  if ((p == nullptr) || (((char*)p)[0] != 1)) {
+    nErrors++;
+  }
+  if (p != nullptr) {
+    pool->releasePage(p);
+  }
+  if (nErrors) {
+    printf("Clear mode %d test failed: %d errors\n", clearMode, nErrors);
+    return -1;
+  }
+  return 0;
+}
+
+// page state latency histogram test
+// pages are kept a given time in a state: the histogram should count each transition in the corresponding bin
+// returns 0 on success
+int testPageStateLatency(MemoryBankManager& bm, const std::string& bankName)
+{
+  std::shared_ptr<MemoryPagesPool> pool;
+  try {
+    pool = bm.getPagedPool(64 * 1024, 4, bankName);
+  } catch (...) {
+  }
+  if (pool == nullptr) {
+    printf("Failed to create page state latency test pool\n");
+    return -1;
+  }
+  const int nBins = MemoryPage::latencyHistogramBins;
+  std::vector<std::atomic<uint64_t>> histogram((int)MemoryPage::PageState::Undefined * nBins);
+  pool->setPageStateLatencyHistogram(&histogram[0]);
+  int nLoops = 5;
+  for (int i = 0; i < nLoops; i++) {
+    auto b = pool->getNewDataBlockContainer();
+    if (b == nullptr) {
+      printf("Failed to get page\n");
+      return -1;
+    }
+    updatePageStateFromDataBlockContainerReference(b, MemoryPage::PageState::InAggregator);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    updatePageStateFromDataBlockContainerReference(b, MemoryPage::PageState::InConsumer);
+  }
+  // 20ms should be in bin 15: [16.384ms, 32.768ms[. Allow some margin for slow scheduling.
+  int nErrors = 0;
+  uint64_t nTotal = 0;
+  for (int k = 0; k < nBins; k++) {
+    uint64_t n = histogram[(int)MemoryPage::PageState::InAggregator * nBins + k];
+    if ((n) && ((k < 15) || (k > 17))) {
+      nErrors++;
+    }
+    nTotal += n;
+  }
+  printf("Page state latency: %llu transitions from InAggregator\n", (unsigned long long)nTotal);
+  if (nTotal != (uint64_t)nLoops) {
+    nErrors++;
+  }
+  if (nErrors) {
+    printf("Page state latency test failed\n");
+    return -1;
+  }
+  return 0;
+}
+
 int main()
 {
   MemoryBankManager bm;
@@ -129,6 +486,114 @@ int main()
     }
   }
 
+  printf("\nTesting concurrent access\n");
+  if (testConcurrentAccess(bm, "malloc:2", 0)) {
+    return -1;
+  }
+  printf("\nTesting concurrent access with per-thread magazines\n");
+  if (testConcurrentAccess(bm, "malloc:2", 8)) {
+    return -1;
+  }
+  printf("\nTesting buddy sub-allocator\n");
+  if (testBuddyAllocator(bm, "malloc:3")) {
+    return -1;
+  }
+  printf("\nTesting anonymous hugepages bank\n");
+  {
+    std::shared_ptr<MemoryBank> b = nullptr;
+    try {
+      b = getMemoryBank(4 * 1024 * 1024, "HugePages", "hugepages");
+    } catch (...) {
+    }
+    if (b == nullptr) {
+      printf("Failed to create hugepages bank\n");
+      return -1;
+    }
+    printf("Created %s, memory page size %lu\n", b->getDescription().c_str(), (unsigned long)b->getMemoryPageSize());
+    // base address should be aligned on 2MB, for transparent hugepages when explicit ones not available
+    if (((uintptr_t)b->getBaseAddress()) % (2 * 1024 * 1024UL)) {
+      printf("Hugepages bank at %p not aligned on 2MB\n", b->getBaseAddress());
+      return -1;
+    }
+    b->clear();
+  }
+  printf("\nTesting NUMA split bank\n");
+  {
+    std::vector<int> nodes;
+    if (numaGetNodes(nodes) == 0) {
+      std::shared_ptr<MemoryBank> b = getMemoryBank(16 * 1024 * 1024, "malloc", "numaSplit");
+      std::vector<int> splitNodes = nodes;
+      splitNodes.insert(splitNodes.end(), nodes.begin(), nodes.end()); // at least 2 parts
+      if ((b == nullptr) || (b->setNumaSplit(splitNodes))) {
+        printf("Failed to create NUMA split bank\n");
+        return -1;
+      }
+      b->clear();
+      bm.addBank(b);
+      for (int i = 0; i < (int)splitNodes.size(); i++) {
+        // half of the pools requested explicitly on a node, the others from a thread bound to this node
+        int node = splitNodes[i];
+        bool isExplicit = (i % 2 == 0);
+        if (!isExplicit) {
+          numaBind(node);
+        }
+        int boundNode = numaGetBoundNode();
+        std::shared_ptr<MemoryPagesPool> p;
+        try {
+          p = bm.getPagedPool(1024 * 1024, 2, "numaSplit", 0, 0, isExplicit ? node : -1);
+        } catch (...) {
+        }
+        if (p == nullptr) {
+          printf("Failed to create pool on NUMA node %d\n", node);
+          return -1;
+        }
+        int nErrors = 0;
+        if (numaGetBoundNode() != boundNode) {
+          printf("NUMA binding of calling thread changed: %d -> %d\n", boundNode, numaGetBoundNode());
+          nErrors++;
+        }
+        if (!isExplicit) {
+          numaBind(-1);
+        }
+        if (p->getNumaNode() != node) {
+          printf("Pool %d on NUMA node %d, requested %d\n", p->getId(), p->getNumaNode(), node);
+          nErrors++;
+        }
+        // each page should be on requested node
+        for (;;) {
+          void* page = p->getPage();
+          if (page == nullptr) {
+            break;
+          }
+          int pageNode = -1;
+          if ((numaGetNodeFromAddress(page, pageNode) != 0) || (pageNode != node)) {
+            printf("Page %p on NUMA node %d, requested %d\n", page, pageNode, node);
+            nErrors++;
+          }
+        }
+        std::map<int, int> numaStats;
+        p->getNumaStats(numaStats);
+        for (auto& s : numaStats) {
+          printf("Pool %d requested on node %d: [%d] = %d MB\n", p->getId(), node, s.first, s.second);
+        }
+        if (nErrors) {
+          printf("NUMA split bank test failed\n");
+          return -1;
+        }
+      }
+    }
+  }
+  printf("\nTesting page state latency histograms\n");
+  if (testPageStateLatency(bm, "malloc:3")) {
+    return -1;
+  }
+  for (int clearMode = 0; clearMode <= 2; clearMode++) {
+    printf("\nTesting memory clear mode %d\n", clearMode);
+    if (testClearMode(bm, "malloc:3", clearMode)) {
+      return -1;
+    }
+  }
+
   return 0;
 }
 
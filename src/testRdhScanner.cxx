@@ -0,0 +1,338 @@
+// Copyright 2019-2020 CERN and copyright holders of ALICE O2.
+// See https://alice-o2.web.cern.ch/copyright for details of the copyright holders.
+// All rights not expressly granted are reserved.
+//
+// This software is distributed under the terms of the GNU General Public
+// License v3 (GPL Version 3), copied verbatim in the file "COPYING".
+//
+// In applying this license CERN does not waive the privileges and immunities
+// granted to it by virtue of its status as an Intergovernmental Organization
+// or submit itself to any jurisdiction.
+
+// test program to check and benchmark RdhScanner
+// pages are filled with the same RDH layout as the CRU emulator equipment
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "RdhUtils.h"
+
+// logs in console mode
+#include "TtyChecker.h"
+TtyChecker theTtyChecker;
+
+#include <InfoLogger/InfoLogger.hxx>
+AliceO2::InfoLogger::InfoLogger theLog;
+
+// RDH stream of one link, generated like ReadoutEquipmentCruEmulator::fillLinkPage()
+// blocks are cruBlockSize apart, HB frames have a random payload split in blocks, some HB frames are empty
+class EmulatorLink
+{
+ public:
+  EmulatorLink(int cruBlockSize, int linkId, int payloadSize, double payloadSizeStdev, double emptyHbRatio, int seed)
+    : cruBlockSize(cruBlockSize), emptyHbRatio(emptyHbRatio), rng(seed), payloadDistrib(payloadSize, payloadSizeStdev * payloadSize)
+  {
+    rdhTemplate.systemId = 19;
+    rdhTemplate.linkId = linkId;
+    rdhTemplate.offsetNextPacket = cruBlockSize;
+    rdhTemplate.stopBit = 0;
+    // HB frame rate matching a 3.2 Gbps link
+    bcStep = (int)ceil(LHCBCRate * (double)(payloadSize + sizeof(o2::Header::RAWDataHeader) * ceil(payloadSize * 1.0 / (cruBlockSize - sizeof(o2::Header::RAWDataHeader)))) * 8 / (3.2 * 1000 * 1000 * 1000));
+  }
+
+  // fill a page, returns number of bytes used in page
+  size_t fillPage(uint8_t* page, size_t pageSize)
+  {
+    uint64_t nowId = getTimeframeFromOrbit(nowOrbit);
+    size_t offset;
+    for (offset = 0; offset + cruBlockSize <= pageSize; offset += cruBlockSize) {
+      bool isNewTF = 0;
+      if (payloadBytesLeft < 0) {
+        // this is a new HB frame
+        unsigned int nextBc = nowBc + bcStep;
+        unsigned int nextOrbit = nowOrbit;
+        if (nextBc >= LHCBunches) {
+          nextOrbit += nextBc / LHCBunches;
+          nextBc = nextBc % LHCBunches;
+          uint64_t nextId = getTimeframeFromOrbit(nextOrbit);
+          if (nextId != nowId) {
+            isNewTF = 1;
+            if (offset) {
+              // force page change on timeframe boundary
+              break;
+            }
+            nowId = nextId;
+          }
+        }
+        nowBc = nextBc;
+        nowOrbit = nextOrbit;
+        HBpagecount = 0;
+        if (std::uniform_real_distribution<double>(0, 1)(rng) < emptyHbRatio) {
+          isEmpty = 1;
+          payloadBytesLeft = 0;
+        } else {
+          isEmpty = 0;
+          payloadBytesLeft = std::max(0, (int)std::round(payloadDistrib(rng)));
+        }
+      } else {
+        // continue with current HB
+        HBpagecount++;
+      }
+
+      o2::Header::RAWDataHeader rdh = rdhTemplate;
+      rdh.triggerOrbit = nowOrbit;
+      rdh.triggerBC = nowBc;
+      rdh.heartbeatOrbit = nowOrbit;
+      rdh.packetCounter = packetCounter++;
+      rdh.triggerType = isNewTF ? (uint32_t)1 << 11 : 0;
+      rdh.pagesCounter = HBpagecount;
+      if (payloadBytesLeft > 0) {
+        int bytesNow = std::min(payloadBytesLeft, cruBlockSize - (int)sizeof(o2::Header::RAWDataHeader));
+        payloadBytesLeft -= bytesNow;
+        rdh.memorySize = sizeof(o2::Header::RAWDataHeader) + bytesNow;
+        if (payloadBytesLeft <= 0) {
+          rdh.stopBit = 1;
+          payloadBytesLeft = -1;
+        }
+      } else {
+        rdh.memorySize = sizeof(o2::Header::RAWDataHeader);
+        if (!(isEmpty && (HBpagecount == 0))) {
+          rdh.stopBit = 1;
+          payloadBytesLeft = -1;
+        }
+      }
+      memcpy(&page[offset], &rdh, sizeof(rdh));
+    }
+    return offset;
+  }
+
+ private:
+  static constexpr unsigned int LHCBunches = 3564;
+  static constexpr double LHCBCRate = 11246.0 * LHCBunches;
+  static constexpr uint32_t timeframePeriodOrbits = 32;
+  static constexpr uint32_t firstOrbit = 0x1000;
+  uint64_t getTimeframeFromOrbit(uint32_t orbit) { return 1 + (orbit - firstOrbit) / timeframePeriodOrbits; }
+
+  int cruBlockSize;
+  double emptyHbRatio;
+  std::mt19937 rng;
+  std::normal_distribution<double> payloadDistrib;
+  o2::Header::RAWDataHeader rdhTemplate;
+  int bcStep;
+  unsigned int nowOrbit = firstOrbit;
+  unsigned int nowBc = 0;
+  uint8_t packetCounter = 0;
+  uint16_t HBpagecount = 0;
+  int payloadBytesLeft = -1;
+  bool isEmpty = 0;
+};
+
+// fill a page with a chain of RDH blocks of random size (multiple of 64 bytes, up to cruBlockSize)
+// returns number of bytes used in page
+size_t fillPageVariableBlockSize(uint8_t* page, size_t pageSize, int cruBlockSize, int linkId, std::mt19937& gen)
+{
+  o2::Header::RAWDataHeader defaultRDH;
+  std::uniform_int_distribution<int> blockSizeDistrib(1, cruBlockSize / (int)sizeof(o2::Header::RAWDataHeader));
+  static uint32_t orbit = 0x1000;
+  static uint8_t packetCounter = 0;
+  uint16_t pagesCounter = 0;
+  size_t offset = 0;
+  for (;;) {
+    int blockSize = blockSizeDistrib(gen) * sizeof(o2::Header::RAWDataHeader);
+    if (offset + blockSize > pageSize) {
+      break;
+    }
+    o2::Header::RAWDataHeader* rdh = (o2::Header::RAWDataHeader*)&page[offset];
+    *rdh = defaultRDH;
+    rdh->triggerOrbit = orbit;
+    rdh->heartbeatOrbit = orbit;
+    rdh->linkId = linkId;
+    rdh->offsetNextPacket = blockSize;
+    rdh->packetCounter = packetCounter++;
+    rdh->pagesCounter = pagesCounter++;
+    rdh->memorySize = sizeof(o2::Header::RAWDataHeader) + gen() % (blockSize - sizeof(o2::Header::RAWDataHeader) + 1);
+    rdh->stopBit = 0;
+    rdh->detectorField = gen();
+    if (gen() % 4 == 0) {
+      rdh->stopBit = 1;
+      pagesCounter = 0;
+      orbit++;
+    }
+    offset += blockSize;
+  }
+  return offset;
+}
+
+// reference implementation: follow the chain with RdhHandle
+int scanReference(uint8_t* page, size_t pageSize, std::vector<RdhDescriptor>& v)
+{
+  v.clear();
+  for (size_t offset = 0; offset + sizeof(o2::Header::RAWDataHeader) <= pageSize;) {
+    RdhHandle h(page + offset);
+    RdhDescriptor d;
+    memset(&d, 0, sizeof(d));
+    d.offset = offset;
+    d.hbOrbit = h.getHbOrbit();
+    d.triggerOrbit = h.getTriggerOrbit();
+    d.triggerType = h.getTriggerType();
+    d.detectorField = h.getDetectorField();
+    d.offsetNextPacket = h.getOffsetNextPacket();
+    d.memorySize = h.getMemorySize();
+    d.pagesCounter = h.getPagesCounter();
+    d.version = h.getHeaderVersion();
+    d.headerSize = h.getHeaderSize();
+    d.linkId = h.getLinkId();
+    d.packetCounter = h.getPacketCounter();
+    d.stopBit = ((o2::Header::RAWDataHeader*)(page + offset))->stopBit; // full field, getStopBit() returns a bool
+    v.push_back(d);
+    if (d.offsetNextPacket < sizeof(o2::Header::RAWDataHeader)) {
+      break;
+    }
+    offset += d.offsetNextPacket;
+  }
+  return (int)v.size();
+}
+
+// check scanner result is same as reference
+// returns 0 on success
+int checkScan(RdhScanner& s, uint8_t* page, size_t pageSize, std::vector<RdhDescriptor>& ref)
+{
+  int nRef = scanReference(page, pageSize, ref);
+  int n = s.scan(page, pageSize);
+  if (n != nRef) {
+    printf("Mismatch: %d RDH found, %d expected\n", n, nRef);
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (memcmp(&s[i], &ref[i], sizeof(RdhDescriptor))) {
+      printf("Mismatch: RDH %d @ 0x%X differs\n", i, (int)ref[i].offset);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  size_t pageSize = 1024 * 1024; // superpage size
+  int cruBlockSize = 8192;       // RDH block size
+  int nLoops = 2000;             // number of scans per benchmark
+  if (argc > 1) {
+    pageSize = atoi(argv[1]) * 1024;
+  }
+  if (argc > 2) {
+    cruBlockSize = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    nLoops = atoi(argv[3]);
+  }
+  if ((cruBlockSize < (int)sizeof(o2::Header::RAWDataHeader)) || (cruBlockSize % sizeof(o2::Header::RAWDataHeader)) || (pageSize < (size_t)cruBlockSize) || (nLoops <= 0)) {
+    printf("usage: %s [pageSizeKB] [cruBlockSize] [nLoops]\n", argv[0]);
+    return -1;
+  }
+
+  std::mt19937 gen(1234);
+  std::vector<uint8_t> page(pageSize);
+  std::vector<RdhDescriptor> ref;
+  RdhScanner scannerScalar(false);
+  RdhScanner scannerSimd(true);
+  printf("Page size %zu bytes, RDH block size %d bytes, SIMD %s\n", pageSize, cruBlockSize, scannerSimd.isUsingSimd() ? "available" : "not available");
+
+  // emulator-like links: 64kB HB frames +/- 50%, 10% empty HB frames
+  std::vector<EmulatorLink> links;
+  for (int i = 0; i < 12; i++) {
+    links.emplace_back(cruBlockSize, i, 64 * 1024, 0.5, 0.1, 1234 + i);
+  }
+
+  // correctness checks, on pages with constant or variable block size, full or truncated
+  for (int variable = 0; variable <= 1; variable++) {
+    for (int i = 0; i < 100; i++) {
+      size_t used = variable ? fillPageVariableBlockSize(page.data(), pageSize, cruBlockSize, i % 12, gen) : links[i % 12].fillPage(page.data(), pageSize);
+      size_t sizes[] = { used, used - (gen() % used), pageSize };
+      for (auto sz : sizes) {
+        if (checkScan(scannerScalar, page.data(), sz, ref) || checkScan(scannerSimd, page.data(), sz, ref)) {
+          printf("Test failed (variable block size = %d, page size = %zu)\n", variable, sz);
+          return -1;
+        }
+      }
+    }
+  }
+  // corrupted chain: an invalid offset in the middle of the page should stop the scan
+  EmulatorLink corruptedLink(cruBlockSize, 0, 64 * 1024, 0.5, 0.1, 1);
+  size_t used = corruptedLink.fillPage(page.data(), pageSize);
+  if (used / cruBlockSize > 10) {
+    ((o2::Header::RAWDataHeader*)&page[10 * cruBlockSize])->offsetNextPacket = 1;
+    if (checkScan(scannerScalar, page.data(), used, ref) || checkScan(scannerSimd, page.data(), used, ref) || (scannerSimd.size() != 11)) {
+      printf("Test failed (corrupted chain)\n");
+      return -1;
+    }
+    // validation should report the bad offset, and other bad fields with their values
+    ((o2::Header::RAWDataHeader*)&page[10 * cruBlockSize])->linkId = 40;
+    scannerSimd.scan(page.data(), used);
+    uint32_t errors = scannerSimd[10].getErrors();
+    std::string err;
+    scannerSimd[10].getErrorsDescription(errors, err);
+    if ((scannerSimd[9].getErrors() != 0) || (scannerSimd.getErrors() != errors) || (errors != (RdhErrorLinkId | RdhErrorOffsetNextPacket)) || (err != "Wrong link ID 40, Wrong offsetNextPacket 1")) {
+      printf("Test failed (validation): 0x%X %s\n", errors, err.c_str());
+      return -1;
+    }
+  }
+  printf("Checks ok\n");
+
+  // benchmark, on a set of emulator pages scanned in turn
+  // throughput is given for the RDH bytes actually read (64 bytes per RDH), not the page size
+  std::vector<std::vector<uint8_t>> benchPages(links.size());
+  std::vector<size_t> benchUsed(links.size());
+  for (size_t i = 0; i < links.size(); i++) {
+    benchPages[i].resize(pageSize);
+    benchUsed[i] = links[i].fillPage(benchPages[i].data(), pageSize);
+  }
+  auto bench = [&](const char* name, auto&& f) {
+    uint64_t nRdh = 0;
+    uint64_t check = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < nLoops; i++) {
+      size_t ix = i % benchPages.size();
+      nRdh += f(benchPages[ix].data(), benchUsed[ix], check);
+    }
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    printf("%-12s %8.2f ns/RDH  %8.2f GB/s of RDH  (%llu RDHs, check 0x%llX)\n", name, t * 1E9 / nRdh, nRdh * sizeof(o2::Header::RAWDataHeader) / t / 1E9, (unsigned long long)nRdh, (unsigned long long)check);
+  };
+  bench("reference", [&](uint8_t* p, size_t sz, uint64_t& check) {
+    int n = scanReference(p, sz, ref);
+    check += ref[n - 1].hbOrbit;
+    return n;
+  });
+  bench("scalar", [&](uint8_t* p, size_t sz, uint64_t& check) {
+    int n = scannerScalar.scan(p, sz);
+    check += scannerScalar[n - 1].hbOrbit;
+    return n;
+  });
+  if (scannerSimd.isUsingSimd()) {
+    bench("simd", [&](uint8_t* p, size_t sz, uint64_t& check) {
+      int n = scannerSimd.scan(p, sz);
+      check += scannerSimd[n - 1].hbOrbit;
+      return n;
+    });
+  }
+  bench("validate", [&](uint8_t* p, size_t sz, uint64_t& check) {
+    int n = scannerSimd.scan(p, sz);
+    for (const RdhDescriptor& d : scannerSimd) {
+      check += d.getErrors();
+    }
+    return n;
+  });
+  bench("scan+errors", [&](uint8_t* p, size_t sz, uint64_t& check) {
+    int n = scannerSimd.scan(p, sz);
+    check += scannerSimd.getErrors();
+    return n;
+  });
+  return 0;
+}